@@ -0,0 +1,252 @@
+/*
+  HAMQTTDiscovery Library - Benchmark Example
+
+  Measures the library against a real Home Assistant instance so that a
+  change can be compared before and after. Three scenarios are run and a
+  line per scenario is printed with the requests, bytes, wall time and heap
+  used per operation:
+
+  1. Provision: create BENCH_ENTITIES sensors (batched, non-blocking)
+  2. Writes:    BENCH_WRITES state writes spread over those sensors
+  3. Polling:   BENCH_POLLS refreshAll() calls
+
+  Set BENCH_STATE_BATCH to true to send the writes as event batches
+  (needs StateBatch.yaml).
+
+  Set BENCH_SLEEP_CYCLES to run a fourth scenario that simulates
+  wake-publish-sleep cycles with enableSleepMode(): each cycle starts a
+  fresh instance, writes two sensors and calls prepareSleep(). The first
+  cycle is a cold start; the later ones resume from retained state.
+
+  Set BENCH_TRANSPORT to TRANSPORT_SERVICE to compare discovery through
+  a service call with the helper buffers.
+
+  Set BENCH_BROKER to the address of an MQTT broker on the LAN to repeat
+  the writes through setLocalBroker() and print the state write latency of
+  the REST path next to that of the broker.
+
+  To measure behaviour on a bad link, build the library with
+  -DHAMQTT_FAULT_INJECTION (e.g. build_flags in platformio.ini) and set
+  FAULT_LOSS, FAULT_ERROR and FAULT_LATENCY below.
+
+  Requirements:
+  1. WiFi connection configured before calling library functions
+  2. Home Assistant with input_text helpers: mqtt_buffer_1 through mqtt_buffer_6
+  3. Home Assistant automation to process discovery messages from buffers
+     (neither is needed with TRANSPORT_SERVICE)
+  4. Long-lived access token from Home Assistant
+
+  Hardware:
+  - ESP32 board
+*/
+
+#include <WiFi.h>
+#include <HAMQTTDiscovery.h>
+
+// WiFi credentials
+const char* ssid = "YOUR_WIFI_SSID";
+const char* password = "YOUR_WIFI_PASSWORD";
+
+// Home Assistant configuration
+const char* ha_server = "https://homeassistant.local:8123";  // No /api/ suffix
+const char* ha_token = "YOUR_LONG_LIVED_ACCESS_TOKEN";
+
+// Scenario sizes
+const int BENCH_ENTITIES = 20;
+const int BENCH_WRITES = 100;
+const int BENCH_POLLS = 10;
+const HATransport BENCH_TRANSPORT = TRANSPORT_HELPERS;
+const bool BENCH_STATE_BATCH = false;
+const int BENCH_SLEEP_CYCLES = 0;
+
+// Local broker for the write latency comparison ("" to skip it)
+const char* BENCH_BROKER = "";
+const char* BENCH_BROKER_USER = "";
+const char* BENCH_BROKER_PASSWORD = "";
+
+// Injected faults (only with -DHAMQTT_FAULT_INJECTION)
+const uint8_t FAULT_LOSS = 0;         // % of requests dropped
+const uint8_t FAULT_ERROR = 0;        // % of requests answered with 503
+const unsigned long FAULT_LATENCY = 0; // ms added to every request
+
+HAMQTTDiscovery ha;
+HAControl* sensors[BENCH_ENTITIES];
+
+unsigned long benchStart;
+uint32_t benchHeap;
+
+void startScenario() {
+  ha.resetRequestStats();
+  benchHeap = ESP.getFreeHeap();
+  benchStart = millis();
+}
+
+void reportScenario(const char* name, int operations) {
+  unsigned long elapsed = millis() - benchStart;
+  HARequestStats stats = ha.getRequestStats();
+  int32_t heapUsed = (int32_t)benchHeap - (int32_t)ESP.getFreeHeap();
+  if (operations < 1) operations = 1;
+
+  Serial.printf("%-10s %5d ops | %6.2f req/op | %7.0f B out/op | %7.0f B in/op | %7.1f ms/op | %6ld B heap/op | %u failed\n",
+                name, operations,
+                (float)stats.requests / operations,
+                (float)stats.bytesSent / operations,
+                (float)stats.bytesReceived / operations,
+                (float)elapsed / operations,
+                (long)(heapUsed / operations),
+                stats.failures);
+}
+
+void benchProvision() {
+  startScenario();
+  ha.setAsyncCreation(true);
+  ha.beginBatch();
+  for (int i = 0; i < BENCH_ENTITIES; i++) {
+    String id = "bench_" + String(i);
+    sensors[i] = ha.createSensor(id, "Bench " + String(i), id + "_uid", "W");
+  }
+
+  // Creation finishes in loop(); queued envelopes go out as one frame
+  unsigned long deadline = millis() + 60000;
+  unsigned long lastFlush = millis();
+  while (ha.pendingControls() > 0 && millis() < deadline) {
+    ha.loop();
+    if (millis() - lastFlush >= 1000) {
+      lastFlush = millis();
+      ha.flushBatch();
+    }
+    delay(10);
+  }
+  ha.endBatch();
+  reportScenario("provision", BENCH_ENTITIES);
+}
+
+void benchWrites() {
+  startScenario();
+  if (BENCH_STATE_BATCH) ha.enableStateBatch();
+  for (int i = 0; i < BENCH_WRITES; i++) {
+    HAControl* sensor = sensors[i % BENCH_ENTITIES];
+    if (sensor) ha.writeControl(sensor, String(random(0, 1000)));
+    // One batch per round over the sensors, as a sketch would per tick
+    if (BENCH_STATE_BATCH && i % BENCH_ENTITIES == BENCH_ENTITIES - 1) ha.flushStates();
+  }
+  if (BENCH_STATE_BATCH) ha.disableStateBatch();
+  reportScenario("writes", BENCH_WRITES);
+}
+
+void benchLocalWrites() {
+  if (!BENCH_BROKER[0]) return;
+
+  // Still holds the numbers of the REST writes scenario
+  HALatencyStats rest = ha.getRequestStats().ops[OP_STATE_POST];
+  if (!ha.setLocalBroker(BENCH_BROKER, 1883, BENCH_BROKER_USER, BENCH_BROKER_PASSWORD)) {
+    Serial.println("Local broker unreachable, skipping the comparison");
+    return;
+  }
+
+  startScenario();
+  for (int i = 0; i < BENCH_WRITES; i++) {
+    HAControl* sensor = sensors[i % BENCH_ENTITIES];
+    if (sensor) ha.writeControl(sensor, String(random(0, 1000)));
+  }
+  reportScenario("local", BENCH_WRITES);
+
+  HALatencyStats local = ha.getRequestStats().ops[OP_LOCAL_PUBLISH];
+  Serial.printf("state write latency | REST p50 %u ms, p90 %u ms | local p50 %u ms, p90 %u ms, %u failed\n",
+                rest.percentileMs(50), rest.percentileMs(90),
+                local.percentileMs(50), local.percentileMs(90), local.failures);
+  ha.clearLocalBroker();
+}
+
+void benchPolling() {
+  startScenario();
+  for (int i = 0; i < BENCH_POLLS; i++) {
+    ha.refreshAll();
+  }
+  reportScenario("polling", BENCH_POLLS);
+}
+
+void benchSleep() {
+  // A fresh instance per cycle stands in for the reboot after deep sleep;
+  // only the RTC-retained state carries over. It lives on the heap: the
+  // object is several KB, too much for loopTask's 8 KB stack.
+  unsigned long warmAwake = 0;
+  for (int i = 0; i < BENCH_SLEEP_CYCLES; i++) {
+    unsigned long wokeAt = millis();
+    HAMQTTDiscovery* sleeper = new HAMQTTDiscovery();
+    HAMQTTDiscovery& node = *sleeper;
+    node.begin(ha_server, ha_token, BENCH_TRANSPORT);
+    node.setDevice("esp32_bench_sleeper", "ESP32 Bench Sleeper", "YourCompany", "ESP32", "1.0.0");
+    node.enableSleepMode(wokeAt);
+    HAControl* a = node.createSensor("bench_sleep_a", "Bench Sleep A", "bench_sleep_a_uid", "W");
+    HAControl* b = node.createSensor("bench_sleep_b", "Bench Sleep B", "bench_sleep_b_uid", "W");
+    node.writeControl(a, String(random(0, 1000)));
+    node.writeControl(b, String(random(0, 1000)));
+    bool ready = node.prepareSleep();
+
+    HASleepStats sleep = node.getSleepStats();
+    HARequestStats stats = node.getRequestStats();
+    if (i > 0) warmAwake += sleep.awakeMs;
+    Serial.printf("sleep %2d   %s | %4u req | %7u ms awake | %u resumed | %s\n",
+                  i, i == 0 ? "cold" : "warm", stats.requests, sleep.awakeMs,
+                  sleep.resumedControls, ready ? "ready" : "NOT ready");
+    delete sleeper;
+  }
+  if (BENCH_SLEEP_CYCLES > 1) {
+    Serial.printf("sleep      %7.1f ms awake per warm cycle\n", (float)warmAwake / (BENCH_SLEEP_CYCLES - 1));
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  Serial.println("HAMQTTDiscovery Benchmark");
+
+  connectWiFi();
+
+  if (!ha.begin(ha_server, ha_token, BENCH_TRANSPORT)) {
+    Serial.println("Failed to initialize HAMQTTDiscovery library");
+    while (1) delay(1000);
+  }
+  ha.setDevice("esp32_bench_device", "ESP32 Benchmark", "YourCompany", "ESP32", "1.0.0");
+  Serial.printf("Discovery transport: %s\n", BENCH_TRANSPORT == TRANSPORT_SERVICE ? "service" : "helpers");
+
+#ifdef HAMQTT_FAULT_INJECTION
+  ha.setFaultInjection(FAULT_LOSS, FAULT_ERROR, FAULT_LATENCY);
+  Serial.printf("Faults: %u%% loss, %u%% errors, %lu ms latency\n", FAULT_LOSS, FAULT_ERROR, FAULT_LATENCY);
+#endif
+
+  benchProvision();
+  benchWrites();
+  benchLocalWrites();
+  benchPolling();
+  benchSleep();
+
+  Serial.printf("Minimum free heap: %u bytes\n", ESP.getMinFreeHeap());
+  Serial.println("Benchmark complete");
+}
+
+void loop() {
+  delay(1000);
+}
+
+void connectWiFi() {
+  Serial.printf("Connecting to WiFi: %s\n", ssid);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(ssid, password);
+
+  unsigned long startTime = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - startTime < 20000) {
+    delay(500);
+    Serial.print(".");
+  }
+  Serial.println();
+
+  if (WiFi.status() == WL_CONNECTED) {
+    Serial.printf("✓ WiFi connected! IP: %s\n", WiFi.localIP().toString().c_str());
+  } else {
+    Serial.println("✗ WiFi connection failed!");
+    while (1) delay(1000);
+  }
+}
@@ -0,0 +1,160 @@
+/*
+  HAMQTTDiscovery Library - Gateway Load Example
+
+  Simulates a gateway publishing for LOAD_NODES radio nodes, to see how
+  gateway mode shares the connection between them. Every node gets its own
+  device with LOAD_SENSORS sensors. Node 0 is "chatty" and writes every
+  CHATTY_PERIOD_MS; the others write every NODE_PERIOD_MS. After
+  LOAD_DURATION_MS a line per node is printed with the writes it made,
+  the values that reached HA and the latency from writeControl() to
+  delivery. A fair scheduler keeps the quiet nodes' latency flat however
+  busy node 0 is.
+
+  Set LOAD_STATE_BATCH to true to send the states of all nodes as shared
+  event batches (needs StateBatch.yaml).
+
+  Requirements:
+  1. WiFi connection configured before calling library functions
+  2. Home Assistant with input_text helpers: mqtt_buffer_1 through mqtt_buffer_6
+  3. Home Assistant automation to process discovery messages from buffers
+  4. Long-lived access token from Home Assistant
+
+  Hardware:
+  - ESP32 board
+*/
+
+#include <WiFi.h>
+#include <HAMQTTDiscovery.h>
+
+// WiFi credentials
+const char* ssid = "YOUR_WIFI_SSID";
+const char* password = "YOUR_WIFI_PASSWORD";
+
+// Home Assistant configuration
+const char* ha_server = "https://homeassistant.local:8123";  // No /api/ suffix
+const char* ha_token = "YOUR_LONG_LIVED_ACCESS_TOKEN";
+
+// Load shape
+const int LOAD_NODES = 24;
+const int LOAD_SENSORS = 2;
+const unsigned long NODE_PERIOD_MS = 5000;
+const unsigned long CHATTY_PERIOD_MS = 50;
+const unsigned long LOAD_DURATION_MS = 120000;
+const bool LOAD_STATE_BATCH = false;
+
+HAMQTTDiscovery ha;
+HANode* nodes[LOAD_NODES];
+HAControl* sensors[LOAD_NODES][LOAD_SENSORS];
+unsigned long lastWrite[LOAD_NODES];
+
+void createNodes() {
+  // Discovery for all nodes goes out in shared batch frames
+  ha.beginBatch();
+  for (int n = 0; n < LOAD_NODES; n++) {
+    String nodeId = "load_node_" + String(n);
+    nodes[n] = ha.addNode(nodeId, "Load Node " + String(n), "YourCompany", "Radio Node", "1.0.0");
+    for (int s = 0; s < LOAD_SENSORS; s++) {
+      String id = nodeId + "_s" + String(s);
+      sensors[n][s] = ha.createSensor(id, "Sensor " + String(s), id + "_uid", "W", "", "", "",
+                                      &nodes[n]->device);
+    }
+  }
+
+  unsigned long deadline = millis() + 120000;
+  unsigned long lastFlush = millis();
+  while (ha.pendingControls() > 0 && millis() < deadline) {
+    ha.loop();
+    if (millis() - lastFlush >= 1000) {
+      lastFlush = millis();
+      ha.flushBatch();
+    }
+    delay(10);
+  }
+  ha.endBatch();
+  Serial.printf("%d nodes created, %d controls still pending\n", LOAD_NODES, ha.pendingControls());
+}
+
+void generateLoad() {
+  ha.resetNodeStats();
+  ha.resetRequestStats();
+  if (LOAD_STATE_BATCH) ha.enableStateBatch();
+
+  unsigned long start = millis();
+  for (int n = 0; n < LOAD_NODES; n++) {
+    // Spread the quiet nodes over the period instead of writing in step
+    lastWrite[n] = start - random(0, NODE_PERIOD_MS);
+  }
+
+  while (millis() - start < LOAD_DURATION_MS) {
+    for (int n = 0; n < LOAD_NODES; n++) {
+      unsigned long period = n == 0 ? CHATTY_PERIOD_MS : NODE_PERIOD_MS;
+      if (millis() - lastWrite[n] < period) continue;
+      lastWrite[n] = millis();
+      for (int s = 0; s < LOAD_SENSORS; s++) {
+        if (sensors[n][s]) ha.writeControl(sensors[n][s], String(random(0, 1000)));
+      }
+    }
+    ha.loop();
+  }
+
+  if (LOAD_STATE_BATCH) ha.disableStateBatch();
+}
+
+void reportNodes() {
+  Serial.println("node  writes  delivered  avg ms  p90 ms  max ms");
+  for (int n = 0; n < LOAD_NODES; n++) {
+    const HANodeStats& stats = nodes[n]->stats;
+    Serial.printf("%4d  %6u  %9u  %6u  %6u  %6u%s\n", n, stats.writes, stats.delivered,
+                  stats.latency.averageMs(), stats.latency.percentileMs(90), stats.latency.maxMs,
+                  n == 0 ? "  (chatty)" : "");
+  }
+
+  HARequestStats requests = ha.getRequestStats();
+  Serial.printf("%u requests, %u failed, %.1f requests/s\n", requests.requests, requests.failures,
+                requests.requests * 1000.0f / LOAD_DURATION_MS);
+}
+
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  Serial.println("HAMQTTDiscovery Gateway Load");
+
+  connectWiFi();
+
+  if (!ha.begin(ha_server, ha_token)) {
+    Serial.println("Failed to initialize HAMQTTDiscovery library");
+    while (1) delay(1000);
+  }
+  ha.setDevice("esp32_load_gateway", "ESP32 Load Gateway", "YourCompany", "ESP32", "1.0.0");
+
+  createNodes();
+  generateLoad();
+  reportNodes();
+
+  Serial.println("Load test complete");
+}
+
+void loop() {
+  delay(1000);
+}
+
+void connectWiFi() {
+  Serial.printf("Connecting to WiFi: %s\n", ssid);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(ssid, password);
+
+  unsigned long startTime = millis();
+  while (WiFi.status() != WL_CONNECTED && millis() - startTime < 20000) {
+    delay(500);
+    Serial.print(".");
+  }
+  Serial.println();
+
+  if (WiFi.status() == WL_CONNECTED) {
+    Serial.printf("✓ WiFi connected! IP: %s\n", WiFi.localIP().toString().c_str());
+  } else {
+    Serial.println("✗ WiFi connection failed!");
+    while (1) delay(1000);
+  }
+}
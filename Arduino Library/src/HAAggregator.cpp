@@ -0,0 +1,77 @@
+#include "HAAggregator.h"
+#include <math.h>
+
+HASampleWindow::HASampleWindow() {
+  count = 0;
+  min = 0;
+  max = 0;
+  sum = 0;
+  last = 0;
+  for (int i = 0; i < SERIES; i++) {
+    series[i] = 0;
+    seriesCount[i] = 0;
+  }
+}
+
+float HASampleWindow::mean() const {
+  return count ? sum / count : NAN;
+}
+
+float HASampleWindow::value(HAAggregate aggregate) const {
+  switch (aggregate) {
+    case AGGREGATE_LAST: return last;
+    case AGGREGATE_MIN: return min;
+    case AGGREGATE_MAX: return max;
+    case AGGREGATE_MEAN: break;
+  }
+  return mean();
+}
+
+HAAggregator::HAAggregator(unsigned long windowMs, HAAggregate aggregate, uint8_t decimals, bool series) {
+  portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+  _mux = unlocked;
+  _windowMs = windowMs ? windowMs : 1;
+  _aggregate = aggregate;
+  _decimals = decimals;
+  _series = series;
+  _startedAt = millis();
+}
+
+void HAAggregator::add(float sample) {
+  if (isnan(sample) || isinf(sample)) return;
+
+  portENTER_CRITICAL(&_mux);
+  // A sample that arrives after the window ended but before take() ran
+  // lands in the last slot rather than starting a window of its own
+  unsigned long elapsed = millis() - _startedAt;
+  int slot = elapsed < _windowMs ? (int)((uint64_t)elapsed * HASampleWindow::SERIES / _windowMs)
+                                 : HASampleWindow::SERIES - 1;
+
+  if (_current.count == 0 || sample < _current.min) _current.min = sample;
+  if (_current.count == 0 || sample > _current.max) _current.max = sample;
+  _current.sum += sample;
+  _current.last = sample;
+  _current.count++;
+  if (_current.seriesCount[slot] < 0xFFFF) {
+    _current.series[slot] += sample;
+    _current.seriesCount[slot]++;
+  }
+  portEXIT_CRITICAL(&_mux);
+}
+
+bool HAAggregator::take(HASampleWindow& window) {
+  unsigned long now = millis();
+  if (now - _startedAt < _windowMs) return false;
+
+  portENTER_CRITICAL(&_mux);
+  window = _current;
+  _current = HASampleWindow();
+  // Keep a steady cadence unless a whole window was missed
+  _startedAt = now - _startedAt < 2 * _windowMs ? _startedAt + _windowMs : now;
+  portEXIT_CRITICAL(&_mux);
+
+  for (int i = 0; i < HASampleWindow::SERIES; i++) {
+    window.series[i] = window.seriesCount[i] ? window.series[i] / window.seriesCount[i] : NAN;
+  }
+  return window.count > 0;
+}
@@ -0,0 +1,60 @@
+#ifndef HAAGGREGATOR_H
+#define HAAGGREGATOR_H
+
+#include <Arduino.h>
+
+// Value published as the entity state for a closed window
+enum HAAggregate {
+  AGGREGATE_MEAN,
+  AGGREGATE_LAST,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX
+};
+
+// One closed aggregation window. The series splits the window into equal
+// slots and holds the mean of each; a slot with no samples is NaN.
+struct HASampleWindow {
+  static const int SERIES = 8;
+  uint32_t count;
+  float min;
+  float max;
+  float sum;
+  float last;
+  float series[SERIES];
+  uint16_t seriesCount[SERIES];
+
+  HASampleWindow();
+  float mean() const;
+  float value(HAAggregate aggregate) const;
+};
+
+// Folds samples into running min/max/sum and a fixed ring of per-slot sums,
+// so add() is O(1), allocation-free and safe to call from any task at any
+// rate. Only take() copies the window out, under the same spinlock, and
+// starts the next one. Floats can't be used in an ISR on the ESP32, so add()
+// belongs in the task the ISR wakes rather than the ISR itself.
+class HAAggregator {
+public:
+  HAAggregator(unsigned long windowMs, HAAggregate aggregate, uint8_t decimals, bool series);
+
+  void add(float sample);
+  // Closes the current window once it is due. Returns false if it isn't due
+  // yet or had no samples (an empty window is discarded).
+  bool take(HASampleWindow& window);
+
+  unsigned long windowMs() const { return _windowMs; }
+  HAAggregate aggregate() const { return _aggregate; }
+  uint8_t decimals() const { return _decimals; }
+  bool series() const { return _series; }
+
+private:
+  portMUX_TYPE _mux;
+  HASampleWindow _current;
+  unsigned long _startedAt;
+  unsigned long _windowMs;
+  HAAggregate _aggregate;
+  uint8_t _decimals;
+  bool _series;
+};
+
+#endif
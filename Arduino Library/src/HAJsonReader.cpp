@@ -0,0 +1,318 @@
+#include "HAJsonReader.h"
+
+HAJsonReader::HAJsonReader() {
+  reset();
+}
+
+void HAJsonReader::reset() {
+  _state = EXPECT_VALUE;
+  _failed = false;
+  _complete = false;
+  _readingKey = false;
+  _depth = 0;
+  _isObject[0] = false;
+  _keys[0][0] = '\0';
+  _valueLength = 0;
+  _value[0] = '\0';
+  _unicode = 0;
+  _unicodeDigits = 0;
+  _highSurrogate = 0;
+}
+
+const char* HAJsonReader::keyAt(int level) const {
+  if (level < 1 || level > _depth || level > KEY_LEVELS) return "";
+  return _keys[level];
+}
+
+bool HAJsonReader::pathIs(const char* path) const {
+  int level = 1;
+  const char* segment = path;
+  while (level <= _depth) {
+    if (level > KEY_LEVELS) return false;
+    const char* end = strchr(segment, '.');
+    size_t length = end ? (size_t)(end - segment) : strlen(segment);
+    const char* key = _keys[level];
+    if (strlen(key) != length || strncmp(key, segment, length) != 0) return false;
+    if (!end) return level == _depth;
+    segment = end + 1;
+    level++;
+  }
+  return false;
+}
+
+size_t HAJsonReader::write(uint8_t c) {
+  feed((char)c);
+  return 1;
+}
+
+size_t HAJsonReader::write(const uint8_t* buffer, size_t size) {
+  feed((const char*)buffer, size);
+  return size;
+}
+
+void HAJsonReader::feed(const char* data, size_t length) {
+  for (size_t i = 0; i < length && !_failed; i++) {
+    feed(data[i]);
+  }
+}
+
+void HAJsonReader::fail() {
+  _failed = true;
+  _state = DONE;
+}
+
+void HAJsonReader::append(char c) {
+  // Overlong keys and values are truncated rather than growing
+  size_t limit = _readingKey ? KEY_SIZE : VALUE_SIZE;
+  if (_valueLength + 1 < limit) {
+    _value[_valueLength++] = c;
+  }
+}
+
+void HAJsonReader::appendCodepoint(uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    append((char)codepoint);
+  } else if (codepoint < 0x800) {
+    append((char)(0xC0 | (codepoint >> 6)));
+    append((char)(0x80 | (codepoint & 0x3F)));
+  } else if (codepoint < 0x10000) {
+    append((char)(0xE0 | (codepoint >> 12)));
+    append((char)(0x80 | ((codepoint >> 6) & 0x3F)));
+    append((char)(0x80 | (codepoint & 0x3F)));
+  } else {
+    append((char)(0xF0 | (codepoint >> 18)));
+    append((char)(0x80 | ((codepoint >> 12) & 0x3F)));
+    append((char)(0x80 | ((codepoint >> 6) & 0x3F)));
+    append((char)(0x80 | (codepoint & 0x3F)));
+  }
+}
+
+void HAJsonReader::openContainer(bool isObject) {
+  if (_depth >= MAX_DEPTH) {
+    fail();
+    return;
+  }
+  onContainer(isObject, true);
+  _depth++;
+  _isObject[_depth] = isObject;
+  if (_depth <= KEY_LEVELS) _keys[_depth][0] = '\0';
+  _state = isObject ? EXPECT_KEY : EXPECT_VALUE;
+}
+
+void HAJsonReader::closeContainer(bool isObject) {
+  if (_depth == 0 || _isObject[_depth] != isObject) {
+    fail();
+    return;
+  }
+  _depth--;
+  onContainer(isObject, false);
+  finishValue();
+}
+
+void HAJsonReader::finishValue() {
+  if (_depth == 0) {
+    _complete = true;
+    _state = DONE;
+  } else {
+    _state = AFTER_VALUE;
+  }
+}
+
+void HAJsonReader::finishString() {
+  _value[_valueLength] = '\0';
+  if (_readingKey) {
+    if (_depth <= KEY_LEVELS) {
+      memcpy(_keys[_depth], _value, _valueLength + 1);
+    }
+    _readingKey = false;
+    _state = EXPECT_COLON;
+    return;
+  }
+
+  // Values at depth 0 have no key; report them with an empty path
+  onValue(_value, _valueLength, true);
+  finishValue();
+}
+
+void HAJsonReader::finishLiteral() {
+  _value[_valueLength] = '\0';
+  onValue(_value, _valueLength, false);
+  finishValue();
+}
+
+void HAJsonReader::feed(char c) {
+  if (_failed) return;
+
+  switch (_state) {
+    case IN_STRING:
+      if (c == '"') {
+        finishString();
+      } else if (c == '\\') {
+        _state = IN_ESCAPE;
+      } else if ((unsigned char)c < 0x20) {
+        fail();
+      } else {
+        append(c);
+      }
+      return;
+
+    case IN_ESCAPE:
+      _state = IN_STRING;
+      switch (c) {
+        case '"': append('"'); break;
+        case '\\': append('\\'); break;
+        case '/': append('/'); break;
+        case 'b': append('\b'); break;
+        case 'f': append('\f'); break;
+        case 'n': append('\n'); break;
+        case 'r': append('\r'); break;
+        case 't': append('\t'); break;
+        case 'u':
+          _unicode = 0;
+          _unicodeDigits = 0;
+          _state = IN_UNICODE;
+          break;
+        default: fail(); break;
+      }
+      return;
+
+    case IN_UNICODE: {
+      int digit;
+      if (c >= '0' && c <= '9') digit = c - '0';
+      else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+      else {
+        fail();
+        return;
+      }
+      _unicode = (_unicode << 4) | digit;
+      if (++_unicodeDigits < 4) return;
+
+      _state = IN_STRING;
+      if (_unicode >= 0xD800 && _unicode < 0xDC00) {
+        _highSurrogate = _unicode;
+      } else if (_unicode >= 0xDC00 && _unicode < 0xE000 && _highSurrogate) {
+        appendCodepoint(0x10000 + (((uint32_t)_highSurrogate - 0xD800) << 10) + (_unicode - 0xDC00));
+        _highSurrogate = 0;
+      } else {
+        appendCodepoint(_unicode);
+        _highSurrogate = 0;
+      }
+      return;
+    }
+
+    case IN_LITERAL:
+      if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' || c == 'E') {
+        append(c);
+        return;
+      }
+      finishLiteral();
+      // The terminating character belongs to the enclosing structure
+      feed(c);
+      return;
+
+    default:
+      break;
+  }
+
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') return;
+
+  switch (_state) {
+    case EXPECT_VALUE:
+      if (c == '{') {
+        openContainer(true);
+      } else if (c == '[') {
+        openContainer(false);
+      } else if (c == ']' && _depth > 0 && !_isObject[_depth]) {
+        // Empty array
+        closeContainer(false);
+      } else if (c == '"') {
+        _valueLength = 0;
+        _readingKey = false;
+        _state = IN_STRING;
+      } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+        _valueLength = 0;
+        append(c);
+        _state = IN_LITERAL;
+      } else {
+        fail();
+      }
+      break;
+
+    case EXPECT_KEY:
+      if (c == '"') {
+        _valueLength = 0;
+        _readingKey = true;
+        _state = IN_STRING;
+      } else if (c == '}') {
+        closeContainer(true);
+      } else {
+        fail();
+      }
+      break;
+
+    case EXPECT_COLON:
+      if (c == ':') _state = EXPECT_VALUE;
+      else fail();
+      break;
+
+    case AFTER_VALUE:
+      if (c == ',') {
+        _state = _isObject[_depth] ? EXPECT_KEY : EXPECT_VALUE;
+      } else if (c == '}') {
+        closeContainer(true);
+      } else if (c == ']') {
+        closeContainer(false);
+      } else {
+        fail();
+      }
+      break;
+
+    case DONE:
+      // Trailing data after a complete document is ignored
+      break;
+
+    default:
+      break;
+  }
+}
+
+HAJsonExtractor::HAJsonExtractor() {
+  _slotCount = 0;
+}
+
+int HAJsonExtractor::addPath(const char* path, char* buffer, size_t size) {
+  if (_slotCount >= MAX_PATHS || !buffer || size == 0) return -1;
+  Slot& slot = _slots[_slotCount];
+  slot.path = path;
+  slot.buffer = buffer;
+  slot.size = size;
+  slot.found = false;
+  buffer[0] = '\0';
+  return _slotCount++;
+}
+
+bool HAJsonExtractor::found(int index) const {
+  return index >= 0 && index < _slotCount && _slots[index].found;
+}
+
+void HAJsonExtractor::clearResults() {
+  reset();
+  for (int i = 0; i < _slotCount; i++) {
+    _slots[i].found = false;
+    _slots[i].buffer[0] = '\0';
+  }
+}
+
+void HAJsonExtractor::onValue(const char* value, size_t length, bool) {
+  for (int i = 0; i < _slotCount; i++) {
+    Slot& slot = _slots[i];
+    // The first match wins, so a later duplicate key can't overwrite it
+    if (slot.found || !pathIs(slot.path)) continue;
+
+    size_t count = min(length, slot.size - 1);
+    memcpy(slot.buffer, value, count);
+    slot.buffer[count] = '\0';
+    slot.found = true;
+  }
+}
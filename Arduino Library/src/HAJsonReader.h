@@ -0,0 +1,113 @@
+#ifndef HAJSONREADER_H
+#define HAJSONREADER_H
+
+#include <Arduino.h>
+
+// Incremental JSON tokenizer with bounded memory. Bytes are pushed in with
+// feed() or through the Stream interface (so it can be handed straight to
+// HTTPClient::writeToStream), and every scalar value is reported to
+// onValue() together with the path of keys leading to it. Keys and values
+// longer than the fixed buffers are truncated; the document itself can be
+// any size.
+class HAJsonReader : public Stream {
+public:
+  HAJsonReader();
+  virtual ~HAJsonReader() {}
+
+  void reset();
+  void feed(char c);
+  void feed(const char* data, size_t length);
+
+  bool failed() const { return _failed; }
+  bool complete() const { return _complete; }
+
+  // Nesting depth of the value being reported; 1 for top-level members
+  int depth() const { return _depth; }
+  const char* keyAt(int level) const;
+  // True when the keys from the top down to the current value match a dotted
+  // path such as "attributes.friendly_name"
+  bool pathIs(const char* path) const;
+
+  // Stream interface; the reader is a write-only sink
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+
+protected:
+  // Called for every string, number, true, false and null value
+  virtual void onValue(const char*, size_t, bool) {}
+  // Called when an object or array opens (at depth()) and after it closes
+  virtual void onContainer(bool, bool) {}
+
+private:
+  static const int MAX_DEPTH = 16;
+  static const int KEY_LEVELS = 8;
+  static const size_t KEY_SIZE = 64;
+  static const size_t VALUE_SIZE = 256;
+
+  enum State {
+    EXPECT_VALUE,
+    EXPECT_KEY,
+    EXPECT_COLON,
+    AFTER_VALUE,
+    IN_STRING,
+    IN_ESCAPE,
+    IN_UNICODE,
+    IN_LITERAL,
+    DONE
+  };
+
+  State _state;
+  bool _failed;
+  bool _complete;
+  bool _readingKey;
+  int _depth;
+  bool _isObject[MAX_DEPTH + 1];
+  char _keys[KEY_LEVELS + 1][KEY_SIZE];
+  char _value[VALUE_SIZE];
+  size_t _valueLength;
+  uint16_t _unicode;
+  int _unicodeDigits;
+  uint16_t _highSurrogate;
+
+  void fail();
+  void append(char c);
+  void appendCodepoint(uint32_t codepoint);
+  void finishString();
+  void finishLiteral();
+  void finishValue();
+  void openContainer(bool isObject);
+  void closeContainer(bool isObject);
+};
+
+// Pulls a few known paths out of a document into caller-provided buffers
+class HAJsonExtractor : public HAJsonReader {
+public:
+  HAJsonExtractor();
+
+  // Returns the slot index, or -1 when all slots are taken
+  int addPath(const char* path, char* buffer, size_t size);
+  bool found(int index) const;
+  void clearResults();
+
+protected:
+  void onValue(const char* value, size_t length, bool isString) override;
+
+private:
+  static const int MAX_PATHS = 6;
+
+  struct Slot {
+    const char* path;
+    char* buffer;
+    size_t size;
+    bool found;
+  };
+
+  Slot _slots[MAX_PATHS];
+  int _slotCount;
+};
+
+#endif
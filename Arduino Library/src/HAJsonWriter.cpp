@@ -0,0 +1,234 @@
+#include "HAJsonWriter.h"
+#include <math.h>
+#include <stdio.h>
+
+HAJsonWriter::HAJsonWriter(char* buffer, size_t capacity) {
+  _buffer = buffer;
+  _output = nullptr;
+  _capacity = buffer ? capacity : 0;
+  _length = 0;
+  _depth = 0;
+  _first[0] = true;
+  _afterKey = false;
+  if (_buffer && _capacity) _buffer[0] = '\0';
+}
+
+HAJsonWriter::HAJsonWriter(String& output) {
+  _buffer = nullptr;
+  _output = &output;
+  _capacity = 0;
+  _length = 0;
+  _depth = 0;
+  _first[0] = true;
+  _afterKey = false;
+}
+
+void HAJsonWriter::put(char c) {
+  if (_output) {
+    *_output += c;
+    _length++;
+    return;
+  }
+
+  // One byte is always kept free for the terminator
+  if (_length + 1 < _capacity) {
+    _buffer[_length] = c;
+    _buffer[_length + 1] = '\0';
+  }
+  _length++;
+}
+
+void HAJsonWriter::put(const char* text, size_t length) {
+  if (!_output && _length + length < _capacity) {
+    memcpy(_buffer + _length, text, length);
+    _buffer[_length + length] = '\0';
+    _length += length;
+    return;
+  }
+  for (size_t i = 0; i < length; i++) put(text[i]);
+}
+
+void HAJsonWriter::separate() {
+  if (_afterKey) {
+    _afterKey = false;
+    return;
+  }
+  if (!_first[_depth]) put(',');
+  _first[_depth] = false;
+}
+
+void HAJsonWriter::open(char bracket) {
+  separate();
+  put(bracket);
+  if (_depth < MAX_DEPTH - 1) _depth++;
+  _first[_depth] = true;
+}
+
+void HAJsonWriter::close(char bracket) {
+  if (_depth > 0) _depth--;
+  put(bracket);
+}
+
+void HAJsonWriter::beginObject() { open('{'); }
+void HAJsonWriter::endObject() { close('}'); }
+void HAJsonWriter::beginArray() { open('['); }
+void HAJsonWriter::endArray() { close(']'); }
+
+void HAJsonWriter::key(const char* name) {
+  separate();
+  put('"');
+  escaped(name, strlen(name));
+  put("\":", 2);
+  _afterKey = true;
+}
+
+size_t HAJsonWriter::escapedLength(const char* text, size_t length) {
+  size_t total = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t') total += 2;
+    else if (c < 0x20) total += 6;
+    else total += 1;
+  }
+  return total;
+}
+
+void HAJsonWriter::escaped(const char* text, size_t length) {
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  size_t runStart = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = text[i];
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+    // Copy the plain run before this character in one go
+    put(text + runStart, i - runStart);
+    runStart = i + 1;
+
+    put('\\');
+    switch (c) {
+      case '"': put('"'); break;
+      case '\\': put('\\'); break;
+      case '\n': put('n'); break;
+      case '\r': put('r'); break;
+      case '\t': put('t'); break;
+      default:
+        put("u00", 3);
+        put(HEX_DIGITS[c >> 4]);
+        put(HEX_DIGITS[c & 0x0F]);
+        break;
+    }
+  }
+  put(text + runStart, length - runStart);
+}
+
+void HAJsonWriter::value(const char* text, size_t length) {
+  separate();
+  put('"');
+  escaped(text, length);
+  put('"');
+}
+
+void HAJsonWriter::value(const char* text) {
+  value(text, strlen(text));
+}
+
+void HAJsonWriter::value(const String& text) {
+  value(text.c_str(), text.length());
+}
+
+void HAJsonWriter::value(float number, int decimals) {
+  separate();
+
+  // JSON has no NaN or infinity
+  if (isnan(number) || isinf(number)) {
+    put("null", 4);
+    return;
+  }
+
+  // Fixed-point formatting, same output as String(number, decimals)
+  if (decimals < 0) decimals = 0;
+  if (decimals > 6) decimals = 6;
+  uint32_t scale = 1;
+  for (int i = 0; i < decimals; i++) scale *= 10;
+
+  // Past what the fixed-point digits hold, exponent form; a float has
+  // about 9 significant digits anyway
+  double magnitude = fabs((double)number);
+  if (magnitude * scale >= 1e18) {
+    char text[24];
+    int length = snprintf(text, sizeof(text), "%.*g", 9, (double)number);
+    put(text, length);
+    return;
+  }
+  uint64_t scaled = (uint64_t)(magnitude * scale + 0.5);
+  uint64_t whole = scaled / scale;
+  uint32_t fraction = (uint32_t)(scaled % scale);
+
+  if (number < 0 && scaled != 0) put('-');
+
+  char digits[24];
+  int count = 0;
+  do {
+    digits[count++] = '0' + (char)(whole % 10);
+    whole /= 10;
+  } while (whole > 0);
+  while (count > 0) put(digits[--count]);
+
+  if (decimals > 0) {
+    put('.');
+    for (int i = decimals - 1; i >= 0; i--) {
+      digits[i] = '0' + (char)(fraction % 10);
+      fraction /= 10;
+    }
+    put(digits, decimals);
+  }
+}
+
+void HAJsonWriter::value(long number) {
+  separate();
+  char text[24];
+  int length = snprintf(text, sizeof(text), "%ld", number);
+  put(text, length);
+}
+
+void HAJsonWriter::raw(const char* text, size_t length) {
+  separate();
+  put(text, length);
+}
+
+void HAJsonWriter::beginString() {
+  separate();
+  put('"');
+}
+
+void HAJsonWriter::stringPart(const char* text, size_t length) {
+  escaped(text, length);
+}
+
+void HAJsonWriter::stringPart(const String& text) {
+  escaped(text.c_str(), text.length());
+}
+
+void HAJsonWriter::endString() {
+  put('"');
+}
+
+void HAJsonWriter::field(const char* name, const char* text) {
+  key(name);
+  value(text);
+}
+
+void HAJsonWriter::field(const char* name, const String& text) {
+  key(name);
+  value(text);
+}
+
+void HAJsonWriter::field(const char* name, float number, int decimals) {
+  key(name);
+  value(number, decimals);
+}
+
+void HAJsonWriter::field(const char* name, long number) {
+  key(name);
+  value(number);
+}
@@ -0,0 +1,68 @@
+#ifndef HAJSONWRITER_H
+#define HAJSONWRITER_H
+
+#include <Arduino.h>
+
+// Serializes JSON straight into a caller-provided fixed buffer without any
+// heap allocation. Constructed with a null buffer it only counts, which gives
+// the exact size of a document before writing it. Writes past the capacity
+// are dropped but still counted, so overflowed() can be checked at the end.
+// The String constructor appends to a String instead, for the String-returning
+// convenience APIs; reserve() it with a counted length to avoid reallocation.
+class HAJsonWriter {
+public:
+  HAJsonWriter(char* buffer, size_t capacity);
+  explicit HAJsonWriter(String& output);
+
+  void beginObject();
+  void endObject();
+  void beginArray();
+  void endArray();
+
+  void key(const char* name);
+  void value(const char* text);
+  void value(const char* text, size_t length);
+  void value(const String& text);
+  void value(float number, int decimals = 3);
+  void value(long number);
+  void raw(const char* text, size_t length);
+
+  // A string value assembled from several pieces
+  void beginString();
+  void stringPart(const char* text, size_t length);
+  void stringPart(const String& text);
+  void endString();
+
+  // "key":"text" and "key":number shorthands
+  void field(const char* name, const char* text);
+  void field(const char* name, const String& text);
+  void field(const char* name, float number, int decimals = 3);
+  void field(const char* name, long number);
+
+  size_t length() const { return _length; }
+  bool overflowed() const { return !_output && _length >= _capacity; }
+  const char* c_str() const { return _buffer; }
+
+  // Escaped length of text without writing anything
+  static size_t escapedLength(const char* text, size_t length);
+
+private:
+  static const int MAX_DEPTH = 8;
+
+  char* _buffer;
+  String* _output;
+  size_t _capacity;
+  size_t _length;
+  int _depth;
+  bool _first[MAX_DEPTH];
+  bool _afterKey;
+
+  void put(char c);
+  void put(const char* text, size_t length);
+  void separate();
+  void open(char bracket);
+  void close(char bracket);
+  void escaped(const char* text, size_t length);
+};
+
+#endif
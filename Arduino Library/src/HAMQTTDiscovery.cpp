@@ -19,106 +19,649 @@ String HADevice::escape(const String& input) {
   return output;
 }
 
-String HADevice::toJson() const {
-  String json = "{\"identifiers\":[\"" + escape(uniqueId) + "\"]";
-  if (name.length()) json += ",\"name\":\"" + escape(name) + "\"";
-  if (manufacturer.length()) json += ",\"manufacturer\":\"" + escape(manufacturer) + "\"";
-  if (model.length()) json += ",\"model\":\"" + escape(model) + "\"";
-  if (swVersion.length()) json += ",\"sw_version\":\"" + escape(swVersion) + "\"";
-  json += "}";
+void HADevice::writeJson(HAJsonWriter& writer, bool compact) const {
+  writer.beginObject();
+  writer.key(compact ? "ids" : "identifiers");
+  writer.beginArray();
+  writer.value(uniqueId);
+  writer.endArray();
+  if (name.length()) writer.field("name", name);
+  if (manufacturer.length()) writer.field(compact ? "mf" : "manufacturer", manufacturer);
+  if (model.length()) writer.field(compact ? "mdl" : "model", model);
+  if (swVersion.length()) writer.field(compact ? "sw" : "sw_version", swVersion);
+  writer.endObject();
+}
+
+String HADevice::toJson(bool compact) const {
+  HAJsonWriter sizer(nullptr, 0);
+  writeJson(sizer, compact);
+
+  String json;
+  json.reserve(sizer.length());
+  HAJsonWriter writer(json);
+  writeJson(writer, compact);
   return json;
 }
 
-HAControl::HAControl() {
-  type = CONTROL_SWITCH;
-  device = nullptr;
+HAPublishPolicy::HAPublishPolicy() {
+  skipUnchanged = false;
+  deadband = 0;
+  minIntervalMs = 0;
+  maxIntervalMs = 0;
+}
+
+HAWriteStats::HAWriteStats() {
+  sent = 0;
+  suppressed = 0;
+  coalesced = 0;
+  failed = 0;
+}
+
+HAOfflineStats::HAOfflineStats() {
+  occupancy = 0;
+  capacity = 0;
+  buffered = 0;
+  replayed = 0;
+  dropped = 0;
+}
+
+HAHelperStats::HAHelperStats() {
+  frames = 0;
+  acked = 0;
+  duplicates = 0;
+  retriggered = 0;
+  lost = 0;
+}
+
+HASleepStats::HASleepStats() {
+  wakes = 0;
+  awakeMs = 0;
+  lastAwakeMs = 0;
+  resumedControls = 0;
+  addressCached = false;
+}
+
+HALatencyStats::HALatencyStats() {
+  count = 0;
+  failures = 0;
+  totalMs = 0;
+  maxMs = 0;
+  for (int i = 0; i < BUCKETS; i++) {
+    buckets[i] = 0;
+  }
+}
+
+uint32_t HALatencyStats::bucketLimitMs(int bucket) {
+  return 8UL << bucket;
+}
+
+void HALatencyStats::record(uint32_t ms, bool success) {
+  count++;
+  if (!success) failures++;
+  totalMs += ms;
+  if (ms > maxMs) maxMs = ms;
+
+  int bucket = 0;
+  while (bucket < BUCKETS - 1 && ms >= bucketLimitMs(bucket)) bucket++;
+  buckets[bucket]++;
+}
+
+uint32_t HALatencyStats::averageMs() const {
+  return count ? totalMs / count : 0;
+}
+
+uint32_t HALatencyStats::percentileMs(uint8_t percentile) const {
+  if (!count) return 0;
+  uint32_t target = ((uint64_t)count * percentile + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < BUCKETS - 1; i++) {
+    seen += buckets[i];
+    // Nothing in the bucket was slower than the slowest operation seen
+    if (seen >= target) return min(bucketLimitMs(i), maxMs);
+  }
+  return maxMs;
+}
+
+HARequestStats::HARequestStats() {
+  requests = 0;
+  retries = 0;
+  failures = 0;
+  bytesSent = 0;
+  bytesReceived = 0;
+  busyMs = 0;
+  minFreeHeap = UINT32_MAX;
+}
+
+HANodeStats::HANodeStats() {
+  writes = 0;
+  delivered = 0;
+}
+
+HANode::HANode() {
+  controls = nullptr;
+  controlCount = 0;
+  controlCapacity = 0;
+  cursor = 0;
+}
+
+HANode::~HANode() {
+  delete[] controls;
+}
+
+void HANode::addControl(HAControl* control) {
+  if (controlCount == controlCapacity) {
+    int capacity = controlCapacity ? controlCapacity * 2 : 4;
+    HAControl** grown = new HAControl*[capacity];
+    for (int i = 0; i < controlCount; i++) {
+      grown[i] = controls[i];
+    }
+    delete[] controls;
+    controls = grown;
+    controlCapacity = capacity;
+  }
+  controls[controlCount++] = control;
+  control->node = this;
+}
+
+HAControlOptions::HAControlOptions() {
   minValue = 0;
   maxValue = 100;
   step = 1;
   mode = "slider";
   payloadOn = "ON";
   payloadOff = "OFF";
+}
+
+bool HAControlOptions::isDefault() const {
+  return !icon.length() && !stateTopic.length() && !commandTopic.length() &&
+         !availabilityTopic.length() && minValue == 0 && maxValue == 100 && step == 1 &&
+         !unit.length() && mode == "slider" && payloadOn == "ON" && payloadOff == "OFF";
+}
+
+HAControl::HAControl() {
+  type = CONTROL_SWITCH;
+  device = nullptr;
+  options = nullptr;
   isOnline = false;
+  changed = false;
+  hasPending = false;
+  hasWritten = false;
+  lastWriteAt = 0;
+  batched = false;
+  status = STATUS_PENDING;
+  stage = STAGE_DONE;
+  stageStartedAt = 0;
+  fingerprint = 0;
+  createdAt = 0;
+  diagnostic = false;
+  stateCallback = nullptr;
+  subscription = 0;
+  descriptor = nullptr;
+  aggregator = nullptr;
+  node = nullptr;
+  queuedAt = 0;
+  batchQueuedAt = 0;
 }
 
-String HAControl::getDiscoveryTopic() const {
-  String component;
+const char* HAControl::componentName(ControlType type) {
   switch (type) {
-    case CONTROL_SWITCH: component = "switch"; break;
-    case CONTROL_NUMBER: component = "number"; break;
-    case CONTROL_SENSOR: component = "sensor"; break;
-    case CONTROL_BINARY_SENSOR: component = "binary_sensor"; break;
+    case CONTROL_SWITCH: return "switch";
+    case CONTROL_NUMBER: return "number";
+    case CONTROL_SENSOR: return "sensor";
+    case CONTROL_BINARY_SENSOR: return "binary_sensor";
   }
-  return "homeassistant/" + component + "/" + objectId + "/config";
+  return "";
+}
+
+String HAControl::getDiscoveryTopic() const {
+  if (descriptor) return descriptor->discoveryTopic;
+  return "homeassistant/" + String(componentName(type)) + "/" + objectId + "/config";
 }
 
 String HAControl::getEntityId() const {
-  String component;
+  if (descriptor) return descriptor->entityId;
+  return String(componentName(type)) + "." + objectId;
+}
+
+const char* HAControl::getObjectId() const {
+  return descriptor ? descriptor->objectId : objectId.c_str();
+}
+
+// 32-bit FNV-1a, continued across calls by passing the previous hash
+static uint32_t fnv1a(uint32_t hash, const char* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+static const uint32_t FNV_OFFSET = 2166136261UL;
+
+uint32_t HAControl::computeFingerprint(bool compact) const {
+  String topic = getDiscoveryTopic();
+  String payload = getDiscoveryPayload(compact);
+  uint32_t hash = fnv1a(FNV_OFFSET, topic.c_str(), topic.length());
+  hash = fnv1a(hash, payload.c_str(), payload.length());
+  // 0 means "no fingerprint" in storage
+  return hash ? hash : 1;
+}
+
+// Empty topics are derived as virt/<objectId>/<suffix> when needed, so the
+// usual case costs no heap per control
+static const char TOPIC_PREFIX[] = "virt/";
+static const char* const TOPIC_SUFFIX[] = { "/state", "/set", "/avail" };
+
+const String& HAControl::customTopic(TopicKind kind) const {
+  const HAControlOptions& opts = getOptions();
+  switch (kind) {
+    case TOPIC_STATE: return opts.stateTopic;
+    case TOPIC_COMMAND: return opts.commandTopic;
+    case TOPIC_AVAILABILITY: break;
+  }
+  return opts.availabilityTopic;
+}
+
+bool HAControl::hasTopic(TopicKind kind) const {
+  if (customTopic(kind).length()) return true;
+  // Sensors and binary sensors have no command topic
+  return kind != TOPIC_COMMAND || type == CONTROL_SWITCH || type == CONTROL_NUMBER;
+}
+
+int HAControl::topicParts(TopicKind kind, const char** parts, size_t* lengths) const {
+  const String& custom = customTopic(kind);
+  if (custom.length()) {
+    parts[0] = custom.c_str();
+    lengths[0] = custom.length();
+    return 1;
+  }
+  parts[0] = TOPIC_PREFIX;
+  lengths[0] = sizeof(TOPIC_PREFIX) - 1;
+  parts[1] = getObjectId();
+  lengths[1] = strlen(parts[1]);
+  parts[2] = TOPIC_SUFFIX[kind];
+  lengths[2] = strlen(TOPIC_SUFFIX[kind]);
+  return 3;
+}
+
+size_t HAControl::topicLength(TopicKind kind) const {
+  const char* parts[3];
+  size_t lengths[3];
+  int count = topicParts(kind, parts, lengths);
+  size_t total = 0;
+  for (int i = 0; i < count; i++) total += lengths[i];
+  return total;
+}
+
+char HAControl::topicChar(TopicKind kind, size_t index) const {
+  const char* parts[3];
+  size_t lengths[3];
+  int count = topicParts(kind, parts, lengths);
+  for (int i = 0; i < count; i++) {
+    if (index < lengths[i]) return parts[i][index];
+    index -= lengths[i];
+  }
+  return 0;
+}
+
+void HAControl::writeTopicChars(HAJsonWriter& writer, TopicKind kind, size_t from, size_t to) const {
+  const char* parts[3];
+  size_t lengths[3];
+  int count = topicParts(kind, parts, lengths);
+  size_t offset = 0;
+  for (int i = 0; i < count; i++) {
+    size_t start = from > offset ? from : offset;
+    size_t end = to < offset + lengths[i] ? to : offset + lengths[i];
+    if (start < end) writer.stringPart(parts[i] + (start - offset), end - start);
+    offset += lengths[i];
+  }
+}
+
+String HAControl::getTopic(TopicKind kind) const {
+  if (!hasTopic(kind)) return String();
+  const String& custom = customTopic(kind);
+  if (custom.length()) return custom;
+  return TOPIC_PREFIX + String(getObjectId()) + TOPIC_SUFFIX[kind];
+}
+
+String HAControl::getStateTopic() const {
+  return getTopic(TOPIC_STATE);
+}
+
+String HAControl::getCommandTopic() const {
+  return getTopic(TOPIC_COMMAND);
+}
+
+String HAControl::getAvailabilityTopic() const {
+  return getTopic(TOPIC_AVAILABILITY);
+}
+
+const char* HAControl::defaultIcon(ControlType type) {
   switch (type) {
-    case CONTROL_SWITCH: component = "switch"; break;
-    case CONTROL_NUMBER: component = "number"; break;
-    case CONTROL_SENSOR: component = "sensor"; break;
-    case CONTROL_BINARY_SENSOR: component = "binary_sensor"; break;
+    case CONTROL_SWITCH: return "mdi:toggle-switch";
+    case CONTROL_NUMBER: return "mdi:gauge";
+    case CONTROL_SENSOR: return "mdi:gauge";
+    case CONTROL_BINARY_SENSOR: return "mdi:motion-sensor";
+  }
+  return "";
+}
+
+// Shared by every control that has no options of its own
+static const HAControlOptions DEFAULT_OPTIONS;
+
+const HAControlOptions& HAControl::getOptions() const {
+  return options ? *options : DEFAULT_OPTIONS;
+}
+
+const char* HAControl::getIcon() const {
+  const String& icon = getOptions().icon;
+  return icon.length() ? icon.c_str() : defaultIcon(type);
+}
+
+bool HAControl::hasEntityId(const String& entityId) const {
+  if (descriptor) return entityId == descriptor->entityId;
+
+  const char* component = componentName(type);
+  size_t componentLength = strlen(component);
+  return entityId.length() == componentLength + 1 + objectId.length() &&
+         strncmp(entityId.c_str(), component, componentLength) == 0 &&
+         entityId[componentLength] == '.' &&
+         strcmp(entityId.c_str() + componentLength + 1, objectId.c_str()) == 0;
+}
+
+// The first topic in use supplies the "~" base for the others
+HAControl::TopicKind HAControl::baseTopic() const {
+  return hasTopic(TOPIC_STATE) ? TOPIC_STATE : TOPIC_AVAILABILITY;
+}
+
+bool HAControl::topicHasBase(TopicKind kind, size_t baseLength) const {
+  TopicKind base = baseTopic();
+  if (topicLength(kind) <= baseLength || topicChar(kind, baseLength) != '/') return false;
+  if (kind == base) return true;
+  for (size_t i = 0; i < baseLength; i++) {
+    if (topicChar(kind, i) != topicChar(base, i)) return false;
+  }
+  return true;
+}
+
+size_t HAControl::getTopicBaseLength() const {
+  // Longest prefix ending before a '/' that is shared by every topic in use
+  TopicKind base = baseTopic();
+  size_t baseLength = topicLength(base);
+  while (baseLength > 0 && topicChar(base, baseLength - 1) != '/') baseLength--;
+  if (baseLength <= 1) return 0;
+  baseLength--;
+
+  int users = 0;
+  for (int i = TOPIC_STATE; i <= TOPIC_AVAILABILITY; i++) {
+    TopicKind kind = (TopicKind)i;
+    if (!hasTopic(kind)) continue;
+    while (baseLength > 0 && !topicHasBase(kind, baseLength)) {
+      do {
+        baseLength--;
+      } while (baseLength > 0 && topicChar(base, baseLength) != '/');
+    }
+    users++;
+  }
+
+  // "~" costs its own key, so it only pays off when it replaces several copies
+  if (users < 2 || baseLength < 4) return 0;
+  return baseLength;
+}
+
+String HAControl::getTopicBase() const {
+  return getTopic(baseTopic()).substring(0, getTopicBaseLength());
+}
+
+void HAControl::writeDiscoveryTopic(HAJsonWriter& writer) const {
+  if (descriptor) {
+    writer.value(descriptor->discoveryTopic);
+    return;
   }
-  return component + "." + objectId;
+
+  const char* component = componentName(type);
+  writer.beginString();
+  writer.stringPart("homeassistant/", 14);
+  writer.stringPart(component, strlen(component));
+  writer.stringPart("/", 1);
+  writer.stringPart(objectId);
+  writer.stringPart("/config", 7);
+  writer.endString();
+}
+
+void HAControl::writeTopic(HAJsonWriter& writer, const char* name, TopicKind kind, size_t baseLength) const {
+  if (!hasTopic(kind)) return;
+
+  // Only topics that really start with the base are shortened
+  if (baseLength && !topicHasBase(kind, baseLength)) baseLength = 0;
+  writer.key(name);
+  writer.beginString();
+  if (baseLength) writer.stringPart("~", 1);
+  writeTopicChars(writer, kind, baseLength, topicLength(kind));
+  writer.endString();
 }
 
-String HAControl::getDiscoveryPayload() const {
-  String json = "{";
+void HAControl::writeDiscoveryPayload(HAJsonWriter& writer, bool compact) const {
+  if (descriptor) {
+    // Copied straight from flash; the payload is already as small as the
+    // full keys allow, so compact mode only shortens the device block
+    writer.beginObject();
+    writer.raw(descriptor->payload, strlen(descriptor->payload));
+    if (descriptor->unitMember[0]) {
+      writer.raw(descriptor->unitMember, strlen(descriptor->unitMember));
+    }
+    if (device) {
+      writer.key(compact ? "dev" : "device");
+      device->writeJson(writer, compact);
+    }
+    writer.endObject();
+    return;
+  }
+
+  writer.beginObject();
 
-  if (name.length()) json += "\"name\":\"" + HADevice::escape(name) + "\",";
-  if (uniqueId.length()) json += "\"unique_id\":\"" + HADevice::escape(uniqueId) + "\",";
-  if (icon.length()) json += "\"icon\":\"" + HADevice::escape(icon) + "\",";
-  if (stateTopic.length()) json += "\"state_topic\":\"" + HADevice::escape(stateTopic) + "\",";
-  if (commandTopic.length()) json += "\"command_topic\":\"" + HADevice::escape(commandTopic) + "\",";
-  if (availabilityTopic.length()) json += "\"availability_topic\":\"" + HADevice::escape(availabilityTopic) + "\",";
+  size_t baseLength = compact ? getTopicBaseLength() : 0;
+  if (baseLength) {
+    writer.key("~");
+    writer.beginString();
+    writeTopicChars(writer, baseTopic(), 0, baseLength);
+    writer.endString();
+  }
+
+  if (name.length()) writer.field("name", name);
+  if (uniqueId.length()) writer.field(compact ? "uniq_id" : "unique_id", uniqueId);
+  if (diagnostic) writer.field(compact ? "ent_cat" : "entity_category", "diagnostic");
+  writer.field(compact ? "ic" : "icon", getIcon());
+
+  writeTopic(writer, compact ? "stat_t" : "state_topic", TOPIC_STATE, baseLength);
+  writeTopic(writer, compact ? "cmd_t" : "command_topic", TOPIC_COMMAND, baseLength);
+  writeTopic(writer, compact ? "avty_t" : "availability_topic", TOPIC_AVAILABILITY, baseLength);
 
   if (device) {
-    json += "\"device\":" + device->toJson() + ",";
+    writer.key(compact ? "dev" : "device");
+    device->writeJson(writer, compact);
   }
 
+  const HAControlOptions& opts = getOptions();
+  const char* unitKey = compact ? "unit_of_meas" : "unit_of_measurement";
   switch (type) {
     case CONTROL_NUMBER:
-      json += "\"min\":" + String(minValue, 3) + ",";
-      json += "\"max\":" + String(maxValue, 3) + ",";
-      json += "\"step\":" + String(step, 3) + ",";
-      if (unit.length()) json += "\"unit_of_measurement\":\"" + HADevice::escape(unit) + "\",";
-      if (mode.length()) json += "\"mode\":\"" + HADevice::escape(mode) + "\",";
+      // HA defaults max to 100 and step to 1, so compact mode leaves them out
+      writer.field("min", opts.minValue);
+      if (!compact || opts.maxValue != 100) writer.field("max", opts.maxValue);
+      if (!compact || opts.step != 1) writer.field("step", opts.step);
+      if (opts.unit.length()) writer.field(unitKey, opts.unit);
+      if (opts.mode.length()) writer.field("mode", opts.mode);
       break;
     case CONTROL_SWITCH:
     case CONTROL_BINARY_SENSOR:
-      json += "\"payload_on\":\"" + HADevice::escape(payloadOn) + "\",";
-      json += "\"payload_off\":\"" + HADevice::escape(payloadOff) + "\",";
+      // "ON"/"OFF" are HA's defaults for both components
+      if (!compact || opts.payloadOn != "ON") writer.field(compact ? "pl_on" : "payload_on", opts.payloadOn);
+      if (!compact || opts.payloadOff != "OFF") writer.field(compact ? "pl_off" : "payload_off", opts.payloadOff);
       break;
     case CONTROL_SENSOR:
-      if (unit.length()) json += "\"unit_of_measurement\":\"" + HADevice::escape(unit) + "\",";
+      if (opts.unit.length()) writer.field(unitKey, opts.unit);
       break;
   }
 
-  if (json.endsWith(",")) {
-    json.remove(json.length() - 1);
-  }
-  json += "}";
+  writer.endObject();
+}
+
+String HAControl::getDiscoveryPayload(bool compact) const {
+  HAJsonWriter sizer(nullptr, 0);
+  writeDiscoveryPayload(sizer, compact);
 
+  String json;
+  json.reserve(sizer.length());
+  HAJsonWriter writer(json);
+  writeDiscoveryPayload(writer, compact);
   return json;
 }
 
 HAMQTTDiscovery::HAMQTTDiscovery() {
+  _port = 443;
+  _secure = true;
+  _client = nullptr;
   _controlCount = 0;
-  for (int i = 0; i < MAX_CONTROLS; i++) {
-    _controls[i] = nullptr;
+  _asyncCreation = false;
+  _loopBudget = 50;
+  _lastVerifyPoll = 0;
+  _batching = false;
+  _batchCount = 0;
+  _batchLength = 0;
+  _compactDiscovery = false;
+  _stateBatch = false;
+  _stateBatchLimit = 0;
+  _stateBatchDelay = 0;
+  _stateBatchBytes = 2;
+  _stateBatchCount = 0;
+  _stateBatchStartedAt = 0;
+  _helperBanks = 1;
+  _nextBank = 0;
+  for (int i = 0; i < MAX_HELPER_BANKS; i++) {
+    _bankSeq[i] = 0;
+    _bankSentAt[i] = 0;
+    _bankChunks[i] = 0;
+    _bankPolledAt[i] = 0;
+    _bankRetriggered[i] = false;
   }
+  _bankCursor = 0;
+  _ackPolled = false;
+  _helpersBusy = false;
+  _batchDue = false;
+  _lastSeq = 0;
+  _chunkSize = MAX_CHUNK;
+  _dataBuffers = MAX_DATA_BUFFERS;
+  _geometryKnown = false;
+  _transport = TRANSPORT_HELPERS;
+  _discoveryEndpoint = "/api/services/mqtt/publish";
+  _offline = nullptr;
+  _offlineCapacity = 0;
+  _offlineHead = 0;
+  _offlineCount = 0;
+  _offlineMode = OFFLINE_LATEST;
+  _replayBatch = 4;
+  _replayInterval = 2000;
+  _lastReplay = 0;
+  _offlineFs = nullptr;
+  _offlineFileLines = 0;
+  _offlineDirty = false;
+  _offlineSavedAt = 0;
+  _fingerprintCache = false;
+  _nodes = nullptr;
+  _nodeCount = 0;
+  _nodeCapacity = 0;
+  _nodeCursor = 0;
+  _sleepMode = false;
+  _wokeAt = 0;
+  _address = 0;
+  for (int i = 0; i < DIAGNOSTIC_SENSORS; i++) {
+    _diagnostics[i] = nullptr;
+  }
+  _connectTimeout = 5000;
+  _readTimeout = 5000;
+  _maxRetries = 0;
+  _retryBaseMs = 250;
+  _retryMaxMs = 4000;
+  _breakerState = BREAKER_CLOSED;
+  _breakerThreshold = 0;
+  _breakerFailures = 0;
+  _breakerOpenMs = 30000;
+  _breakerOpenedAt = 0;
+  _breakerCallback = nullptr;
+  _diagnosticInterval = 0;
+  _lastDiagnostics = 0;
+  _pushReader.begin(this);
+  _pushState = PUSH_OFF;
+  _pushMessageId = 0;
+  _pushRetryAt = 0;
+  _pushSubscribeAt = 0;
+  _pushBackoff = PUSH_RETRY_MIN_MS;
+  _lastPushPing = 0;
+  _stateCallback = nullptr;
+  _brokerPort = 1883;
+  _localReady = false;
+  _localRetryAt = 0;
+  _localBackoff = LOCAL_RETRY_MIN_MS;
+#ifdef HAMQTT_FAULT_INJECTION
+  _faultLoss = 0;
+  _faultError = 0;
+  _faultLatency = 0;
+#endif
+  _highQueue.head = 0;
+  _highQueue.count = 0;
+  _lowQueue.head = 0;
+  _lowQueue.count = 0;
+  _queueLock = xSemaphoreCreateMutex();
+  _netLock = xSemaphoreCreateRecursiveMutex();
+  _workerDone = xSemaphoreCreateBinary();
+  portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+  _sampleMux = unlocked;
+  _workerTask = nullptr;
+  _workerRunning = false;
+  _loopCursor = 0;
+  _statusCallback = nullptr;
+  _blocks = nullptr;
+  _blockUsed = 0;
+  _controls = nullptr;
+  _scratch = nullptr;
+  _controlCapacity = 0;
 }
 
 HAMQTTDiscovery::~HAMQTTDiscovery() {
+  stopWorker();
+  stopPush();
+  _local.close();
+
   for (int i = 0; i < _controlCount; i++) {
-    if (_controls[i]) {
-      delete _controls[i];
-    }
+    delete _controls[i]->options;
+    delete _controls[i]->aggregator;
+  }
+  while (_blocks) {
+    ControlBlock* next = _blocks->next;
+    delete _blocks;
+    _blocks = next;
+  }
+  delete[] _controls;
+  delete[] _scratch;
+  for (int i = 0; i < _nodeCount; i++) {
+    delete _nodes[i];
+  }
+  delete[] _nodes;
+
+  closeConnection();
+  delete[] _offline;
+
+  if (_fingerprintCache) {
+    _prefs.end();
   }
+
+  vSemaphoreDelete(_queueLock);
+  vSemaphoreDelete(_netLock);
+  vSemaphoreDelete(_workerDone);
 }
 
-bool HAMQTTDiscovery::begin(const String& serverUrl, const String& token) {
+bool HAMQTTDiscovery::begin(const String& serverUrl, const String& token, HATransport transport) {
   if (WiFi.status() != WL_CONNECTED) {
     Serial.println("HAMQTTDiscovery: WiFi not connected");
     return false;
@@ -130,11 +673,46 @@ bool HAMQTTDiscovery::begin(const String& serverUrl, const String& token) {
   }
 
   _token = token;
+  _transport = transport;
+
+  // Split the URL into host and port for the persistent connection
+  String hostPart = _serverUrl;
+  _secure = !hostPart.startsWith("http://");
+  int schemeEnd = hostPart.indexOf("://");
+  if (schemeEnd != -1) {
+    hostPart = hostPart.substring(schemeEnd + 3);
+  }
+  int pathStart = hostPart.indexOf('/');
+  if (pathStart != -1) {
+    _basePath = hostPart.substring(pathStart);
+    hostPart = hostPart.substring(0, pathStart);
+  } else {
+    _basePath = "";
+  }
+  int portStart = hostPart.indexOf(':');
+  if (portStart != -1) {
+    _port = hostPart.substring(portStart + 1).toInt();
+    _host = hostPart.substring(0, portStart);
+  } else {
+    _port = _secure ? 443 : 80;
+    _host = hostPart;
+  }
+
+  if (_client) {
+    closeConnection();
+    _client = nullptr;
+  }
 
   Serial.println("HAMQTTDiscovery: Initialized successfully");
   return true;
 }
 
+void HAMQTTDiscovery::setDiscoveryService(const String& service) {
+  String path = service;
+  path.replace(".", "/");
+  _discoveryEndpoint = "/api/services/" + path;
+}
+
 void HAMQTTDiscovery::setDevice(const String& uniqueId, const String& name,
                                const String& manufacturer, const String& model,
                                const String& swVersion) {
@@ -149,342 +727,2754 @@ String HAMQTTDiscovery::getAuthHeader() const {
   return "Bearer " + _token;
 }
 
-bool HAMQTTDiscovery::postToHA(const String& endpoint, const String& payload) {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("HAMQTTDiscovery: WiFi not connected");
+bool HAMQTTDiscovery::openConnection() {
+  if (_client && _client->connected()) {
+    return true;
+  }
+
+  if (!_client) {
+    if (_secure) {
+      _secureClient.setInsecure();
+      _client = &_secureClient;
+    } else {
+      _client = &_plainClient;
+    }
+  }
+
+  _client->stop();
+  unsigned long startTime = millis();
+  if (_secure) {
+    _secureClient.setHandshakeTimeout((_connectTimeout + 999) / 1000);
+  }
+  if (!connectClient()) {
+    recordOperation(OP_CONNECT, startTime, false);
+    Serial.printf("HAMQTTDiscovery: Connection to %s:%u failed\n", _host.c_str(), _port);
     return false;
   }
+  recordOperation(OP_CONNECT, startTime, true);
+  return true;
+}
+
+bool HAMQTTDiscovery::connectClient() {
+  if (!_sleepMode) {
+    return _client->connect(_host.c_str(), _port, _connectTimeout);
+  }
+
+  // Sleep mode connects by address so a wake with a retained one skips DNS.
+  // TLS still gets the host name for SNI.
+  if (!_address) {
+    IPAddress resolved;
+    if (WiFi.hostByName(_host.c_str(), resolved) == 1) {
+      _address = (uint32_t)resolved;
+    }
+  }
+  if (_address) {
+    IPAddress address(_address);
+    bool connected = _secure
+      ? _secureClient.connect(address, _port, _host.c_str(), nullptr, nullptr, nullptr)
+      : _client->connect(address, _port, _connectTimeout);
+    if (connected) return true;
+
+    // The server may have moved; resolve again on the next connection
+    _client->stop();
+    _address = 0;
+  }
+  return _client->connect(_host.c_str(), _port, _connectTimeout);
+}
 
-  WiFiClientSecure* client = new WiFiClientSecure();
-  client->setInsecure();
+void HAMQTTDiscovery::closeConnection() {
+  if (_client) {
+    _client->stop();
+  }
+}
 
-  HTTPClient https;
-  String url = _serverUrl + endpoint;
-  https.begin(*client, url);
-  https.addHeader("Authorization", getAuthHeader());
-  https.addHeader("Content-Type", "application/json");
+size_t HAMQTTDiscovery::discardResponse() {
+  // The socket is reused for the next request, so any unread body has to be
+  // consumed first. Without a Content-Length we can't tell where it ends.
+  int remaining = _https.getSize();
+  if (remaining < 0) {
+    closeConnection();
+    return 0;
+  }
 
-  int httpCode = https.POST(payload);
-  bool success = (httpCode >= 200 && httpCode < 300);
+  WiFiClient* stream = _https.getStreamPtr();
+  uint8_t scratch[64];
+  size_t discarded = 0;
+  unsigned long startTime = millis();
+  while (remaining > 0 && stream && stream->connected() && millis() - startTime < _readTimeout) {
+    int available = stream->available();
+    if (available <= 0) {
+      delay(1);
+      continue;
+    }
+    int count = stream->read(scratch, min((int)sizeof(scratch), min(available, remaining)));
+    if (count <= 0) break;
+    remaining -= count;
+    discarded += count;
+  }
 
-  if (!success) {
-    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", url.c_str(), httpCode);
+  if (remaining > 0) {
+    closeConnection();
   }
+  return discarded;
+}
 
-  https.end();
-  delete client;
-  return success;
+// Worth another attempt: the request didn't get through, or HA's proxy
+// answered for an overloaded or restarting instance
+static bool isRetryable(int httpCode) {
+  return httpCode < 0 || httpCode == 429 || httpCode == 502 || httpCode == 503 || httpCode == 504;
 }
 
-bool HAMQTTDiscovery::getFromHA(const String& endpoint, String& response) {
+int HAMQTTDiscovery::sendRequest(const char* method, const String& endpoint, const char* body, size_t length,
+                                 String* response, Stream* sink) {
   if (WiFi.status() != WL_CONNECTED) {
     Serial.println("HAMQTTDiscovery: WiFi not connected");
-    return false;
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+
+  lockNet();
+  if (!allowRequest()) {
+    unlockNet();
+    return CIRCUIT_OPEN;
   }
 
-  WiFiClientSecure* client = new WiFiClientSecure();
-  client->setInsecure();
+  int httpCode = HTTPC_ERROR_CONNECTION_LOST;
+  unsigned long startTime = millis();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < _requestStats.minFreeHeap) _requestStats.minFreeHeap = freeHeap;
+
+  // A kept-alive socket may have been closed by the server while idle, so a
+  // failure on a reused connection gets one immediate retry on a fresh
+  // connection. Other retryable failures back off first. Every request the
+  // library makes sets or reads absolute state, so repeating one is safe.
+  bool freshRetry = true;
+  uint8_t retries = 0;
+  while (true) {
+    bool reused = _client && _client->connected();
+    if (!openConnection()) {
+      httpCode = HTTPC_ERROR_CONNECTION_REFUSED;
+    } else {
+      _https.begin(*_client, _host, _port, _basePath + endpoint, _secure);
+      _https.setReuse(true);
+      _https.setConnectTimeout(_connectTimeout);
+      _https.setTimeout(_readTimeout);
+      _https.addHeader("Authorization", getAuthHeader());
+      if (length) {
+        _https.addHeader("Content-Type", "application/json");
+      }
 
-  HTTPClient https;
-  String url = _serverUrl + endpoint;
-  https.begin(*client, url);
-  https.addHeader("Authorization", getAuthHeader());
+      _requestStats.requests++;
+      _requestStats.bytesSent += length;
+      if (!injectFault(httpCode)) {
+        httpCode = _https.sendRequest(method, (uint8_t*)body, length);
+      }
 
-  int httpCode = https.GET();
-  bool success = (httpCode >= 200 && httpCode < 300);
+      if (httpCode < 0) {
+        _https.end();
+        closeConnection();
+        if (reused && freshRetry) {
+          freshRetry = false;
+          _requestStats.retries++;
+          continue;
+        }
+      } else {
+        bool success = (httpCode >= 200 && httpCode < 300);
+        if (success && sink) {
+          // Streamed straight into the sink, whatever the body size
+          int written = _https.writeToStream(sink);
+          if (written < 0) {
+            closeConnection();
+          } else {
+            _requestStats.bytesReceived += written;
+          }
+        } else if (success && response) {
+          *response = _https.getString();
+          _requestStats.bytesReceived += response->length();
+        } else {
+          _requestStats.bytesReceived += discardResponse();
+        }
+        _https.end();
+      }
+    }
 
-  if (success) {
-    response = https.getString();
-  } else {
-    Serial.printf("HAMQTTDiscovery: GET %s failed with code %d\n", url.c_str(), httpCode);
+    if (!isRetryable(httpCode) || retries >= _maxRetries) break;
+
+    // Exponential backoff with jitter, so several devices hitting the same
+    // degraded instance don't retry in lockstep
+    unsigned long backoff = _retryBaseMs << retries;
+    if (backoff > _retryMaxMs) backoff = _retryMaxMs;
+    delay(backoff / 2 + random(backoff / 2 + 1));
+    retries++;
+    _requestStats.retries++;
   }
 
-  https.end();
-  delete client;
-  return success;
+  if (httpCode < 200 || httpCode >= 300) {
+    _requestStats.failures++;
+  }
+  recordBreakerResult(httpCode);
+  _requestStats.busyMs += millis() - startTime;
+  freeHeap = ESP.getFreeHeap();
+  if (freeHeap < _requestStats.minFreeHeap) _requestStats.minFreeHeap = freeHeap;
+  unlockNet();
+  return httpCode;
 }
 
-bool HAMQTTDiscovery::postHelperBuffer(int bufferIndex, const String& content) {
-  if (bufferIndex < 1 || bufferIndex > 6) return false;
+void HAMQTTDiscovery::setTimeouts(uint32_t connectMs, uint32_t readMs) {
+  _connectTimeout = connectMs;
+  _readTimeout = readMs > 65535 ? 65535 : readMs;
+}
 
-  String entityId = "input_text.mqtt_buffer_" + String(bufferIndex);
-  String escaped = HADevice::escape(content);
-  String payload = "{\"state\":\"" + escaped + "\"}";
+void HAMQTTDiscovery::setRetryPolicy(uint8_t maxRetries, unsigned long baseDelayMs, unsigned long maxDelayMs) {
+  _maxRetries = maxRetries;
+  _retryBaseMs = baseDelayMs;
+  _retryMaxMs = maxDelayMs;
+}
 
-  return postToHA("/api/states/" + entityId, payload);
+void HAMQTTDiscovery::setCircuitBreaker(uint8_t failureThreshold, unsigned long openMs) {
+  _breakerThreshold = failureThreshold;
+  _breakerOpenMs = openMs;
 }
 
-bool HAMQTTDiscovery::publishDiscovery(HAControl* control) {
-  String topic = control->getDiscoveryTopic();
-  String payload = control->getDiscoveryPayload();
+void HAMQTTDiscovery::onBreakerChange(HABreakerCallback callback) {
+  _breakerCallback = callback;
+}
 
-  String envelope = "{\"topic\":\"" + topic + "\",\"payload\":" + payload + "}";
+HABreakerState HAMQTTDiscovery::breakerState() const {
+  return _breakerState;
+}
 
-  const size_t MAX_CHUNK = 255;
-  size_t len = envelope.length();
+void HAMQTTDiscovery::setBreakerState(HABreakerState state) {
+  if (state == _breakerState) return;
+  _breakerState = state;
 
-  if (len > MAX_CHUNK * 5) {
-    Serial.println("HAMQTTDiscovery: Discovery payload too large");
-    return false;
+  if (state == BREAKER_OPEN) {
+    _breakerOpenedAt = millis();
+    Serial.printf("HAMQTTDiscovery: HA unreachable, failing fast for %lu ms\n", _breakerOpenMs);
+  } else if (state == BREAKER_CLOSED) {
+    Serial.println("HAMQTTDiscovery: HA reachable again");
   }
 
-  bool success = true;
-  for (int i = 1; i <= 5; i++) {
-    String chunk = "";
-    if (len > 0) {
-      size_t start = (i - 1) * MAX_CHUNK;
-      size_t count = min((size_t)MAX_CHUNK, len - start);
-      if (start < len) {
-        chunk = envelope.substring(start, start + count);
-      }
-    }
-    success &= postHelperBuffer(i, chunk);
+  if (_breakerCallback) {
+    _breakerCallback(state);
   }
-
-  success &= postHelperBuffer(6, "END");
-  return success;
 }
 
-bool HAMQTTDiscovery::controlExists(const String& entityId) {
-  String response;
-  bool exists = getFromHA("/api/states/" + entityId, response);
-  return exists && response.length() > 0 && !response.startsWith("null");
+bool HAMQTTDiscovery::allowRequest() {
+  if (_breakerState != BREAKER_OPEN) return true;
+  if (millis() - _breakerOpenedAt < _breakerOpenMs) return false;
+
+  // This request is the probe; its result closes or reopens the breaker
+  setBreakerState(BREAKER_HALF_OPEN);
+  return true;
 }
 
-bool HAMQTTDiscovery::waitForControlCreation(const String& entityId, int timeoutSeconds) {
-  unsigned long startTime = millis();
-  unsigned long timeout = timeoutSeconds * 1000;
+void HAMQTTDiscovery::recordBreakerResult(int httpCode) {
+  if (!_breakerThreshold) return;
 
-  while (millis() - startTime < timeout) {
-    if (controlExists(entityId)) {
-      return true;
-    }
-    delay(500);
+  // Any reply below 500 means HA itself answered
+  if (httpCode > 0 && httpCode < 500) {
+    _breakerFailures = 0;
+    setBreakerState(BREAKER_CLOSED);
+    return;
   }
-  return false;
-}
 
-HAControl* HAMQTTDiscovery::createSwitch(const String& objectId, const String& name, const String& uniqueId,
-                                        const String& icon, const String& stateTopic,
-                                        const String& commandTopic, const String& availabilityTopic,
-                                        const String& payloadOn, const String& payloadOff,
-                                        HADevice* device) {
-  if (_controlCount >= MAX_CONTROLS) {
-    Serial.println("HAMQTTDiscovery: Maximum number of controls reached");
-    return nullptr;
+  if (_breakerState == BREAKER_HALF_OPEN) {
+    _breakerOpenedAt = millis();
+    setBreakerState(BREAKER_OPEN);
+  } else if (++_breakerFailures >= _breakerThreshold) {
+    setBreakerState(BREAKER_OPEN);
   }
+}
 
-  HAControl* control = new HAControl();
-  control->type = CONTROL_SWITCH;
-  control->objectId = objectId;
-  control->name = name;
-  control->uniqueId = uniqueId;
-  control->icon = icon.length() ? icon : "mdi:toggle-switch";
-  control->stateTopic = stateTopic.length() ? stateTopic : ("virt/" + objectId + "/state");
-  control->commandTopic = commandTopic.length() ? commandTopic : ("virt/" + objectId + "/set");
-  control->availabilityTopic = availabilityTopic.length() ? availabilityTopic : ("virt/" + objectId + "/avail");
-  control->payloadOn = payloadOn.length() ? payloadOn : "ON";
-  control->payloadOff = payloadOff.length() ? payloadOff : "OFF";
-  control->device = device ? device : &_defaultDevice;
+void HAMQTTDiscovery::probeBreaker() {
+  if (_breakerState != BREAKER_OPEN || millis() - _breakerOpenedAt < _breakerOpenMs) return;
 
-  String entityId = control->getEntityId();
+  // Cheapest authenticated endpoint; answers {"message":"API running."}
+  sendRequest("GET", "/api/", nullptr, 0, nullptr, nullptr);
+}
 
-  if (controlExists(entityId)) {
-    Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
-    delete control;
-    return nullptr;
+HARequestStats HAMQTTDiscovery::getRequestStats() const {
+  lockNet();
+  HARequestStats snapshot = _requestStats;
+  unlockNet();
+  return snapshot;
+}
+
+void HAMQTTDiscovery::recordOperation(HAOperation op, unsigned long startedAt, bool success) {
+  lockNet();
+  _requestStats.ops[op].record(millis() - startedAt, success);
+  unlockNet();
+}
+
+void HAMQTTDiscovery::resetRequestStats() {
+  lockNet();
+  _requestStats = HARequestStats();
+  unlockNet();
+}
+
+HANode* HAMQTTDiscovery::addNode(const String& uniqueId, const String& name, const String& manufacturer,
+                                 const String& model, const String& swVersion) {
+  lockNet();
+  HANode* node = findNode(uniqueId);
+  if (node) {
+    unlockNet();
+    return node;
   }
 
-  if (!publishDiscovery(control)) {
-    Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", entityId.c_str());
-    delete control;
-    return nullptr;
+  if (_nodeCount == _nodeCapacity) {
+    int capacity = _nodeCapacity ? _nodeCapacity * 2 : 8;
+    HANode** nodes = new HANode*[capacity];
+    for (int i = 0; i < _nodeCount; i++) {
+      nodes[i] = _nodes[i];
+    }
+    delete[] _nodes;
+    _nodes = nodes;
+    _nodeCapacity = capacity;
   }
 
-  Serial.printf("HAMQTTDiscovery: Waiting for control %s to be created...\n", entityId.c_str());
-  delay(3000);
+  node = new HANode();
+  node->device.uniqueId = uniqueId;
+  node->device.name = name;
+  node->device.manufacturer = manufacturer;
+  node->device.model = model;
+  node->device.swVersion = swVersion;
+  _nodes[_nodeCount++] = node;
+
+  if (_nodeCount == 1) {
+    // Gateway mode starts here: a blocking create would stall every node,
+    // and controls made so far share the local lane
+    _asyncCreation = true;
+    for (int i = 0; i < _controlCount; i++) {
+      attachToNode(_controls[i]);
+    }
+  }
+  unlockNet();
+  return node;
+}
 
-  if (!waitForControlCreation(entityId, 10)) {
-    Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", entityId.c_str());
-    delete control;
-    return nullptr;
+HANode* HAMQTTDiscovery::findNode(const String& uniqueId) const {
+  for (int i = 0; i < _nodeCount; i++) {
+    if (_nodes[i]->device.uniqueId == uniqueId) {
+      return _nodes[i];
+    }
   }
+  return nullptr;
+}
 
-  control->isOnline = true;
-  _controls[_controlCount++] = control;
-  Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
-  return control;
+HANode* HAMQTTDiscovery::getNode(int index) const {
+  return index >= 0 && index < _nodeCount ? _nodes[index] : nullptr;
 }
 
-HAControl* HAMQTTDiscovery::createNumber(const String& objectId, const String& name, const String& uniqueId,
-                                        float minVal, float maxVal, float step,
-                                        const String& unit, const String& mode,
-                                        const String& icon, const String& stateTopic,
-                                        const String& commandTopic, const String& availabilityTopic,
-                                        HADevice* device) {
-  if (_controlCount >= MAX_CONTROLS) {
-    Serial.println("HAMQTTDiscovery: Maximum number of controls reached");
+int HAMQTTDiscovery::nodeCount() const {
+  return _nodeCount;
+}
+
+void HAMQTTDiscovery::resetNodeStats() {
+  lockNet();
+  _localNode.stats = HANodeStats();
+  for (int i = 0; i < _nodeCount; i++) {
+    _nodes[i]->stats = HANodeStats();
+  }
+  unlockNet();
+}
+
+void HAMQTTDiscovery::attachToNode(HAControl* control) {
+  if (control->node) return;
+  for (int i = 0; i < _nodeCount; i++) {
+    if (control->device == &_nodes[i]->device) {
+      _nodes[i]->addControl(control);
+      return;
+    }
+  }
+  _localNode.addControl(control);
+}
+
+void HAMQTTDiscovery::serviceNodes(unsigned long startTime) {
+  // Every round gives each lane at most one network step, so a lane's share
+  // depends neither on its traffic nor on its control count. Rounds stop
+  // when nothing is left to do; the cap keeps failing writes from spinning.
+  int lanes = _nodeCount + 1;
+  bool worked = true;
+  for (int round = 0; worked && round < _controlCount; round++) {
+    worked = false;
+    for (int n = 0; n < lanes; n++) {
+      if (millis() - startTime >= _loopBudget) return;
+
+      int lane = (_nodeCursor + n) % lanes;
+      HANode* node = lane == 0 ? &_localNode : _nodes[lane - 1];
+      if (serviceNode(node)) {
+        // The budget usually runs out after a request or two, so the next
+        // loop() starts with the lane after the last one served
+        _nodeCursor = (lane + 1) % lanes;
+        worked = true;
+      }
+    }
+  }
+}
+
+bool HAMQTTDiscovery::serviceNode(HANode* node) {
+  for (int n = 0; n < node->controlCount; n++) {
+    int index = (node->cursor + n) % node->controlCount;
+    HAControl* control = node->controls[index];
+    if (advanceCreation(control) || serviceAggregation(control) || serviceWrites(control)) {
+      node->cursor = (index + 1) % node->controlCount;
+      return true;
+    }
+  }
+  return false;
+}
+
+void HAMQTTDiscovery::recordDelivery(HAControl* control, unsigned long queuedAt) {
+  if (!control->node || !queuedAt) return;
+  control->node->stats.delivered++;
+  control->node->stats.latency.record(millis() - queuedAt, true);
+}
+
+HAPushReader::HAPushReader() {
+  _owner = nullptr;
+  clearMessage();
+}
+
+void HAPushReader::begin(HAMQTTDiscovery* owner) {
+  _owner = owner;
+}
+
+void HAPushReader::clearMessage() {
+  reset();
+  type[0] = '\0';
+  id = 0;
+  success = false;
+}
+
+void HAPushReader::onValue(const char* value, size_t, bool isString) {
+  if (depth() == 1) {
+    if (pathIs("type")) {
+      strncpy(type, value, sizeof(type) - 1);
+      type[sizeof(type) - 1] = '\0';
+    } else if (pathIs("id")) {
+      id = strtoul(value, nullptr, 10);
+    } else if (pathIs("success")) {
+      success = !isString && strcmp(value, "true") == 0;
+    }
+    return;
+  }
+
+  // subscribe_entities sends event.a.<entity>.s with the current state,
+  // then event.c.<entity>.+.s for each change
+  if (strcmp(keyAt(1), "event") != 0) return;
+  bool added = depth() == 4 && strcmp(keyAt(2), "a") == 0 && strcmp(keyAt(4), "s") == 0;
+  bool changed = depth() == 5 && strcmp(keyAt(2), "c") == 0 &&
+                 strcmp(keyAt(4), "+") == 0 && strcmp(keyAt(5), "s") == 0;
+  if ((added || changed) && _owner) {
+    _owner->dispatchPush(keyAt(3), value);
+  }
+}
+
+HAStateListReader::HAStateListReader(HAControl** controls, int count)
+  : _controls(controls), _count(count), _cursor(0), _changedCount(0), _match(-1) {
+  _state[0] = '\0';
+  _lastChanged[0] = '\0';
+}
+
+void HAStateListReader::onContainer(bool isObject, bool opened) {
+  if (!isObject || depth() != 1) return;
+  if (opened) {
+    _match = -1;
+    _state[0] = '\0';
+    _lastChanged[0] = '\0';
+    return;
+  }
+  if (_match < 0) return;
+
+  HAControl* control = _controls[_match];
+  if (!control->isOnline || control->currentState != _state || control->lastChanged != _lastChanged) {
+    control->changed = true;
+    _changedCount++;
+  }
+  control->currentState = _state;
+  control->lastChanged = _lastChanged;
+  control->isOnline = true;
+  _controls[_match] = nullptr;
+  _cursor = _match + 1;
+}
+
+void HAStateListReader::onValue(const char* value, size_t length, bool) {
+  if (depth() != 2) return;
+  const char* key = keyAt(2);
+  if (strcmp(key, "s") == 0) {
+    size_t count = min(length, sizeof(_state) - 1);
+    memcpy(_state, value, count);
+    _state[count] = '\0';
+  } else if (strcmp(key, "c") == 0) {
+    size_t count = min(length, sizeof(_lastChanged) - 1);
+    memcpy(_lastChanged, value, count);
+    _lastChanged[count] = '\0';
+  } else if (strcmp(key, "e") == 0) {
+    // Entries usually come back in the order they were asked for, so the
+    // search starts after the last match
+    String entityId(value);
+    for (int n = 0; n < _count; n++) {
+      int i = (_cursor + n) % _count;
+      if (_controls[i] && _controls[i]->hasEntityId(entityId)) {
+        _match = i;
+        break;
+      }
+    }
+  }
+}
+
+bool HAMQTTDiscovery::startPush() {
+  if (!_host.length()) {
+    Serial.println("HAMQTTDiscovery: Call begin() before startPush()");
+    return false;
+  }
+
+  lockNet();
+  if (_pushState == PUSH_OFF) {
+    _pushState = PUSH_DISCONNECTED;
+    _pushRetryAt = millis();
+    _pushBackoff = PUSH_RETRY_MIN_MS;
+  }
+  unlockNet();
+  return true;
+}
+
+void HAMQTTDiscovery::stopPush() {
+  lockNet();
+  _push.close();
+  _pushState = PUSH_OFF;
+  for (int i = 0; i < _controlCount; i++) {
+    _controls[i]->subscription = 0;
+  }
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::pushConnected() const {
+  return _pushState == PUSH_READY;
+}
+
+void HAMQTTDiscovery::onStateChange(HAControl* control, HAStateCallback callback) {
+  if (control) {
+    control->stateCallback = callback;
+  }
+}
+
+void HAMQTTDiscovery::onStateChange(HAStateCallback callback) {
+  _stateCallback = callback;
+}
+
+void HAMQTTDiscovery::servicePush() {
+  if (_pushState == PUSH_OFF) return;
+
+  if (!_push.connected()) {
+    if (_pushState != PUSH_DISCONNECTED) {
+      Serial.println("HAMQTTDiscovery: Push connection lost");
+      _pushState = PUSH_DISCONNECTED;
+      _pushRetryAt = millis() + _pushBackoff;
+      for (int i = 0; i < _controlCount; i++) {
+        _controls[i]->subscription = 0;
+      }
+    }
+    if ((long)(millis() - _pushRetryAt) < 0 || WiFi.status() != WL_CONNECTED) return;
+
+    if (!_push.connect(_host, _port, _basePath + "/api/websocket", _secure, _connectTimeout)) {
+      _pushRetryAt = millis() + _pushBackoff;
+      _pushBackoff = min(_pushBackoff * 2, (unsigned long)PUSH_RETRY_MAX_MS);
+      return;
+    }
+    _pushState = PUSH_AUTH;
+    _pushMessageId = 0;
+    _pushReader.clearMessage();
+    _pushBackoff = PUSH_RETRY_MIN_MS;
+  }
+
+  // A few messages per pass keeps loop() responsive during a burst
+  for (int n = 0; n < 4 && _push.poll(_pushReader); n++) {
+    handlePushMessage();
+    _pushReader.clearMessage();
+  }
+
+  if (_pushState != PUSH_READY) return;
+
+  subscribePush();
+
+  if (millis() - _lastPushPing >= PUSH_PING_MS) {
+    _lastPushPing = millis();
+    HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+    writer.beginObject();
+    writer.field("id", (long)++_pushMessageId);
+    writer.field("type", "ping");
+    writer.endObject();
+    sendPush(writer);
+  }
+
+  // HA answers every ping, so silence means the connection is dead
+  if (millis() - _push.lastReceiveAt() > PUSH_PING_MS * 2) {
+    Serial.println("HAMQTTDiscovery: Push connection stalled");
+    _push.close();
+  }
+}
+
+bool HAMQTTDiscovery::sendPush(HAJsonWriter& writer) {
+  if (writer.overflowed() || !_push.sendText(_bodyBuffer, writer.length())) {
+    _push.close();
+    return false;
+  }
+  return true;
+}
+
+void HAMQTTDiscovery::handlePushMessage() {
+  const char* type = _pushReader.type;
+
+  if (strcmp(type, "auth_required") == 0) {
+    HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+    writer.beginObject();
+    writer.field("type", "auth");
+    writer.field("access_token", _token);
+    writer.endObject();
+    sendPush(writer);
+  } else if (strcmp(type, "auth_ok") == 0) {
+    _pushState = PUSH_READY;
+    _lastPushPing = millis();
+    Serial.println("HAMQTTDiscovery: Push connection ready");
+  } else if (strcmp(type, "auth_invalid") == 0) {
+    // Retrying with the same token can't help
+    Serial.println("HAMQTTDiscovery: Push authentication failed");
+    stopPush();
+  } else if (strcmp(type, "result") == 0 && !_pushReader.success) {
+    // Only the controls of the refused message lose their subscription;
+    // they are asked for again after a pause, not on every pass
+    int refused = 0;
+    for (int i = 0; i < _controlCount; i++) {
+      if (_pushReader.id && _controls[i]->subscription == _pushReader.id) {
+        _controls[i]->subscription = 0;
+        refused++;
+      }
+    }
+    if (refused > 0) {
+      _pushSubscribeAt = millis() + PUSH_RETRY_MIN_MS;
+    }
+    Serial.printf("HAMQTTDiscovery: Push subscription %lu refused for %d controls\n",
+                  (unsigned long)_pushReader.id, refused);
+  }
+}
+
+void HAMQTTDiscovery::subscribePush() {
+  if ((long)(millis() - _pushSubscribeAt) < 0) return;
+
+  // Online controls that aren't subscribed yet go into one subscription,
+  // as many as fit in the body buffer; the rest follow on the next pass
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  writer.field("id", (long)(_pushMessageId + 1));
+  writer.field("type", "subscribe_entities");
+  writer.key("entity_ids");
+  writer.beginArray();
+
+  int count = 0;
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (!control->isOnline || control->subscription) continue;
+
+    String entityId = control->getEntityId();
+    if (writer.length() + HAJsonWriter::escapedLength(entityId.c_str(), entityId.length()) + 8 > sizeof(_bodyBuffer)) break;
+    writer.value(entityId);
+    _scratch[count++] = control;
+  }
+  if (count == 0) return;
+
+  writer.endArray();
+  writer.endObject();
+  _pushMessageId++;
+  if (!sendPush(writer)) return;
+
+  for (int i = 0; i < count; i++) {
+    _scratch[i]->subscription = _pushMessageId;
+  }
+}
+
+void HAMQTTDiscovery::dispatchPush(const char* entityId, const char* state) {
+  HAControl* control = findControl(String(entityId));
+  // Also drops the echo of our own writes, which already set currentState
+  if (!control || control->currentState == state) return;
+
+  control->currentState = state;
+  control->changed = true;
+  if (control->stateCallback) {
+    control->stateCallback(control, control->currentState);
+  }
+  if (_stateCallback) {
+    _stateCallback(control, control->currentState);
+  }
+}
+
+bool HAMQTTDiscovery::setLocalBroker(const String& host, uint16_t port, const String& username,
+                                     const String& password) {
+  if (!host.length()) {
+    Serial.println("HAMQTTDiscovery: Broker host required");
+    return false;
+  }
+
+  lockNet();
+  _local.close();
+  _brokerHost = host;
+  _brokerPort = port;
+  _brokerUser = username;
+  _brokerPassword = password;
+  _localReady = false;
+  _localBackoff = LOCAL_RETRY_MIN_MS;
+  bool connected = WiFi.status() == WL_CONNECTED && connectLocal();
+  if (!connected) {
+    Serial.println("HAMQTTDiscovery: Local broker unreachable, using REST until it answers");
+  }
+  unlockNet();
+  return connected;
+}
+
+void HAMQTTDiscovery::clearLocalBroker() {
+  lockNet();
+  _local.close();
+  _brokerHost = "";
+  _localReady = false;
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::localConnected() const {
+  return _localReady;
+}
+
+bool HAMQTTDiscovery::connectLocal() {
+  // The client id only has to be unique on the broker; the session is clean
+  String clientId = _defaultDevice.uniqueId.length() ? _defaultDevice.uniqueId
+                                                     : "hamqtt_" + String((uint32_t)esp_random(), HEX);
+  bool connected = _local.connect(_brokerHost, _brokerPort, clientId, _brokerUser, _brokerPassword,
+                                  LOCAL_KEEPALIVE_S, _connectTimeout);
+  if (!connected) {
+    _localRetryAt = millis() + _localBackoff;
+    _localBackoff = min(_localBackoff * 2, (unsigned long)LOCAL_RETRY_MAX_MS);
+    return false;
+  }
+
+  _localReady = true;
+  _localBackoff = LOCAL_RETRY_MIN_MS;
+  Serial.printf("HAMQTTDiscovery: Local broker %s:%u connected\n", _brokerHost.c_str(), _brokerPort);
+  // Subscriptions don't outlive a clean session, so every control is
+  // announced again
+  for (int i = 0; i < _controlCount && _localReady; i++) {
+    announceLocal(_controls[i]);
+  }
+  return _localReady;
+}
+
+void HAMQTTDiscovery::dropLocal() {
+  Serial.println("HAMQTTDiscovery: Local broker lost, falling back to REST");
+  _local.close();
+  _localReady = false;
+  _localRetryAt = millis() + _localBackoff;
+}
+
+void HAMQTTDiscovery::serviceLocal() {
+  if (!_brokerHost.length()) return;
+
+  if (_localReady && (!_local.connected() || !_local.keepAlive())) {
+    dropLocal();
+  }
+  if (!_localReady) {
+    if ((long)(millis() - _localRetryAt) < 0 || WiFi.status() != WL_CONNECTED) return;
+    connectLocal();
+    return;
+  }
+
+  // A few messages per pass keeps loop() responsive during a burst
+  for (int n = 0; n < 4 && _local.poll(); n++) {
+    dispatchCommand(_local.topic(), _local.payload(), _local.payloadLength());
+  }
+}
+
+bool HAMQTTDiscovery::publishLocal(const char* topic, const char* payload, size_t length, bool retain) {
+  lockNet();
+  bool success = false;
+  if (_localReady) {
+    unsigned long startTime = millis();
+    success = _local.publish(topic, payload, length, retain);
+    recordOperation(OP_LOCAL_PUBLISH, startTime, success);
+    if (!success) {
+      dropLocal();
+    }
+  }
+  unlockNet();
+  return success;
+}
+
+bool HAMQTTDiscovery::publishLocalState(HAControl* control, const String& value) {
+  if (!_localReady) return false;
+  String topic = control->getStateTopic();
+  return publishLocal(topic.c_str(), value.c_str(), value.length(), false);
+}
+
+bool HAMQTTDiscovery::sendLocalDiscovery(HAControl* control) {
+  // The body buffer, since the frame buffer may hold a batch being packed
+  HAJsonWriter payload(_bodyBuffer, sizeof(_bodyBuffer));
+  control->writeDiscoveryPayload(payload, _compactDiscovery);
+  if (payload.overflowed()) {
+    Serial.println("HAMQTTDiscovery: Discovery payload too large");
+    return false;
+  }
+  String topic = control->getDiscoveryTopic();
+  return publishLocal(topic.c_str(), _bodyBuffer, payload.length(), true);
+}
+
+void HAMQTTDiscovery::announceLocal(HAControl* control) {
+  if (control->status == STATUS_FAILED) return;
+
+  String topic = control->getAvailabilityTopic();
+  if (!publishLocal(topic.c_str(), "online", 6, true)) return;
+
+  topic = control->getCommandTopic();
+  if (topic.length() && !_local.subscribe(topic.c_str())) {
+    dropLocal();
+  }
+}
+
+static bool topicMatches(const HAControl* control, HAControl::TopicKind kind, const char* topic, size_t length) {
+  if (!control->hasTopic(kind) || control->topicLength(kind) != length) return false;
+  for (size_t i = 0; i < length; i++) {
+    if (control->topicChar(kind, i) != topic[i]) return false;
+  }
+  return true;
+}
+
+void HAMQTTDiscovery::dispatchCommand(const char* topic, const char* payload, size_t length) {
+  size_t topicLength = strlen(topic);
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (!topicMatches(control, HAControl::TOPIC_COMMAND, topic, topicLength)) continue;
+
+    // HA waits for the state topic before showing the change, so the
+    // command is echoed back as the new state
+    String stateTopic = control->getStateTopic();
+    publishLocal(stateTopic.c_str(), payload, length, false);
+    dispatchPush(control->getEntityId().c_str(), payload);
+    return;
+  }
+}
+
+static const char* const DIAGNOSTIC_IDS[] = {
+  "connect_ms", "state_post_ms", "state_get_ms", "failures", "min_heap"
+};
+static const char* const DIAGNOSTIC_NAMES[] = {
+  "REST Connect Time", "REST Write Latency", "REST Read Latency", "REST Failures", "Minimum Free Heap"
+};
+static const char* const DIAGNOSTIC_UNITS[] = { "ms", "ms", "ms", "", "B" };
+
+bool HAMQTTDiscovery::enableDiagnostics(unsigned long intervalMs) {
+  String prefix = _defaultDevice.uniqueId.length() ? _defaultDevice.uniqueId : String("hamqtt");
+  bool created = true;
+
+  for (int i = 0; i < DIAGNOSTIC_SENSORS; i++) {
+    if (_diagnostics[i]) continue;
+
+    String objectId = prefix + "_" + DIAGNOSTIC_IDS[i];
+    HAControl* control = allocControl();
+    control->type = CONTROL_SENSOR;
+    control->objectId = objectId;
+    control->name = DIAGNOSTIC_NAMES[i];
+    control->uniqueId = objectId;
+    HAControlOptions options;
+    options.icon = "mdi:chart-bell-curve";
+    options.unit = DIAGNOSTIC_UNITS[i];
+    setControlOptions(control, options);
+    control->device = &_defaultDevice;
+    control->diagnostic = true;
+    _diagnostics[i] = registerControl(control);
+    if (!_diagnostics[i]) created = false;
+  }
+
+  _diagnosticInterval = intervalMs;
+  _lastDiagnostics = millis();
+  return created;
+}
+
+void HAMQTTDiscovery::publishDiagnostics() {
+  if (!_diagnosticInterval || millis() - _lastDiagnostics < _diagnosticInterval) {
+    return;
+  }
+  _lastDiagnostics = millis();
+
+  HARequestStats stats = _requestStats;
+  uint32_t values[DIAGNOSTIC_SENSORS] = {
+    stats.ops[OP_CONNECT].percentileMs(90),
+    stats.ops[OP_STATE_POST].percentileMs(90),
+    stats.ops[OP_STATE_GET].percentileMs(90),
+    stats.failures,
+    stats.minFreeHeap == UINT32_MAX ? ESP.getFreeHeap() : stats.minFreeHeap
+  };
+
+  for (int i = 0; i < DIAGNOSTIC_SENSORS; i++) {
+    if (_diagnostics[i] && _diagnostics[i]->isOnline) {
+      writeControl(_diagnostics[i], String(values[i]));
+    }
+  }
+}
+
+#ifdef HAMQTT_FAULT_INJECTION
+void HAMQTTDiscovery::setFaultInjection(uint8_t lossPercent, uint8_t errorPercent, unsigned long latencyMs) {
+  _faultLoss = lossPercent;
+  _faultError = errorPercent;
+  _faultLatency = latencyMs;
+}
+#endif
+
+bool HAMQTTDiscovery::injectFault(int& httpCode) {
+#ifdef HAMQTT_FAULT_INJECTION
+  if (_faultLatency) delay(_faultLatency);
+  long roll = random(100);
+  if (roll < _faultLoss) {
+    httpCode = HTTPC_ERROR_CONNECTION_LOST;
+    return true;
+  }
+  if (roll < _faultLoss + _faultError) {
+    httpCode = 503;
+    return true;
+  }
+#else
+  (void)httpCode;
+#endif
+  return false;
+}
+
+bool HAMQTTDiscovery::postToHA(const String& endpoint, const String& payload) {
+  return postToHA(endpoint, payload.c_str(), payload.length());
+}
+
+bool HAMQTTDiscovery::postToHA(const String& endpoint, const char* body, size_t length) {
+  int httpCode = sendRequest("POST", endpoint, body, length, nullptr, nullptr);
+  bool success = (httpCode >= 200 && httpCode < 300);
+
+  if (!success && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + endpoint).c_str(), httpCode);
+  }
+  return success;
+}
+
+bool HAMQTTDiscovery::postToHA(const String& endpoint, const String& payload, String& response) {
+  int httpCode = sendRequest("POST", endpoint, payload.c_str(), payload.length(), &response, nullptr);
+  bool success = (httpCode >= 200 && httpCode < 300);
+
+  if (!success && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + endpoint).c_str(), httpCode);
+  }
+  return success;
+}
+
+bool HAMQTTDiscovery::getFromHA(const String& endpoint, Stream* sink) {
+  int httpCode = sendRequest("GET", endpoint, nullptr, 0, nullptr, sink);
+  bool success = (httpCode >= 200 && httpCode < 300);
+
+  if (!success && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: GET %s failed with code %d\n", (_serverUrl + endpoint).c_str(), httpCode);
+  }
+  return success;
+}
+
+bool HAMQTTDiscovery::postHelperBuffer(int bank, int bufferIndex, const char* content, size_t length) {
+  if (bufferIndex < 1 || bufferIndex > TRIGGER_BUFFER) return false;
+
+  // Bank 0 keeps the original helper names
+  char endpoint[48];
+  if (bank == 0) {
+    snprintf(endpoint, sizeof(endpoint), "/api/states/input_text.mqtt_buffer_%d", bufferIndex);
+  } else {
+    snprintf(endpoint, sizeof(endpoint), "/api/states/input_text.mqtt_bank%d_%d", bank + 1, bufferIndex);
+  }
+
+  lockNet();
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  writer.key("state");
+  writer.value(content, length);
+  writer.endObject();
+
+  bool success = false;
+  if (writer.overflowed()) {
+    Serial.println("HAMQTTDiscovery: Helper buffer body too large");
+  } else {
+    unsigned long startTime = millis();
+    success = postToHA(endpoint, _bodyBuffer, writer.length());
+    recordOperation(OP_HELPER_POST, startTime, success);
+  }
+  unlockNet();
+  return success;
+}
+
+bool HAMQTTDiscovery::setHelperBanks(int banks) {
+  if (banks < 1 || banks > MAX_HELPER_BANKS) return false;
+
+  lockNet();
+  _helperBanks = banks;
+  _nextBank = 0;
+  for (int i = 0; i < MAX_HELPER_BANKS; i++) {
+    _bankSeq[i] = 0;
+  }
+  unlockNet();
+  return true;
+}
+
+void HAMQTTDiscovery::checkHelperBanks() {
+  // Frames in banks that aren't being reused would otherwise never be
+  // confirmed, or restarted when their run was dropped. One read per
+  // loop(), taking the banks in turn; none of it waits.
+  for (int n = 0; n < _helperBanks && !_ackPolled; n++) {
+    int bank = (_bankCursor + n) % _helperBanks;
+    if (bankDue(bank) && millis() - _bankSentAt[bank] >= ACK_RETRIGGER_MS) {
+      _ackPolled = true;
+      _bankCursor = (bank + 1) % _helperBanks;
+      pollBank(bank);
+    }
+  }
+}
+
+bool HAMQTTDiscovery::detectHelperGeometry() {
+  lockNet();
+  // Counting stops at the first helper without a max, so the buffers in
+  // use are always mqtt_buffer_1..n
+  String tmpl = "{% set ns = namespace(count=0, size=" + String((int)MAX_CHUNK) + ") %}"
+                "{% for i in range(1, " + String(MAX_DATA_BUFFERS + 1) + ") %}"
+                "{% set m = state_attr('input_text.mqtt_buffer_' ~ i, 'max') %}"
+                "{% if m is number and ns.count == i - 1 %}"
+                "{% set ns.count = i %}{% set ns.size = [ns.size, m | int] | min %}"
+                "{% endif %}{% endfor %}{{ ns.count }}|{{ ns.size }}";
+  String payload = "{\"template\":\"" + HADevice::escape(tmpl) + "\"}";
+
+  String response;
+  if (!postToHA("/api/template", payload, response)) {
+    // Defaults stay in place and the next frame asks again
+    unlockNet();
+    return false;
+  }
+  _geometryKnown = true;
+
+  int separator = response.indexOf('|');
+  int count = separator > 0 ? response.substring(0, separator).toInt() : 0;
+  int size = separator > 0 ? response.substring(separator + 1).toInt() : 0;
+  if (count < 1 || size < 1) {
+    Serial.println("HAMQTTDiscovery: No helper buffers found, assuming mqtt_buffer_1..5 of 255");
+    unlockNet();
+    return false;
+  }
+
+  _dataBuffers = min(count, (int)MAX_DATA_BUFFERS);
+  _chunkSize = min((size_t)size, (size_t)MAX_CHUNK);
+  Serial.printf("HAMQTTDiscovery: %d helper buffers of %u characters\n", _dataBuffers, (unsigned)_chunkSize);
+  unlockNet();
+  return true;
+}
+
+int HAMQTTDiscovery::helperBuffers() const {
+  return _dataBuffers;
+}
+
+size_t HAMQTTDiscovery::helperChunkSize() const {
+  return _chunkSize;
+}
+
+size_t HAMQTTDiscovery::frameCapacity() const {
+  // Bytes are at least characters, so this is never more than the helpers hold
+  return min(sizeof(_frameBuffer) - 1, _chunkSize * _dataBuffers);
+}
+
+HAHelperStats HAMQTTDiscovery::getHelperStats() const {
+  lockNet();
+  HAHelperStats stats = _helperStats;
+  unlockNet();
+  return stats;
+}
+
+bool HAMQTTDiscovery::bankDue(int bank) const {
+  return _bankSeq[bank] && millis() - _bankPolledAt[bank] >= ACK_POLL_MS;
+}
+
+bool HAMQTTDiscovery::pollBank(int bank) {
+  uint16_t seq = _bankSeq[bank];
+  if (seq == 0) return true;
+  if (!bankDue(bank)) return false;
+  _bankPolledAt[bank] = millis();
+
+  char endpoint[48];
+  if (bank == 0) {
+    snprintf(endpoint, sizeof(endpoint), "/api/states/input_text.mqtt_buffer_%d", TRIGGER_BUFFER);
+  } else {
+    snprintf(endpoint, sizeof(endpoint), "/api/states/input_text.mqtt_bank%d_%d", bank + 1, TRIGGER_BUFFER);
+  }
+
+  char state[16] = "";
+  HAJsonExtractor reader;
+  int stateSlot = reader.addPath("state", state, sizeof(state));
+  if (getFromHA(endpoint, &reader) && reader.found(stateSlot)) {
+    // An automation from before sequence numbers clears the trigger instead
+    if (state[0] == '\0') {
+      _helperStats.acked++;
+      _bankSeq[bank] = 0;
+      return true;
+    }
+
+    // Only "ACK:", "DUP:" and "END:" carry a sequence number
+    bool acked = strncmp(state, "ACK:", 4) == 0;
+    bool duplicate = strncmp(state, "DUP:", 4) == 0;
+    bool pending = strncmp(state, "END:", 4) == 0;
+    unsigned long stateSeq = acked || duplicate || pending ? strtoul(state + 4, nullptr, 10) : 0;
+    if (acked && stateSeq == seq) {
+      _helperStats.acked++;
+      _bankSeq[bank] = 0;
+      return true;
+    }
+    if (duplicate && stateSeq == seq) {
+      _helperStats.duplicates++;
+      _bankSeq[bank] = 0;
+      return true;
+    }
+
+    // Still END after a while means the run was dropped (a full automation
+    // queue, or HA restarting). The frame is still in the bank, so a new
+    // trigger publishes it without rewriting the chunks.
+    if (!_bankRetriggered[bank] && pending && stateSeq == seq &&
+        millis() - _bankSentAt[bank] >= ACK_RETRIGGER_MS) {
+      _bankRetriggered[bank] = true;
+      _lastSeq = _lastSeq % 9999 + 1;
+      char trigger[12];
+      int triggerLength = snprintf(trigger, sizeof(trigger), "END:%u/%u", _lastSeq, _bankChunks[bank]);
+      if (postHelperBuffer(bank, TRIGGER_BUFFER, trigger, triggerLength)) {
+        _bankSeq[bank] = _lastSeq;
+        _helperStats.retriggered++;
+      }
+    }
+  }
+
+  if (millis() - _bankSentAt[bank] < ACK_TIMEOUT_MS) return false;
+
+  Serial.printf("HAMQTTDiscovery: Frame %u in helper bank %d was never acknowledged\n", _bankSeq[bank], bank + 1);
+  _helperStats.lost++;
+  _bankSeq[bank] = 0;
+  return true;
+}
+
+bool HAMQTTDiscovery::waitForBank(int bank, unsigned long timeoutMs) {
+  // The connection is only held for each read, so a wait on the worker
+  // doesn't hold up callers on other tasks
+  unsigned long startTime = millis();
+  while (true) {
+    lockNet();
+    bool free = pollBank(bank);
+    unlockNet();
+    if (free) return true;
+    if (_breakerState == BREAKER_OPEN || millis() - startTime >= timeoutMs) return false;
+    delay(ACK_POLL_MS);
+  }
+}
+
+bool HAMQTTDiscovery::helpersReady() {
+  // Frames go out through the helpers only when neither the broker nor
+  // the service transport takes them
+  if (_localReady || _transport != TRANSPORT_HELPERS || !_bankSeq[_nextBank]) return true;
+
+  // Shares loop()'s one acknowledgement read with checkHelperBanks()
+  if (_ackPolled || !bankDue(_nextBank)) return false;
+  _ackPolled = true;
+  return pollBank(_nextBank);
+}
+
+// Bytes in the longest prefix of at most maxChars characters that doesn't
+// end inside a UTF-8 sequence. HA counts input_text length in characters,
+// and a sequence cut in two would reach the automation as invalid text.
+static size_t chunkLength(const char* text, size_t length, size_t maxChars) {
+  size_t offset = 0;
+  for (size_t chars = 0; chars < maxChars && offset < length; chars++) {
+    uint8_t lead = (uint8_t)text[offset];
+    size_t width = 1;
+    if ((lead & 0xE0) == 0xC0) width = 2;
+    else if ((lead & 0xF0) == 0xE0) width = 3;
+    else if ((lead & 0xF8) == 0xF0) width = 4;
+    offset += min(width, length - offset);
+  }
+  return offset;
+}
+
+static int countChunks(const char* text, size_t length, size_t maxChars) {
+  int count = 0;
+  for (size_t offset = 0; offset < length; count++) {
+    offset += chunkLength(text + offset, length - offset, maxChars);
+  }
+  return count;
+}
+
+bool HAMQTTDiscovery::sendHelperFrame(const char* frame, size_t len) {
+  if (countChunks(frame, len, _chunkSize) > _dataBuffers) {
+    Serial.println("HAMQTTDiscovery: Discovery payload too large");
+    return false;
+  }
+
+  // The bank's previous frame has to be published before it is rewritten,
+  // or the automation could assemble a mix of both. Nothing waits for that
+  // here; callers hand the frame to loop() when the bank is busy.
+  int bank = _nextBank;
+  _helpersBusy = !pollBank(bank);
+  if (_helpersBusy) {
+    return false;
+  }
+
+  // Only the buffers holding the frame are written; the trigger tells the
+  // automation how many to read
+  int chunks = 0;
+  for (size_t offset = 0; offset < len;) {
+    size_t count = chunkLength(frame + offset, len - offset, _chunkSize);
+    // A bank holding part of this frame and part of the last one must not
+    // be triggered
+    if (!postHelperBuffer(bank, ++chunks, frame + offset, count)) {
+      return false;
+    }
+    offset += count;
+  }
+
+  // Sequence numbers fit the 10 character trigger helper as "END:9999/5"
+  char trigger[12];
+  _lastSeq = _lastSeq % 9999 + 1;
+  int triggerLength = snprintf(trigger, sizeof(trigger), "END:%u/%d", _lastSeq, chunks);
+  bool success = postHelperBuffer(bank, TRIGGER_BUFFER, trigger, triggerLength);
+  if (success) {
+    _bankChunks[bank] = chunks;
+    _bankSeq[bank] = _lastSeq;
+    _bankSentAt[bank] = millis();
+    _bankPolledAt[bank] = millis();
+    _bankRetriggered[bank] = false;
+    _helperStats.frames++;
+    _nextBank = (bank + 1) % _helperBanks;
+  }
+  return success;
+}
+
+void HAMQTTDiscovery::writeEnvelope(HAJsonWriter& writer, HAControl* control, bool compact) const {
+  writer.beginObject();
+  writer.key("topic");
+  control->writeDiscoveryTopic(writer);
+  writer.key("payload");
+  control->writeDiscoveryPayload(writer, compact);
+  writer.endObject();
+}
+
+size_t HAMQTTDiscovery::envelopeLength(HAControl* control, bool compact) const {
+  HAJsonWriter sizer(nullptr, 0);
+  writeEnvelope(sizer, control, compact);
+  return sizer.length();
+}
+
+bool HAMQTTDiscovery::publishDiscovery(HAControl* control) {
+  lockNet();
+  bool success = writeDiscoveryFrame(control);
+  unlockNet();
+  return success;
+}
+
+bool HAMQTTDiscovery::batchingFrames() const {
+  // Service calls and broker publishes carry one message each, so there is
+  // nothing to pack
+  return _batching && _transport == TRANSPORT_HELPERS && !_localReady;
+}
+
+bool HAMQTTDiscovery::sendServiceDiscovery(HAControl* control) {
+  // The service takes the payload as a string, so it is serialized into
+  // the frame buffer (unused without helper batching) and then escaped
+  // into the request body
+  HAJsonWriter payload(_frameBuffer, sizeof(_frameBuffer));
+  control->writeDiscoveryPayload(payload, _compactDiscovery);
+
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  writer.key("topic");
+  control->writeDiscoveryTopic(writer);
+  writer.key("payload");
+  writer.value(_frameBuffer, payload.length());
+  writer.key("retain");
+  writer.raw("true", 4);
+  writer.endObject();
+
+  if (payload.overflowed() || writer.overflowed()) {
+    Serial.println("HAMQTTDiscovery: Discovery payload too large");
+    return false;
+  }
+  return postToHA(_discoveryEndpoint, _bodyBuffer, writer.length());
+}
+
+bool HAMQTTDiscovery::writeDiscoveryFrame(HAControl* control) {
+  if (_localReady && sendLocalDiscovery(control)) {
+    return true;
+  }
+  if (_transport == TRANSPORT_SERVICE) {
+    return sendServiceDiscovery(control);
+  }
+  if (!_geometryKnown && _batchCount == 0) {
+    detectHelperGeometry();
+  }
+
+  // The envelope is measured first and then serialized in place into the
+  // frame buffer, so publishing doesn't touch the heap.
+  size_t len = envelopeLength(control, _compactDiscovery);
+
+  if (!_batching) {
+    if (len > frameCapacity()) {
+      Serial.println("HAMQTTDiscovery: Discovery payload too large");
+      return false;
+    }
+    HAJsonWriter writer(_frameBuffer, sizeof(_frameBuffer));
+    writeEnvelope(writer, control, _compactDiscovery);
+    return sendHelperFrame(_frameBuffer, writer.length());
+  }
+
+  // Batch items are written after room for the {"batch":[ prefix; the
+  // separating comma and the closing ]} are accounted for as well
+  if (BATCH_PREFIX + len + 3 > frameCapacity()) {
+    Serial.println("HAMQTTDiscovery: Discovery payload too large");
+    return false;
+  }
+
+  if (_batchCount > 0 && BATCH_PREFIX + _batchLength + len + 3 > frameCapacity()) {
+    if (!sendBatchFrame()) {
+      return false;
+    }
+  }
+
+  char* item = _frameBuffer + BATCH_PREFIX + _batchLength;
+  if (_batchCount > 0) {
+    *item++ = ',';
+    _batchLength++;
+  }
+  HAJsonWriter writer(item, sizeof(_frameBuffer) - (item - _frameBuffer));
+  writeEnvelope(writer, control, _compactDiscovery);
+  _batchLength += writer.length();
+  _batchCount++;
+  return true;
+}
+
+void HAMQTTDiscovery::beginBatch() {
+  _batching = true;
+}
+
+bool HAMQTTDiscovery::flushBatch() {
+  lockNet();
+  bool success = sendBatchFrame();
+  if (!success && _helpersBusy) {
+    _batchDue = true;
+    success = true;
+  }
+  unlockNet();
+  return success;
+}
+
+bool HAMQTTDiscovery::sendBatchFrame() {
+  if (_batchCount == 0) return true;
+
+  // A single envelope goes out unwrapped in the original format
+  bool success;
+  if (_batchCount == 1) {
+    success = sendHelperFrame(_frameBuffer + BATCH_PREFIX, _batchLength);
+  } else {
+    memcpy(_frameBuffer, "{\"batch\":[", BATCH_PREFIX);
+    memcpy(_frameBuffer + BATCH_PREFIX + _batchLength, "]}", 2);
+    success = sendHelperFrame(_frameBuffer, BATCH_PREFIX + _batchLength + 2);
+  }
+  if (!success && _helpersBusy) {
+    // The batch and its queued controls stay as they are until the bank is free
+    return false;
+  }
+  _batchLength = 0;
+  _batchCount = 0;
+
+  // Queued controls start their settle delay once their frame has gone out
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (control->stage != STAGE_QUEUED) continue;
+
+    if (success) {
+      control->stage = STAGE_SETTLE;
+      control->stageStartedAt = millis();
+    } else {
+      Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", control->getEntityId().c_str());
+      setControlStatus(control, STATUS_FAILED);
+    }
+  }
+
+  return success;
+}
+
+void HAMQTTDiscovery::setCompactDiscovery(bool enabled) {
+  _compactDiscovery = enabled;
+}
+
+int HAMQTTDiscovery::discoveryChunks(HAControl* control, bool compact) const {
+  if (!control) return 0;
+  String envelope;
+  envelope.reserve(envelopeLength(control, compact));
+  HAJsonWriter writer(envelope);
+  writeEnvelope(writer, control, compact);
+  return countChunks(envelope.c_str(), envelope.length(), _chunkSize);
+}
+
+void HAMQTTDiscovery::printDiscoveryReport() const {
+  int fullTotal = 0;
+  int compactTotal = 0;
+
+  Serial.println("HAMQTTDiscovery: Discovery size report (bytes / chunks)");
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    size_t fullLen = envelopeLength(control, false);
+    size_t compactLen = envelopeLength(control, true);
+    int fullChunks = discoveryChunks(control, false);
+    int compactChunks = discoveryChunks(control, true);
+    fullTotal += fullChunks;
+    compactTotal += compactChunks;
+    Serial.printf("  %-40s full %4u / %d   compact %4u / %d\n", control->getEntityId().c_str(),
+                  (unsigned)fullLen, fullChunks, (unsigned)compactLen, compactChunks);
+  }
+  Serial.printf("  Total chunks: full %d, compact %d\n", fullTotal, compactTotal);
+}
+
+bool HAMQTTDiscovery::endBatch() {
+  bool success = flushBatch();
+  _batching = false;
+  return success;
+}
+
+bool HAMQTTDiscovery::controlExists(const String& entityId) {
+  // HA answers 404 for unknown entities, so the body isn't needed
+  return getFromHA("/api/states/" + entityId, nullptr);
+}
+
+bool HAMQTTDiscovery::waitForControlCreation(const String& entityId, int timeoutSeconds) {
+  unsigned long startTime = millis();
+  unsigned long timeout = timeoutSeconds * 1000;
+  // Short pauses first: over the broker or the service transport the
+  // entity usually appears within tens of milliseconds
+  unsigned long pause = ACK_POLL_MS;
+
+  while (millis() - startTime < timeout) {
+    if (controlExists(entityId)) {
+      return true;
+    }
+    delay(pause);
+    pause = min(pause * 2, 500UL);
+  }
+  return false;
+}
+
+HAControl* HAMQTTDiscovery::allocControl() {
+  lockNet();
+  if (!_blocks || _blockUsed == CONTROL_BLOCK) {
+    ControlBlock* block = new ControlBlock();
+    block->next = _blocks;
+    _blocks = block;
+    _blockUsed = 0;
+  }
+  HAControl* control = &_blocks->slots[_blockUsed++];
+  unlockNet();
+  return control;
+}
+
+// Only a control with something other than the defaults gets its own copy
+void HAMQTTDiscovery::setControlOptions(HAControl* control, const HAControlOptions& options) {
+  if (!options.isDefault()) control->options = new HAControlOptions(options);
+}
+
+void HAMQTTDiscovery::releaseControl(HAControl* control) {
+  delete control->options;
+  delete control->aggregator;
+  *control = HAControl();
+  // create* releases the slot it just took, so it is normally the last one
+  if (_blockUsed > 0 && control == &_blocks->slots[_blockUsed - 1]) {
+    _blockUsed--;
+  }
+}
+
+void HAMQTTDiscovery::addControl(HAControl* control) {
+  // Held so the worker never walks an index that is being replaced
+  lockNet();
+  if (_controlCount == _controlCapacity) {
+    int capacity = _controlCapacity ? _controlCapacity * 2 : CONTROL_BLOCK;
+    HAControl** controls = new HAControl*[capacity];
+    for (int i = 0; i < _controlCount; i++) {
+      controls[i] = _controls[i];
+    }
+    delete[] _controls;
+    delete[] _scratch;
+    _controls = controls;
+    _scratch = new HAControl*[capacity];
+    _controlCapacity = capacity;
+  }
+  _controls[_controlCount++] = control;
+  if (_nodeCount > 0) {
+    attachToNode(control);
+  }
+  if (_localReady) {
+    announceLocal(control);
+  }
+  unlockNet();
+}
+
+HAControl* HAMQTTDiscovery::registerControl(HAControl* control) {
+  // The worker's loop() walks the same controls and uses the same connection
+  lockNet();
+  HAControl* registered = createControl(control);
+  unlockNet();
+  return registered;
+}
+
+HAControl* HAMQTTDiscovery::createControl(HAControl* control) {
+  String entityId = control->getEntityId();
+  control->createdAt = millis();
+
+  bool retained = _sleepMode && retainedMatches(control);
+  if (retained || (_fingerprintCache && fingerprintMatches(control))) {
+    // HA already has this exact config, so there is nothing to send or check
+    if (retained) _sleepStats.resumedControls++;
+    control->isOnline = true;
+    control->status = STATUS_ONLINE;
+    addControl(control);
+    Serial.printf("HAMQTTDiscovery: Control %s unchanged, adopted from cache\n", entityId.c_str());
+    if (_asyncCreation && _statusCallback) {
+      _statusCallback(control);
+    }
+    return control;
+  }
+
+  if (_asyncCreation) {
+    control->status = STATUS_PENDING;
+    control->stage = STAGE_CHECK_EXISTS;
+    control->stageStartedAt = millis();
+    addControl(control);
+    Serial.printf("HAMQTTDiscovery: Control %s queued for creation\n", entityId.c_str());
+    return control;
+  }
+
+  // With the cache on, an existing entity is republished so a changed
+  // config reaches HA; retained discovery replaces the old one in place
+  if (!_fingerprintCache && controlExists(entityId)) {
+    Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
+    releaseControl(control);
+    return nullptr;
+  }
+
+  // A blocking create waits for its entity, so its envelope can't sit in a batch
+  if (!publishDiscovery(control) || !flushBatch()) {
+    if (_helpersBusy) {
+      return deferCreation(control, STAGE_PUBLISH);
+    }
+    Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", entityId.c_str());
+    releaseControl(control);
+    return nullptr;
+  }
+  if (_batchDue) {
+    return deferCreation(control, STAGE_QUEUED);
+  }
+
+  Serial.printf("HAMQTTDiscovery: Waiting for control %s to be created...\n", entityId.c_str());
+  if (_localReady || _transport == TRANSPORT_SERVICE) {
+    // The broker already has it (the service call returns once it is
+    // published); HA picks it up within milliseconds
+  } else {
+    // The acknowledgement says when the message is out. Past the old settle
+    // delay verification takes over, and loop() keeps watching the bank.
+    waitForBank((_nextBank + _helperBanks - 1) % _helperBanks, SETTLE_MS);
+  }
+
+  bool created = waitForControlCreation(entityId, VERIFY_TIMEOUT_MS / 1000);
+  recordOperation(OP_DISCOVERY, control->createdAt, created);
+  if (!created) {
+    Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", entityId.c_str());
+    releaseControl(control);
     return nullptr;
   }
 
-  HAControl* control = new HAControl();
-  control->type = CONTROL_NUMBER;
-  control->objectId = objectId;
-  control->name = name;
-  control->uniqueId = uniqueId;
-  control->minValue = minVal;
-  control->maxValue = maxVal;
-  control->step = step;
-  control->unit = unit;
-  control->mode = mode.length() ? mode : "slider";
-  control->icon = icon.length() ? icon : "mdi:gauge";
-  control->stateTopic = stateTopic.length() ? stateTopic : ("virt/" + objectId + "/state");
-  control->commandTopic = commandTopic.length() ? commandTopic : ("virt/" + objectId + "/set");
-  control->availabilityTopic = availabilityTopic.length() ? availabilityTopic : ("virt/" + objectId + "/avail");
-  control->device = device ? device : &_defaultDevice;
+  control->isOnline = true;
+  control->status = STATUS_ONLINE;
+  addControl(control);
+  storeFingerprint(control);
+  Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
+  return control;
+}
+
+HAControl* HAMQTTDiscovery::deferCreation(HAControl* control, CreationStage stage) {
+  // The helper bank still holds an unacknowledged frame. Rather than wait
+  // for it on the caller's task, creation carries on in loop() as if it
+  // had been asynchronous from the start.
+  control->status = STATUS_PENDING;
+  control->stage = stage;
+  control->stageStartedAt = millis();
+  addControl(control);
+  Serial.printf("HAMQTTDiscovery: Helper bank busy, %s continues in loop()\n", control->getEntityId().c_str());
+  return control;
+}
+
+bool HAMQTTDiscovery::enableFingerprintCache(const char* name) {
+  if (_fingerprintCache) {
+    _prefs.end();
+  }
+  _fingerprintCache = _prefs.begin(name, false);
+  if (!_fingerprintCache) {
+    Serial.printf("HAMQTTDiscovery: Can't open fingerprint store %s\n", name);
+  }
+  return _fingerprintCache;
+}
+
+void HAMQTTDiscovery::clearFingerprintCache() {
+  if (_fingerprintCache) {
+    _prefs.clear();
+  }
+}
+
+// NVS keys are limited to 15 characters, so entities are keyed by a hash
+static void fingerprintKey(const String& entityId, char* key, size_t size) {
+  snprintf(key, size, "fp%08lx", (unsigned long)fnv1a(FNV_OFFSET, entityId.c_str(), entityId.length()));
+}
+
+bool HAMQTTDiscovery::fingerprintMatches(HAControl* control) {
+  control->fingerprint = control->computeFingerprint(_compactDiscovery);
+
+  char key[16];
+  fingerprintKey(control->getEntityId(), key, sizeof(key));
+  return _prefs.getUInt(key, 0) == control->fingerprint;
+}
+
+void HAMQTTDiscovery::storeFingerprint(HAControl* control) {
+  if (!_fingerprintCache || !control->fingerprint) return;
+
+  char key[16];
+  fingerprintKey(control->getEntityId(), key, sizeof(key));
+  if (_prefs.getUInt(key, 0) != control->fingerprint) {
+    _prefs.putUInt(key, control->fingerprint);
+  }
+}
+
+// Kept in RTC slow memory, which survives deep sleep but not a power cycle
+// or reset; the magic and server hash tell a valid copy from a stale one
+static const int RETAINED_CONTROLS = 32;
+
+struct HARetainedControl {
+  uint32_t idHash;
+  uint32_t fingerprint;
+};
+
+struct HARetainedState {
+  uint32_t magic;
+  uint32_t serverHash;
+  uint32_t address;
+  uint32_t wakes;
+  uint32_t lastAwakeMs;
+  uint16_t controlCount;
+  HARetainedControl controls[RETAINED_CONTROLS];
+};
+
+static const uint32_t RETAINED_MAGIC = 0x48415331;  // "HAS1"
+static RTC_DATA_ATTR HARetainedState retainedState;
+
+static uint32_t hashString(const String& text) {
+  uint32_t hash = fnv1a(FNV_OFFSET, text.c_str(), text.length());
+  return hash ? hash : 1;
+}
+
+bool HAMQTTDiscovery::enableSleepMode(unsigned long wokeAt) {
+  lockNet();
+  _sleepMode = true;
+  _wokeAt = wokeAt;
+  _sleepStats = HASleepStats();
+
+  bool resumed = retainedState.magic == RETAINED_MAGIC && retainedState.serverHash == hashString(_serverUrl);
+  if (resumed) {
+    _address = retainedState.address;
+    _sleepStats.addressCached = _address != 0;
+    _sleepStats.wakes = ++retainedState.wakes;
+    _sleepStats.lastAwakeMs = retainedState.lastAwakeMs;
+  } else {
+    memset(&retainedState, 0, sizeof(retainedState));
+    _address = 0;
+  }
+  unlockNet();
+  return resumed;
+}
+
+bool HAMQTTDiscovery::retainedMatches(HAControl* control) {
+  if (retainedState.magic != RETAINED_MAGIC) return false;
+
+  uint32_t idHash = hashString(control->getEntityId());
+  for (int i = 0; i < retainedState.controlCount; i++) {
+    if (retainedState.controls[i].idHash == idHash) {
+      control->fingerprint = control->computeFingerprint(_compactDiscovery);
+      return retainedState.controls[i].fingerprint == control->fingerprint;
+    }
+  }
+  return false;
+}
+
+void HAMQTTDiscovery::saveRetained() {
+  retainedState.magic = RETAINED_MAGIC;
+  retainedState.serverHash = hashString(_serverUrl);
+  retainedState.address = _address;
+
+  int count = 0;
+  for (int i = 0; i < _controlCount && count < RETAINED_CONTROLS; i++) {
+    HAControl* control = _controls[i];
+    if (!control->isOnline) continue;
+    if (!control->fingerprint) {
+      control->fingerprint = control->computeFingerprint(_compactDiscovery);
+    }
+    retainedState.controls[count].idHash = hashString(control->getEntityId());
+    retainedState.controls[count].fingerprint = control->fingerprint;
+    count++;
+  }
+  retainedState.controlCount = count;
+}
+
+bool HAMQTTDiscovery::prepareSleep(unsigned long timeoutMs) {
+  lockNet();
+  unsigned long startTime = millis();
+  bool sent = true;
+
+  // Writes held from an earlier wake go first so HA sees them in order
+  while (_offlineCount > 0 && millis() - startTime < timeoutMs) {
+    int before = _offlineCount;
+    _lastReplay = millis() - _replayInterval;
+    replayOffline();
+    if (_offlineCount == before) break;
+  }
+
+  // Everything below reuses the one keep-alive connection
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (!control->hasPending) continue;
+    if (millis() - startTime >= timeoutMs || !sendState(control, control->pendingValue)) {
+      sent = false;
+    }
+  }
+  if (!sendStateBatch()) {
+    sent = false;
+  }
+
+  // Held writes are only safe across sleep if they are on flash
+  if (_offlineCount > 0 && !_offlineFs) {
+    sent = false;
+  }
+  if (_offlineDirty) {
+    saveOffline();
+  }
+
+  saveRetained();
+  closeConnection();
+  _local.close();
+  _localReady = false;
+
+  _sleepStats.awakeMs = millis() - _wokeAt;
+  retainedState.lastAwakeMs = _sleepStats.awakeMs;
+  unlockNet();
+
+  Serial.printf("HAMQTTDiscovery: %s sleep after %lu ms awake\n",
+                sent ? "Ready to" : "Writes pending at", (unsigned long)_sleepStats.awakeMs);
+  return sent;
+}
+
+HASleepStats HAMQTTDiscovery::getSleepStats() const {
+  return _sleepStats;
+}
+
+void HAMQTTDiscovery::setAsyncCreation(bool enabled) {
+  _asyncCreation = enabled;
+}
+
+void HAMQTTDiscovery::setLoopBudget(unsigned long milliseconds) {
+  _loopBudget = milliseconds;
+}
+
+void HAMQTTDiscovery::onControlStatus(HAControlCallback callback) {
+  _statusCallback = callback;
+}
+
+int HAMQTTDiscovery::pendingControls() const {
+  int count = 0;
+  for (int i = 0; i < _controlCount; i++) {
+    if (_controls[i]->status == STATUS_PENDING) count++;
+  }
+  return count;
+}
+
+void HAMQTTDiscovery::setControlStatus(HAControl* control, ControlStatus status) {
+  control->status = status;
+  control->stage = STAGE_DONE;
+  control->isOnline = (status == STATUS_ONLINE);
+
+  recordOperation(OP_DISCOVERY, control->createdAt, status == STATUS_ONLINE);
+
+  String entityId = control->getEntityId();
+  if (status == STATUS_ONLINE) {
+    storeFingerprint(control);
+    Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
+  } else {
+    Serial.printf("HAMQTTDiscovery: Control %s failed to be created\n", entityId.c_str());
+  }
+
+  if (_statusCallback) {
+    _statusCallback(control);
+  }
+}
+
+void HAMQTTDiscovery::loop() {
+  // Once the worker is running it is the only task that drives the loop
+  if (_workerTask && xTaskGetCurrentTaskHandle() != _workerTask) return;
+
+  // The budget is checked before each network step; a single request that is
+  // already in flight still runs to completion.
+  unsigned long startTime = millis();
+
+  lockNet();
+  probeBreaker();
+  servicePush();
+  serviceLocal();
+  _ackPolled = false;
+  checkHelperBanks();
+  if (_batchDue && helpersReady()) {
+    _batchDue = !sendBatchFrame() && _helpersBusy;
+  }
+  verifyPendingControls();
+  replayOffline();
+  publishDiagnostics();
+
+  if (_nodeCount > 0) {
+    serviceNodes(startTime);
+  }
+  for (int n = 0; n < _controlCount && _nodeCount == 0; n++) {
+    if (millis() - startTime >= _loopBudget) break;
+
+    int index = (_loopCursor + n) % _controlCount;
+    HAControl* control = _controls[index];
+    if (advanceCreation(control) || serviceAggregation(control) || serviceWrites(control)) {
+      _loopCursor = (index + 1) % _controlCount;
+    }
+  }
+
+  if (_stateBatchCount > 0 && millis() - _stateBatchStartedAt >= _stateBatchDelay) {
+    sendStateBatch();
+  }
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::advanceCreation(HAControl* control) {
+  String entityId;
+
+  switch (control->stage) {
+    case STAGE_CHECK_EXISTS:
+      entityId = control->getEntityId();
+      if (_fingerprintCache) {
+        control->stage = STAGE_PUBLISH;
+        return false;
+      }
+      if (controlExists(entityId)) {
+        Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
+        setControlStatus(control, STATUS_FAILED);
+      } else {
+        control->stage = STAGE_PUBLISH;
+      }
+      return true;
+
+    case STAGE_PUBLISH:
+      // Wait here, without blocking, while the helpers still hold a frame;
+      // a batch that fills up is sent from here too
+      if (!helpersReady()) {
+        return false;
+      }
+      if (!publishDiscovery(control)) {
+        if (_helpersBusy) {
+          return false;
+        }
+        Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", control->getEntityId().c_str());
+        setControlStatus(control, STATUS_FAILED);
+      } else if (batchingFrames()) {
+        control->stage = STAGE_QUEUED;
+      } else if (_localReady || _transport == TRANSPORT_SERVICE) {
+        // Nothing to settle when it went straight to the broker, or when
+        // the service call returned after publishing it
+        control->stage = STAGE_VERIFY;
+        control->stageStartedAt = millis();
+      } else {
+        control->stage = STAGE_SETTLE;
+        control->stageStartedAt = millis();
+      }
+      return true;
+
+    case STAGE_QUEUED:
+      // Waiting for flushBatch() to send the frame holding this control
+      return false;
+
+    case STAGE_SETTLE:
+      if (millis() - control->stageStartedAt >= SETTLE_MS) {
+        control->stage = STAGE_VERIFY;
+        control->stageStartedAt = millis();
+      }
+      return false;
+
+    case STAGE_VERIFY:
+    case STAGE_DONE:
+      // Verification is batched across all controls in verifyPendingControls()
+      return false;
+  }
+  return false;
+}
+
+void HAMQTTDiscovery::verifyPendingControls() {
+  if (millis() - _lastVerifyPoll < VERIFY_INTERVAL_MS) return;
+
+  HAControl** verifying = _scratch;
+  int count = 0;
+  for (int i = 0; i < _controlCount; i++) {
+    if (_controls[i]->stage == STAGE_VERIFY) {
+      verifying[count++] = _controls[i];
+    }
+  }
+  if (count == 0) return;
+
+  _lastVerifyPoll = millis();
+
+  // One request checks every control that is waiting to appear in HA; the
+  // ones found are marked online by the reader
+  bool fetched = renderEntityStates(verifying, count) >= 0;
+
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (control->stage != STAGE_VERIFY) continue;
+    if (fetched && control->isOnline) {
+      setControlStatus(control, STATUS_ONLINE);
+    } else if (millis() - control->stageStartedAt >= VERIFY_TIMEOUT_MS) {
+      Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", control->getEntityId().c_str());
+      setControlStatus(control, STATUS_FAILED);
+    }
+  }
+}
+
+HAControl* HAMQTTDiscovery::createSwitch(const String& objectId, const String& name, const String& uniqueId,
+                                        const String& icon, const String& stateTopic,
+                                        const String& commandTopic, const String& availabilityTopic,
+                                        const String& payloadOn, const String& payloadOff,
+                                        HADevice* device) {
+  HAControl* control = allocControl();
+  control->type = CONTROL_SWITCH;
+  control->objectId = objectId;
+  control->name = name;
+  control->uniqueId = uniqueId;
+  HAControlOptions options;
+  options.icon = icon;
+  options.stateTopic = stateTopic;
+  options.commandTopic = commandTopic;
+  options.availabilityTopic = availabilityTopic;
+  if (payloadOn.length()) options.payloadOn = payloadOn;
+  if (payloadOff.length()) options.payloadOff = payloadOff;
+  setControlOptions(control, options);
+  control->device = device ? device : &_defaultDevice;
+
+  return registerControl(control);
+}
+
+HAControl* HAMQTTDiscovery::createNumber(const String& objectId, const String& name, const String& uniqueId,
+                                        float minVal, float maxVal, float step,
+                                        const String& unit, const String& mode,
+                                        const String& icon, const String& stateTopic,
+                                        const String& commandTopic, const String& availabilityTopic,
+                                        HADevice* device) {
+  HAControl* control = allocControl();
+  control->type = CONTROL_NUMBER;
+  control->objectId = objectId;
+  control->name = name;
+  control->uniqueId = uniqueId;
+  HAControlOptions options;
+  options.minValue = minVal;
+  options.maxValue = maxVal;
+  options.step = step;
+  options.unit = unit;
+  if (mode.length()) options.mode = mode;
+  options.icon = icon;
+  options.stateTopic = stateTopic;
+  options.commandTopic = commandTopic;
+  options.availabilityTopic = availabilityTopic;
+  setControlOptions(control, options);
+  control->device = device ? device : &_defaultDevice;
+
+  return registerControl(control);
+}
+
+HAControl* HAMQTTDiscovery::createSensor(const String& objectId, const String& name, const String& uniqueId,
+                                        const String& unit, const String& icon,
+                                        const String& stateTopic, const String& availabilityTopic,
+                                        HADevice* device) {
+  HAControl* control = allocControl();
+  control->type = CONTROL_SENSOR;
+  control->objectId = objectId;
+  control->name = name;
+  control->uniqueId = uniqueId;
+  HAControlOptions options;
+  options.unit = unit;
+  options.icon = icon;
+  options.stateTopic = stateTopic;
+  options.availabilityTopic = availabilityTopic;
+  setControlOptions(control, options);
+  control->device = device ? device : &_defaultDevice;
+
+  return registerControl(control);
+}
+
+HAControl* HAMQTTDiscovery::createBinarySensor(const String& objectId, const String& name, const String& uniqueId,
+                                              const String& icon, const String& stateTopic,
+                                              const String& availabilityTopic,
+                                              const String& payloadOn, const String& payloadOff,
+                                              HADevice* device) {
+  HAControl* control = allocControl();
+  control->type = CONTROL_BINARY_SENSOR;
+  control->objectId = objectId;
+  control->name = name;
+  control->uniqueId = uniqueId;
+  HAControlOptions options;
+  options.icon = icon;
+  options.stateTopic = stateTopic;
+  options.availabilityTopic = availabilityTopic;
+  if (payloadOn.length()) options.payloadOn = payloadOn;
+  if (payloadOff.length()) options.payloadOff = payloadOff;
+  setControlOptions(control, options);
+  control->device = device ? device : &_defaultDevice;
+
+  return registerControl(control);
+}
+
+HAControl* HAMQTTDiscovery::createFromDescriptor(const HAEntityDescriptor& descriptor, HADevice* device) {
+  HAControl* control = allocControl();
+  control->type = descriptor.type;
+  control->descriptor = &descriptor;
+  control->device = device ? device : &_defaultDevice;
+
+  return registerControl(control);
+}
+
+static bool parseNumber(const String& text, float& number) {
+  if (!text.length()) return false;
+  char* end = nullptr;
+  number = strtof(text.c_str(), &end);
+  return end && *end == '\0';
+}
+
+bool HAMQTTDiscovery::isInsignificant(HAControl* control, const String& value) const {
+  const HAPublishPolicy& policy = control->policy;
+
+  // Nothing has been sent yet, or the heartbeat is due
+  if (!control->hasWritten) return false;
+  if (policy.maxIntervalMs && millis() - control->lastWriteAt >= policy.maxIntervalMs) return false;
+
+  if (policy.skipUnchanged && value == control->currentState) return true;
+
+  float previous, next;
+  if (policy.deadband > 0 && parseNumber(control->currentState, previous) && parseNumber(value, next)) {
+    return fabs(next - previous) < policy.deadband;
+  }
+  return false;
+}
+
+bool HAMQTTDiscovery::writeControl(HAControl* control, const String& value) {
+  if (!control) {
+    return false;
+  }
+  // writeControlAsync() jobs and the worker's loop() touch the same fields
+  lockNet();
+  bool success = updateControl(control, value);
+  unlockNet();
+  return success;
+}
+
+bool HAMQTTDiscovery::updateControl(HAControl* control, const String& value) {
+  if (!control->isOnline) {
+    return false;
+  }
+  if (control->node) {
+    control->node->stats.writes++;
+  }
+
+  if (isInsignificant(control, value)) {
+    // The newest value matches what HA already has, so a held-back one is moot
+    if (control->hasPending) {
+      control->hasPending = false;
+      control->writeStats.coalesced++;
+    }
+    control->writeStats.suppressed++;
+    return true;
+  }
+
+  unsigned long minInterval = control->policy.minIntervalMs;
+  if (_sleepMode || _nodeCount > 0 ||
+      (control->hasWritten && minInterval && millis() - control->lastWriteAt < minInterval)) {
+    // In sleep mode everything waits for prepareSleep(), and in gateway mode
+    // for the node's turn in loop()
+    if (control->hasPending) {
+      control->writeStats.coalesced++;
+    } else {
+      control->queuedAt = millis();
+    }
+    control->pendingValue = value;
+    control->hasPending = true;
+    return true;
+  }
+
+  return sendState(control, value);
+}
+
+bool HAMQTTDiscovery::sendState(HAControl* control, const String& value, const HASampleWindow* window) {
+  String entityId = control->getEntityId();
+  int httpCode;
+
+  // The local broker goes first; a window's attributes need the REST API
+  if (!window && _offlineCount == 0 && publishLocalState(control, value)) {
+    httpCode = HTTP_CODE_OK;
+  } else {
+    // While writes are held, newer ones queue behind them so HA sees them in
+    // order; replayOffline() is what probes the connection again
+    if (_offlineCount > 0) {
+      storeOffline(entityId, value);
+      control->hasPending = false;
+      control->lastWriteAt = millis();
+      return true;
+    }
+
+    // StateBatch.yaml only publishes to default virt/<objectId>/state topics
+    if (_stateBatch && !control->customTopic(HAControl::TOPIC_STATE).length()) {
+      queueState(control, value);
+      return true;
+    }
+
+    httpCode = postState(entityId, value, window, control->aggregator);
+  }
+  if (httpCode >= 200 && httpCode < 300) {
+    control->currentState = value;
+    control->hasPending = false;
+    control->hasWritten = true;
+    control->lastWriteAt = millis();
+    control->writeStats.sent++;
+    recordDelivery(control, control->queuedAt);
+    control->queuedAt = 0;
+    return true;
+  }
+
+  control->writeStats.failed++;
+
+  // Only connection problems and server errors are worth holding on to;
+  // anything else HA would reject again on replay
+  if (_offline && (httpCode < 0 || httpCode >= 500)) {
+    storeOffline(entityId, value);
+    control->hasPending = false;
+    control->lastWriteAt = millis();
+    return true;
+  }
+  return false;
+}
+
+int HAMQTTDiscovery::postState(const String& entityId, const String& value, const HASampleWindow* window,
+                               const HAAggregator* aggregator) {
+  lockNet();
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  writer.field("state", value);
+  if (window && aggregator) {
+    int decimals = aggregator->decimals();
+    writer.key("attributes");
+    writer.beginObject();
+    writer.field("min", window->min, decimals);
+    writer.field("max", window->max, decimals);
+    writer.field("mean", window->mean(), decimals);
+    writer.field("count", (long)window->count);
+    if (aggregator->series()) {
+      writer.key("series");
+      writer.beginArray();
+      for (int i = 0; i < HASampleWindow::SERIES; i++) {
+        writer.value(window->series[i], decimals);
+      }
+      writer.endArray();
+    }
+    writer.endObject();
+  }
+  writer.endObject();
+  if (writer.overflowed()) {
+    unlockNet();
+    Serial.println("HAMQTTDiscovery: State value too large");
+    return HTTP_CODE_PAYLOAD_TOO_LARGE;
+  }
+
+  String endpoint = "/api/states/" + entityId;
+  unsigned long startTime = millis();
+  int httpCode = sendRequest("POST", endpoint, _bodyBuffer, writer.length(), nullptr, nullptr);
+  recordOperation(OP_STATE_POST, startTime, httpCode >= 200 && httpCode < 300);
+  unlockNet();
+
+  if ((httpCode < 200 || httpCode >= 300) && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + endpoint).c_str(), httpCode);
+  }
+  return httpCode;
+}
+
+void HAMQTTDiscovery::enableStateBatch(const String& eventType, size_t maxBytes, unsigned long maxDelayMs) {
+  lockNet();
+  _stateBatchEndpoint = "/api/events/" + eventType;
+  _stateBatchLimit = min(maxBytes, sizeof(_bodyBuffer));
+  _stateBatchDelay = maxDelayMs;
+  _stateBatch = true;
+  unlockNet();
+}
+
+void HAMQTTDiscovery::disableStateBatch() {
+  lockNet();
+  sendStateBatch();
+  _stateBatch = false;
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::flushStates() {
+  lockNet();
+  bool success = sendStateBatch();
+  unlockNet();
+  return success;
+}
+
+static size_t stateEntryLength(const String& topic, const String& value) {
+  // "topic":"value" plus the separating comma
+  return HAJsonWriter::escapedLength(topic.c_str(), topic.length()) +
+         HAJsonWriter::escapedLength(value.c_str(), value.length()) + 6;
+}
+
+void HAMQTTDiscovery::queueState(HAControl* control, const String& value) {
+  lockNet();
+  String topic = control->getStateTopic();
+  if (control->batched) {
+    // Latest value wins; the entry keeps its place
+    _stateBatchBytes -= stateEntryLength(topic, control->batchValue);
+    control->batched = false;
+    _stateBatchCount--;
+  }
+
+  size_t length = stateEntryLength(topic, value);
+  if (_stateBatchCount > 0 && _stateBatchBytes + length > _stateBatchLimit) {
+    sendStateBatch();
+  }
+  if (_stateBatchCount == 0) {
+    _stateBatchStartedAt = millis();
+  }
+
+  control->batchValue = value;
+  control->batched = true;
+  if (!control->batchQueuedAt) {
+    control->batchQueuedAt = control->queuedAt;
+  }
+  control->queuedAt = 0;
+  control->hasPending = false;
+  control->lastWriteAt = millis();
+  _stateBatchBytes += length;
+  _stateBatchCount++;
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::sendStateBatch() {
+  if (_stateBatchCount == 0) return true;
+
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (!control->batched) continue;
+    writer.key(control->getStateTopic().c_str());
+    writer.value(control->batchValue);
+  }
+  writer.endObject();
+
+  int httpCode = HTTP_CODE_PAYLOAD_TOO_LARGE;
+  if (writer.overflowed()) {
+    Serial.println("HAMQTTDiscovery: State batch too large");
+  } else {
+    unsigned long startTime = millis();
+    httpCode = sendRequest("POST", _stateBatchEndpoint, _bodyBuffer, writer.length(), nullptr, nullptr);
+    recordOperation(OP_STATE_POST, startTime, httpCode >= 200 && httpCode < 300);
+    if ((httpCode < 200 || httpCode >= 300) && httpCode != CIRCUIT_OPEN) {
+      Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + _stateBatchEndpoint).c_str(), httpCode);
+    }
+  }
+  bool success = (httpCode >= 200 && httpCode < 300);
+
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (!control->batched) continue;
+    control->batched = false;
+
+    if (success) {
+      control->currentState = control->batchValue;
+      control->hasWritten = true;
+      control->writeStats.sent++;
+      recordDelivery(control, control->batchQueuedAt);
+    } else {
+      control->writeStats.failed++;
+      // Held writes are replayed one by one through /api/states
+      if (_offline && (httpCode < 0 || httpCode >= 500)) {
+        storeOffline(control->getEntityId(), control->batchValue);
+      }
+    }
+    control->batchValue = String();
+    control->batchQueuedAt = 0;
+  }
 
-  String entityId = control->getEntityId();
+  _stateBatchBytes = 2;
+  _stateBatchCount = 0;
+  return success;
+}
 
-  if (controlExists(entityId)) {
-    Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
-    delete control;
-    return nullptr;
+bool HAMQTTDiscovery::serviceWrites(HAControl* control) {
+  // A control that was never written can still hold a value in sleep or
+  // gateway mode
+  if (!control->isOnline || !(control->hasWritten || control->hasPending)) return false;
+
+  unsigned long sinceWrite = millis() - control->lastWriteAt;
+  if (control->hasPending && sinceWrite >= control->policy.minIntervalMs) {
+    // Copy first; a successful send clears the pending value
+    String value = control->pendingValue;
+    sendState(control, value);
+    return true;
   }
 
-  if (!publishDiscovery(control)) {
-    Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", entityId.c_str());
-    delete control;
-    return nullptr;
+  if (control->policy.maxIntervalMs && sinceWrite >= control->policy.maxIntervalMs) {
+    // A value still held by a longer minIntervalMs is newer than what HA has
+    String value = control->hasPending ? control->pendingValue : control->currentState;
+    sendState(control, value);
+    return true;
   }
+  return false;
+}
 
-  Serial.printf("HAMQTTDiscovery: Waiting for control %s to be created...\n", entityId.c_str());
-  delay(3000);
-
-  if (!waitForControlCreation(entityId, 10)) {
-    Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", entityId.c_str());
-    delete control;
-    return nullptr;
+bool HAMQTTDiscovery::setAggregation(HAControl* control, unsigned long windowMs, HAAggregate aggregate,
+                                     uint8_t decimals, bool series) {
+  if (!control || control->type != CONTROL_SENSOR) {
+    Serial.println("HAMQTTDiscovery: Aggregation is only available for sensors");
+    return false;
   }
 
-  control->isOnline = true;
-  _controls[_controlCount++] = control;
-  Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
-  return control;
+  // The net lock keeps loop() off the old window; the spinlock keeps
+  // addSample() off it. Nothing is allocated or freed inside the spinlock.
+  HAAggregator* aggregator = new HAAggregator(windowMs, aggregate, decimals, series);
+  lockNet();
+  portENTER_CRITICAL(&_sampleMux);
+  HAAggregator* old = control->aggregator;
+  control->aggregator = aggregator;
+  portEXIT_CRITICAL(&_sampleMux);
+  delete old;
+  unlockNet();
+  return true;
 }
 
-HAControl* HAMQTTDiscovery::createSensor(const String& objectId, const String& name, const String& uniqueId,
-                                        const String& unit, const String& icon,
-                                        const String& stateTopic, const String& availabilityTopic,
-                                        HADevice* device) {
-  if (_controlCount >= MAX_CONTROLS) {
-    Serial.println("HAMQTTDiscovery: Maximum number of controls reached");
-    return nullptr;
+void HAMQTTDiscovery::clearAggregation(HAControl* control) {
+  if (!control) return;
+
+  lockNet();
+  portENTER_CRITICAL(&_sampleMux);
+  HAAggregator* old = control->aggregator;
+  control->aggregator = nullptr;
+  portEXIT_CRITICAL(&_sampleMux);
+  delete old;
+  unlockNet();
+}
+
+bool HAMQTTDiscovery::addSample(HAControl* control, float sample) {
+  // Not the net lock: this runs at sampling rate, possibly beside a request
+  // in flight, and only has to keep the aggregator from being swapped
+  if (!control) return false;
+
+  portENTER_CRITICAL(&_sampleMux);
+  HAAggregator* aggregator = control->aggregator;
+  if (aggregator) aggregator->add(sample);
+  portEXIT_CRITICAL(&_sampleMux);
+  return aggregator != nullptr;
+}
+
+bool HAMQTTDiscovery::serviceAggregation(HAControl* control) {
+  if (!control->aggregator || !control->isOnline) return false;
+
+  HASampleWindow window;
+  if (!control->aggregator->take(window)) return false;
+
+  // Offline and batched writes carry only the state, not the attributes
+  String value(window.value(control->aggregator->aggregate()), (unsigned int)control->aggregator->decimals());
+  sendState(control, value, &window);
+  return true;
+}
+
+void HAMQTTDiscovery::setPublishPolicy(HAControl* control, const HAPublishPolicy& policy) {
+  if (control) {
+    control->policy = policy;
   }
+}
 
-  HAControl* control = new HAControl();
-  control->type = CONTROL_SENSOR;
-  control->objectId = objectId;
-  control->name = name;
-  control->uniqueId = uniqueId;
-  control->unit = unit;
-  control->icon = icon.length() ? icon : "mdi:gauge";
-  control->stateTopic = stateTopic.length() ? stateTopic : ("virt/" + objectId + "/state");
-  control->availabilityTopic = availabilityTopic.length() ? availabilityTopic : ("virt/" + objectId + "/avail");
-  control->device = device ? device : &_defaultDevice;
+HAWriteStats HAMQTTDiscovery::getWriteStats() const {
+  HAWriteStats total;
+  for (int i = 0; i < _controlCount; i++) {
+    const HAWriteStats& stats = _controls[i]->writeStats;
+    total.sent += stats.sent;
+    total.suppressed += stats.suppressed;
+    total.coalesced += stats.coalesced;
+    total.failed += stats.failed;
+  }
+  return total;
+}
 
-  String entityId = control->getEntityId();
+void HAMQTTDiscovery::resetWriteStats() {
+  for (int i = 0; i < _controlCount; i++) {
+    _controls[i]->writeStats = HAWriteStats();
+  }
+}
 
-  if (controlExists(entityId)) {
-    Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
-    delete control;
-    return nullptr;
+bool HAMQTTDiscovery::enableOfflineBuffer(int capacity, OfflineMode mode) {
+  if (capacity <= 0) {
+    return false;
   }
 
-  if (!publishDiscovery(control)) {
-    Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", entityId.c_str());
-    delete control;
-    return nullptr;
+  lockNet();
+  if (_offlineCount > 0) {
+    unlockNet();
+    Serial.println("HAMQTTDiscovery: Offline buffer still holds writes");
+    return false;
   }
 
-  Serial.printf("HAMQTTDiscovery: Waiting for control %s to be created...\n", entityId.c_str());
-  delay(3000);
+  delete[] _offline;
+  _offline = new OfflineEntry[capacity];
+  _offlineCapacity = capacity;
+  _offlineHead = 0;
+  _offlineMode = mode;
+  unlockNet();
+  return true;
+}
 
-  if (!waitForControlCreation(entityId, 10)) {
-    Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", entityId.c_str());
-    delete control;
-    return nullptr;
+void HAMQTTDiscovery::setOfflineReplay(int batchSize, unsigned long intervalMs) {
+  _replayBatch = batchSize > 0 ? batchSize : 1;
+  _replayInterval = intervalMs;
+}
+
+bool HAMQTTDiscovery::setOfflineStorage(fs::FS& fs, const char* path) {
+  if (!_offline) {
+    Serial.println("HAMQTTDiscovery: Enable the offline buffer before its storage");
+    return false;
   }
 
-  control->isOnline = true;
-  _controls[_controlCount++] = control;
-  Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
-  return control;
+  lockNet();
+  int held = _offlineCount;
+  _offlinePath = path;
+  loadOffline(fs);
+  _offlineFs = &fs;
+  // Writes held before the storage was set aren't in the file yet
+  if (held > 0) {
+    saveOffline();
+  }
+  unlockNet();
+  return true;
 }
 
-HAControl* HAMQTTDiscovery::createBinarySensor(const String& objectId, const String& name, const String& uniqueId,
-                                              const String& icon, const String& stateTopic,
-                                              const String& availabilityTopic,
-                                              const String& payloadOn, const String& payloadOff,
-                                              HADevice* device) {
-  if (_controlCount >= MAX_CONTROLS) {
-    Serial.println("HAMQTTDiscovery: Maximum number of controls reached");
-    return nullptr;
+HAOfflineStats HAMQTTDiscovery::getOfflineStats() const {
+  HAOfflineStats stats = _offlineStats;
+  stats.occupancy = _offlineCount;
+  stats.capacity = _offlineCapacity;
+  return stats;
+}
+
+void HAMQTTDiscovery::storeOffline(const String& entityId, const String& value) {
+  lockNet();
+  _offlineStats.buffered++;
+  holdOffline(entityId, value);
+  appendOffline(entityId, value);
+  unlockNet();
+}
+
+void HAMQTTDiscovery::holdOffline(const String& entityId, const String& value) {
+  if (_offlineMode == OFFLINE_LATEST) {
+    for (int i = 0; i < _offlineCount; i++) {
+      OfflineEntry& entry = _offline[(_offlineHead + i) % _offlineCapacity];
+      if (entry.entityId == entityId) {
+        entry.value = value;
+        return;
+      }
+    }
   }
 
-  HAControl* control = new HAControl();
-  control->type = CONTROL_BINARY_SENSOR;
-  control->objectId = objectId;
-  control->name = name;
-  control->uniqueId = uniqueId;
-  control->icon = icon.length() ? icon : "mdi:motion-sensor";
-  control->stateTopic = stateTopic.length() ? stateTopic : ("virt/" + objectId + "/state");
-  control->availabilityTopic = availabilityTopic.length() ? availabilityTopic : ("virt/" + objectId + "/avail");
-  control->payloadOn = payloadOn.length() ? payloadOn : "ON";
-  control->payloadOff = payloadOff.length() ? payloadOff : "OFF";
-  control->device = device ? device : &_defaultDevice;
+  if (_offlineCount == _offlineCapacity) {
+    Serial.printf("HAMQTTDiscovery: Offline buffer full, dropping %s\n", _offline[_offlineHead].entityId.c_str());
+    popOffline();
+    _offlineStats.dropped++;
+  }
 
-  String entityId = control->getEntityId();
+  OfflineEntry& entry = _offline[(_offlineHead + _offlineCount) % _offlineCapacity];
+  entry.entityId = entityId;
+  entry.value = value;
+  _offlineCount++;
+}
 
-  if (controlExists(entityId)) {
-    Serial.printf("HAMQTTDiscovery: Control %s already exists\n", entityId.c_str());
-    delete control;
-    return nullptr;
+void HAMQTTDiscovery::popOffline() {
+  OfflineEntry& entry = _offline[_offlineHead];
+  entry.entityId = String();
+  entry.value = String();
+  _offlineHead = (_offlineHead + 1) % _offlineCapacity;
+  _offlineCount--;
+}
+
+void HAMQTTDiscovery::replayOffline() {
+  // Replayed writes are taken out of the file in one rewrite now and then,
+  // rather than one per write
+  if (_offlineDirty && millis() - _offlineSavedAt >= OFFLINE_SAVE_MS) {
+    lockNet();
+    saveOffline();
+    unlockNet();
   }
 
-  if (!publishDiscovery(control)) {
-    Serial.printf("HAMQTTDiscovery: Failed to publish discovery for %s\n", entityId.c_str());
-    delete control;
-    return nullptr;
+  if (_offlineCount == 0 || millis() - _lastReplay < _replayInterval) {
+    return;
+  }
+  _lastReplay = millis();
+
+  lockNet();
+  int taken = 0;
+  while (taken < _replayBatch && _offlineCount > 0) {
+    // With state batching on, held writes go out the same way, several to
+    // a request; the local broker takes them one by one
+    int count = (_stateBatch && !_localReady) ? replayOfflineBatch() : replayOfflineEntry();
+    if (count == 0) break;  // still unreachable; try again next interval
+    taken += count;
   }
 
-  Serial.printf("HAMQTTDiscovery: Waiting for control %s to be created...\n", entityId.c_str());
-  delay(3000);
+  if (taken > 0) {
+    if (_offlineCount == 0) {
+      saveOffline();
+    } else {
+      _offlineDirty = true;
+    }
+  }
+  unlockNet();
+}
 
-  if (!waitForControlCreation(entityId, 10)) {
-    Serial.printf("HAMQTTDiscovery: Control %s was not created within timeout\n", entityId.c_str());
-    delete control;
-    return nullptr;
+int HAMQTTDiscovery::replayOfflineEntry() {
+  OfflineEntry& entry = _offline[_offlineHead];
+  HAControl* control = findControl(entry.entityId);
+  int httpCode = control && publishLocalState(control, entry.value)
+    ? HTTP_CODE_OK : postState(entry.entityId, entry.value);
+  bool success = (httpCode >= 200 && httpCode < 300);
+  if (!success && (httpCode < 0 || httpCode >= 500)) {
+    return 0;
   }
 
-  control->isOnline = true;
-  _controls[_controlCount++] = control;
-  Serial.printf("HAMQTTDiscovery: Control %s created successfully\n", entityId.c_str());
-  return control;
+  if (success) {
+    finishReplay(control, entry.value);
+  } else {
+    _offlineStats.dropped++;
+  }
+  popOffline();
+  return 1;
 }
 
-bool HAMQTTDiscovery::writeControl(HAControl* control, const String& value) {
-  if (!control || !control->isOnline) {
-    return false;
+int HAMQTTDiscovery::replayOfflineBatch() {
+  // Entries from the head up to the replay batch size, as long as each has
+  // a control on its default state topic (the event is keyed by it) and no
+  // control appears twice, which OFFLINE_HISTORY allows
+  HAControl** controls = _scratch;
+  size_t bytes = 2;
+  int count = 0;
+  while (count < _replayBatch && count < _offlineCount) {
+    const OfflineEntry& entry = _offline[(_offlineHead + count) % _offlineCapacity];
+    HAControl* control = findControl(entry.entityId);
+    if (!control || control->customTopic(HAControl::TOPIC_STATE).length()) break;
+    bool repeated = false;
+    for (int i = 0; i < count && !repeated; i++) {
+      repeated = (controls[i] == control);
+    }
+    if (repeated) break;
+    size_t length = stateEntryLength(control->getStateTopic(), entry.value);
+    if (count > 0 && bytes + length > _stateBatchLimit) break;
+    controls[count++] = control;
+    bytes += length;
+  }
+  if (count == 0) {
+    return replayOfflineEntry();
   }
 
-  String entityId = control->getEntityId();
-  String payload = "{\"state\":\"" + HADevice::escape(value) + "\"}";
+  HAJsonWriter writer(_bodyBuffer, sizeof(_bodyBuffer));
+  writer.beginObject();
+  for (int i = 0; i < count; i++) {
+    writer.key(controls[i]->getStateTopic().c_str());
+    writer.value(_offline[(_offlineHead + i) % _offlineCapacity].value);
+  }
+  writer.endObject();
+  if (writer.overflowed()) {
+    // A single value too large for the body; HA would never take it
+    Serial.println("HAMQTTDiscovery: State batch too large");
+    _offlineStats.dropped++;
+    popOffline();
+    return 1;
+  }
 
-  bool success = postToHA("/api/states/" + entityId, payload);
-  if (success) {
+  unsigned long startTime = millis();
+  int httpCode = sendRequest("POST", _stateBatchEndpoint, _bodyBuffer, writer.length(), nullptr, nullptr);
+  bool success = (httpCode >= 200 && httpCode < 300);
+  recordOperation(OP_STATE_POST, startTime, success);
+  if (!success && (httpCode < 0 || httpCode >= 500)) {
+    return 0;
+  }
+  if (!success && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + _stateBatchEndpoint).c_str(), httpCode);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (success) {
+      finishReplay(controls[i], _offline[_offlineHead].value);
+    } else {
+      _offlineStats.dropped++;
+    }
+    popOffline();
+  }
+  return count;
+}
+
+void HAMQTTDiscovery::finishReplay(HAControl* control, const String& value) {
+  _offlineStats.replayed++;
+  if (control) {
     control->currentState = value;
+    control->hasWritten = true;
+    control->lastWriteAt = millis();
+    control->writeStats.sent++;
   }
-  return success;
+}
+
+// One "entity<TAB>value" line per held write; tabs, newlines and
+// backslashes in either field are escaped
+static void writeOfflineField(File& file, const String& field) {
+  for (size_t i = 0; i < field.length(); i++) {
+    char c = field[i];
+    if (c == '\\') {
+      file.write((const uint8_t*)"\\\\", 2);
+    } else if (c == '\t') {
+      file.write((const uint8_t*)"\\t", 2);
+    } else if (c == '\n') {
+      file.write((const uint8_t*)"\\n", 2);
+    } else if (c == '\r') {
+      file.write((const uint8_t*)"\\r", 2);
+    } else {
+      file.write((uint8_t)c);
+    }
+  }
+}
+
+static String readOfflineField(const String& line, int start, int end) {
+  String field;
+  field.reserve(end - start);
+  for (int i = start; i < end; i++) {
+    char c = line[i];
+    if (c == '\\' && i + 1 < end) {
+      c = line[++i];
+      if (c == 't') c = '\t';
+      else if (c == 'n') c = '\n';
+      else if (c == 'r') c = '\r';
+    }
+    field += c;
+  }
+  return field;
+}
+
+void HAMQTTDiscovery::appendOffline(const String& entityId, const String& value) {
+  if (!_offlineFs) {
+    return;
+  }
+
+  // In OFFLINE_LATEST a replaced value adds a line too; the file is
+  // compacted once it holds twice what the buffer does
+  if (_offlineFileLines >= 2 * _offlineCapacity) {
+    saveOffline();
+    return;
+  }
+
+  File file = _offlineFs->open(_offlinePath, FILE_APPEND);
+  if (!file) {
+    Serial.printf("HAMQTTDiscovery: Can't write %s\n", _offlinePath.c_str());
+    return;
+  }
+  writeOfflineField(file, entityId);
+  file.write((uint8_t)'\t');
+  writeOfflineField(file, value);
+  file.write((uint8_t)'\n');
+  file.close();
+  _offlineFileLines++;
+}
+
+void HAMQTTDiscovery::saveOffline() {
+  if (!_offlineFs) {
+    return;
+  }
+  _offlineDirty = false;
+  _offlineSavedAt = millis();
+  _offlineFileLines = _offlineCount;
+
+  if (_offlineCount == 0) {
+    _offlineFs->remove(_offlinePath);
+    return;
+  }
+
+  File file = _offlineFs->open(_offlinePath, FILE_WRITE);
+  if (!file) {
+    Serial.printf("HAMQTTDiscovery: Can't write %s\n", _offlinePath.c_str());
+    return;
+  }
+  for (int i = 0; i < _offlineCount; i++) {
+    const OfflineEntry& entry = _offline[(_offlineHead + i) % _offlineCapacity];
+    writeOfflineField(file, entry.entityId);
+    file.write((uint8_t)'\t');
+    writeOfflineField(file, entry.value);
+    file.write((uint8_t)'\n');
+  }
+  file.close();
+}
+
+void HAMQTTDiscovery::loadOffline(fs::FS& fs) {
+  if (!fs.exists(_offlinePath)) {
+    return;
+  }
+
+  File file = fs.open(_offlinePath, FILE_READ);
+  if (!file) {
+    return;
+  }
+
+  int loaded = 0;
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    int tab = line.indexOf('\t');
+    if (tab <= 0) continue;
+    // Already counted as buffered by the run that wrote them
+    holdOffline(readOfflineField(line, 0, tab), readOfflineField(line, tab + 1, line.length()));
+    loaded++;
+  }
+  file.close();
+  _offlineFileLines = loaded;
+
+  if (loaded) {
+    Serial.printf("HAMQTTDiscovery: Loaded %d offline writes from %s\n", loaded, _offlinePath.c_str());
+  }
+}
+
+HAControl* HAMQTTDiscovery::findControl(const String& id) const {
+  bool isEntityId = id.indexOf('.') != -1;
+  for (int i = 0; i < _controlCount; i++) {
+    HAControl* control = _controls[i];
+    if (isEntityId ? control->hasEntityId(id) : strcmp(control->getObjectId(), id.c_str()) == 0) {
+      return control;
+    }
+  }
+  return nullptr;
+}
+
+int HAMQTTDiscovery::controlCount() const {
+  return _controlCount;
 }
 
 String HAMQTTDiscovery::readControl(HAControl* control) {
@@ -492,13 +3482,23 @@ String HAMQTTDiscovery::readControl(HAControl* control) {
     return "";
   }
 
-  String entityId = control->getEntityId();
-  String response;
+  // Only the fields we need are kept, however large the attributes are
+  char state[256];
+  char lastChanged[40];
+  HAJsonExtractor reader;
+  int stateSlot = reader.addPath("state", state, sizeof(state));
+  int changedSlot = reader.addPath("last_changed", lastChanged, sizeof(lastChanged));
+
+  unsigned long startTime = millis();
+  bool fetched = getFromHA("/api/states/" + control->getEntityId(), &reader);
+  recordOperation(OP_STATE_GET, startTime, fetched);
 
-  if (getFromHA("/api/states/" + entityId, response)) {
-    String state = extractJsonValue(response, "state");
+  if (fetched && reader.found(stateSlot)) {
     control->currentState = state;
-    return state;
+    if (reader.found(changedSlot)) {
+      control->lastChanged = lastChanged;
+    }
+    return control->currentState;
   }
 
   return "";
@@ -507,38 +3507,220 @@ String HAMQTTDiscovery::readControl(HAControl* control) {
 bool HAMQTTDiscovery::isControlOnline(HAControl* control) {
   if (!control) return false;
 
-  String entityId = control->getEntityId();
-  String response;
-  bool online = getFromHA("/api/states/" + entityId, response);
+  bool online = getFromHA("/api/states/" + control->getEntityId(), nullptr);
   control->isOnline = online;
   return online;
 }
 
-String HAMQTTDiscovery::extractJsonValue(const String& json, const String& key) {
-  String searchKey = "\"" + key + "\":";
-  int startIndex = json.indexOf(searchKey);
-  if (startIndex == -1) return "";
+int HAMQTTDiscovery::renderEntityStates(HAControl** controls, int count) {
+  // Have HA render a JSON array with one {"e","c","s"} entry per existing
+  // entity; expand() skips entities that don't exist. Entity ids are user
+  // input, so quotes and backslashes are escaped inside the Jinja strings.
+  String ids = "[";
+  for (int i = 0; i < count; i++) {
+    String entityId = controls[i]->getEntityId();
+    entityId.replace("\\", "\\\\");
+    entityId.replace("'", "\\'");
+    if (i > 0) ids += ",";
+    ids += "'" + entityId + "'";
+  }
+  ids += "]";
+
+  String tmpl = "[{% for s in expand(" + ids + ") %}"
+                "{{ {'e': s.entity_id, 'c': s.last_changed.isoformat(), 's': s.state} | tojson }}"
+                "{{ ',' if not loop.last }}{% endfor %}]";
+  String payload = "{\"template\":\"" + HADevice::escape(tmpl) + "\"}";
+
+  // The list is read as it streams in, however many controls there are
+  HAStateListReader reader(controls, count);
+  int httpCode = sendRequest("POST", "/api/template", payload.c_str(), payload.length(), nullptr, &reader);
+  if ((httpCode < 200 || httpCode >= 300) && httpCode != CIRCUIT_OPEN) {
+    Serial.printf("HAMQTTDiscovery: POST %s failed with code %d\n", (_serverUrl + "/api/template").c_str(), httpCode);
+  }
+  if (httpCode < 200 || httpCode >= 300 || !reader.complete()) return -1;
+  return reader.changedCount();
+}
+
+int HAMQTTDiscovery::refreshAll() {
+  lockNet();
+
+  // Controls that are still being created (or failed) are left alone
+  HAControl** active = _scratch;
+  int activeCount = 0;
+  for (int i = 0; i < _controlCount; i++) {
+    if (_controls[i]->status == STATUS_ONLINE) {
+      active[activeCount++] = _controls[i];
+    }
+  }
+  if (activeCount == 0) {
+    unlockNet();
+    return 0;
+  }
+
+  for (int i = 0; i < activeCount; i++) {
+    active[i]->changed = false;
+  }
+  int changedCount = renderEntityStates(active, activeCount);
+  if (changedCount < 0) {
+    unlockNet();
+    return -1;
+  }
 
-  startIndex += searchKey.length();
-  while (startIndex < json.length() && (json[startIndex] == ' ' || json[startIndex] == '\t')) {
-    startIndex++;
+  // Whatever is left didn't come back from HA
+  for (int i = 0; i < activeCount; i++) {
+    if (active[i] && active[i]->isOnline) {
+      active[i]->isOnline = false;
+      active[i]->changed = true;
+      changedCount++;
+    }
   }
 
-  if (startIndex >= json.length()) return "";
+  unlockNet();
+  return changedCount;
+}
 
-  if (json[startIndex] == '"') {
-    startIndex++;
-    int endIndex = json.indexOf('"', startIndex);
-    if (endIndex == -1) return "";
-    return json.substring(startIndex, endIndex);
-  } else {
-    int endIndex = startIndex;
-    while (endIndex < json.length() &&
-           json[endIndex] != ',' &&
-           json[endIndex] != '}' &&
-           json[endIndex] != ']') {
-      endIndex++;
+void HAMQTTDiscovery::lockNet() const {
+  xSemaphoreTakeRecursive(_netLock, portMAX_DELAY);
+}
+
+void HAMQTTDiscovery::unlockNet() const {
+  xSemaphoreGiveRecursive(_netLock);
+}
+
+bool HAMQTTDiscovery::startWorker(uint32_t stackSize, UBaseType_t priority, BaseType_t core) {
+  if (_workerTask) return true;
+
+  _workerRunning = true;
+  if (xTaskCreatePinnedToCore(workerTask, "HAMQTTDiscovery", stackSize, this, priority, &_workerTask, core) != pdPASS) {
+    Serial.println("HAMQTTDiscovery: Failed to start worker task");
+    _workerRunning = false;
+    _workerTask = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void HAMQTTDiscovery::stopWorker() {
+  if (!_workerTask) return;
+
+  _workerRunning = false;
+  xTaskNotifyGive(_workerTask);
+  xSemaphoreTake(_workerDone, portMAX_DELAY);
+  _workerTask = nullptr;
+
+  // Jobs that never ran are reported as failed
+  HAJob job;
+  while (takeJob(job)) {
+    if (job.callback) {
+      job.callback(job.control, false, "", job.context);
+    }
+  }
+}
+
+void HAMQTTDiscovery::workerTask(void* arg) {
+  HAMQTTDiscovery* self = static_cast<HAMQTTDiscovery*>(arg);
+
+  while (self->_workerRunning) {
+    HAJob job;
+    if (self->takeJob(job)) {
+      self->runJob(job);
+      continue;
     }
-    return json.substring(startIndex, endIndex);
+
+    // Idle: advance creation, pending writes and heartbeats, then sleep until
+    // a job is queued or the next loop tick is due
+    self->loop();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+  }
+
+  xSemaphoreGive(self->_workerDone);
+  vTaskDelete(nullptr);
+}
+
+bool HAMQTTDiscovery::enqueueJob(JobType type, HAControl* control, const String& value,
+                                 HAJobCallback callback, void* context) {
+  if (!control || !_workerTask) return false;
+
+  // State and command traffic goes ahead of bulk discovery
+  JobRing& ring = (type == JOB_DISCOVERY) ? _lowQueue : _highQueue;
+
+  xSemaphoreTake(_queueLock, portMAX_DELAY);
+  bool queued = ring.count < JOB_QUEUE_SIZE;
+  if (queued) {
+    HAJob& job = ring.jobs[(ring.head + ring.count) % JOB_QUEUE_SIZE];
+    job.type = type;
+    job.control = control;
+    job.value = value;
+    job.callback = callback;
+    job.context = context;
+    ring.count++;
+  }
+  xSemaphoreGive(_queueLock);
+
+  if (!queued) {
+    Serial.println("HAMQTTDiscovery: Job queue full");
+    return false;
+  }
+
+  xTaskNotifyGive(_workerTask);
+  return true;
+}
+
+bool HAMQTTDiscovery::takeJob(HAJob& job) {
+  xSemaphoreTake(_queueLock, portMAX_DELAY);
+  JobRing* ring = _highQueue.count ? &_highQueue : (_lowQueue.count ? &_lowQueue : nullptr);
+  if (ring) {
+    job = ring->jobs[ring->head];
+    ring->jobs[ring->head].value = "";
+    ring->head = (ring->head + 1) % JOB_QUEUE_SIZE;
+    ring->count--;
+  }
+  xSemaphoreGive(_queueLock);
+  return ring != nullptr;
+}
+
+void HAMQTTDiscovery::runJob(HAJob& job) {
+  bool success = false;
+  String value;
+
+  switch (job.type) {
+    case JOB_WRITE:
+      success = writeControl(job.control, job.value);
+      value = job.value;
+      break;
+    case JOB_READ:
+      value = readControl(job.control);
+      success = value.length() > 0;
+      break;
+    case JOB_DISCOVERY:
+      // The worker can afford to wait for the bank; no caller is blocked
+      if (_transport == TRANSPORT_HELPERS && !_localReady) {
+        waitForBank(_nextBank, ACK_TIMEOUT_MS);
+      }
+      success = publishDiscovery(job.control);
+      break;
+  }
+
+  if (job.callback) {
+    job.callback(job.control, success, value, job.context);
   }
-}
\ No newline at end of file
+}
+
+bool HAMQTTDiscovery::writeControlAsync(HAControl* control, const String& value, HAJobCallback callback, void* context) {
+  return enqueueJob(JOB_WRITE, control, value, callback, context);
+}
+
+bool HAMQTTDiscovery::readControlAsync(HAControl* control, HAJobCallback callback, void* context) {
+  return enqueueJob(JOB_READ, control, "", callback, context);
+}
+
+bool HAMQTTDiscovery::publishDiscoveryAsync(HAControl* control, HAJobCallback callback, void* context) {
+  return enqueueJob(JOB_DISCOVERY, control, "", callback, context);
+}
+
+int HAMQTTDiscovery::queuedJobs() const {
+  xSemaphoreTake(_queueLock, portMAX_DELAY);
+  int count = _highQueue.count + _lowQueue.count;
+  xSemaphoreGive(_queueLock);
+  return count;
+}
@@ -5,6 +5,16 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
+#include <FS.h>
+#include <Preferences.h>
+#include "HAJsonWriter.h"
+#include "HAJsonReader.h"
+#include "HAWebSocket.h"
+#include "HAMqttClient.h"
+#include "HAAggregator.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 
 enum ControlType {
   CONTROL_SWITCH,
@@ -13,6 +23,22 @@ enum ControlType {
   CONTROL_BINARY_SENSOR
 };
 
+enum ControlStatus {
+  STATUS_PENDING,
+  STATUS_ONLINE,
+  STATUS_FAILED
+};
+
+// Steps of the non-blocking creation state machine driven by loop()
+enum CreationStage {
+  STAGE_DONE,
+  STAGE_CHECK_EXISTS,
+  STAGE_PUBLISH,
+  STAGE_QUEUED,
+  STAGE_SETTLE,
+  STAGE_VERIFY
+};
+
 struct HADevice {
   String uniqueId;
   String name;
@@ -20,20 +46,143 @@ struct HADevice {
   String model;
   String swVersion;
 
-  String toJson() const;
+  String toJson(bool compact = false) const;
+  void writeJson(HAJsonWriter& writer, bool compact = false) const;
   static String escape(const String& input);
 };
 
-struct HAControl {
+// Decides which writeControl() calls actually reach Home Assistant
+struct HAPublishPolicy {
+  bool skipUnchanged;           // drop writes equal to the current state
+  float deadband;               // drop numeric changes smaller than this (0 = off)
+  unsigned long minIntervalMs;  // hold back writes closer together than this
+  unsigned long maxIntervalMs;  // resend the current state after this long (0 = off)
+
+  HAPublishPolicy();
+};
+
+struct HAWriteStats {
+  uint32_t sent;        // state writes that reached HA
+  uint32_t suppressed;  // dropped as unchanged or inside the deadband
+  uint32_t coalesced;   // replaced by a newer value before they were sent
+  uint32_t failed;      // state writes that HA didn't accept
+
+  HAWriteStats();
+};
+
+// How the offline buffer treats several held writes to the same entity
+enum OfflineMode {
+  OFFLINE_LATEST,   // keep only the newest value per entity
+  OFFLINE_HISTORY   // keep every value and replay them in order
+};
+
+struct HAOfflineStats {
+  int occupancy;      // writes currently held
+  int capacity;
+  uint32_t buffered;  // writes that went into the buffer
+  uint32_t replayed;  // held writes that later reached HA
+  uint32_t dropped;   // pushed out by a full buffer or rejected on replay
+
+  HAOfflineStats();
+};
+
+// Acknowledgements of pipelined helper frames (see setHelperBanks)
+struct HAHelperStats {
+  uint32_t frames;      // frames written with a sequence number
+  uint32_t acked;       // confirmed published by the automation
+  uint32_t duplicates;  // triggers the automation saw twice
+  uint32_t retriggered; // dropped runs started again from the same bank
+  uint32_t lost;        // never acknowledged; the bank was reused anyway
+
+  HAHelperStats();
+};
+
+// Wake-to-sleep accounting for sleep mode (see enableSleepMode)
+struct HASleepStats {
+  uint32_t wakes;            // wakes that found state retained across sleep
+  uint32_t awakeMs;          // this cycle's wake-to-sleep time, set by prepareSleep()
+  uint32_t lastAwakeMs;      // the previous cycle's
+  uint16_t resumedControls;  // controls adopted from retained state this wake
+  bool addressCached;        // the server address came from retained state
+
+  HASleepStats();
+};
+
+// Entity whose identifiers and discovery payload are fixed at compile time.
+// Declare one with the HA_SWITCH/HA_NUMBER/HA_SENSOR/HA_BINARY_SENSOR macros
+// below and pass it to HAMQTTDiscovery::createFromDescriptor().
+struct HAEntityDescriptor {
   ControlType type;
-  String objectId;
-  String name;
-  String uniqueId;
+  const char* objectId;
+  const char* entityId;        // "switch.<objectId>"
+  const char* discoveryTopic;  // "homeassistant/switch/<objectId>/config"
+  const char* payload;         // discovery members, without braces or device
+  const char* unitMember;      // "unit_of_measurement" member, or ""
+};
+
+// The macros paste their arguments into string literals, so the compiler
+// assembles every string and the descriptor is placed in flash. Arguments
+// must be string literals (plain numbers for min/max/step) that need no
+// JSON escaping. Topics are the library defaults, virt/<objectId>/state,
+// /set and /avail. The device block is the only part added at runtime.
+#define HA_DESCRIPTOR_UNIT(unit) \
+  (sizeof(unit) > 1 ? "\"unit_of_measurement\":\"" unit "\"" : "")
+
+#define HA_DESCRIPTOR_COMMON(objectId, name, uniqueId, icon) \
+  "\"name\":\"" name "\",\"unique_id\":\"" uniqueId "\",\"icon\":\"" icon "\"," \
+  "\"state_topic\":\"virt/" objectId "/state\","
+
+#define HA_SWITCH(var, objectId, name, uniqueId, icon) \
+  static const HAEntityDescriptor var = { \
+    CONTROL_SWITCH, objectId, "switch." objectId, "homeassistant/switch/" objectId "/config", \
+    HA_DESCRIPTOR_COMMON(objectId, name, uniqueId, icon) \
+    "\"command_topic\":\"virt/" objectId "/set\"," \
+    "\"availability_topic\":\"virt/" objectId "/avail\"," \
+    "\"payload_on\":\"ON\",\"payload_off\":\"OFF\"", \
+    "" }
+
+#define HA_NUMBER(var, objectId, name, uniqueId, minVal, maxVal, step, unit, mode, icon) \
+  static const HAEntityDescriptor var = { \
+    CONTROL_NUMBER, objectId, "number." objectId, "homeassistant/number/" objectId "/config", \
+    HA_DESCRIPTOR_COMMON(objectId, name, uniqueId, icon) \
+    "\"command_topic\":\"virt/" objectId "/set\"," \
+    "\"availability_topic\":\"virt/" objectId "/avail\"," \
+    "\"min\":" #minVal ",\"max\":" #maxVal ",\"step\":" #step ",\"mode\":\"" mode "\"", \
+    HA_DESCRIPTOR_UNIT(unit) }
+
+#define HA_SENSOR(var, objectId, name, uniqueId, unit, icon) \
+  static const HAEntityDescriptor var = { \
+    CONTROL_SENSOR, objectId, "sensor." objectId, "homeassistant/sensor/" objectId "/config", \
+    HA_DESCRIPTOR_COMMON(objectId, name, uniqueId, icon) \
+    "\"availability_topic\":\"virt/" objectId "/avail\"", \
+    HA_DESCRIPTOR_UNIT(unit) }
+
+#define HA_BINARY_SENSOR(var, objectId, name, uniqueId, icon) \
+  static const HAEntityDescriptor var = { \
+    CONTROL_BINARY_SENSOR, objectId, "binary_sensor." objectId, \
+    "homeassistant/binary_sensor/" objectId "/config", \
+    HA_DESCRIPTOR_COMMON(objectId, name, uniqueId, icon) \
+    "\"availability_topic\":\"virt/" objectId "/avail\"," \
+    "\"payload_on\":\"ON\",\"payload_off\":\"OFF\"", \
+    "" }
+
+struct HAControl;
+struct HANode;
+
+// Called with the new state when HA reports a change pushed over the
+// WebSocket connection (see HAMQTTDiscovery::startPush)
+typedef void (*HAStateCallback)(HAControl* control, const String& state);
+
+// Settings a control only carries when a create call gives it something
+// other than the defaults. Most controls keep none, so they live outside
+// HAControl and cost nothing in the common case.
+struct HAControlOptions {
+  // Left empty unless customised; use getIcon() and the get*Topic() calls
+  // for the values actually published
   String icon;
   String stateTopic;
   String commandTopic;
   String availabilityTopic;
-  HADevice* device;
 
   // Number-specific properties
   float minValue;
@@ -46,14 +195,257 @@ struct HAControl {
   String payloadOn;
   String payloadOff;
 
+  HAControlOptions();
+  bool isDefault() const;
+};
+
+struct HAControl {
+  ControlType type;
+  String objectId;
+  String name;
+  String uniqueId;
+  HADevice* device;
+
+  // nullptr while every option is at its default; read through getOptions()
+  HAControlOptions* options;
+
   // Current state tracking
   String currentState;
+  String lastChanged;
   bool isOnline;
+  bool changed;
+
+  // Write filtering and coalescing (see HAPublishPolicy)
+  HAPublishPolicy policy;
+  HAWriteStats writeStats;
+  String pendingValue;
+  bool hasPending;
+  bool hasWritten;
+  unsigned long lastWriteAt;
+  // Value waiting in the state batch (see enableStateBatch)
+  String batchValue;
+  bool batched;
+
+  // Creation tracking (see HAMQTTDiscovery::setAsyncCreation)
+  ControlStatus status;
+  CreationStage stage;
+  unsigned long stageStartedAt;
+  uint32_t fingerprint;  // hash of the discovery config, 0 until computed
+  unsigned long createdAt;
+
+  // Published with entity_category "diagnostic"
+  bool diagnostic;
+
+  // Push updates
+  HAStateCallback stateCallback;
+  uint32_t subscription;  // id of the subscribe_entities message covering it, 0 if none
+
+  // Set for controls made by createFromDescriptor(); the identity Strings
+  // above are then left empty and everything is read from flash
+  const HAEntityDescriptor* descriptor;
+
+  // Sample aggregation (see HAMQTTDiscovery::setAggregation)
+  HAAggregator* aggregator;
+
+  // Gateway mode: the node the control is scheduled with, and when the
+  // value waiting to go out (pending, then batched) was written
+  HANode* node;
+  unsigned long queuedAt;
+  unsigned long batchQueuedAt;
 
   HAControl();
   String getDiscoveryTopic() const;
-  String getDiscoveryPayload() const;
+  // compact uses HA's abbreviated keys and a shared "~" topic prefix
+  String getDiscoveryPayload(bool compact = false) const;
+  void writeDiscoveryTopic(HAJsonWriter& writer) const;
+  void writeDiscoveryPayload(HAJsonWriter& writer, bool compact = false) const;
+  String getTopicBase() const;
+  size_t getTopicBaseLength() const;
+  static const char* componentName(ControlType type);
+  static const char* defaultIcon(ControlType type);
   String getEntityId() const;
+  const char* getObjectId() const;
+  bool hasEntityId(const String& entityId) const;
+  uint32_t computeFingerprint(bool compact = false) const;
+
+  const HAControlOptions& getOptions() const;
+  const char* getIcon() const;
+  String getStateTopic() const;
+  String getCommandTopic() const;    // empty for sensors and binary sensors
+  String getAvailabilityTopic() const;
+
+  // A topic is either the custom String or virt/<objectId>/<suffix>, and is
+  // read and serialized in place without building it
+  enum TopicKind {
+    TOPIC_STATE,
+    TOPIC_COMMAND,
+    TOPIC_AVAILABILITY
+  };
+  const String& customTopic(TopicKind kind) const;
+  bool hasTopic(TopicKind kind) const;
+  int topicParts(TopicKind kind, const char** parts, size_t* lengths) const;
+  size_t topicLength(TopicKind kind) const;
+  char topicChar(TopicKind kind, size_t index) const;
+  void writeTopicChars(HAJsonWriter& writer, TopicKind kind, size_t from, size_t to) const;
+  String getTopic(TopicKind kind) const;
+  TopicKind baseTopic() const;
+  bool topicHasBase(TopicKind kind, size_t baseLength) const;
+  void writeTopic(HAJsonWriter& writer, const char* name, TopicKind kind, size_t baseLength) const;
+};
+
+// Operations timed separately in HARequestStats::ops
+enum HAOperation {
+  OP_CONNECT,       // TCP connect and TLS handshake
+  OP_HELPER_POST,   // one input_text helper write
+  OP_STATE_POST,    // one state write
+  OP_STATE_GET,     // one state read
+  OP_DISCOVERY,     // create* until the entity is verified in HA
+  OP_LOCAL_PUBLISH, // one publish to the local broker (see setLocalBroker)
+  OP_COUNT
+};
+
+// Latency histogram; bucket i counts operations that took less than
+// 8 << i ms, and the last bucket everything slower
+struct HALatencyStats {
+  static const int BUCKETS = 12;
+  uint32_t count;
+  uint32_t failures;
+  uint32_t totalMs;
+  uint32_t maxMs;
+  uint32_t buckets[BUCKETS];
+
+  HALatencyStats();
+  void record(uint32_t ms, bool success);
+  uint32_t averageMs() const;
+  // Upper bound of the bucket holding the given percentile (0-100),
+  // capped at maxMs
+  uint32_t percentileMs(uint8_t percentile) const;
+  static uint32_t bucketLimitMs(int bucket);
+};
+
+// Per-node counters in gateway mode (see HAMQTTDiscovery::addNode)
+struct HANodeStats {
+  uint32_t writes;         // writeControl() calls
+  uint32_t delivered;      // values that reached HA; the rest were coalesced or failed
+  HALatencyStats latency;  // writeControl() to delivery
+
+  HANodeStats();
+};
+
+// A downstream node published through a gateway. Pass &node->device to
+// create* so its controls are scheduled with the node.
+struct HANode {
+  HADevice device;
+  HANodeStats stats;
+
+  // Scheduling state, kept by HAMQTTDiscovery
+  HAControl** controls;
+  int controlCount;
+  int controlCapacity;
+  int cursor;
+
+  HANode();
+  ~HANode();
+  void addControl(HAControl* control);
+
+private:
+  HANode(const HANode&);
+  HANode& operator=(const HANode&);
+};
+
+// Totals over every REST request the library makes, for measuring it on
+// the device (see the Benchmark example)
+struct HARequestStats {
+  uint32_t requests;       // HTTP requests sent, retries included
+  uint32_t retries;        // requests repeated on a fresh connection
+  uint32_t failures;       // calls that ended without a 2xx reply
+  uint32_t bytesSent;      // request bodies
+  uint32_t bytesReceived;  // response bodies
+  uint32_t busyMs;         // wall time spent inside requests
+  uint32_t minFreeHeap;    // lowest free heap seen around a request
+  HALatencyStats ops[OP_COUNT];
+
+  HARequestStats();
+};
+
+// Circuit breaker around HA requests (see setCircuitBreaker)
+enum HABreakerState {
+  BREAKER_CLOSED,     // requests go through
+  BREAKER_OPEN,       // HA unreachable, requests fail at once
+  BREAKER_HALF_OPEN   // one probe request is testing recovery
+};
+
+// How discovery messages reach MQTT (see begin)
+enum HATransport {
+  TRANSPORT_HELPERS,  // six input_text helper writes and the bundled automation
+  TRANSPORT_SERVICE   // one call to mqtt.publish (or a script) per message
+};
+
+typedef void (*HAControlCallback)(HAControl* control);
+typedef void (*HABreakerCallback)(HABreakerState state);
+
+// Completion callback for queued jobs; value is the state read by
+// readControlAsync(). Runs on the worker task.
+typedef void (*HAJobCallback)(HAControl* control, bool success, const String& value, void* context);
+
+enum JobType {
+  JOB_WRITE,
+  JOB_READ,
+  JOB_DISCOVERY
+};
+
+struct HAJob {
+  JobType type;
+  HAControl* control;
+  String value;
+  HAJobCallback callback;
+  void* context;
+};
+
+class HAMQTTDiscovery;
+
+// Reads HA WebSocket messages. The message type, id and result are kept;
+// entity states are handed to the owner as they are parsed, so an event of
+// any size needs no more than the reader's fixed buffers.
+class HAPushReader : public HAJsonReader {
+public:
+  HAPushReader();
+  void begin(HAMQTTDiscovery* owner);
+  void clearMessage();
+
+  char type[24];
+  uint32_t id;
+  bool success;
+
+protected:
+  void onValue(const char* value, size_t length, bool isString) override;
+
+private:
+  HAMQTTDiscovery* _owner;
+};
+
+// Reads the entity list that refreshAll() and the creation check render,
+// a JSON array of {"e": entity_id, "c": last_changed, "s": state}, into
+// the matching controls. Matched controls are cleared from the list, so
+// whatever is left afterwards wasn't found in HA.
+class HAStateListReader : public HAJsonReader {
+public:
+  HAStateListReader(HAControl** controls, int count);
+  // Controls whose state, last_changed or availability changed
+  int changedCount() const { return _changedCount; }
+
+protected:
+  void onValue(const char* value, size_t length, bool isString) override;
+  void onContainer(bool isObject, bool opened) override;
+
+private:
+  HAControl** _controls;
+  int _count;
+  int _cursor;
+  int _changedCount;
+  int _match;  // the current entry's control, or -1
+  char _state[256];
+  char _lastChanged[40];
 };
 
 class HAMQTTDiscovery {
@@ -61,7 +453,12 @@ public:
   HAMQTTDiscovery();
   ~HAMQTTDiscovery();
 
-  bool begin(const String& serverUrl, const String& token);
+  bool begin(const String& serverUrl, const String& token,
+             HATransport transport = TRANSPORT_HELPERS);
+
+  // Service used by TRANSPORT_SERVICE, as "domain.service". It is called
+  // with topic, payload (a JSON string) and retain.
+  void setDiscoveryService(const String& service);
 
   HAControl* createSwitch(const String& objectId, const String& name, const String& uniqueId,
                          const String& icon = "", const String& stateTopic = "",
@@ -83,12 +480,211 @@ public:
                                const String& availabilityTopic = "",
                                const String& payloadOn = "ON", const String& payloadOff = "OFF",
                                HADevice* device = nullptr);
+  // Creates a control from a compile-time descriptor (see HA_SWITCH). The
+  // descriptor must outlive the control, which a static one always does.
+  HAControl* createFromDescriptor(const HAEntityDescriptor& descriptor, HADevice* device = nullptr);
+
+  // Non-blocking creation. When enabled, create* returns immediately with the
+  // control in STATUS_PENDING and loop() advances it through the exists check,
+  // discovery publish and verification. The callback fires once per control
+  // when it reaches STATUS_ONLINE or STATUS_FAILED. A blocking create that
+  // finds the helper bank busy is handed to loop() the same way.
+  void setAsyncCreation(bool enabled);
+  void setLoopBudget(unsigned long milliseconds);
+  void onControlStatus(HAControlCallback callback);
+  void loop();
+  int pendingControls() const;
+
+  // Fingerprint cache. Each control's discovery config is hashed and the
+  // hash kept in NVS once HA has the entity. On later boots a control whose
+  // hash matches is adopted as online without any request; a control whose
+  // config changed, or that has no hash yet, is republished and verified
+  // instead of being rejected as already existing.
+  bool enableFingerprintCache(const char* name = "hamqtt");
+  void clearFingerprintCache();
+
+  // Wake-publish-sleep mode for battery devices. Call after begin() and
+  // before creating controls. The server address and every online control's
+  // fingerprint are kept in RTC memory, so after a deep sleep the controls
+  // are adopted and the connection opened without DNS or any check request.
+  // writeControl() only holds values; prepareSleep() sends them all over one
+  // connection, saves the retained state and returns true once it is safe to
+  // sleep. Awake time is counted from wokeAt (boot by default).
+  bool enableSleepMode(unsigned long wokeAt = 0);
+  bool prepareSleep(unsigned long timeoutMs = 5000);
+  HASleepStats getSleepStats() const;
+
+  // Discovery batching. Between beginBatch() and endBatch(), discovery
+  // envelopes are packed into a single {"batch":[...]} frame that is sent
+  // through the helper buffers when it is full or when flushBatch() is called.
+  // A flush that finds the helper bank still busy leaves the frame to loop().
+  void beginBatch();
+  bool flushBatch();
+  bool endBatch();
+
+  // Pipelined helper banks. With more than one bank (up to 4), frames go to
+  // the banks in turn and the trigger helper gets "END:<seq>". The bundled
+  // automation replies by setting it to "ACK:<seq>" (or "DUP:<seq>" for a
+  // repeated trigger), so a bank is only rewritten once its last frame was
+  // published, while the next bank is filled in the meantime. Bank 1 is
+  // mqtt_buffer_1..6; bank n is mqtt_bank<n>_1..6.
+  bool setHelperBanks(int banks);
+  HAHelperStats getHelperStats() const;
+
+  // Helper geometry. Before the first helper frame, one template render
+  // reads how many data helpers exist (mqtt_buffer_1..5, up to the first
+  // missing one) and the smallest configured max. Frames are split on UTF-8
+  // character boundaries into chunks of that size, only the helpers a frame
+  // needs are written, and the trigger says how many: "END/<n>", or
+  // "END:<seq>/<n>" with banks. Extra banks are assumed to match bank 1.
+  bool detectHelperGeometry();
+  int helperBuffers() const;
+  size_t helperChunkSize() const;
+
+  // Compact discovery uses HA's abbreviated keys (stat_t, uniq_id, dev, ...)
+  // and a "~" topic prefix so more envelopes fit in fewer helper chunks.
+  void setCompactDiscovery(bool enabled);
+  int discoveryChunks(HAControl* control, bool compact) const;
+  void printDiscoveryReport() const;
 
+  // Writes are filtered by the control's policy. A held-back value is kept
+  // as pending (latest value wins) and sent by loop() once allowed; the call
+  // still returns true. loop() also sends the maxIntervalMs heartbeats.
   bool writeControl(HAControl* control, const String& value);
+  void setPublishPolicy(HAControl* control, const HAPublishPolicy& policy);
+  HAWriteStats getWriteStats() const;
+  void resetWriteStats();
   String readControl(HAControl* control);
 
+  // Windowed aggregation for sensors sampled faster than HA can be written.
+  // addSample() only folds the value into the window (O(1), no network, safe
+  // from any task) and loop() publishes once per window: the aggregate as
+  // the state, with min, max, mean and count (and with series, the mean of
+  // each eighth of the window) as attributes. The aggregator can be set or
+  // cleared while other tasks sample; samples folded into a window that is
+  // being replaced are dropped with it.
+  bool setAggregation(HAControl* control, unsigned long windowMs, HAAggregate aggregate = AGGREGATE_MEAN,
+                      uint8_t decimals = 2, bool series = false);
+  void clearAggregation(HAControl* control);
+  bool addSample(HAControl* control, float sample);
+
+  // Offline store-and-forward. State writes that can't reach HA are held in
+  // a ring of `capacity` entries (oldest dropped when full) and replayed by
+  // loop() once HA answers again, `batchSize` writes every `intervalMs`.
+  // While anything is held, writeControl() queues behind it without touching
+  // the network and returns true.
+  bool enableOfflineBuffer(int capacity = 32, OfflineMode mode = OFFLINE_LATEST);
+  void setOfflineReplay(int batchSize, unsigned long intervalMs);
+  // Mirrors the buffer to a file so it survives a reboot, and loads any
+  // writes left there by a previous run.
+  bool setOfflineStorage(fs::FS& fs, const char* path);
+  HAOfflineStats getOfflineStats() const;
+
+  // State batching. While enabled, writes that pass the publish policy are
+  // collected (latest value per control) and sent together as a single
+  // POST /api/events/<eventType>, whose data maps each control's state
+  // topic to its value. The batch goes out when the next value would take
+  // it past maxBytes, when its oldest value is maxDelayMs old (checked by
+  // loop()), or on flushStates(). StateBatch.yaml publishes the map to MQTT.
+  void enableStateBatch(const String& eventType = "hamqtt_states", size_t maxBytes = 1024,
+                        unsigned long maxDelayMs = 1000);
+  void disableStateBatch();
+  bool flushStates();
+
   bool isControlOnline(HAControl* control);
 
+  // Background worker. startWorker() runs a FreeRTOS task that owns the
+  // connection; the *Async calls queue a job and return at once. State and
+  // command jobs are served before discovery jobs. While the worker runs it
+  // also drives loop(), and loop() calls from other tasks return at once.
+  bool startWorker(uint32_t stackSize = 8192, UBaseType_t priority = 1, BaseType_t core = tskNO_AFFINITY);
+  void stopWorker();
+  bool writeControlAsync(HAControl* control, const String& value, HAJobCallback callback = nullptr, void* context = nullptr);
+  bool readControlAsync(HAControl* control, HAJobCallback callback, void* context = nullptr);
+  bool publishDiscoveryAsync(HAControl* control, HAJobCallback callback = nullptr, void* context = nullptr);
+  int queuedJobs() const;
+
+  // Request deadlines and retries. Connection errors and 429/502/503/504
+  // replies are retried up to maxRetries times (none by default), waiting
+  // a jittered baseDelayMs, 2x, 4x ... (at most maxDelayMs) in between.
+  void setTimeouts(uint32_t connectMs, uint32_t readMs);
+  void setRetryPolicy(uint8_t maxRetries, unsigned long baseDelayMs = 250, unsigned long maxDelayMs = 4000);
+
+  // After failureThreshold requests in a row fail without HA answering,
+  // the breaker opens and requests fail at once for openMs. Then one
+  // request (or a probe from loop()) is let through: success closes the
+  // breaker, failure opens it again. A threshold of 0, the default, turns
+  // it off.
+  void setCircuitBreaker(uint8_t failureThreshold, unsigned long openMs = 30000);
+  void onBreakerChange(HABreakerCallback callback);
+  HABreakerState breakerState() const;
+
+  HARequestStats getRequestStats() const;
+  void resetRequestStats();
+
+  // Gateway mode, for one ESP32 publishing for many downstream nodes.
+  // addNode() registers a node with its own device; adding the first one
+  // turns gateway mode on. Creation is then asynchronous, and writeControl()
+  // only queues the value. Each loop() pass gives the local controls and
+  // every node one network step (a creation stage or a write) in turn, so a
+  // busy node or one with many controls can't hold the others back. The
+  // connection, discovery batching and state batching are shared by all.
+  HANode* addNode(const String& uniqueId, const String& name, const String& manufacturer = "",
+                  const String& model = "", const String& swVersion = "");
+  HANode* findNode(const String& uniqueId) const;
+  HANode* getNode(int index) const;
+  int nodeCount() const;
+  void resetNodeStats();
+
+  // Publishes a summary of the stats every intervalMs from loop(), as
+  // diagnostic sensors on the default device: connect, state write and
+  // state read latency (90th percentile), failed calls and the free heap
+  // low-water mark. Call after setDevice().
+  bool enableDiagnostics(unsigned long intervalMs = 60000);
+
+#ifdef HAMQTT_FAULT_INJECTION
+  // Test builds only: each request is delayed by latencyMs, then dropped
+  // as a lost connection with lossPercent chance or answered with a 503
+  // with errorPercent chance, without reaching HA.
+  void setFaultInjection(uint8_t lossPercent, uint8_t errorPercent, unsigned long latencyMs);
+#endif
+
+  // Looks a control up by object id ("tank_temp") or entity id
+  // ("sensor.tank_temp"); nullptr when there is none.
+  HAControl* findControl(const String& id) const;
+  int controlCount() const;
+
+  // Push updates over HA's WebSocket API. Once started, loop() keeps a
+  // second connection to /api/websocket, authenticated with the begin()
+  // token, subscribed to the entities of online controls. States changed
+  // in HA (from the UI, an automation...) update currentState and are
+  // passed to the control's callback and then the global one. A dropped
+  // connection is reopened with backoff and every entity resubscribed.
+  bool startPush();
+  void stopPush();
+  bool pushConnected() const;
+  void onStateChange(HAControl* control, HAStateCallback callback);
+  void onStateChange(HAStateCallback callback);
+
+  // Local broker. While an MQTT broker on the LAN is reachable, discovery
+  // (retained), availability ("online", retained) and states are published
+  // to it directly on each control's own topics, and command topics are
+  // subscribed: a command is echoed to the state topic as the new state and
+  // passed on like a push update. When the broker can't be reached, the
+  // same calls go through the begin() transport instead and loop() keeps
+  // reconnecting with backoff. Aggregated windows (for their attributes)
+  // and every query (existence checks, verification, readControl) still
+  // use the REST API.
+  bool setLocalBroker(const String& host, uint16_t port = 1883, const String& username = "",
+                      const String& password = "");
+  void clearLocalBroker();
+  bool localConnected() const;
+
+  // Fetches the state of every registered control in a single request.
+  // Updates currentState, lastChanged and isOnline in place and sets each
+  // control's changed flag. Returns the number of changed controls, or -1.
+  int refreshAll();
+
   void setDevice(const String& uniqueId, const String& name,
                  const String& manufacturer = "", const String& model = "",
                  const String& swVersion = "");
@@ -98,18 +694,306 @@ private:
   String _token;
   HADevice _defaultDevice;
 
-  static const int MAX_CONTROLS = 50;
-  HAControl* _controls[MAX_CONTROLS];
+  // Long-lived keep-alive connection shared by all REST calls
+  String _host;
+  String _basePath;
+  uint16_t _port;
+  bool _secure;
+  // Owned here and declared before _https, whose destructor still calls
+  // stop() on the client it was given. _client points at the one in use.
+  WiFiClient _plainClient;
+  WiFiClientSecure _secureClient;
+  WiFiClient* _client;
+  HTTPClient _https;
+
+  // Controls are carved out of fixed blocks that never move, so pointers
+  // handed out stay valid while the registry grows. _controls indexes them
+  // in creation order; _scratch is working space of the same size.
+  static const int CONTROL_BLOCK = 8;
+  struct ControlBlock {
+    HAControl slots[CONTROL_BLOCK];
+    ControlBlock* next;
+  };
+  ControlBlock* _blocks;
+  int _blockUsed;
+  HAControl** _controls;
+  HAControl** _scratch;
   int _controlCount;
+  int _controlCapacity;
+
+  // input_text states are limited to 255 characters; helper 6 of each
+  // bank is the trigger
+  static const size_t MAX_CHUNK = 255;
+  static const int MAX_DATA_BUFFERS = 5;
+  static const int TRIGGER_BUFFER = 6;
+  size_t _chunkSize;
+  int _dataBuffers;
+  bool _geometryKnown;
+
+  // Discovery frames and request bodies are serialized into these fixed
+  // buffers. A body holds one escaped chunk, where a control character can
+  // take up to six bytes.
+  static const size_t BATCH_PREFIX = 10;
+  char _frameBuffer[MAX_CHUNK * MAX_DATA_BUFFERS + 1];
+  char _bodyBuffer[MAX_CHUNK * 6 + 16];
+
+  bool _stateBatch;
+  String _stateBatchEndpoint;
+  size_t _stateBatchLimit;
+  unsigned long _stateBatchDelay;
+  size_t _stateBatchBytes;
+  int _stateBatchCount;
+  unsigned long _stateBatchStartedAt;
+
+  static const int MAX_HELPER_BANKS = 4;
+  static const unsigned long ACK_TIMEOUT_MS = 10000;
+  static const unsigned long ACK_RETRIGGER_MS = 2000;
+  static const unsigned long ACK_POLL_MS = 100;
+  int _helperBanks;
+  int _nextBank;
+  uint16_t _bankSeq[MAX_HELPER_BANKS];  // frame in each bank, 0 when free
+  uint8_t _bankChunks[MAX_HELPER_BANKS];
+  unsigned long _bankSentAt[MAX_HELPER_BANKS];
+  unsigned long _bankPolledAt[MAX_HELPER_BANKS];
+  bool _bankRetriggered[MAX_HELPER_BANKS];
+  int _bankCursor;   // bank checkHelperBanks() looks at first
+  bool _ackPolled;   // this loop() has read a trigger helper already
+  bool _helpersBusy; // the last frame found its bank unacknowledged and wasn't sent
+  bool _batchDue;    // a flushed batch is waiting in loop() for its bank
+  uint16_t _lastSeq;
+  HAHelperStats _helperStats;
+
+  HATransport _transport;
+  String _discoveryEndpoint;
+
+  bool _batching;
+  size_t _batchLength;
+  int _batchCount;
+  bool _compactDiscovery;
+
+  static const unsigned long SETTLE_MS = 3000;
+  static const unsigned long VERIFY_TIMEOUT_MS = 10000;
+  static const unsigned long VERIFY_INTERVAL_MS = 500;
+  bool _asyncCreation;
+  unsigned long _loopBudget;
+  unsigned long _lastVerifyPoll;
+  int _loopCursor;
+  HAControlCallback _statusCallback;
+
+  // Offline ring; entries are keyed by entity id so they can outlive the
+  // controls (e.g. when loaded from storage before the controls exist)
+  struct OfflineEntry {
+    String entityId;
+    String value;
+  };
+  OfflineEntry* _offline;
+  int _offlineCapacity;
+  int _offlineHead;
+  int _offlineCount;
+  OfflineMode _offlineMode;
+  int _replayBatch;
+  unsigned long _replayInterval;
+  unsigned long _lastReplay;
+  HAOfflineStats _offlineStats;
+  fs::FS* _offlineFs;
+  String _offlinePath;
+  int _offlineFileLines;    // records in the file, replaced ones included
+  bool _offlineDirty;       // the file still lists replayed writes
+  unsigned long _offlineSavedAt;
+  static const unsigned long OFFLINE_SAVE_MS = 10000;
+
+  HARequestStats _requestStats;
+
+  uint32_t _connectTimeout;
+  uint16_t _readTimeout;
+  uint8_t _maxRetries;
+  unsigned long _retryBaseMs;
+  unsigned long _retryMaxMs;
+
+  // Returned by sendRequest() without a request while the breaker is open
+  static const int CIRCUIT_OPEN = -100;
+  HABreakerState _breakerState;
+  uint8_t _breakerThreshold;
+  uint8_t _breakerFailures;
+  unsigned long _breakerOpenMs;
+  unsigned long _breakerOpenedAt;
+  HABreakerCallback _breakerCallback;
+
+  static const int DIAGNOSTIC_SENSORS = 5;
+  HAControl* _diagnostics[DIAGNOSTIC_SENSORS];
+  unsigned long _diagnosticInterval;
+  unsigned long _lastDiagnostics;
+#ifdef HAMQTT_FAULT_INJECTION
+  uint8_t _faultLoss;
+  uint8_t _faultError;
+  unsigned long _faultLatency;
+#endif
+
+  // Push connection (see startPush)
+  enum PushState {
+    PUSH_OFF,
+    PUSH_DISCONNECTED,
+    PUSH_AUTH,
+    PUSH_READY
+  };
+  static const unsigned long PUSH_RETRY_MIN_MS = 1000;
+  static const unsigned long PUSH_RETRY_MAX_MS = 60000;
+  static const unsigned long PUSH_PING_MS = 30000;
+  HAWebSocket _push;
+  HAPushReader _pushReader;
+  PushState _pushState;
+  int _pushMessageId;
+  unsigned long _pushRetryAt;
+  unsigned long _pushSubscribeAt;  // no new subscription before this, after one was refused
+  unsigned long _pushBackoff;
+  unsigned long _lastPushPing;
+  HAStateCallback _stateCallback;
+
+  // Local broker connection (see setLocalBroker)
+  static const unsigned long LOCAL_RETRY_MIN_MS = 1000;
+  static const unsigned long LOCAL_RETRY_MAX_MS = 60000;
+  static const uint16_t LOCAL_KEEPALIVE_S = 30;
+  HAMqttClient _local;
+  String _brokerHost;
+  uint16_t _brokerPort;
+  String _brokerUser;
+  String _brokerPassword;
+  bool _localReady;
+  unsigned long _localRetryAt;
+  unsigned long _localBackoff;
+
+  Preferences _prefs;
+  bool _fingerprintCache;
+
+  HANode** _nodes;
+  int _nodeCount;
+  int _nodeCapacity;
+  int _nodeCursor;     // lane served first by the next loop(); 0 is _localNode
+  HANode _localNode;   // controls on the default device or a plain HADevice
+
+  bool _sleepMode;
+  unsigned long _wokeAt;
+  uint32_t _address;  // resolved server address, 0 until known
+  HASleepStats _sleepStats;
+
+  // Worker queue: one ring per priority, guarded by _queueLock. _netLock
+  // serializes everything that uses the connection and the shared buffers.
+  static const int JOB_QUEUE_SIZE = 16;
+  struct JobRing {
+    HAJob jobs[JOB_QUEUE_SIZE];
+    int head;
+    int count;
+  };
+  JobRing _highQueue;
+  JobRing _lowQueue;
+  SemaphoreHandle_t _queueLock;
+  SemaphoreHandle_t _netLock;
+  SemaphoreHandle_t _workerDone;  // given by the worker as it exits
+  // Held only while a control's aggregator is swapped or sampled into, so
+  // addSample() never waits on a request in flight
+  portMUX_TYPE _sampleMux;
+  TaskHandle_t _workerTask;
+  volatile bool _workerRunning;
+
+  static void workerTask(void* arg);
+  bool enqueueJob(JobType type, HAControl* control, const String& value, HAJobCallback callback, void* context);
+  bool takeJob(HAJob& job);
+  void runJob(HAJob& job);
+  void lockNet() const;
+  void unlockNet() const;
+  void recordOperation(HAOperation op, unsigned long startedAt, bool success);
+  void servicePush();
+  void handlePushMessage();
+  void subscribePush();
+  bool sendPush(HAJsonWriter& writer);
+  void dispatchPush(const char* entityId, const char* state);
+  friend class HAPushReader;
+  void serviceLocal();
+  bool connectLocal();
+  void dropLocal();
+  bool publishLocal(const char* topic, const char* payload, size_t length, bool retain);
+  bool publishLocalState(HAControl* control, const String& value);
+  bool sendLocalDiscovery(HAControl* control);
+  void announceLocal(HAControl* control);
+  void dispatchCommand(const char* topic, const char* payload, size_t length);
+  void publishDiagnostics();
 
   String getAuthHeader() const;
+  bool openConnection();
+  bool connectClient();
+  void closeConnection();
+  size_t discardResponse();
+  bool allowRequest();
+  void recordBreakerResult(int httpCode);
+  void setBreakerState(HABreakerState state);
+  void probeBreaker();
+  // Test builds (HAMQTT_FAULT_INJECTION): true when the request is dropped
+  // or failed instead of sent, with httpCode set to the failure
+  bool injectFault(int& httpCode);
+  int sendRequest(const char* method, const String& endpoint, const char* body, size_t length,
+                  String* response, Stream* sink);
   bool postToHA(const String& endpoint, const String& payload);
-  bool getFromHA(const String& endpoint, String& response);
-  bool postHelperBuffer(int bufferIndex, const String& content);
+  bool postToHA(const String& endpoint, const char* body, size_t length);
+  bool postToHA(const String& endpoint, const String& payload, String& response);
+  bool getFromHA(const String& endpoint, Stream* sink);
+  bool postHelperBuffer(int bank, int bufferIndex, const char* content, size_t length);
+  // One read of the bank's trigger helper, at most every ACK_POLL_MS;
+  // true once the bank is free to be rewritten
+  bool bankDue(int bank) const;
+  bool pollBank(int bank);
+  bool waitForBank(int bank, unsigned long timeoutMs);
+  bool helpersReady();
+  void checkHelperBanks();
+  bool sendHelperFrame(const char* frame, size_t len);
+  size_t frameCapacity() const;
+  void writeEnvelope(HAJsonWriter& writer, HAControl* control, bool compact) const;
+  size_t envelopeLength(HAControl* control, bool compact) const;
   bool publishDiscovery(HAControl* control);
+  HAControl* deferCreation(HAControl* control, CreationStage stage);
+  bool writeDiscoveryFrame(HAControl* control);
+  bool sendServiceDiscovery(HAControl* control);
+  bool batchingFrames() const;
+  bool sendBatchFrame();
+  HAControl* allocControl();
+  void setControlOptions(HAControl* control, const HAControlOptions& options);
+  void releaseControl(HAControl* control);
+  void addControl(HAControl* control);
+  HAControl* registerControl(HAControl* control);
+  HAControl* createControl(HAControl* control);
+  bool updateControl(HAControl* control, const String& value);
+  bool advanceCreation(HAControl* control);
+  bool serviceWrites(HAControl* control);
+  bool isInsignificant(HAControl* control, const String& value) const;
+  bool serviceAggregation(HAControl* control);
+  void attachToNode(HAControl* control);
+  void serviceNodes(unsigned long startTime);
+  bool serviceNode(HANode* node);
+  void recordDelivery(HAControl* control, unsigned long queuedAt);
+  bool sendState(HAControl* control, const String& value, const HASampleWindow* window = nullptr);
+  int postState(const String& entityId, const String& value, const HASampleWindow* window = nullptr,
+                const HAAggregator* aggregator = nullptr);
+  void queueState(HAControl* control, const String& value);
+  bool sendStateBatch();
+  void storeOffline(const String& entityId, const String& value);
+  void holdOffline(const String& entityId, const String& value);
+  void replayOffline();
+  int replayOfflineEntry();
+  int replayOfflineBatch();
+  void finishReplay(HAControl* control, const String& value);
+  void popOffline();
+  void appendOffline(const String& entityId, const String& value);
+  void saveOffline();
+  void loadOffline(fs::FS& fs);
+  bool fingerprintMatches(HAControl* control);
+  void storeFingerprint(HAControl* control);
+  bool retainedMatches(HAControl* control);
+  void saveRetained();
+  void verifyPendingControls();
+  void setControlStatus(HAControl* control, ControlStatus status);
+  // Returns how many of the controls changed, or -1
+  int renderEntityStates(HAControl** controls, int count);
   bool controlExists(const String& entityId);
   bool waitForControlCreation(const String& entityId, int timeoutSeconds = 10);
-  String extractJsonValue(const String& json, const String& key);
 };
 
 #endif
\ No newline at end of file
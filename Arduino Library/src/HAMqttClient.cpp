@@ -0,0 +1,244 @@
+#include "HAMqttClient.h"
+
+HAMqttClient::HAMqttClient() {
+  _lastReceiveAt = 0;
+  _lastSendAt = 0;
+  _keepAliveMs = 0;
+  _packetId = 0;
+  _topic = "";
+  _payload = "";
+  _payloadLength = 0;
+  resetPacket();
+}
+
+void HAMqttClient::resetPacket() {
+  _packetState = PACKET_HEADER;
+  _header = 0;
+  _remaining = 0;
+  _multiplier = 1;
+  _bodyLength = 0;
+  _oversized = false;
+}
+
+size_t HAMqttClient::putLength(uint8_t* out, size_t length) {
+  out[0] = (length >> 8) & 0xFF;
+  out[1] = length & 0xFF;
+  return 2;
+}
+
+bool HAMqttClient::connect(const String& host, uint16_t port, const String& clientId, const String& username,
+                           const String& password, uint16_t keepAliveSec, uint32_t timeoutMs) {
+  close();
+
+  if (!_client.connect(host.c_str(), port, timeoutMs)) {
+    Serial.printf("HAMQTTDiscovery: Broker connection to %s:%u failed\n", host.c_str(), port);
+    return false;
+  }
+  _client.setNoDelay(true);
+
+  // Variable header: protocol name, level 4 (3.1.1), flags and keep-alive.
+  // A clean session is asked for, since subscriptions are renewed anyway.
+  uint8_t head[10] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02,
+                       (uint8_t)(keepAliveSec >> 8), (uint8_t)(keepAliveSec & 0xFF) };
+  if (username.length()) head[7] |= 0x80;
+  if (password.length()) head[7] |= 0x40;
+
+  uint8_t prefixes[3][2];
+  const uint8_t* parts[7] = { head };
+  size_t lengths[7] = { sizeof(head) };
+  int count = 1;
+  const String* fields[3] = { &clientId, &username, &password };
+  for (int i = 0; i < 3; i++) {
+    if (i > 0 && !fields[i]->length()) continue;
+    parts[count] = prefixes[i];
+    lengths[count++] = putLength(prefixes[i], fields[i]->length());
+    parts[count] = (const uint8_t*)fields[i]->c_str();
+    lengths[count++] = fields[i]->length();
+  }
+  if (!sendPacket(PACKET_CONNECT, parts, lengths, count)) {
+    return false;
+  }
+
+  // CONNACK is always four bytes: type, length 2, flags, return code
+  uint8_t ack[4];
+  size_t received = 0;
+  unsigned long startTime = millis();
+  while (received < sizeof(ack) && millis() - startTime < timeoutMs) {
+    if (_client.available() <= 0) {
+      if (!_client.connected()) break;
+      delay(1);
+      continue;
+    }
+    int c = _client.read();
+    if (c >= 0) ack[received++] = (uint8_t)c;
+  }
+  if (received < sizeof(ack) || ack[0] != PACKET_CONNACK || ack[3] != 0) {
+    Serial.printf("HAMQTTDiscovery: Broker refused connection (%d)\n", received == sizeof(ack) ? ack[3] : -1);
+    _client.stop();
+    return false;
+  }
+
+  resetPacket();
+  _keepAliveMs = (unsigned long)keepAliveSec * 1000;
+  _lastReceiveAt = millis();
+  return true;
+}
+
+void HAMqttClient::close() {
+  if (_client.connected()) {
+    sendPacket(PACKET_DISCONNECT, nullptr, nullptr, 0);
+    _client.stop();
+  }
+  resetPacket();
+}
+
+bool HAMqttClient::connected() {
+  return _client.connected();
+}
+
+bool HAMqttClient::publish(const char* topic, const char* payload, size_t length, bool retain) {
+  size_t topicLength = strlen(topic);
+  uint8_t prefix[2];
+  const uint8_t* parts[3] = { prefix, (const uint8_t*)topic, (const uint8_t*)payload };
+  size_t lengths[3] = { putLength(prefix, topicLength), topicLength, length };
+  return sendPacket(PACKET_PUBLISH | (retain ? 0x01 : 0x00), parts, lengths, 3);
+}
+
+bool HAMqttClient::subscribe(const char* topic) {
+  // Packet ids must be non-zero; the SUBACK isn't waited for
+  if (++_packetId == 0) _packetId = 1;
+  size_t topicLength = strlen(topic);
+  uint8_t head[4] = { (uint8_t)(_packetId >> 8), (uint8_t)(_packetId & 0xFF) };
+  putLength(head + 2, topicLength);
+  uint8_t qos = 0;
+  const uint8_t* parts[3] = { head, (const uint8_t*)topic, &qos };
+  size_t lengths[3] = { sizeof(head), topicLength, 1 };
+  return sendPacket(PACKET_SUBSCRIBE, parts, lengths, 3);
+}
+
+bool HAMqttClient::sendPacket(uint8_t header, const uint8_t* const* parts, const size_t* lengths, int count) {
+  if (!_client.connected()) return false;
+
+  size_t remaining = 0;
+  for (int i = 0; i < count; i++) {
+    remaining += lengths[i];
+  }
+
+  // Fixed header and body share one buffer so a small packet goes out as
+  // a single segment
+  uint8_t chunk[256];
+  size_t used = 0;
+  chunk[used++] = header;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    chunk[used++] = remaining ? digit | 0x80 : digit;
+  } while (remaining);
+
+  for (int i = 0; i < count; i++) {
+    size_t offset = 0;
+    while (offset < lengths[i]) {
+      size_t take = min(lengths[i] - offset, sizeof(chunk) - used);
+      memcpy(chunk + used, parts[i] + offset, take);
+      used += take;
+      offset += take;
+      if (used == sizeof(chunk)) {
+        if (_client.write(chunk, used) != used) return false;
+        used = 0;
+      }
+    }
+  }
+  if (used && _client.write(chunk, used) != used) return false;
+  _lastSendAt = millis();
+  return true;
+}
+
+bool HAMqttClient::poll(size_t maxBytes) {
+  uint8_t skip[64];
+  while (maxBytes > 0) {
+    int available = _client.available();
+    if (available <= 0) return false;
+    _lastReceiveAt = millis();
+
+    if (_packetState == PACKET_BODY) {
+      size_t want = min((size_t)available, min(maxBytes, (size_t)_remaining));
+      uint8_t* target = _oversized ? skip : _body + _bodyLength;
+      if (_oversized && want > sizeof(skip)) want = sizeof(skip);
+      int count = _client.read(target, want);
+      if (count <= 0) return false;
+      maxBytes -= count;
+      _remaining -= count;
+      if (!_oversized) _bodyLength += count;
+    } else {
+      int c = _client.read();
+      if (c < 0) return false;
+      maxBytes--;
+
+      if (_packetState == PACKET_HEADER) {
+        _header = (uint8_t)c;
+        _remaining = 0;
+        _multiplier = 1;
+        _packetState = PACKET_LENGTH;
+        continue;
+      }
+
+      _remaining += (c & 0x7F) * _multiplier;
+      _multiplier *= 128;
+      if (c & 0x80) {
+        if (_multiplier > 128UL * 128 * 128) {
+          // More than four length bytes: the stream can't be trusted
+          _client.stop();
+          resetPacket();
+          return false;
+        }
+        continue;
+      }
+      _packetState = PACKET_BODY;
+      _bodyLength = 0;
+      _oversized = _remaining > PACKET_SIZE;
+    }
+
+    if (_packetState == PACKET_BODY && _remaining == 0 && finishPacket()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HAMqttClient::finishPacket() {
+  uint8_t type = _header & 0xF0;
+  uint8_t qos = (_header >> 1) & 0x03;
+  bool oversized = _oversized;
+  size_t length = _bodyLength;
+  resetPacket();
+
+  // CONNACK, SUBACK and PINGRESP only matter as proof of life
+  if (type != PACKET_PUBLISH) return false;
+  if (oversized) {
+    Serial.println("HAMQTTDiscovery: Broker message too large, skipped");
+    return false;
+  }
+  if (length < 2) return false;
+
+  size_t topicLength = ((size_t)_body[0] << 8) | _body[1];
+  // Subscriptions are QoS 0, but a QoS 1 or 2 publish carries a packet id
+  size_t payloadStart = 2 + topicLength + (qos ? 2 : 0);
+  if (payloadStart > length) return false;
+
+  // The topic is moved over its length prefix so both can be terminated
+  memmove(_body, _body + 2, topicLength);
+  _body[topicLength] = '\0';
+  _body[length] = '\0';
+  _topic = (const char*)_body;
+  _payload = (const char*)_body + payloadStart;
+  _payloadLength = length - payloadStart;
+  return true;
+}
+
+bool HAMqttClient::keepAlive() {
+  if (!_keepAliveMs) return true;
+  if (millis() - _lastSendAt >= _keepAliveMs / 2) {
+    sendPacket(PACKET_PINGREQ, nullptr, nullptr, 0);
+  }
+  return millis() - _lastReceiveAt < _keepAliveMs + _keepAliveMs / 2;
+}
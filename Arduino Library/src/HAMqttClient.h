@@ -0,0 +1,78 @@
+#ifndef HAMQTTCLIENT_H
+#define HAMQTTCLIENT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+// Minimal MQTT 3.1.1 client for a broker on the local network. Only what
+// the library needs is implemented: QoS 0 publish (retained or not),
+// QoS 0 subscriptions, keep-alive pings and incoming publishes. An incoming
+// message is kept in a fixed buffer; commands are short, so a longer one
+// is skipped rather than allocated for.
+class HAMqttClient {
+public:
+  HAMqttClient();
+
+  bool connect(const String& host, uint16_t port, const String& clientId, const String& username,
+               const String& password, uint16_t keepAliveSec, uint32_t timeoutMs);
+  void close();
+  bool connected();
+
+  bool publish(const char* topic, const char* payload, size_t length, bool retain);
+  bool subscribe(const char* topic);
+
+  // Reads whatever has arrived, up to maxBytes. Returns true as soon as a
+  // publish has been received; topic() and payload() hold it until the
+  // next poll().
+  bool poll(size_t maxBytes = 1024);
+  const char* topic() const { return _topic; }
+  const char* payload() const { return _payload; }
+  size_t payloadLength() const { return _payloadLength; }
+
+  // Sends a ping when the keep-alive interval is half over. Returns false
+  // once the broker has been silent for the whole interval and a half.
+  bool keepAlive();
+
+  unsigned long lastReceiveAt() const { return _lastReceiveAt; }
+
+private:
+  enum PacketState {
+    PACKET_HEADER,
+    PACKET_LENGTH,
+    PACKET_BODY
+  };
+
+  static const uint8_t PACKET_CONNECT = 0x10;
+  static const uint8_t PACKET_CONNACK = 0x20;
+  static const uint8_t PACKET_PUBLISH = 0x30;
+  static const uint8_t PACKET_SUBSCRIBE = 0x82;
+  static const uint8_t PACKET_PINGREQ = 0xC0;
+  static const uint8_t PACKET_DISCONNECT = 0xE0;
+  static const size_t PACKET_SIZE = 384;
+
+  WiFiClient _client;
+  unsigned long _lastReceiveAt;
+  unsigned long _lastSendAt;
+  unsigned long _keepAliveMs;
+  uint16_t _packetId;
+
+  PacketState _packetState;
+  uint8_t _header;
+  uint32_t _remaining;
+  uint32_t _multiplier;
+  size_t _bodyLength;
+  bool _oversized;
+  uint8_t _body[PACKET_SIZE + 1];
+
+  const char* _topic;
+  const char* _payload;
+  size_t _payloadLength;
+
+  void resetPacket();
+  bool finishPacket();
+  // Sends the fixed header and then the parts, in order, as the body
+  bool sendPacket(uint8_t header, const uint8_t* const* parts, const size_t* lengths, int count);
+  static size_t putLength(uint8_t* out, size_t length);
+};
+
+#endif
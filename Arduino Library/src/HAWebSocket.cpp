@@ -0,0 +1,277 @@
+#include "HAWebSocket.h"
+
+static const uint8_t OP_PONG = 0xA;
+
+static void base64Encode(const uint8_t* data, size_t length, char* out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t triple = (uint32_t)data[i] << 16;
+    if (i + 1 < length) triple |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length) triple |= data[i + 2];
+    out[o++] = alphabet[(triple >> 18) & 0x3F];
+    out[o++] = alphabet[(triple >> 12) & 0x3F];
+    out[o++] = i + 1 < length ? alphabet[(triple >> 6) & 0x3F] : '=';
+    out[o++] = i + 2 < length ? alphabet[triple & 0x3F] : '=';
+  }
+  out[o] = '\0';
+}
+
+HAWebSocket::HAWebSocket() {
+  _client = nullptr;
+  _secure = true;
+  _lastReceiveAt = 0;
+  _messageOpcode = OP_TEXT;
+  _controlLength = 0;
+  resetFrame();
+}
+
+HAWebSocket::~HAWebSocket() {
+  close();
+  delete _client;
+}
+
+void HAWebSocket::resetFrame() {
+  _frameState = FRAME_HEADER;
+  _headerCount = 0;
+  _lengthSize = 0;
+  _opcode = 0;
+  _final = false;
+  _masked = false;
+  _remaining = 0;
+  _payloadOffset = 0;
+}
+
+bool HAWebSocket::connect(const String& host, uint16_t port, const String& path, bool secure, uint32_t timeoutMs) {
+  close();
+
+  if (!_client || _secure != secure) {
+    delete _client;
+    if (secure) {
+      WiFiClientSecure* secureClient = new WiFiClientSecure();
+      secureClient->setInsecure();
+      _client = secureClient;
+    } else {
+      _client = new WiFiClient();
+    }
+    _secure = secure;
+  }
+
+  if (secure) {
+    ((WiFiClientSecure*)_client)->setHandshakeTimeout((timeoutMs + 999) / 1000);
+  }
+  if (!_client->connect(host.c_str(), port, timeoutMs)) {
+    Serial.printf("HAMQTTDiscovery: WebSocket connection to %s:%u failed\n", host.c_str(), port);
+    return false;
+  }
+
+  uint8_t nonce[16];
+  for (size_t i = 0; i < sizeof(nonce); i++) {
+    nonce[i] = (uint8_t)esp_random();
+  }
+  char key[25];
+  base64Encode(nonce, sizeof(nonce), key);
+
+  String request;
+  request.reserve(160 + host.length() + path.length());
+  request += "GET ";
+  request += path;
+  request += " HTTP/1.1\r\nHost: ";
+  request += host;
+  request += "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: ";
+  request += key;
+  request += "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+  _client->print(request);
+
+  // Sec-WebSocket-Accept isn't verified: it only proves the server speaks
+  // WebSocket, which a 101 from HA's endpoint already does
+  char line[128];
+  if (!readLine(line, sizeof(line), timeoutMs) || strncmp(line, "HTTP/1.1 101", 12) != 0) {
+    Serial.printf("HAMQTTDiscovery: WebSocket upgrade refused: %s\n", line);
+    _client->stop();
+    return false;
+  }
+  do {
+    if (!readLine(line, sizeof(line), timeoutMs)) {
+      _client->stop();
+      return false;
+    }
+  } while (line[0]);
+
+  resetFrame();
+  _messageOpcode = OP_TEXT;
+  _lastReceiveAt = millis();
+  return true;
+}
+
+bool HAWebSocket::readLine(char* line, size_t size, uint32_t timeoutMs) {
+  size_t length = 0;
+  line[0] = '\0';
+  unsigned long startTime = millis();
+  while (millis() - startTime < timeoutMs) {
+    if (_client->available() <= 0) {
+      if (!_client->connected()) return false;
+      delay(1);
+      continue;
+    }
+    int c = _client->read();
+    if (c == '\n') {
+      line[length] = '\0';
+      return true;
+    }
+    if (c != '\r' && c >= 0 && length + 1 < size) {
+      line[length++] = (char)c;
+      line[length] = '\0';
+    }
+  }
+  return false;
+}
+
+void HAWebSocket::close() {
+  if (_client && _client->connected()) {
+    uint8_t normalClosure[2] = { 0x03, 0xE8 };  // 1000
+    sendFrame(OP_CLOSE, normalClosure, sizeof(normalClosure));
+    _client->stop();
+  }
+  resetFrame();
+}
+
+bool HAWebSocket::connected() {
+  return _client && _client->connected();
+}
+
+bool HAWebSocket::sendText(const char* data, size_t length) {
+  return sendFrame(OP_TEXT, (const uint8_t*)data, length);
+}
+
+bool HAWebSocket::sendFrame(uint8_t opcode, const uint8_t* data, size_t length) {
+  if (!connected()) return false;
+
+  // Header and masked payload share one buffer so small messages go out
+  // as a single TLS record
+  uint8_t chunk[256];
+  size_t used = 0;
+  chunk[used++] = 0x80 | opcode;
+  if (length < 126) {
+    chunk[used++] = 0x80 | length;
+  } else if (length < 65536) {
+    chunk[used++] = 0x80 | 126;
+    chunk[used++] = (length >> 8) & 0xFF;
+    chunk[used++] = length & 0xFF;
+  } else {
+    chunk[used++] = 0x80 | 127;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      chunk[used++] = ((uint64_t)length >> shift) & 0xFF;
+    }
+  }
+
+  // Client frames must be masked
+  uint32_t maskWord = esp_random();
+  uint8_t mask[4];
+  memcpy(mask, &maskWord, sizeof(mask));
+  memcpy(chunk + used, mask, sizeof(mask));
+  used += sizeof(mask);
+
+  size_t offset = 0;
+  do {
+    while (used < sizeof(chunk) && offset < length) {
+      chunk[used++] = data[offset] ^ mask[offset & 3];
+      offset++;
+    }
+    if (_client->write(chunk, used) != used) return false;
+    used = 0;
+  } while (offset < length);
+  return true;
+}
+
+bool HAWebSocket::poll(Stream& sink, size_t maxBytes) {
+  if (!_client) return false;
+
+  uint8_t chunk[64];
+  while (maxBytes > 0) {
+    int available = _client->available();
+    if (available <= 0) return false;
+    _lastReceiveAt = millis();
+
+    if (_frameState == FRAME_PAYLOAD) {
+      size_t want = min((size_t)available, min(maxBytes, sizeof(chunk)));
+      if (want > _remaining) want = _remaining;
+      int count = _client->read(chunk, want);
+      if (count <= 0) return false;
+      maxBytes -= count;
+
+      for (int i = 0; i < count; i++) {
+        if (_masked) chunk[i] ^= _mask[(_payloadOffset + i) & 3];
+        if (_opcode >= OP_CLOSE && _controlLength < CONTROL_SIZE) {
+          _control[_controlLength++] = chunk[i];
+        }
+      }
+      if (_opcode < OP_CLOSE && _messageOpcode == OP_TEXT) {
+        sink.write(chunk, count);
+      }
+      _payloadOffset += count;
+      _remaining -= count;
+    } else {
+      int c = _client->read();
+      if (c < 0) return false;
+      maxBytes--;
+
+      if (_frameState == FRAME_HEADER) {
+        _header[_headerCount++] = (uint8_t)c;
+        if (_headerCount == 2) {
+          _final = _header[0] & 0x80;
+          _opcode = _header[0] & 0x0F;
+          _masked = _header[1] & 0x80;
+          uint8_t length = _header[1] & 0x7F;
+          _lengthSize = length == 127 ? 8 : (length == 126 ? 2 : 0);
+          _remaining = _lengthSize ? 0 : length;
+          _headerCount = 0;
+          _controlLength = 0;
+          // Continuation frames keep the opcode of the message they extend
+          if (_opcode != OP_CONTINUATION && _opcode < OP_CLOSE) {
+            _messageOpcode = _opcode;
+          }
+          _frameState = _lengthSize ? FRAME_LENGTH : (_masked ? FRAME_MASK : FRAME_PAYLOAD);
+        }
+      } else if (_frameState == FRAME_LENGTH) {
+        _remaining = (_remaining << 8) | (uint8_t)c;
+        if (++_headerCount == _lengthSize) {
+          _headerCount = 0;
+          _frameState = _masked ? FRAME_MASK : FRAME_PAYLOAD;
+        }
+      } else {
+        _mask[_headerCount++] = (uint8_t)c;
+        if (_headerCount == 4) {
+          _headerCount = 0;
+          _frameState = FRAME_PAYLOAD;
+        }
+      }
+    }
+
+    if (_frameState == FRAME_PAYLOAD && _remaining == 0 && finishFrame()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HAWebSocket::finishFrame() {
+  uint8_t opcode = _opcode;
+  bool final = _final;
+  resetFrame();
+
+  if (opcode == OP_PING) {
+    sendFrame(OP_PONG, _control, _controlLength);
+    return false;
+  }
+  if (opcode == OP_CLOSE) {
+    // Echo the status code and drop the connection
+    sendFrame(OP_CLOSE, _control, _controlLength < 2 ? _controlLength : 2);
+    _client->stop();
+    return false;
+  }
+  if (opcode >= OP_CLOSE) {
+    return false;
+  }
+  return final && _messageOpcode == OP_TEXT;
+}
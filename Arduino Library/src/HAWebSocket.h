@@ -0,0 +1,70 @@
+#ifndef HAWEBSOCKET_H
+#define HAWEBSOCKET_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+
+// Minimal RFC 6455 client for the Home Assistant WebSocket API. Only what
+// HA needs is implemented: text messages out, text messages in, ping/pong
+// and close. Incoming message payloads are streamed into a sink (usually an
+// HAJsonReader) as they arrive, so a message of any size is received with
+// a fixed amount of memory.
+class HAWebSocket {
+public:
+  HAWebSocket();
+  ~HAWebSocket();
+
+  bool connect(const String& host, uint16_t port, const String& path, bool secure, uint32_t timeoutMs);
+  void close();
+  bool connected();
+
+  // Sends one text message as a single masked frame
+  bool sendText(const char* data, size_t length);
+
+  // Reads whatever has arrived, up to maxBytes, feeding text payloads into
+  // sink. Returns true as soon as a complete message has been delivered, so
+  // the caller can act on it and reset the sink before polling again.
+  bool poll(Stream& sink, size_t maxBytes = 1024);
+
+  unsigned long lastReceiveAt() const { return _lastReceiveAt; }
+
+private:
+  enum FrameState {
+    FRAME_HEADER,
+    FRAME_LENGTH,
+    FRAME_MASK,
+    FRAME_PAYLOAD
+  };
+
+  static const uint8_t OP_CONTINUATION = 0x0;
+  static const uint8_t OP_TEXT = 0x1;
+  static const uint8_t OP_CLOSE = 0x8;
+  static const uint8_t OP_PING = 0x9;
+  static const size_t CONTROL_SIZE = 125;
+
+  WiFiClient* _client;
+  bool _secure;
+  unsigned long _lastReceiveAt;
+
+  FrameState _frameState;
+  uint8_t _header[2];
+  int _headerCount;
+  int _lengthSize;
+  uint8_t _opcode;
+  uint8_t _messageOpcode;
+  bool _final;
+  bool _masked;
+  uint8_t _mask[4];
+  uint64_t _remaining;
+  uint64_t _payloadOffset;
+  uint8_t _control[CONTROL_SIZE];
+  size_t _controlLength;
+
+  bool readLine(char* line, size_t size, uint32_t timeoutMs);
+  bool sendFrame(uint8_t opcode, const uint8_t* data, size_t length);
+  void resetFrame();
+  bool finishFrame();
+};
+
+#endif
@@ -194,11 +194,12 @@ bool postStateToHA(const String& entityId, const String& stateJson, const String
 
   String url = String(serverName) + "/api/states/" + entityId;
 
-  WiFiClientSecure* client = new WiFiClientSecure();
-  client->setInsecure();
+  // Declared before the HTTPClient, whose destructor still stops it
+  WiFiClientSecure client;
+  client.setInsecure();
 
   HTTPClient https;
-  https.begin(*client, url);
+  https.begin(client, url);
   https.addHeader("Authorization", authHeader());
   https.addHeader("Content-Type", "application/json");
 
@@ -211,7 +212,6 @@ bool postStateToHA(const String& entityId, const String& stateJson, const String
     Serial.printf("POST error %s → %s\n", url.c_str(), https.errorToString(httpCode).c_str());
   }
   https.end();
-  delete client;
   return httpCode >= 200 && httpCode < 300;
 }
 
@@ -0,0 +1,219 @@
+// Sample aggregation: what a window holds, when it closes, and what loop()
+// posts for it.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include <math.h>
+#include <atomic>
+#include <thread>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const unsigned long WINDOW_MS = 8000;
+// One series slot
+const unsigned long SLOT_MS = WINDOW_MS / HASampleWindow::SERIES;
+
+HAControl* start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  HAControl* control = discovery.createSensor("vibration", "Vibration", "vibration_uid", "g");
+  CHECK(control != nullptr);
+  return control;
+}
+
+// Runs loop() for a while on the virtual clock
+void runFor(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    discovery.loop();
+    delay(100);
+  }
+}
+
+}  // namespace
+
+TEST(window_holds_min_max_mean_and_last) {
+  HAAggregator aggregator(WINDOW_MS, AGGREGATE_MEAN, 2, false);
+  aggregator.add(3);
+  aggregator.add(-1);
+  aggregator.add(7);
+  aggregator.add(2);
+  delay(WINDOW_MS);
+
+  HASampleWindow window;
+  CHECK(aggregator.take(window));
+  CHECK_EQ(window.count, 4u);
+  CHECK_EQ(window.min, -1.0f);
+  CHECK_EQ(window.max, 7.0f);
+  CHECK_EQ(window.last, 2.0f);
+  CHECK_EQ(window.mean(), 2.75f);
+  CHECK_EQ(window.value(AGGREGATE_MEAN), 2.75f);
+  CHECK_EQ(window.value(AGGREGATE_LAST), 2.0f);
+  CHECK_EQ(window.value(AGGREGATE_MIN), -1.0f);
+  CHECK_EQ(window.value(AGGREGATE_MAX), 7.0f);
+}
+
+TEST(nan_and_infinite_samples_are_rejected) {
+  HAAggregator aggregator(WINDOW_MS, AGGREGATE_MAX, 2, false);
+  aggregator.add(NAN);
+  aggregator.add(INFINITY);
+  aggregator.add(-INFINITY);
+  delay(WINDOW_MS);
+
+  // Nothing valid came in, so the window is discarded
+  HASampleWindow window;
+  CHECK(!aggregator.take(window));
+  CHECK_EQ(window.count, 0u);
+
+  aggregator.add(NAN);
+  aggregator.add(4);
+  delay(WINDOW_MS);
+  CHECK(aggregator.take(window));
+  CHECK_EQ(window.count, 1u);
+  CHECK_EQ(window.max, 4.0f);
+  CHECK_EQ(window.mean(), 4.0f);
+}
+
+TEST(series_holds_the_mean_of_each_slot) {
+  HAAggregator aggregator(WINDOW_MS, AGGREGATE_MEAN, 2, true);
+  for (int slot = 0; slot < HASampleWindow::SERIES; slot++) {
+    // Slot 2 gets nothing
+    if (slot != 2) {
+      aggregator.add(slot * 10);
+      aggregator.add(slot * 10 + 2);
+    }
+    delay(SLOT_MS);
+  }
+  // Late, but before take(): counted in the last slot
+  aggregator.add(80);
+
+  HASampleWindow window;
+  CHECK(aggregator.take(window));
+  for (int slot = 0; slot < HASampleWindow::SERIES - 1; slot++) {
+    if (slot == 2) {
+      CHECK(isnan(window.series[slot]));
+    } else {
+      CHECK_EQ(window.series[slot], slot * 10 + 1.0f);
+    }
+  }
+  CHECK_EQ(window.seriesCount[HASampleWindow::SERIES - 1], 3);
+  CHECK_EQ(window.series[HASampleWindow::SERIES - 1], 74.0f);
+  CHECK_EQ(window.count, 15u);
+}
+
+TEST(windows_close_on_a_steady_cadence) {
+  HAAggregator aggregator(WINDOW_MS, AGGREGATE_LAST, 2, false);
+  HASampleWindow window;
+  aggregator.add(1);
+  delay(WINDOW_MS - 1);
+  CHECK(!aggregator.take(window));
+
+  // Taken late, the next window still ends a whole window after this one began
+  delay(1001);
+  CHECK(aggregator.take(window));
+  aggregator.add(2);
+  delay(WINDOW_MS - 1001);
+  CHECK(!aggregator.take(window));
+  delay(1);
+  CHECK(aggregator.take(window));
+  CHECK_EQ(window.last, 2.0f);
+
+  // A whole window missed restarts the cadence from the take
+  aggregator.add(3);
+  delay(3 * WINDOW_MS);
+  CHECK(aggregator.take(window));
+  aggregator.add(4);
+  delay(WINDOW_MS - 1);
+  CHECK(!aggregator.take(window));
+  delay(1);
+  CHECK(aggregator.take(window));
+  CHECK_EQ(window.last, 4.0f);
+}
+
+TEST(loop_posts_each_window_with_its_attributes) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* vibration = start(discovery, ha);
+  CHECK(discovery.setAggregation(vibration, WINDOW_MS, AGGREGATE_MAX, 2, true));
+  uint32_t writes = ha.stats.stateWrites;
+
+  for (int i = 0; i < 40; i++) {
+    CHECK(discovery.addSample(vibration, (i % 10) * 0.5f));
+    discovery.loop();
+    delay(WINDOW_MS / 40);
+  }
+  runFor(discovery, 500);
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(ha.state("sensor.vibration"), std::string("4.50"));
+
+  const mock::Entity* entity = ha.entity("sensor.vibration");
+  CHECK(entity != nullptr);
+  if (entity) {
+    CHECK_EQ(entity->attributes["min"].number, 0.0);
+    CHECK_EQ(entity->attributes["max"].number, 4.5);
+    CHECK_EQ(entity->attributes["mean"].number, 2.25);
+    CHECK_EQ(entity->attributes["count"].number, 40.0);
+    CHECK_EQ(entity->attributes["series"].size(), (size_t)HASampleWindow::SERIES);
+  }
+
+  // An empty window is skipped
+  runFor(discovery, 2 * WINDOW_MS);
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+}
+
+TEST(aggregation_is_for_sensors_only) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* vibration = start(discovery, ha);
+  HAControl* pump = discovery.createSwitch("pump", "Pump", "pump_uid");
+
+  sim::clearSerial();
+  CHECK(!discovery.setAggregation(pump, WINDOW_MS));
+  CHECK(sim::serialContains("only available for sensors"));
+  CHECK(!discovery.addSample(pump, 1));
+
+  // Without an aggregator, or once it is cleared, samples are refused
+  CHECK(!discovery.addSample(vibration, 1));
+  CHECK(discovery.setAggregation(vibration, WINDOW_MS));
+  CHECK(discovery.addSample(vibration, 1));
+  discovery.clearAggregation(vibration);
+  CHECK(!discovery.addSample(vibration, 1));
+}
+
+TEST(aggregator_can_be_swapped_while_another_task_samples) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* vibration = start(discovery, ha);
+  CHECK(discovery.setAggregation(vibration, WINDOW_MS));
+
+  // Under the sanitizers, a sample folded into a freed aggregator fails here
+  std::atomic<bool> sampling(true);
+  std::atomic<uint32_t> accepted(0);
+  std::thread sampler([&] {
+    while (sampling) {
+      if (discovery.addSample(vibration, 1.5f)) accepted++;
+    }
+  });
+  for (int i = 0; i < 200; i++) {
+    if (i % 3 == 2) {
+      discovery.clearAggregation(vibration);
+    } else {
+      discovery.setAggregation(vibration, WINDOW_MS, i % 2 ? AGGREGATE_MIN : AGGREGATE_MEAN);
+    }
+    std::this_thread::yield();
+  }
+  CHECK(discovery.setAggregation(vibration, WINDOW_MS));
+  sampling = false;
+  sampler.join();
+  CHECK(accepted > 0u);
+
+  // The window that was left in place is posted as usual
+  CHECK(discovery.addSample(vibration, 2.5f));
+  runFor(discovery, WINDOW_MS + 500);
+  float mean = atof(ha.state("sensor.vibration").c_str());
+  CHECK(mean >= 1.5f && mean <= 2.5f);
+}
@@ -0,0 +1,137 @@
+// Helper banks checked from loop(): each call reads at most one trigger
+// helper and never waits for the automation.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 6;
+const int BANKS = 2;
+const unsigned long ACK_POLL_MS = 100;  // the library's interval between trigger reads
+
+struct LoopTrace {
+  unsigned long longestMs = 0;
+  uint32_t mostReads = 0;
+};
+
+// Loops with a short pause between calls, recording the longest call and
+// the most trigger reads any one call made
+void runLoop(HAMQTTDiscovery& discovery, HomeAssistant& ha, unsigned long ms, LoopTrace& trace) {
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    unsigned long start = millis();
+    uint32_t reads = ha.stats.helperReads;
+    discovery.loop();
+    trace.longestMs = max(trace.longestMs, millis() - start);
+    trace.mostReads = max(trace.mostReads, ha.stats.helperReads - reads);
+    delay(10);
+  }
+}
+
+void createAsync(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** controls) {
+  ha.installHelpers(BANKS);
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setHelperBanks(BANKS);
+  discovery.setAsyncCreation(true);
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    controls[i] = discovery.createSensor(id, "Probe", id + "_uid");
+  }
+}
+
+}  // namespace
+
+TEST(loop_reads_one_trigger_per_call_without_waiting) {
+  HomeAssistant ha;
+  ha.automationRunMs = 400;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls);
+
+  LoopTrace trace;
+  runLoop(discovery, ha, 20000, trace);
+  CHECK_EQ(discovery.pendingControls(), 0);
+  for (int i = 0; i < CONTROLS; i++) {
+    CHECK(controls[i] && discovery.isControlOnline(controls[i]));
+  }
+  HAHelperStats stats = discovery.getHelperStats();
+  CHECK_EQ(stats.acked, (uint32_t)CONTROLS);
+  CHECK_EQ(stats.lost, 0u);
+  CHECK(trace.longestMs < ACK_POLL_MS);
+  CHECK(trace.mostReads <= 1u);
+  check::report("banks_async_create", "longest_loop", trace.longestMs, "ms");
+}
+
+TEST(loop_restarts_a_dropped_run) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls);
+  LoopTrace trace;
+  runLoop(discovery, ha, 5000, trace);
+
+  // The next frame's trigger finds the automation off, as when its run
+  // queue was full; the loop starts it again once it is back
+  ha.automationEnabled = false;
+  HAControl* late = discovery.createSensor("late", "Late", "late_uid");
+  runLoop(discovery, ha, 1000, trace);
+  CHECK_EQ(discovery.getHelperStats().frames, (uint32_t)CONTROLS + 1);
+  ha.automationEnabled = true;
+  runLoop(discovery, ha, 5000, trace);
+
+  CHECK(late && discovery.isControlOnline(late));
+  HAHelperStats stats = discovery.getHelperStats();
+  CHECK_EQ(stats.retriggered, 1u);
+  CHECK_EQ(stats.lost, 0u);
+  CHECK(trace.longestMs < ACK_POLL_MS);
+  CHECK(trace.mostReads <= 1u);
+}
+
+TEST(loop_gives_up_on_an_unacknowledged_frame_without_waiting) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls);
+  LoopTrace trace;
+  runLoop(discovery, ha, 5000, trace);
+
+  ha.automationEnabled = false;
+  discovery.createSensor("lost", "Lost", "lost_uid");
+  runLoop(discovery, ha, 15000, trace);
+  CHECK_EQ(discovery.getHelperStats().lost, 1u);
+  CHECK(trace.longestMs < ACK_POLL_MS);
+  CHECK(trace.mostReads <= 1u);
+
+  // The bank is free again for the next frame
+  ha.automationEnabled = true;
+  HAControl* late = discovery.createSensor("late", "Late", "late_uid");
+  runLoop(discovery, ha, 5000, trace);
+  CHECK(late && discovery.isControlOnline(late));
+}
+
+TEST(a_short_trigger_state_is_not_taken_for_an_acknowledgement) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls);
+  LoopTrace trace;
+  runLoop(discovery, ha, 5000, trace);
+
+  ha.automationEnabled = false;
+  discovery.createSensor("stray", "Stray", "stray_uid");
+  runLoop(discovery, ha, 500, trace);
+  // Something else wrote the trigger helper: too short for a sequence number
+  ha.setState("input_text.mqtt_buffer_6", "AC");
+  runLoop(discovery, ha, 3000, trace);
+  HAHelperStats stats = discovery.getHelperStats();
+  CHECK_EQ(stats.acked, (uint32_t)CONTROLS);
+  CHECK_EQ(stats.lost, 0u);
+
+  runLoop(discovery, ha, 10000, trace);
+  CHECK_EQ(discovery.getHelperStats().lost, 1u);
+}
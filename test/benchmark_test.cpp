@@ -0,0 +1,255 @@
+// Benchmark scenarios against the mock Home Assistant: provisioning over
+// helpers and the service transport, state writes and polling. Each prints BENCH lines with the REST requests,
+// bytes on the wire, virtual wall time and heap per operation, and checks
+// the outcome so a regression that breaks the scenario fails the test.
+//
+// Run one scenario: benchmark_test provision_blocking
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 8;
+
+// A LAN with a Pi running HA: a few ms per connect, each reply ~15 ms
+void lanConditions(HomeAssistant& ha) {
+  sim::network().connectMs = 5;
+  ha.faults.latencyMs = 15;
+}
+
+struct Measure {
+  const char* scenario;
+  HomeAssistant& ha;
+  unsigned long startedAt;
+  uint32_t requests;
+  uint64_t bytes;
+  uint64_t allocations;
+  size_t liveBytes;
+
+  Measure(const char* name, HomeAssistant& server) : scenario(name), ha(server) {
+    startedAt = millis();
+    requests = ha.stats.requests;
+    bytes = ha.stats.bytesIn + ha.stats.bytesOut;
+    sim::resetHeapPeak();
+    sim::HeapStats heap = sim::heap();
+    allocations = heap.allocations;
+    liveBytes = heap.liveBytes;
+  }
+
+  void report(int operations) {
+    sim::HeapStats heap = sim::heap();
+    double ops = operations > 0 ? operations : 1;
+    check::report(scenario, "ops", operations);
+    check::report(scenario, "requests_per_op", (ha.stats.requests - requests) / ops);
+    check::report(scenario, "bytes_per_op", (ha.stats.bytesIn + ha.stats.bytesOut - bytes) / ops, "B");
+    check::report(scenario, "wall_per_op", (millis() - startedAt) / ops, "ms");
+    check::report(scenario, "allocations_per_op", (heap.allocations - allocations) / ops);
+    check::report(scenario, "heap_peak", (double)(heap.peakBytes - liveBytes), "B");
+  }
+};
+
+void createControls(HAMQTTDiscovery& discovery, HAControl** controls) {
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    controls[i] = discovery.createSensor(id, "Probe " + String(i), id + "_uid", "\xC2\xB0" "C");
+  }
+}
+
+int onlineCount(HAMQTTDiscovery& discovery, HAControl** controls) {
+  int online = 0;
+  for (int i = 0; i < CONTROLS; i++) {
+    if (controls[i] && discovery.isControlOnline(controls[i])) online++;
+  }
+  return online;
+}
+
+bool begin(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  bool started = discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setDevice("bench", "Bench");
+  return started;
+}
+
+}  // namespace
+
+TEST(provision_blocking) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  lanConditions(ha);
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+
+  Measure measure("provision_blocking", ha);
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  measure.report(CONTROLS);
+  CHECK_EQ(onlineCount(discovery, controls), CONTROLS);
+}
+
+TEST(provision_banked) {
+  HomeAssistant ha;
+  ha.installHelpers(2);
+  lanConditions(ha);
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  CHECK(discovery.setHelperBanks(2));
+
+  Measure measure("provision_banked", ha);
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  measure.report(CONTROLS);
+  CHECK_EQ(onlineCount(discovery, controls), CONTROLS);
+}
+
+TEST(provision_batched) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  lanConditions(ha);
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  discovery.setAsyncCreation(true);
+
+  Measure measure("provision_batched", ha);
+  HAControl* controls[CONTROLS];
+  discovery.beginBatch();
+  createControls(discovery, controls);
+  CHECK(discovery.endBatch());
+  while (discovery.pendingControls() > 0 && millis() - measure.startedAt < 60000) {
+    discovery.loop();
+    delay(10);
+  }
+  measure.report(CONTROLS);
+  CHECK_EQ(onlineCount(discovery, controls), CONTROLS);
+  CHECK_EQ(ha.stats.rejected, 0u);
+}
+
+// One service call per entity instead of helper chunks, a trigger and an
+// automation run; the helper figures come from a blocking run alongside
+TEST(provision_service) {
+  double helperRequests, helperWall;
+  {
+    HomeAssistant ha(nullptr, "helpers.local", 8123);
+    ha.installHelpers();
+    lanConditions(ha);
+    HAMQTTDiscovery discovery;
+    CHECK(begin(discovery, ha));
+    uint32_t requests = ha.stats.requests;
+    unsigned long startedAt = millis();
+    HAControl* controls[CONTROLS];
+    createControls(discovery, controls);
+    helperRequests = (double)(ha.stats.requests - requests) / CONTROLS;
+    helperWall = (double)(millis() - startedAt) / CONTROLS;
+    CHECK_EQ(onlineCount(discovery, controls), CONTROLS);
+  }
+
+  HomeAssistant ha;
+  lanConditions(ha);
+  HAMQTTDiscovery discovery;
+  CHECK(discovery.begin(ha.url().c_str(), ha.token.c_str(), TRANSPORT_SERVICE));
+  discovery.setDevice("bench", "Bench");
+  discovery.setDiscoveryService("script.mqtt_discovery_publish");
+
+  Measure measure("provision_service", ha);
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  double serviceRequests = (double)(ha.stats.requests - measure.requests) / CONTROLS;
+  double serviceWall = (double)(millis() - measure.startedAt) / CONTROLS;
+  measure.report(CONTROLS);
+  check::report("provision_service", "helper_requests_per_op", helperRequests);
+  check::report("provision_service", "helper_wall_per_op", helperWall, "ms");
+
+  CHECK_EQ(onlineCount(discovery, controls), CONTROLS);
+  CHECK_EQ(ha.stats.serviceCalls, (uint32_t)CONTROLS);
+  CHECK_EQ(ha.stats.helperWrites, 0u);
+  CHECK_EQ(ha.stats.runs, 0u);
+  CHECK(serviceRequests < helperRequests);
+  CHECK(serviceWall < helperWall);
+}
+
+TEST(writes_direct) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  lanConditions(ha);
+
+  const int ROUNDS = 25;
+  Measure measure("writes_direct", ha);
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < CONTROLS; i++) discovery.writeControl(controls[i], String(20 + round % 5 + i * 0.1f, 1));
+    delay(1000);
+  }
+  measure.report(ROUNDS * CONTROLS);
+  CHECK_EQ(ha.stats.stateWrites, (uint32_t)(ROUNDS * CONTROLS));
+}
+
+TEST(writes_state_batch) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  lanConditions(ha);
+  discovery.enableStateBatch();
+
+  const int ROUNDS = 25;
+  Measure measure("writes_state_batch", ha);
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < CONTROLS; i++) discovery.writeControl(controls[i], String(20 + round % 5 + i * 0.1f, 1));
+    discovery.flushStates();
+    delay(1000);
+  }
+  sim::drain();
+  measure.report(ROUNDS * CONTROLS);
+  CHECK_EQ(ha.stats.stateBatches, (uint32_t)ROUNDS);
+  CHECK_EQ(ha.stats.rejected, 0u);
+}
+
+TEST(polling_per_control) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  ha.addNoiseEntities(200);
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  lanConditions(ha);
+
+  const int ROUNDS = 10;
+  Measure measure("polling_per_control", ha);
+  int read = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < CONTROLS; i++) read += discovery.readControl(controls[i]).length() ? 1 : 0;
+  }
+  measure.report(ROUNDS * CONTROLS);
+  CHECK_EQ(read, ROUNDS * CONTROLS);
+}
+
+TEST(polling_refresh_all) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  ha.addNoiseEntities(200);
+  HAMQTTDiscovery discovery;
+  CHECK(begin(discovery, ha));
+  HAControl* controls[CONTROLS];
+  createControls(discovery, controls);
+  lanConditions(ha);
+
+  const int ROUNDS = 10;
+  Measure measure("polling_refresh_all", ha);
+  bool ok = true;
+  for (int round = 0; round < ROUNDS; round++) {
+    if (round % 2) ha.setState("sensor.probe_3", String(round).c_str());
+    ok &= discovery.refreshAll() >= 0;
+  }
+  measure.report(ROUNDS * CONTROLS);
+  CHECK(ok);
+  CHECK_EQ(controls[3]->currentState, String("9"));
+}
@@ -0,0 +1,189 @@
+// Compact discovery: abbreviated keys, HA defaults left out and a shared
+// "~" topic base, and what that saves in helper chunks.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+using mock::Json;
+
+namespace {
+
+const int CONTROLS = 4;
+
+Json parse(const String& text) {
+  Json json;
+  CHECK(Json::parse(text.c_str(), json));
+  return json;
+}
+
+void begin(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setDevice("boiler_controller_01", "Boiler Controller", "Virtual Devices", "ESP32-S3", "2.4.1");
+}
+
+// Numbers whose topics share "home/boiler/<id>"
+void createBoiler(HAMQTTDiscovery& discovery, HAControl** controls) {
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "boiler_flow_" + String(i);
+    String base = "home/boiler/" + id;
+    controls[i] = discovery.createNumber(id, "Boiler Flow " + String(i), id + "_uid", 20, 80, 0.5f,
+                                        "\xC2\xB0" "C", "box", "mdi:water-boiler", base + "/state",
+                                        base + "/set", base + "/avail");
+  }
+}
+
+void runUntilCreated(HAMQTTDiscovery& discovery) {
+  unsigned long start = millis();
+  while (discovery.pendingControls() > 0 && millis() - start < 60000) {
+    discovery.loop();
+    delay(10);
+  }
+}
+
+int totalChunks(HAMQTTDiscovery& discovery, HAControl** controls, bool compact) {
+  int total = 0;
+  for (int i = 0; i < CONTROLS; i++) total += discovery.discoveryChunks(controls[i], compact);
+  return total;
+}
+
+}  // namespace
+
+TEST(compact_payload_expands_to_the_full_one) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  begin(discovery, ha);
+  discovery.setAsyncCreation(true);
+  HAControl* controls[CONTROLS];
+  createBoiler(discovery, controls);
+
+  String fullText = controls[0]->getDiscoveryPayload(false);
+  String compactText = controls[0]->getDiscoveryPayload(true);
+  check::report("compact_payload", "full_bytes", fullText.length(), "B");
+  check::report("compact_payload", "compact_bytes", compactText.length(), "B");
+  CHECK(compactText.length() < fullText.length());
+
+  Json full = parse(fullText);
+  Json compact = parse(compactText);
+  CHECK_EQ(compact["~"].text, std::string("home/boiler/boiler_flow_0"));
+  CHECK_EQ(compact["stat_t"].text, std::string("~/state"));
+
+  // Nothing in this control is at HA's default, so the two carry the same
+  // members once abbreviations and "~" are expanded
+  Json expanded = HomeAssistant::expandConfig(compact);
+  CHECK_EQ(expanded.members.size(), full.members.size() + 1);
+  for (const auto& member : full.members) {
+    CHECK_EQ(expanded[member.first].dump(), member.second.dump());
+  }
+}
+
+TEST(defaults_are_left_out_of_the_compact_payload) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  begin(discovery, ha);
+  discovery.setAsyncCreation(true);
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  HAControl* level = discovery.createNumber("level", "Level", "level_uid");
+
+  Json full = parse(lamp->getDiscoveryPayload(false));
+  Json compact = parse(lamp->getDiscoveryPayload(true));
+  CHECK_EQ(full["payload_on"].text, std::string("ON"));
+  CHECK(!compact.has("pl_on"));
+  CHECK(!compact.has("pl_off"));
+  CHECK_EQ(compact["dev"]["ids"][0].text, std::string("boiler_controller_01"));
+
+  full = parse(level->getDiscoveryPayload(false));
+  compact = parse(level->getDiscoveryPayload(true));
+  CHECK(full.has("max"));
+  CHECK(full.has("step"));
+  CHECK(compact.has("min"));
+  CHECK(!compact.has("max"));
+  CHECK(!compact.has("step"));
+}
+
+TEST(topic_base_is_the_longest_shared_directory) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  begin(discovery, ha);
+  discovery.setAsyncCreation(true);
+
+  // Default topics: virt/<objectId>/state, /set and /avail
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  CHECK_EQ(lamp->getTopicBaseLength(), strlen("virt/lamp"));
+  CHECK_EQ(lamp->getTopicBase(), String("virt/lamp"));
+  CHECK(lamp->topicHasBase(HAControl::TOPIC_COMMAND, lamp->getTopicBaseLength()));
+
+  // Shortened to the directory every topic shares
+  HAControl* flow = discovery.createNumber("flow", "Flow", "flow_uid", 0, 100, 1, "", "", "",
+                                          "home/boiler/flow/state", "home/boiler/flow/set",
+                                          "home/boiler/status");
+  CHECK_EQ(flow->getTopicBase(), String("home/boiler"));
+  CHECK(flow->topicHasBase(HAControl::TOPIC_AVAILABILITY, flow->getTopicBaseLength()));
+  // A prefix has to end at a '/' of the topic, not inside a level
+  CHECK(!flow->topicHasBase(HAControl::TOPIC_STATE, strlen("home/boil")));
+  CHECK_EQ(parse(flow->getDiscoveryPayload(true))["avty_t"].text, std::string("~/status"));
+
+  // Nothing shared, or too short to pay for the "~" key
+  HAControl* apart = discovery.createSensor("apart", "Apart", "apart_uid", "", "", "home/apart/state",
+                                            "other/apart/avail");
+  CHECK_EQ(apart->getTopicBaseLength(), (size_t)0);
+  HAControl* brief = discovery.createSensor("brief", "Brief", "brief_uid", "", "", "ab/state", "ab/avail");
+  CHECK_EQ(brief->getTopicBaseLength(), (size_t)0);
+  CHECK(!parse(brief->getDiscoveryPayload(true)).has("~"));
+}
+
+TEST(compact_discovery_needs_fewer_chunks_and_requests) {
+  uint32_t helperWrites[2];
+  int chunks[2];
+  for (int compact = 0; compact < 2; compact++) {
+    HomeAssistant ha;
+    ha.installHelpers(1, 5, 150);
+    HAMQTTDiscovery discovery;
+    begin(discovery, ha);
+    discovery.setAsyncCreation(true);
+    discovery.setCompactDiscovery(compact == 1);
+    CHECK(discovery.detectHelperGeometry());
+
+    HAControl* controls[CONTROLS];
+    createBoiler(discovery, controls);
+    runUntilCreated(discovery);
+    for (int i = 0; i < CONTROLS; i++) {
+      CHECK_EQ(controls[i]->status, STATUS_ONLINE);
+    }
+    // HA reads the same entity either way
+    const mock::Entity* entity = ha.entity("number.boiler_flow_0");
+    CHECK(entity != nullptr);
+    if (entity) {
+      CHECK_EQ(entity->config["command_topic"].text, std::string("home/boiler/boiler_flow_0/set"));
+      CHECK_EQ(entity->config["max"].number, 80.0);
+    }
+
+    chunks[compact] = totalChunks(discovery, controls, compact == 1);
+    helperWrites[compact] = ha.stats.helperWrites;
+  }
+
+  check::report("compact_discovery", "chunks_full", chunks[0]);
+  check::report("compact_discovery", "chunks_compact", chunks[1]);
+  check::report("compact_discovery", "helper_writes_full", helperWrites[0]);
+  check::report("compact_discovery", "helper_writes_compact", helperWrites[1]);
+  CHECK(chunks[1] < chunks[0]);
+  CHECK(helperWrites[1] < helperWrites[0]);
+}
+
+TEST(discovery_report_lists_both_sizes) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  begin(discovery, ha);
+  discovery.setAsyncCreation(true);
+  HAControl* controls[CONTROLS];
+  createBoiler(discovery, controls);
+
+  sim::clearSerial();
+  discovery.printDiscoveryReport();
+  String total = "Total chunks: full " + String(totalChunks(discovery, controls, false)) + ", compact " +
+                 String(totalChunks(discovery, controls, true));
+  CHECK(sim::serialContains(total.c_str()));
+  CHECK(sim::serialContains("number.boiler_flow_3"));
+}
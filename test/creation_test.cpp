@@ -0,0 +1,166 @@
+// Asynchronous creation through a single helper bank: each frame waits for
+// the automation to acknowledge the previous one before rewriting the bank.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 6;
+
+void runUntilCreated(HAMQTTDiscovery& discovery, unsigned long timeoutMs) {
+  unsigned long start = millis();
+  while (discovery.pendingControls() > 0 && millis() - start < timeoutMs) {
+    discovery.loop();
+    delay(10);
+  }
+}
+
+void createAsync(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** controls, bool batch = false) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setAsyncCreation(true);
+  if (batch) discovery.beginBatch();
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    controls[i] = discovery.createSensor(id, "Probe", id + "_uid");
+  }
+}
+
+}  // namespace
+
+TEST(async_frames_wait_for_the_previous_acknowledgement) {
+  HomeAssistant ha;
+  // Runs slower than the loop, so an ungated frame would land on top of
+  // one the automation hasn't read yet
+  ha.automationRunMs = 400;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls);
+
+  runUntilCreated(discovery, 60000);
+  CHECK_EQ(discovery.pendingControls(), 0);
+  for (int i = 0; i < CONTROLS; i++) {
+    CHECK(controls[i] && discovery.isControlOnline(controls[i]));
+  }
+  CHECK_EQ(ha.stats.rejected, 0u);
+  CHECK_EQ(ha.stats.published, (uint32_t)CONTROLS);
+  HAHelperStats stats = discovery.getHelperStats();
+  CHECK_EQ(stats.frames, (uint32_t)CONTROLS);
+  CHECK_EQ(stats.lost, 0u);
+}
+
+TEST(async_batch_flush_is_gated_like_single_frames) {
+  HomeAssistant ha;
+  ha.automationRunMs = 400;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  createAsync(discovery, ha, controls, true);
+  CHECK(discovery.endBatch());
+
+  runUntilCreated(discovery, 60000);
+  for (int i = 0; i < CONTROLS; i++) {
+    CHECK(controls[i] && discovery.isControlOnline(controls[i]));
+  }
+  CHECK_EQ(ha.stats.rejected, 0u);
+  CHECK_EQ(discovery.getHelperStats().lost, 0u);
+}
+
+TEST(blocking_create_waits_for_the_acknowledgement_not_a_fixed_delay) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+
+  unsigned long start = millis();
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  CHECK(probe != nullptr);
+  // The old 3 s settle delay is gone for the helper transport
+  CHECK(millis() - start < 3000);
+  CHECK_EQ(discovery.getHelperStats().acked, 1u);
+}
+
+TEST(a_failed_chunk_leaves_the_bank_untriggered) {
+  HomeAssistant ha;
+  ha.installHelpers(1, 5, 100);
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+
+  // The envelope spans several 100 character buffers; the second write fails
+  ha.faults.errorPath = "/api/states/input_text.mqtt_buffer_2";
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid", "W");
+  CHECK(probe == nullptr);
+  CHECK(ha.state("input_text.mqtt_buffer_6").compare(0, 4, "END:") != 0);
+  CHECK_EQ(ha.stats.runs, 0u);
+  CHECK_EQ(ha.stats.published, 0u);
+  CHECK_EQ(discovery.getHelperStats().frames, 0u);
+
+  ha.faults.errorPath = "";
+  probe = discovery.createSensor("probe", "Probe", "probe_uid", "W");
+  CHECK(probe && discovery.isControlOnline(probe));
+}
+
+TEST(blocking_create_hands_a_busy_bank_to_loop) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+
+  // The first frame goes out but isn't acknowledged, so the only bank
+  // is still busy
+  ha.automationEnabled = false;
+  discovery.setAsyncCreation(true);
+  HAControl* first = discovery.createSensor("first", "First", "first_uid");
+  while (discovery.getHelperStats().frames == 0) {
+    discovery.loop();
+    delay(20);
+  }
+  discovery.setAsyncCreation(false);
+
+  unsigned long start = millis();
+  HAControl* second = discovery.createSensor("second", "Second", "second_uid");
+  CHECK(millis() - start < 1000);
+  CHECK(second != nullptr);
+  CHECK_EQ(discovery.pendingControls(), 2);
+  CHECK(!discovery.isControlOnline(second));
+
+  // loop() restarts the stuck frame, then sends the waiting one
+  ha.automationEnabled = true;
+  unsigned long end = millis() + 20000;
+  while (discovery.pendingControls() > 0 && millis() < end) {
+    discovery.loop();
+    delay(20);
+  }
+  CHECK(first && discovery.isControlOnline(first));
+  CHECK(discovery.isControlOnline(second));
+  CHECK_EQ(discovery.getHelperStats().lost, 0u);
+}
+
+TEST(flushing_into_a_busy_bank_leaves_the_batch_to_loop) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* controls[CONTROLS];
+  ha.automationRunMs = 3000;
+  createAsync(discovery, ha, controls, true);
+  // The first batch goes out at once; the bank is busy for the second
+  CHECK(discovery.flushBatch());
+  HAControl* late = discovery.createSensor("late", "Late", "late_uid");
+  for (int i = 0; i < 5; i++) {
+    discovery.loop();
+    delay(20);
+  }
+
+  unsigned long start = millis();
+  CHECK(discovery.flushBatch());
+  CHECK(millis() - start < 1000);
+  CHECK_EQ(discovery.getHelperStats().frames, 1u);
+
+  runUntilCreated(discovery, 60000);
+  CHECK(late && discovery.isControlOnline(late));
+  CHECK_EQ(discovery.getHelperStats().frames, 2u);
+  CHECK_EQ(ha.stats.rejected, 0u);
+}
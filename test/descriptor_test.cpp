@@ -0,0 +1,107 @@
+// Compile-time descriptors: each HA_* macro must give HA the same entity as
+// the create* call with the same arguments.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+using mock::Json;
+
+HA_SWITCH(pumpDescriptor, "pump", "Pump", "pump_uid", "mdi:pump");
+HA_NUMBER(levelDescriptor, "level", "Tank Level", "level_uid", 0, 50, 5, "%", "box", "mdi:gauge");
+HA_SENSOR(tempDescriptor, "tank_temp", "Tank Temperature", "tank_temp_uid", "\xC2\xB0" "C", "mdi:thermometer");
+HA_SENSOR(countDescriptor, "cycles", "Cycles", "cycles_uid", "", "mdi:counter");
+HA_BINARY_SENSOR(doorDescriptor, "door", "Door", "door_uid", "mdi:door");
+
+namespace {
+
+// Two registries on one HA, so both sides can use the same object id.
+// Nothing is sent: creation is asynchronous and loop() never runs.
+struct Pair {
+  HomeAssistant ha;
+  HAMQTTDiscovery fromDescriptor;
+  HAMQTTDiscovery fromCreate;
+
+  Pair() {
+    for (HAMQTTDiscovery* discovery : {&fromDescriptor, &fromCreate}) {
+      discovery->begin(ha.url().c_str(), ha.token.c_str());
+      discovery->setDevice("tank_controller", "Tank Controller", "Virtual Devices", "ESP32");
+      discovery->setAsyncCreation(true);
+    }
+  }
+};
+
+// Member order differs (HA doesn't care), and numbers are compared by value
+// since the macros keep their literal spelling
+bool sameJson(const Json& a, const Json& b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case Json::NUMBER: return a.number == b.number;
+    case Json::OBJECT:
+      if (a.members.size() != b.members.size()) return false;
+      for (const auto& member : a.members) {
+        if (!b.has(member.first) || !sameJson(member.second, b[member.first])) return false;
+      }
+      return true;
+    case Json::ARRAY:
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); i++) {
+        if (!sameJson(a[i], b[i])) return false;
+      }
+      return true;
+    default: return a.dump() == b.dump();
+  }
+}
+
+void checkSame(HAControl* descriptor, HAControl* created) {
+  CHECK(descriptor != nullptr);
+  CHECK(created != nullptr);
+  if (!descriptor || !created) return;
+  CHECK_EQ(descriptor->getDiscoveryTopic(), created->getDiscoveryTopic());
+  CHECK_EQ(descriptor->getEntityId(), created->getEntityId());
+  CHECK_EQ(descriptor->getStateTopic(), created->getStateTopic());
+  CHECK_EQ(descriptor->getCommandTopic(), created->getCommandTopic());
+  CHECK_EQ(descriptor->getAvailabilityTopic(), created->getAvailabilityTopic());
+
+  String fromDescriptor = descriptor->getDiscoveryPayload();
+  String fromCreate = created->getDiscoveryPayload();
+  Json a, b;
+  CHECK(Json::parse(fromDescriptor.c_str(), a));
+  CHECK(Json::parse(fromCreate.c_str(), b));
+  if (!sameJson(a, b)) {
+    printf("  descriptor: %s\n  create:     %s\n", fromDescriptor.c_str(), fromCreate.c_str());
+  }
+  CHECK(sameJson(a, b));
+}
+
+}  // namespace
+
+TEST(switch_descriptor_matches_create_switch) {
+  Pair pair;
+  checkSame(pair.fromDescriptor.createFromDescriptor(pumpDescriptor),
+            pair.fromCreate.createSwitch("pump", "Pump", "pump_uid", "mdi:pump"));
+}
+
+TEST(number_descriptor_matches_create_number) {
+  Pair pair;
+  checkSame(pair.fromDescriptor.createFromDescriptor(levelDescriptor),
+            pair.fromCreate.createNumber("level", "Tank Level", "level_uid", 0, 50, 5, "%", "box", "mdi:gauge"));
+}
+
+TEST(sensor_descriptor_matches_create_sensor) {
+  Pair pair;
+  checkSame(pair.fromDescriptor.createFromDescriptor(tempDescriptor),
+            pair.fromCreate.createSensor("tank_temp", "Tank Temperature", "tank_temp_uid", "\xC2\xB0" "C",
+                                         "mdi:thermometer"));
+  // Without a unit the member is left out on both sides
+  checkSame(pair.fromDescriptor.createFromDescriptor(countDescriptor),
+            pair.fromCreate.createSensor("cycles", "Cycles", "cycles_uid", "", "mdi:counter"));
+}
+
+TEST(binary_sensor_descriptor_matches_create_binary_sensor) {
+  Pair pair;
+  checkSame(pair.fromDescriptor.createFromDescriptor(doorDescriptor),
+            pair.fromCreate.createBinarySensor("door", "Door", "door_uid", "mdi:door"));
+}
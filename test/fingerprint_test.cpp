@@ -0,0 +1,103 @@
+// Fingerprint cache: a warm boot adopts unchanged controls from NVS without
+// a request, and republishes the ones whose config changed.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include <Preferences.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 3;
+
+void start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  CHECK(discovery.enableFingerprintCache());
+}
+
+void createProbes(HAMQTTDiscovery& discovery, HAControl** probes, const char* name = "Probe") {
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    probes[i] = discovery.createSensor(id, i == 0 ? name : "Probe", id + "_uid");
+  }
+}
+
+// One boot of the device: a fresh client, the same NVS
+void boot(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** probes, const char* name = "Probe") {
+  start(discovery, ha);
+  createProbes(discovery, probes, name);
+}
+
+}  // namespace
+
+TEST(warm_boot_adopts_unchanged_controls_without_requests) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAControl* probes[CONTROLS];
+  {
+    HAMQTTDiscovery first;
+    boot(first, ha, probes);
+  }
+
+  uint32_t writes = Preferences::writes();
+  HAMQTTDiscovery second;
+  start(second, ha);
+  uint32_t before = ha.stats.requests;
+  createProbes(second, probes);
+  CHECK_EQ(ha.stats.requests - before, 0u);
+  for (int i = 0; i < CONTROLS; i++) CHECK(probes[i] && second.isControlOnline(probes[i]));
+  // Nothing changed, so nothing was written to flash
+  CHECK_EQ(Preferences::writes(), writes);
+}
+
+TEST(changed_config_is_republished_instead_of_rejected) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAControl* probes[CONTROLS];
+  {
+    HAMQTTDiscovery first;
+    boot(first, ha, probes);
+  }
+
+  HAMQTTDiscovery second;
+  uint32_t published = ha.stats.published;
+  boot(second, ha, probes, "Renamed");
+  CHECK(probes[0] != nullptr);
+  CHECK(probes[0] && second.isControlOnline(probes[0]));
+  CHECK_EQ(ha.stats.published - published, 1u);
+  std::string config;
+  CHECK(ha.bus().retained("homeassistant/sensor/probe_0/config", config));
+  CHECK(config.find("Renamed") != std::string::npos);
+}
+
+TEST(without_the_cache_an_existing_entity_is_rejected) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery first;
+  first.begin(ha.url().c_str(), ha.token.c_str());
+  CHECK(first.createSensor("probe", "Probe", "probe_uid") != nullptr);
+
+  HAMQTTDiscovery second;
+  second.begin(ha.url().c_str(), ha.token.c_str());
+  CHECK(second.createSensor("probe", "Probe", "probe_uid") == nullptr);
+}
+
+TEST(clearing_the_cache_verifies_every_control_again) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAControl* probes[CONTROLS];
+  {
+    HAMQTTDiscovery first;
+    boot(first, ha, probes);
+    first.clearFingerprintCache();
+  }
+
+  HAMQTTDiscovery second;
+  uint32_t published = ha.stats.published;
+  boot(second, ha, probes);
+  for (int i = 0; i < CONTROLS; i++) CHECK(probes[i] && second.isControlOnline(probes[i]));
+  CHECK_EQ(ha.stats.published - published, (uint32_t)CONTROLS);
+}
@@ -0,0 +1,169 @@
+// Gateway mode: one instance publishing for many downstream nodes, each
+// with its own device, scheduled a network step per node in turn. The load
+// test drives NODES nodes, one of them chatty, and reports the latency from
+// writeControl() to delivery per node.
+//
+// Run one scenario: gateway_test gateway_load
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int NODES = 8;
+const int SENSORS = 2;
+
+struct Gateway {
+  HANode* nodes[NODES];
+  HAControl* sensors[NODES][SENSORS];
+};
+
+void runLoop(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    discovery.loop();
+    delay(20);
+  }
+}
+
+// Registers every node and its sensors, then loops until all are online
+void createNodes(HAMQTTDiscovery& discovery, HomeAssistant& ha, Gateway& gateway) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  for (int n = 0; n < NODES; n++) {
+    String nodeId = "node_" + String(n);
+    gateway.nodes[n] = discovery.addNode(nodeId, "Node " + String(n), "YourCompany", "Radio Node");
+    for (int s = 0; s < SENSORS; s++) {
+      String id = nodeId + "_s" + String(s);
+      gateway.sensors[n][s] = discovery.createSensor(id, "Sensor " + String(s), id + "_uid", "W", "", "", "",
+                                                     &gateway.nodes[n]->device);
+    }
+  }
+  unsigned long start = millis();
+  while (discovery.pendingControls() > 0 && millis() - start < 120000) runLoop(discovery, 100);
+}
+
+}  // namespace
+
+TEST(nodes_are_registered_once_with_their_own_device) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  HANode* first = discovery.addNode("probe_node", "Probe Node");
+  CHECK(first != nullptr);
+  CHECK(discovery.addNode("probe_node", "Renamed") == first);
+  HANode* second = discovery.addNode("other_node", "Other Node");
+  CHECK(second != nullptr && second != first);
+  CHECK_EQ(discovery.nodeCount(), 2);
+  CHECK(discovery.findNode("other_node") == second);
+  CHECK(discovery.getNode(0) == first);
+  CHECK(discovery.findNode("missing") == nullptr);
+}
+
+TEST(every_nodes_controls_come_online_under_its_device) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  Gateway gateway;
+  createNodes(discovery, ha, gateway);
+
+  CHECK_EQ(discovery.pendingControls(), 0);
+  for (int n = 0; n < NODES; n++) {
+    for (int s = 0; s < SENSORS; s++) {
+      CHECK(gateway.sensors[n][s] && discovery.isControlOnline(gateway.sensors[n][s]));
+    }
+  }
+  // The config names the node's device, not the gateway's
+  std::string config;
+  CHECK(ha.bus().retained("homeassistant/sensor/node_3_s1/config", config));
+  CHECK(config.find("node_3") != std::string::npos);
+  CHECK_EQ(ha.stats.rejected, 0u);
+}
+
+TEST(writes_are_queued_until_loop) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  Gateway gateway;
+  createNodes(discovery, ha, gateway);
+
+  uint32_t writes = ha.stats.stateWrites;
+  CHECK(discovery.writeControl(gateway.sensors[0][0], "1"));
+  CHECK(discovery.writeControl(gateway.sensors[0][0], "2"));
+  CHECK_EQ(ha.stats.stateWrites, writes);
+
+  // The latest value wins
+  runLoop(discovery, 500);
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(ha.state("sensor.node_0_s0"), "2");
+  CHECK_EQ(gateway.nodes[0]->stats.writes, 2u);
+  CHECK_EQ(gateway.nodes[0]->stats.delivered, 1u);
+}
+
+TEST(gateway_load) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  Gateway gateway;
+  createNodes(discovery, ha, gateway);
+  // A reply takes 15 ms and loop() may spend 20 ms, so each call only
+  // gets through a step or two and the order of service matters
+  ha.faults.latencyMs = 15;
+  discovery.setLoopBudget(20);
+  discovery.resetNodeStats();
+
+  // Node 0 writes both sensors every loop; the rest once a second
+  unsigned long end = millis() + 10000;
+  unsigned long lastQuiet = 0;
+  while (millis() < end) {
+    for (int s = 0; s < SENSORS; s++) discovery.writeControl(gateway.sensors[0][s], String(millis()));
+    if (millis() - lastQuiet >= 1000) {
+      lastQuiet = millis();
+      for (int n = 1; n < NODES; n++) {
+        for (int s = 0; s < SENSORS; s++) discovery.writeControl(gateway.sensors[n][s], String(millis()));
+      }
+    }
+    discovery.loop();
+    delay(10);
+  }
+  runLoop(discovery, 2000);
+
+  for (int n = 0; n < NODES; n++) {
+    HANodeStats& stats = gateway.nodes[n]->stats;
+    String scenario = "gateway_node_" + String(n);
+    check::report(scenario.c_str(), "writes", stats.writes);
+    check::report(scenario.c_str(), "delivered", stats.delivered);
+    check::report(scenario.c_str(), "latency_p90", stats.latency.percentileMs(90), "ms");
+    if (n == 0) continue;
+    // Quiet nodes lose nothing to the chatty one and wait at most a few
+    // rounds of the scheduler
+    CHECK_EQ(stats.delivered, stats.writes);
+    CHECK(stats.latency.percentileMs(90) <= 512u);
+  }
+  // The chatty node's extra values were coalesced, not queued behind
+  HANodeStats& chatty = gateway.nodes[0]->stats;
+  CHECK(chatty.delivered > 0u);
+  CHECK(chatty.delivered < chatty.writes);
+  CHECK_EQ(sim::network().stats.connects, 1u);
+}
+
+TEST(state_batches_mix_every_nodes_values) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  Gateway gateway;
+  createNodes(discovery, ha, gateway);
+  discovery.enableStateBatch();
+
+  uint32_t writes = ha.stats.stateWrites;
+  for (int n = 0; n < NODES; n++) CHECK(discovery.writeControl(gateway.sensors[n][0], String(n)));
+  runLoop(discovery, 200);
+  CHECK(discovery.flushStates());
+  sim::drain();
+
+  CHECK_EQ(ha.stats.stateBatches, 1u);
+  CHECK_EQ(ha.stats.stateWrites, writes);
+  for (int n = 0; n < NODES; n++) {
+    CHECK_EQ(gateway.nodes[n]->stats.delivered, 1u);
+  }
+}
@@ -0,0 +1,68 @@
+#include "Check.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "Sim.h"
+
+namespace check {
+
+namespace {
+
+struct Case {
+  const char* name;
+  TestFunction function;
+};
+
+std::vector<Case>& cases() {
+  static std::vector<Case>* list = new std::vector<Case>();
+  return *list;
+}
+
+int failures = 0;
+
+}  // namespace
+
+Registrar::Registrar(const char* name, TestFunction function) {
+  cases().push_back(Case{name, function});
+}
+
+void fail(const char* file, int line, const std::string& message) {
+  failures++;
+  printf("  FAILED %s:%d: %s\n", file, line, message.c_str());
+}
+
+void report(const std::string& scenario, const std::string& metric, double value, const char* unit) {
+  printf("BENCH %s %s=%.6g %s\n", scenario.c_str(), metric.c_str(), value, unit);
+}
+
+}  // namespace check
+
+int main(int argc, char** argv) {
+  int failedCases = 0;
+  int run = 0;
+  for (const check::Case& test : check::cases()) {
+    if (argc > 1) {
+      bool selected = false;
+      for (int i = 1; i < argc; i++) selected |= strcmp(argv[i], test.name) == 0;
+      if (!selected) continue;
+    }
+    sim::reset();
+    int before = check::failures;
+    printf("[ RUN  ] %s\n", test.name);
+    fflush(stdout);
+    test.function();
+    run++;
+    if (check::failures != before) {
+      failedCases++;
+      printf("[ FAIL ] %s\n", test.name);
+      // The library's own log usually says why
+      const std::string& log = sim::serialOutput();
+      printf("  Serial (last 2 KB):\n%s\n", log.substr(log.size() > 2048 ? log.size() - 2048 : 0).c_str());
+    } else {
+      printf("[  OK  ] %s\n", test.name);
+    }
+    fflush(stdout);
+  }
+  printf("%d of %d cases passed\n", run - failedCases, run);
+  return failedCases || !run ? 1 : 0;
+}
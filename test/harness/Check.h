@@ -0,0 +1,55 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+// Just enough of a test framework: TEST() registers a case, CHECK and
+// CHECK_EQ record failures without stopping the case, and main() (in
+// Check.cpp) runs every case, or those named on the command line, each from
+// a fresh sim::reset().
+
+#include <stdint.h>
+#include <sstream>
+#include <string>
+#include <WString.h>
+
+inline std::ostream& operator<<(std::ostream& out, const String& text) {
+  return out << text.c_str();
+}
+
+namespace check {
+
+typedef void (*TestFunction)();
+
+struct Registrar {
+  Registrar(const char* name, TestFunction function);
+};
+
+void fail(const char* file, int line, const std::string& message);
+
+// One line of benchmark output, kept in a form that's easy to grep and diff:
+//   BENCH <scenario> <metric>=<value> <unit>
+void report(const std::string& scenario, const std::string& metric, double value, const char* unit = "");
+
+template <typename A, typename B>
+void checkEqual(const A& actual, const B& expected, const char* actualText, const char* expectedText,
+                const char* file, int line) {
+  if (actual == expected) return;
+  std::ostringstream message;
+  message << actualText << " == " << expectedText << " (got " << actual << ", expected " << expected << ")";
+  fail(file, line, message.str());
+}
+
+}  // namespace check
+
+#define TEST(name)                                              \
+  static void name();                                           \
+  static check::Registrar name##_registrar(#name, name);        \
+  static void name()
+
+#define CHECK(condition)                                        \
+  do {                                                          \
+    if (!(condition)) check::fail(__FILE__, __LINE__, #condition); \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) check::checkEqual((actual), (expected), #actual, #expected, __FILE__, __LINE__)
+
+#endif
@@ -0,0 +1,196 @@
+// The harness itself: virtual clock, shims and mocks, checked on their own
+// before the library tests lean on them.
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+using mock::Json;
+
+namespace {
+
+struct Reply {
+  int code;
+  String body;
+};
+
+// A REST client the way the library holds one: the HTTPClient outlives
+// each request, so its connection is kept alive in between
+struct Rest {
+  WiFiClient client;
+  HTTPClient http;
+
+  Reply request(const char* method, const String& path, const String& body = "",
+                const String& token = "test-token") {
+    http.begin(client, "http://ha.local:8123" + path);
+    http.setReuse(true);
+    http.addHeader("Authorization", "Bearer " + token);
+    http.addHeader("Content-Type", "application/json");
+    Reply reply;
+    reply.code = http.sendRequest(method, body);
+    if (reply.code > 0) reply.body = http.getString();
+    http.end();
+    return reply;
+  }
+};
+
+String helperBody(const std::string& value) {
+  return String(("{\"state\":" + mock::quote(value) + "}").c_str());
+}
+
+}  // namespace
+
+TEST(timers_run_in_order_as_the_clock_advances) {
+  std::string order;
+  sim::after(20, [&]() { order += "b"; });
+  sim::after(10, [&]() { order += "a"; });
+  sim::after(20, [&]() { order += "c"; });
+  delay(15);
+  CHECK_EQ(order, "a");
+  CHECK_EQ(millis(), 15ul);
+  delay(5);
+  CHECK_EQ(order, "abc");
+}
+
+TEST(heap_accounting_follows_new_and_delete) {
+  sim::HeapStats before = sim::heap();
+  void* block = ::operator new(1000);
+  CHECK(sim::heap().liveBytes >= before.liveBytes + 1000);
+  CHECK(ESP.getFreeHeap() <= sim::HEAP_SIZE - 1000);
+  ::operator delete(block);
+  CHECK_EQ(sim::heap().liveBytes, before.liveBytes);
+}
+
+TEST(rest_requests_share_one_keep_alive_connection) {
+  HomeAssistant ha;
+  Rest rest;
+  Reply first = rest.request("GET", "/api/");
+  Reply second = rest.request("GET", "/api/");
+  CHECK_EQ(first.code, 200);
+  CHECK_EQ(second.body, String("{\"message\":\"API running.\"}"));
+  CHECK_EQ(sim::network().stats.connects, 1u);
+  CHECK_EQ(ha.stats.requests, 2u);
+}
+
+TEST(rest_requests_need_the_token) {
+  HomeAssistant ha;
+  Rest rest;
+  CHECK_EQ(rest.request("GET", "/api/", "", "wrong").code, 401);
+}
+
+TEST(states_are_created_read_and_limited_to_255_characters) {
+  HomeAssistant ha;
+  Rest rest;
+  CHECK_EQ(rest.request("POST", "/api/states/sensor.a", "{\"state\":\"1\"}").code, 201);
+  CHECK_EQ(rest.request("POST", "/api/states/sensor.a", "{\"state\":\"2\"}").code, 200);
+  Reply read = rest.request("GET", "/api/states/sensor.a");
+  Json state;
+  CHECK(Json::parse(read.body.str(), state));
+  CHECK_EQ(state["state"].asString(), "2");
+  CHECK_EQ(rest.request("GET", "/api/states/sensor.missing").code, 404);
+
+  // 255 two-byte characters fit; HA counts characters, not bytes
+  std::string wide;
+  for (int i = 0; i < 255; i++) wide += "\xC3\xA9";
+  CHECK_EQ(rest.request("POST", "/api/states/sensor.b", helperBody(wide)).code, 201);
+  CHECK_EQ(rest.request("POST", "/api/states/sensor.b", helperBody(wide + "x")).code, 400);
+}
+
+TEST(automation_publishes_a_frame_and_acknowledges_its_sequence) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  Rest rest;
+  std::string frame =
+    "{\"topic\":\"homeassistant/switch/lamp/config\",\"payload\":{\"name\":\"Lamp\",\"stat_t\":\"virt/lamp/state\"}}";
+  rest.request("POST", "/api/states/input_text.mqtt_buffer_1", helperBody(frame));
+  rest.request("POST", "/api/states/input_text.mqtt_buffer_6", helperBody("END:7/1"));
+  sim::drain();
+
+  std::string config;
+  CHECK(ha.bus().retained("homeassistant/switch/lamp/config", config));
+  CHECK(ha.has("switch.lamp"));
+  CHECK_EQ(ha.state(HomeAssistant::helperId(0, 6)), "ACK:7");
+  CHECK_EQ(ha.state(HomeAssistant::helperId(0, 1)), "");
+  // set_value put the helper attributes back
+  CHECK_EQ(ha.entity(HomeAssistant::helperId(0, 1))->attributes["max"].asNumber(), 255.0);
+
+  // The same trigger again finds the buffers empty
+  rest.request("POST", "/api/states/input_text.mqtt_buffer_6", helperBody("END:7/1"));
+  sim::drain();
+  CHECK_EQ(ha.state(HomeAssistant::helperId(0, 6)), "DUP:7");
+  CHECK_EQ(ha.stats.published, 1u);
+}
+
+TEST(automation_drops_triggers_past_its_queue) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  ha.automationQueueMax = 2;
+  Rest rest;
+  for (int i = 0; i < 4; i++) {
+    rest.request("POST", "/api/states/input_text.mqtt_buffer_6", helperBody("END:" + std::to_string(i)));
+  }
+  sim::drain();
+  CHECK_EQ(ha.stats.dropped, 2u);
+}
+
+TEST(mqtt_entities_follow_availability_and_state_topics) {
+  HomeAssistant ha;
+  ha.bus().publish("homeassistant/switch/lamp/config",
+                   "{\"name\":\"Lamp\",\"~\":\"virt/lamp\",\"stat_t\":\"~/state\",\"cmd_t\":\"~/set\","
+                   "\"avty_t\":\"~/avail\"}",
+                   true);
+  sim::drain();
+  CHECK_EQ(ha.state("switch.lamp"), "unavailable");
+  ha.bus().publish("virt/lamp/state", "ON", true);
+  ha.bus().publish("virt/lamp/avail", "online", true);
+  CHECK_EQ(ha.state("switch.lamp"), "on");
+  CHECK(ha.command("switch.lamp", "OFF"));
+  CHECK_EQ(ha.bus().history.back().first, "virt/lamp/set");
+}
+
+TEST(fault_injection_loses_fails_and_delays_requests) {
+  HomeAssistant ha;
+  Rest rest;
+  ha.faults.errorPercent = 100;
+  CHECK_EQ(rest.request("GET", "/api/").code, 503);
+
+  ha.faults.errorPercent = 0;
+  ha.faults.lossPercent = 100;
+  CHECK(rest.request("GET", "/api/").code < 0);
+  CHECK_EQ(ha.stats.lost, 1u);
+
+  ha.faults.lossPercent = 0;
+  ha.faults.latencyMs = 250;
+  unsigned long start = millis();
+  CHECK_EQ(rest.request("GET", "/api/").code, 200);
+  CHECK(millis() - start >= 250);
+}
+
+TEST(idle_keep_alive_connections_are_closed) {
+  HomeAssistant ha;
+  ha.faults.idleTimeoutMs = 1000;
+  Rest rest;
+  rest.request("GET", "/api/");
+  delay(500);
+  CHECK(rest.client.connected());
+  delay(600);
+  CHECK(!rest.client.connected());
+}
+
+TEST(library_creates_a_switch_end_to_end) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  HAMQTTDiscovery discovery;
+  CHECK(discovery.begin(ha.url().c_str(), ha.token.c_str()));
+  discovery.setDevice("dev1", "Device");
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  CHECK(lamp != nullptr);
+  CHECK(lamp && discovery.isControlOnline(lamp));
+  CHECK(ha.has("switch.lamp"));
+  CHECK(discovery.writeControl(lamp, "ON"));
+  CHECK_EQ(ha.state("switch.lamp"), "ON");
+}
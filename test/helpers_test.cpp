@@ -0,0 +1,121 @@
+// Helper geometry and chunking: frames are split into as many input_text
+// helpers as HA has, at the smallest configured max, and never inside a
+// UTF-8 sequence.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+// Below the 255 default, so chunking by it is visible
+const int HELPER_MAX = 100;
+
+size_t characters(const std::string& text) {
+  size_t count = 0;
+  for (unsigned char c : text) {
+    if ((c & 0xC0) != 0x80) count++;
+  }
+  return count;
+}
+
+// The envelope sendHelperFrame splits, built from the control's parts
+std::string envelopeOf(HAControl* control) {
+  return "{\"topic\":\"" + std::string(control->getDiscoveryTopic().c_str()) +
+         "\",\"payload\":" + control->getDiscoveryPayload().c_str() + "}";
+}
+
+// A sensor named so that the "°" of "°C" is the last character of the
+// first chunk and the "C" starts the second
+String straddlingName() {
+  HomeAssistant probeHa;
+  HAMQTTDiscovery probe;
+  probe.begin(probeHa.url().c_str(), probeHa.token.c_str());
+  probe.setAsyncCreation(true);
+  HAControl* control = probe.createSensor("probe", "°C", "probe_uid");
+  std::string envelope = envelopeOf(control);
+  size_t degree = characters(envelope.substr(0, envelope.find("°")));
+
+  String name;
+  for (size_t i = degree; i < HELPER_MAX - 1; i++) name += "x";
+  return name + "°C";
+}
+
+}  // namespace
+
+TEST(geometry_follows_a_helper_max_below_the_default) {
+  HomeAssistant ha;
+  ha.installHelpers(1, 3, HELPER_MAX);
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+
+  // Defaults until HA has been asked
+  CHECK_EQ(discovery.helperBuffers(), 5);
+  CHECK_EQ(discovery.helperChunkSize(), (size_t)255);
+
+  CHECK(discovery.detectHelperGeometry());
+  CHECK_EQ(discovery.helperBuffers(), 3);
+  CHECK_EQ(discovery.helperChunkSize(), (size_t)HELPER_MAX);
+  CHECK_EQ(ha.stats.templates, 1u);
+}
+
+TEST(a_character_straddling_a_chunk_boundary_is_kept_whole) {
+  String name = straddlingName();
+  HomeAssistant ha;
+  ha.installHelpers(1, 5, HELPER_MAX);
+  // Leaves the chunks in the helpers to be read back
+  ha.automationEnabled = false;
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setAsyncCreation(true);
+  HAControl* control = discovery.createSensor("probe", name, "probe_uid");
+  for (int i = 0; i < 10 && ha.state(HomeAssistant::helperId(0, 6)).empty(); i++) {
+    discovery.loop();
+    delay(10);
+  }
+
+  std::string envelope = envelopeOf(control);
+  std::string first = ha.state(HomeAssistant::helperId(0, 1));
+  std::string second = ha.state(HomeAssistant::helperId(0, 2));
+  CHECK_EQ(ha.state(HomeAssistant::helperId(0, 6)).substr(0, 4), std::string("END:"));
+  // Counted in characters, so the first chunk is a byte longer than its max
+  CHECK_EQ(characters(first), (size_t)HELPER_MAX);
+  CHECK_EQ(first.size(), (size_t)HELPER_MAX + 1);
+  CHECK(first.size() > 2 && first.compare(first.size() - 2, 2, "°") == 0);
+  CHECK_EQ(second.substr(0, 1), std::string("C"));
+
+  std::string frame;
+  for (int i = 1; i <= discovery.discoveryChunks(control, false); i++) {
+    std::string chunk = ha.state(HomeAssistant::helperId(0, i));
+    CHECK(characters(chunk) <= (size_t)HELPER_MAX);
+    frame += chunk;
+  }
+  CHECK_EQ(frame, envelope);
+  CHECK_EQ(discovery.discoveryChunks(control, false), (int)((characters(envelope) + HELPER_MAX - 1) / HELPER_MAX));
+}
+
+TEST(a_frame_needing_more_buffers_than_exist_is_not_sent) {
+  HomeAssistant ha;
+  ha.installHelpers(1, 2, HELPER_MAX);
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setAsyncCreation(true);
+
+  String name;
+  for (int i = 0; i < 2 * HELPER_MAX; i++) name += "x";
+  HAControl* control = discovery.createSensor("probe", name, "probe_uid");
+  for (int i = 0; i < 10 && control->status == STATUS_PENDING; i++) {
+    discovery.loop();
+    delay(10);
+  }
+
+  CHECK_EQ(discovery.helperBuffers(), 2);
+  CHECK(discovery.discoveryChunks(control, false) > discovery.helperBuffers());
+  CHECK_EQ(control->status, STATUS_FAILED);
+  // Nothing half-written and nothing triggered
+  CHECK_EQ(ha.stats.helperWrites, 0u);
+  CHECK_EQ(ha.stats.runs, 0u);
+}
@@ -0,0 +1,234 @@
+// HAJsonReader and HAJsonExtractor: paths, escapes, chunked input and
+// malformed documents, and their cost on a recorded /api/states response
+// against reading it into a String and scanning it.
+
+#include <Arduino.h>
+#include <HAJsonReader.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include "Check.h"
+#include "Sim.h"
+
+namespace {
+
+// Records every event as one line, to check what subclasses are told
+class Recorder : public HAJsonReader {
+public:
+  std::string events;
+
+protected:
+  void onValue(const char* value, size_t length, bool isString) override {
+    events += std::to_string(depth()) + (isString ? " s " : " v ") + std::string(value, length) + "\n";
+  }
+  void onContainer(bool isObject, bool opened) override {
+    events += std::string(opened ? "open " : "close ") + (isObject ? "{" : "[") + "\n";
+  }
+};
+
+std::string fixture() {
+  std::ifstream file(STATES_FIXTURE, std::ios::binary);
+  std::stringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+// One entry's state out of the whole list, as it streams past
+class StateFinder : public HAJsonReader {
+public:
+  explicit StateFinder(const char* entityId) : _entityId(entityId), _matched(false) {}
+  std::string state;
+
+protected:
+  void onValue(const char* value, size_t length, bool isString) override {
+    (void)isString;
+    if (depth() != 2) return;
+    if (strcmp(keyAt(2), "entity_id") == 0) {
+      _matched = length == strlen(_entityId) && strncmp(value, _entityId, length) == 0;
+    } else if (_matched && strcmp(keyAt(2), "state") == 0) {
+      state.assign(value, length);
+    }
+  }
+
+private:
+  const char* _entityId;
+  bool _matched;
+};
+
+// The lookup as it was before the reader: the body held in a String and
+// searched with indexOf, kept as the baseline for the benchmark below
+String extractJsonValue(const String& json, const String& key, int from) {
+  String searchKey = "\"" + key + "\":";
+  int startIndex = json.indexOf(searchKey, from);
+  if (startIndex == -1) return "";
+  startIndex += searchKey.length();
+  if (json[startIndex] == '"') {
+    startIndex++;
+    int endIndex = json.indexOf('"', startIndex);
+    if (endIndex == -1) return "";
+    return json.substring(startIndex, endIndex);
+  }
+  int endIndex = startIndex;
+  while (endIndex < (int)json.length() && json[endIndex] != ',' && json[endIndex] != '}' && json[endIndex] != ']') {
+    endIndex++;
+  }
+  return json.substring(startIndex, endIndex);
+}
+
+const int PASSES = 50;
+// What HTTPClient::writeToStream hands over at a time
+const size_t STREAM_CHUNK = 1436;
+const char TARGET[] = "sensor.tank_temp";
+
+struct ReadBench {
+  const char* scenario;
+  size_t bytes;
+  size_t liveBytes;
+  std::chrono::steady_clock::time_point startedAt;
+
+  ReadBench(const char* name, size_t length) : scenario(name), bytes(length) {
+    sim::resetHeapPeak();
+    liveBytes = sim::heap().liveBytes;
+    startedAt = std::chrono::steady_clock::now();
+  }
+
+  // Peak heap above where the pass started
+  double report() {
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startedAt).count();
+    double peak = (double)(sim::heap().peakBytes - liveBytes);
+    check::report(scenario, "mb_per_s", (double)bytes * PASSES / ns * 1000.0, "MB/s");
+    check::report(scenario, "heap_peak", peak, "B");
+    return peak;
+  }
+};
+
+}  // namespace
+
+TEST(extractor_finds_nested_paths) {
+  char state[16], name[32];
+  HAJsonExtractor reader;
+  int stateSlot = reader.addPath("state", state, sizeof(state));
+  int nameSlot = reader.addPath("attributes.friendly_name", name, sizeof(name));
+  const char* body = "{\"entity_id\":\"sensor.a\",\"state\":\"21.5\","
+                     "\"attributes\":{\"unit\":\"C\",\"friendly_name\":\"Room \\\"A\\\" \\u00e9\"}}";
+  reader.feed(body, strlen(body));
+  CHECK(reader.complete());
+  CHECK(!reader.failed());
+  CHECK(reader.found(stateSlot));
+  CHECK_EQ(std::string(state), "21.5");
+  CHECK(reader.found(nameSlot));
+  CHECK_EQ(std::string(name), "Room \"A\" \xC3\xA9");
+}
+
+TEST(extractor_keeps_the_first_match_and_truncates) {
+  char state[4];
+  HAJsonExtractor reader;
+  int slot = reader.addPath("state", state, sizeof(state));
+  const char* body = "{\"state\":\"abcdef\",\"state\":\"x\"}";
+  reader.feed(body, strlen(body));
+  CHECK(reader.found(slot));
+  CHECK_EQ(std::string(state), "abc");
+
+  reader.clearResults();
+  CHECK(!reader.found(slot));
+  CHECK_EQ(std::string(state), "");
+}
+
+TEST(bytes_can_arrive_one_at_a_time) {
+  char value[8];
+  HAJsonExtractor reader;
+  int slot = reader.addPath("a.b", value, sizeof(value));
+  const char* body = "{\"a\":{\"b\":true}}";
+  for (const char* c = body; *c; c++) reader.write((uint8_t)*c);
+  CHECK(reader.complete());
+  CHECK(reader.found(slot));
+  CHECK_EQ(std::string(value), "true");
+}
+
+TEST(subclasses_see_values_and_containers) {
+  Recorder reader;
+  const char* body = "[{\"n\":1},null,\"x\"]";
+  reader.feed(body, strlen(body));
+  CHECK(reader.complete());
+  CHECK_EQ(reader.events, "open [\nopen {\n2 v 1\nclose {\n1 v null\n1 s x\nclose [\n");
+}
+
+TEST(malformed_documents_fail) {
+  const char* bad[] = {"{\"a\" 1}", "{1:2}", "{\"a\":\"\\q\"}", "[1 2]"};
+  for (const char* body : bad) {
+    HAJsonExtractor reader;
+    reader.feed(body, strlen(body));
+    CHECK(reader.failed());
+    CHECK(!reader.complete());
+  }
+}
+
+TEST(trailing_data_after_a_document_is_ignored) {
+  HAJsonExtractor reader;
+  const char* body = "{\"a\":1}\r\n";
+  reader.feed(body, strlen(body));
+  CHECK(reader.complete());
+  CHECK(!reader.failed());
+}
+
+// Throughput depends on the host and the sanitizer build, so only the
+// results and the heap are checked
+TEST(states_reader_vs_string_scan) {
+  std::string body = fixture();
+  CHECK(body.size() > 10000);
+  check::report("states_fixture", "bytes", (double)body.size(), "B");
+
+  std::string streamed;
+  ReadBench reader("states_reader", body.size());
+  for (int pass = 0; pass < PASSES; pass++) {
+    StateFinder finder(TARGET);
+    for (size_t offset = 0; offset < body.size(); offset += STREAM_CHUNK) {
+      finder.feed(body.data() + offset, std::min(STREAM_CHUNK, body.size() - offset));
+    }
+    CHECK(finder.complete());
+    streamed = finder.state;
+  }
+  double readerPeak = reader.report();
+
+  String scanned;
+  ReadBench scan("states_string_scan", body.size());
+  for (int pass = 0; pass < PASSES; pass++) {
+    String response;
+    for (size_t offset = 0; offset < body.size(); offset += STREAM_CHUNK) {
+      response += String(body.substr(offset, STREAM_CHUNK).c_str());
+    }
+    int entry = response.indexOf(String("\"entity_id\":\"") + TARGET + "\"");
+    scanned = extractJsonValue(response, "state", entry);
+  }
+  double scanPeak = scan.report();
+
+  CHECK_EQ(streamed, std::string("48.25"));
+  CHECK_EQ(std::string(scanned.c_str()), streamed);
+  // The reader holds nothing but itself; the scan holds the whole body
+  CHECK_EQ(readerPeak, 0.0);
+  CHECK(scanPeak >= body.size());
+}
+
+TEST(extractor_reads_one_entity_without_holding_it) {
+  std::string body = fixture();
+  size_t start = body.find(std::string("{\"entity_id\":\"") + TARGET);
+  size_t end = body.find("}}", start) + 2;
+  std::string entity = body.substr(start, end - start);
+
+  char state[32], changed[40];
+  sim::resetHeapPeak();
+  size_t liveBytes = sim::heap().liveBytes;
+  HAJsonExtractor extractor;
+  int stateSlot = extractor.addPath("state", state, sizeof(state));
+  int changedSlot = extractor.addPath("last_changed", changed, sizeof(changed));
+  extractor.feed(entity.data(), entity.size());
+  size_t peak = sim::heap().peakBytes - liveBytes;
+  check::report("entity_extractor", "bytes", (double)entity.size(), "B");
+  check::report("entity_extractor", "heap_peak", (double)peak, "B");
+
+  CHECK(extractor.complete());
+  CHECK(extractor.found(stateSlot));
+  CHECK(extractor.found(changedSlot));
+  CHECK_EQ(std::string(state), "48.25");
+  CHECK_EQ(peak, (size_t)0);
+}
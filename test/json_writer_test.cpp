@@ -0,0 +1,222 @@
+// HAJsonWriter: structure, escaping, numbers and overflow, and what it
+// saves over building discovery payloads by String concatenation.
+
+#include <Arduino.h>
+#include <HAJsonWriter.h>
+#include <HAMQTTDiscovery.h>
+#include <chrono>
+#include "Check.h"
+#include "Sim.h"
+
+namespace {
+
+String number(float value, int decimals = 3) {
+  String output;
+  HAJsonWriter writer(output);
+  writer.value(value, decimals);
+  return output;
+}
+
+// The discovery payload as it was built before HAJsonWriter, kept as the
+// baseline for the benchmark below
+String concatEscape(const String& input) {
+  String output;
+  output.reserve(input.length() + 8);
+  for (size_t i = 0; i < input.length(); i++) {
+    char c = input[i];
+    if (c == '"' || c == '\\') {
+      output += '\\';
+      output += c;
+    } else if (c == '\n') {
+      output += "\\n";
+    } else if (c == '\r') {
+      output += "\\r";
+    } else {
+      output += c;
+    }
+  }
+  return output;
+}
+
+String concatDevice(const HADevice& device) {
+  String json = "{\"identifiers\":[\"" + concatEscape(device.uniqueId) + "\"]";
+  if (device.name.length()) json += ",\"name\":\"" + concatEscape(device.name) + "\"";
+  if (device.manufacturer.length()) json += ",\"manufacturer\":\"" + concatEscape(device.manufacturer) + "\"";
+  if (device.model.length()) json += ",\"model\":\"" + concatEscape(device.model) + "\"";
+  if (device.swVersion.length()) json += ",\"sw_version\":\"" + concatEscape(device.swVersion) + "\"";
+  json += "}";
+  return json;
+}
+
+String concatPayload(const HAControl& control) {
+  const HAControlOptions& opts = control.getOptions();
+  String json = "{";
+  if (control.name.length()) json += "\"name\":\"" + concatEscape(control.name) + "\",";
+  if (control.uniqueId.length()) json += "\"unique_id\":\"" + concatEscape(control.uniqueId) + "\",";
+  if (opts.icon.length()) json += "\"icon\":\"" + concatEscape(opts.icon) + "\",";
+  if (opts.stateTopic.length()) json += "\"state_topic\":\"" + concatEscape(opts.stateTopic) + "\",";
+  if (opts.commandTopic.length()) json += "\"command_topic\":\"" + concatEscape(opts.commandTopic) + "\",";
+  if (opts.availabilityTopic.length()) {
+    json += "\"availability_topic\":\"" + concatEscape(opts.availabilityTopic) + "\",";
+  }
+  if (control.device) json += "\"device\":" + concatDevice(*control.device) + ",";
+  json += "\"min\":" + String(opts.minValue, 3) + ",";
+  json += "\"max\":" + String(opts.maxValue, 3) + ",";
+  json += "\"step\":" + String(opts.step, 3) + ",";
+  if (opts.unit.length()) json += "\"unit_of_measurement\":\"" + concatEscape(opts.unit) + "\",";
+  if (opts.mode.length()) json += "\"mode\":\"" + concatEscape(opts.mode) + "\",";
+  if (json.endsWith(",")) json.remove(json.length() - 1);
+  json += "}";
+  return json;
+}
+
+const int PAYLOADS = 2000;
+
+struct PayloadBench {
+  const char* scenario;
+  uint64_t allocations;
+  std::chrono::steady_clock::time_point startedAt;
+
+  explicit PayloadBench(const char* name) : scenario(name) {
+    allocations = sim::heap().allocations;
+    startedAt = std::chrono::steady_clock::now();
+  }
+
+  // Allocations per payload
+  double report() {
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startedAt).count();
+    double perPayload = (double)(sim::heap().allocations - allocations) / PAYLOADS;
+    check::report(scenario, "ns_per_payload", ns / PAYLOADS, "ns");
+    check::report(scenario, "allocations_per_payload", perPayload);
+    return perPayload;
+  }
+};
+
+}  // namespace
+
+TEST(objects_and_arrays_get_commas_between_members) {
+  String output;
+  HAJsonWriter writer(output);
+  writer.beginObject();
+  writer.field("name", "Lamp");
+  writer.key("list");
+  writer.beginArray();
+  writer.value("a");
+  writer.value("b");
+  writer.endArray();
+  writer.field("level", 1.5f, 1);
+  writer.endObject();
+  CHECK_EQ(output, String("{\"name\":\"Lamp\",\"list\":[\"a\",\"b\"],\"level\":1.5}"));
+}
+
+TEST(strings_are_escaped) {
+  String output;
+  HAJsonWriter writer(output);
+  writer.value("a\"b\\c\nd\x01");
+  CHECK_EQ(output, String("\"a\\\"b\\\\c\\nd\\u0001\""));
+  CHECK_EQ(HAJsonWriter::escapedLength("a\"b", 3), (size_t)4);
+}
+
+TEST(numbers_match_fixed_point_formatting) {
+  CHECK_EQ(number(21.5f, 1), String("21.5"));
+  CHECK_EQ(number(-0.25f, 2), String("-0.25"));
+  CHECK_EQ(number(-0.0001f, 2), String("0.00"));
+  CHECK_EQ(number(42.0f, 0), String("42"));
+  CHECK_EQ(number(1.0f / 3.0f), String("0.333"));
+}
+
+TEST(numbers_json_cannot_hold_become_null) {
+  CHECK_EQ(number(NAN), String("null"));
+  CHECK_EQ(number(INFINITY), String("null"));
+  CHECK_EQ(number(-INFINITY), String("null"));
+}
+
+TEST(large_numbers_use_exponent_form) {
+  // magnitude * scale no longer fits the 64-bit fixed-point digits
+  CHECK_EQ(number(3.0e38f), String("3.00000001e+38"));
+  CHECK_EQ(number(-1.0e20f, 0), String("-1.00000002e+20"));
+  CHECK_EQ(number(1.0e16f, 3), String("1.00000003e+16"));
+  // Just under the cut-over, still plain digits
+  CHECK_EQ(number(1.0e14f, 3), String("100000000376832.000"));
+}
+
+TEST(integers_are_written_exactly) {
+  String output;
+  HAJsonWriter writer(output);
+  writer.beginObject();
+  writer.field("count", 16777217L);
+  writer.field("id", -42L);
+  writer.key("list");
+  writer.beginArray();
+  writer.value(0L);
+  writer.value(2147483647L);
+  writer.endArray();
+  writer.endObject();
+  // 16777217 has no exact float
+  CHECK_EQ(output, String("{\"count\":16777217,\"id\":-42,\"list\":[0,2147483647]}"));
+}
+
+TEST(fixed_buffer_reports_overflow) {
+  char buffer[8];
+  HAJsonWriter writer(buffer, sizeof(buffer));
+  writer.value("longer than eight");
+  CHECK(writer.overflowed());
+
+  char roomy[32];
+  HAJsonWriter fits(roomy, sizeof(roomy));
+  fits.value("short");
+  CHECK(!fits.overflowed());
+  CHECK_EQ(String(fits.c_str()), String("\"short\""));
+}
+
+// Wall-clock ns depend on the host and the sanitizer build; allocations
+// don't, so only those are checked
+TEST(discovery_payload_writer_vs_string_concatenation) {
+  HADevice device;
+  device.uniqueId = "bench_device_01";
+  device.name = "Bench";
+  device.manufacturer = "Virtual";
+  device.model = "ESP32";
+  device.swVersion = "1.0.0";
+  HAControlOptions options;
+  options.minValue = 5;
+  options.maxValue = 30;
+  options.step = 0.5f;
+  options.unit = "\xC2\xB0" "C";
+  options.icon = "mdi:thermometer";
+  options.stateTopic = "home/thermostat/temp/state";
+  options.commandTopic = "home/thermostat/temp/set";
+  options.availabilityTopic = "home/thermostat/temp/avail";
+  HAControl control;
+  control.type = CONTROL_NUMBER;
+  control.objectId = "thermostat_temp";
+  control.name = "Thermostat \"Living\"";
+  control.uniqueId = "thermostat_temp_01";
+  control.device = &device;
+  control.options = &options;
+
+  size_t length = 0;
+  PayloadBench concat("payload_string_concat");
+  for (int i = 0; i < PAYLOADS; i++) length += concatPayload(control).length();
+  double concatAllocations = concat.report();
+
+  PayloadBench string("payload_writer_string");
+  for (int i = 0; i < PAYLOADS; i++) length += control.getDiscoveryPayload().length();
+  double stringAllocations = string.report();
+
+  char buffer[1024];
+  PayloadBench fixed("payload_writer_buffer");
+  for (int i = 0; i < PAYLOADS; i++) {
+    HAJsonWriter writer(buffer, sizeof(buffer));
+    control.writeDiscoveryPayload(writer);
+    length += writer.length();
+  }
+  double fixedAllocations = fixed.report();
+  control.options = nullptr;
+
+  CHECK(length > 0);
+  CHECK(stringAllocations < concatAllocations);
+  // One exact reserve for the returned String, nothing in place
+  CHECK(stringAllocations <= 1);
+  CHECK_EQ(fixedAllocations, 0.0);
+}
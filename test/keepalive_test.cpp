@@ -0,0 +1,79 @@
+// Persistent connection: one TLS handshake for many requests, and a fresh
+// connection (once) when HA has dropped the idle one.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const char* HTTPS_URL = "https://ha.local:8123";
+
+HAControl* startWithSensor(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(HTTPS_URL, ha.token.c_str());
+  return discovery.createSensor("probe", "Probe", "probe_uid");
+}
+
+}  // namespace
+
+TEST(requests_share_one_tls_handshake) {
+  HomeAssistant ha;
+  sim::network().handshakeMs = 400;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+  CHECK(probe != nullptr);
+
+  for (int i = 0; i < 20; i++) CHECK(discovery.writeControl(probe, String(i)));
+  CHECK_EQ(sim::network().stats.handshakes, 1u);
+  CHECK_EQ(ha.stats.stateWrites, 20u);
+  HARequestStats stats = discovery.getRequestStats();
+  CHECK_EQ(stats.ops[OP_CONNECT].count, 1u);
+  CHECK_EQ(stats.retries, 0u);
+}
+
+TEST(connection_closed_while_idle_is_reopened) {
+  HomeAssistant ha;
+  ha.faults.idleTimeoutMs = 5000;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+
+  CHECK(discovery.writeControl(probe, "1"));
+  delay(6000);
+  CHECK(discovery.writeControl(probe, "2"));
+  CHECK_EQ(ha.state("sensor.probe"), "2");
+  CHECK_EQ(sim::network().stats.handshakes, 2u);
+}
+
+TEST(connection_lost_silently_gets_one_fresh_retry) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+  CHECK(discovery.writeControl(probe, "1"));
+
+  // A NAT or proxy forgot the connection: the request vanishes and the
+  // socket reads as reset
+  discovery.resetRequestStats();
+  sim::network().dropConnections(true);
+  CHECK(discovery.writeControl(probe, "2"));
+  CHECK_EQ(ha.state("sensor.probe"), "2");
+  HARequestStats stats = discovery.getRequestStats();
+  CHECK_EQ(stats.retries, 1u);
+  CHECK_EQ(stats.failures, 0u);
+}
+
+TEST(server_down_fails_without_retrying_a_fresh_connection) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+
+  sim::network().dropConnections();
+  sim::network().setReachable("ha.local", false);
+  discovery.resetRequestStats();
+  CHECK(!discovery.writeControl(probe, "2"));
+  CHECK_EQ(discovery.getRequestStats().retries, 0u);
+  CHECK_EQ(discovery.getRequestStats().failures, 1u);
+}
@@ -0,0 +1,155 @@
+// Local broker transport: discovery, states and commands go straight to a
+// broker on the LAN, and the REST path takes over whenever it is gone.
+// Home Assistant shares the broker, as its MQTT integration would.
+//
+// Run one scenario: local_broker_test local_vs_rest_latency
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::Broker;
+using mock::HomeAssistant;
+
+namespace {
+
+const char* BROKER_HOST = "broker.local";
+
+int commandsSeen = 0;
+String lastCommand;
+
+void recordCommand(HAControl*, const String& state) {
+  commandsSeen++;
+  lastCommand = state;
+}
+
+void runLoop(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    discovery.loop();
+    delay(20);
+  }
+}
+
+void start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setDevice("gateway_uid", "Gateway");
+}
+
+}  // namespace
+
+TEST(discovery_and_states_go_straight_to_the_broker) {
+  Broker broker;
+  broker.listen(BROKER_HOST, 1883);
+  HomeAssistant ha(&broker);
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  CHECK(discovery.setLocalBroker(BROKER_HOST));
+  CHECK(discovery.localConnected());
+
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  CHECK(probe && discovery.isControlOnline(probe));
+  std::string payload;
+  CHECK(broker.retained("homeassistant/sensor/probe/config", payload));
+  CHECK_EQ(ha.stats.helperWrites, 0u);
+
+  uint32_t writes = ha.stats.stateWrites;
+  CHECK(discovery.writeControl(probe, "42"));
+  sim::drain();
+  CHECK_EQ(ha.stats.stateWrites, writes);
+  CHECK_EQ(ha.state("sensor.probe"), "42");
+  CHECK_EQ(discovery.getRequestStats().ops[OP_LOCAL_PUBLISH].failures, 0u);
+}
+
+TEST(commands_arrive_through_loop) {
+  Broker broker;
+  broker.listen(BROKER_HOST, 1883);
+  HomeAssistant ha(&broker);
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  CHECK(discovery.setLocalBroker(BROKER_HOST));
+  HAControl* fan = discovery.createSwitch("fan", "Fan", "fan_uid");
+  CHECK(fan != nullptr);
+  commandsSeen = 0;
+  discovery.onStateChange(fan, recordCommand);
+
+  CHECK(ha.command("switch.fan", "ON"));
+  runLoop(discovery, 200);
+  CHECK_EQ(commandsSeen, 1);
+  CHECK_EQ(lastCommand, String("ON"));
+  CHECK_EQ(fan->currentState, String("ON"));
+  // Echoed to the state topic, so HA shows the new state
+  CHECK_EQ(ha.state("switch.fan"), "on");
+}
+
+TEST(broker_gone_falls_back_to_rest_then_reconnects) {
+  Broker broker;
+  broker.listen(BROKER_HOST, 1883);
+  HomeAssistant ha(&broker);
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  CHECK(discovery.setLocalBroker(BROKER_HOST));
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+
+  broker.stop();
+  sim::network().dropConnections();
+  uint32_t writes = ha.stats.stateWrites;
+  CHECK(discovery.writeControl(probe, "7"));
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(ha.state("sensor.probe"), "7");
+  CHECK(!discovery.localConnected());
+
+  // loop() reconnects with backoff and announces the controls again
+  broker.listen(BROKER_HOST, 1883);
+  uint32_t connects = broker.stats.connects;
+  runLoop(discovery, 5000);
+  CHECK(discovery.localConnected());
+  CHECK_EQ(broker.stats.connects - connects, 1u);
+  writes = ha.stats.stateWrites;
+  CHECK(discovery.writeControl(probe, "8"));
+  sim::drain();
+  CHECK_EQ(ha.stats.stateWrites, writes);
+  CHECK_EQ(ha.state("sensor.probe"), "8");
+}
+
+TEST(unreachable_broker_leaves_the_rest_path_in_place) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  CHECK(!discovery.setLocalBroker(BROKER_HOST));
+  CHECK(!discovery.localConnected());
+
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  CHECK(probe && discovery.isControlOnline(probe));
+  CHECK(ha.stats.helperWrites > 0u);
+  CHECK(discovery.writeControl(probe, "1"));
+  CHECK_EQ(ha.state("sensor.probe"), "1");
+}
+
+TEST(local_vs_rest_latency) {
+  Broker broker;
+  broker.listen(BROKER_HOST, 1883);
+  HomeAssistant ha(&broker);
+  // HA reached through a cloud relay; the broker is on the LAN
+  ha.faults.latencyMs = 80;
+  sim::network().connectMs = 5;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  for (int i = 0; i < 20; i++) CHECK(discovery.writeControl(probe, String(i)));
+
+  CHECK(discovery.setLocalBroker(BROKER_HOST));
+  for (int i = 0; i < 20; i++) CHECK(discovery.writeControl(probe, String(i)));
+  sim::drain();
+
+  HARequestStats stats = discovery.getRequestStats();
+  HALatencyStats rest = stats.ops[OP_STATE_POST];
+  HALatencyStats local = stats.ops[OP_LOCAL_PUBLISH];
+  CHECK_EQ(rest.count, 20u);
+  CHECK(local.count >= 20u);
+  CHECK(local.averageMs() < rest.averageMs());
+  check::report("local_vs_rest_latency", "rest_avg", rest.averageMs(), "ms");
+  check::report("local_vs_rest_latency", "local_avg", local.averageMs(), "ms");
+}
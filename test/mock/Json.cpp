@@ -0,0 +1,391 @@
+#include "Json.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace mock {
+
+namespace {
+
+struct Parser {
+  const std::string& text;
+  size_t position;
+
+  explicit Parser(const std::string& input) : text(input), position(0) {}
+
+  void skipSpace() {
+    while (position < text.size() && (text[position] == ' ' || text[position] == '\t' || text[position] == '\n' ||
+                                      text[position] == '\r')) {
+      position++;
+    }
+  }
+
+  bool literal(const char* word) {
+    size_t length = strlen(word);
+    if (text.compare(position, length, word) != 0) return false;
+    position += length;
+    return true;
+  }
+
+  static void putUtf8(std::string& out, unsigned long code) {
+    if (code < 0x80) {
+      out += (char)code;
+    } else if (code < 0x800) {
+      out += (char)(0xC0 | (code >> 6));
+      out += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      out += (char)(0xE0 | (code >> 12));
+      out += (char)(0x80 | ((code >> 6) & 0x3F));
+      out += (char)(0x80 | (code & 0x3F));
+    } else {
+      out += (char)(0xF0 | (code >> 18));
+      out += (char)(0x80 | ((code >> 12) & 0x3F));
+      out += (char)(0x80 | ((code >> 6) & 0x3F));
+      out += (char)(0x80 | (code & 0x3F));
+    }
+  }
+
+  bool hex4(unsigned long& code) {
+    if (position + 4 > text.size()) return false;
+    code = 0;
+    for (int i = 0; i < 4; i++) {
+      char c = text[position++];
+      code <<= 4;
+      if (c >= '0' && c <= '9') {
+        code |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        code |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        code |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool string(std::string& out) {
+    if (position >= text.size() || text[position] != '"') return false;
+    position++;
+    while (position < text.size()) {
+      char c = text[position++];
+      if (c == '"') return true;
+      if ((unsigned char)c < 0x20) return false;
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (position >= text.size()) return false;
+      char escape = text[position++];
+      switch (escape) {
+        case '"':
+        case '\\':
+        case '/':
+          out += escape;
+          break;
+        case 'b':
+          out += '\b';
+          break;
+        case 'f':
+          out += '\f';
+          break;
+        case 'n':
+          out += '\n';
+          break;
+        case 'r':
+          out += '\r';
+          break;
+        case 't':
+          out += '\t';
+          break;
+        case 'u': {
+          unsigned long code;
+          if (!hex4(code)) return false;
+          if (code >= 0xD800 && code < 0xDC00) {
+            unsigned long low;
+            if (!literal("\\u") || !hex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          }
+          putUtf8(out, code);
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+    return false;
+  }
+
+  bool value(Json& out, int depth) {
+    if (depth > 64) return false;
+    skipSpace();
+    if (position >= text.size()) return false;
+    char c = text[position];
+    if (c == '{') {
+      position++;
+      out = Json::object();
+      skipSpace();
+      if (position < text.size() && text[position] == '}') {
+        position++;
+        return true;
+      }
+      while (true) {
+        skipSpace();
+        std::string key;
+        if (!string(key)) return false;
+        skipSpace();
+        if (position >= text.size() || text[position++] != ':') return false;
+        Json member;
+        if (!value(member, depth + 1)) return false;
+        out.set(key, member);
+        skipSpace();
+        if (position >= text.size()) return false;
+        char next = text[position++];
+        if (next == '}') return true;
+        if (next != ',') return false;
+      }
+    }
+    if (c == '[') {
+      position++;
+      out = Json::array();
+      skipSpace();
+      if (position < text.size() && text[position] == ']') {
+        position++;
+        return true;
+      }
+      while (true) {
+        Json item;
+        if (!value(item, depth + 1)) return false;
+        out.push(item);
+        skipSpace();
+        if (position >= text.size()) return false;
+        char next = text[position++];
+        if (next == ']') return true;
+        if (next != ',') return false;
+      }
+    }
+    if (c == '"') {
+      std::string s;
+      if (!string(s)) return false;
+      out = Json::of(s);
+      return true;
+    }
+    if (literal("true")) {
+      out = Json::of(true);
+      return true;
+    }
+    if (literal("false")) {
+      out = Json::of(false);
+      return true;
+    }
+    if (literal("null")) {
+      out = Json();
+      return true;
+    }
+    size_t start = position;
+    if (text[position] == '-') position++;
+    if (position >= text.size() || !isdigit((unsigned char)text[position])) return false;
+    if (text[position] == '0') {
+      position++;
+    } else {
+      while (position < text.size() && isdigit((unsigned char)text[position])) position++;
+    }
+    if (position < text.size() && text[position] == '.') {
+      position++;
+      if (position >= text.size() || !isdigit((unsigned char)text[position])) return false;
+      while (position < text.size() && isdigit((unsigned char)text[position])) position++;
+    }
+    if (position < text.size() && (text[position] == 'e' || text[position] == 'E')) {
+      position++;
+      if (position < text.size() && (text[position] == '+' || text[position] == '-')) position++;
+      if (position >= text.size() || !isdigit((unsigned char)text[position])) return false;
+      while (position < text.size() && isdigit((unsigned char)text[position])) position++;
+    }
+    out = Json::of(strtod(text.c_str() + start, nullptr));
+    out.text = text.substr(start, position - start);
+    return true;
+  }
+};
+
+const Json& nullValue() {
+  static Json* value = new Json();
+  return *value;
+}
+
+}  // namespace
+
+Json Json::of(bool value) {
+  Json json;
+  json.type = BOOLEAN;
+  json.boolean = value;
+  return json;
+}
+
+Json Json::of(double value) {
+  Json json;
+  json.type = NUMBER;
+  json.number = value;
+  return json;
+}
+
+Json Json::of(const std::string& value) {
+  Json json;
+  json.type = STRING;
+  json.text = value;
+  return json;
+}
+
+Json Json::array() {
+  Json json;
+  json.type = ARRAY;
+  return json;
+}
+
+Json Json::object() {
+  Json json;
+  json.type = OBJECT;
+  return json;
+}
+
+bool Json::parse(const std::string& text, Json& out) {
+  Parser parser(text);
+  if (!parser.value(out, 0)) return false;
+  parser.skipSpace();
+  return parser.position == text.size();
+}
+
+std::string quote(const std::string& text) {
+  std::string out = "\"";
+  for (unsigned char c : text) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          char escape[8];
+          snprintf(escape, sizeof(escape), "\\u%04x", c);
+          out += escape;
+        } else {
+          out += (char)c;
+        }
+    }
+  }
+  return out + "\"";
+}
+
+std::string Json::dump() const {
+  switch (type) {
+    case NUL:
+      return "null";
+    case BOOLEAN:
+      return boolean ? "true" : "false";
+    case NUMBER: {
+      if (!text.empty()) return text;
+      if (!isfinite(number)) return "null";
+      char buffer[32];
+      if (number == floor(number) && fabs(number) < 1e15) {
+        snprintf(buffer, sizeof(buffer), "%.0f", number);
+      } else {
+        snprintf(buffer, sizeof(buffer), "%.17g", number);
+      }
+      return buffer;
+    }
+    case STRING:
+      return quote(text);
+    case ARRAY: {
+      std::string out = "[";
+      for (size_t i = 0; i < items.size(); i++) {
+        if (i) out += ",";
+        out += items[i].dump();
+      }
+      return out + "]";
+    }
+    case OBJECT: {
+      std::string out = "{";
+      for (size_t i = 0; i < members.size(); i++) {
+        if (i) out += ",";
+        out += quote(members[i].first) + ":" + members[i].second.dump();
+      }
+      return out + "}";
+    }
+  }
+  return "null";
+}
+
+const Json& Json::operator[](const std::string& key) const {
+  for (const auto& member : members) {
+    if (member.first == key) return member.second;
+  }
+  return nullValue();
+}
+
+Json& Json::set(const std::string& key, const Json& value) {
+  type = OBJECT;
+  for (auto& member : members) {
+    if (member.first == key) {
+      member.second = value;
+      return member.second;
+    }
+  }
+  members.emplace_back(key, value);
+  return members.back().second;
+}
+
+bool Json::has(const std::string& key) const {
+  for (const auto& member : members) {
+    if (member.first == key) return true;
+  }
+  return false;
+}
+
+void Json::erase(const std::string& key) {
+  for (auto it = members.begin(); it != members.end(); ++it) {
+    if (it->first == key) {
+      members.erase(it);
+      return;
+    }
+  }
+}
+
+const Json& Json::operator[](size_t index) const {
+  return index < items.size() ? items[index] : nullValue();
+}
+
+void Json::push(const Json& value) {
+  type = ARRAY;
+  items.push_back(value);
+}
+
+size_t Json::size() const {
+  return type == ARRAY ? items.size() : members.size();
+}
+
+std::string Json::asString() const {
+  if (type == STRING) return text;
+  if (type == NUL) return "";
+  return dump();
+}
+
+double Json::asNumber() const {
+  if (type == NUMBER) return number;
+  if (type == BOOLEAN) return boolean ? 1 : 0;
+  if (type == STRING) return atof(text.c_str());
+  return 0;
+}
+
+}  // namespace mock
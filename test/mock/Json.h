@@ -0,0 +1,62 @@
+#ifndef MOCK_JSON_H
+#define MOCK_JSON_H
+
+// A small JSON document model for the mocks. It is independent of the
+// library's reader and writer on purpose, so one can check the other.
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mock {
+
+class Json {
+public:
+  enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+  Json() : type(NUL), boolean(false), number(0) {}
+  static Json null() { return Json(); }
+  static Json of(bool value);
+  static Json of(double value);
+  static Json of(const std::string& value);
+  static Json of(const char* value) { return of(std::string(value)); }
+  static Json array();
+  static Json object();
+
+  // Returns false on malformed input or trailing garbage
+  static bool parse(const std::string& text, Json& out);
+  std::string dump() const;
+
+  bool isNull() const { return type == NUL; }
+  bool isString() const { return type == STRING; }
+  bool isObject() const { return type == OBJECT; }
+  bool isArray() const { return type == ARRAY; }
+
+  // Object access; a missing member reads as null
+  const Json& operator[](const std::string& key) const;
+  Json& set(const std::string& key, const Json& value);
+  bool has(const std::string& key) const;
+  void erase(const std::string& key);
+
+  // Array access
+  const Json& operator[](size_t index) const;
+  void push(const Json& value);
+  size_t size() const;
+
+  std::string asString() const;  // numbers and booleans as text too
+  double asNumber() const;
+
+  Type type;
+  bool boolean;
+  double number;
+  std::string text;  // string value, or a number's original spelling
+  std::vector<Json> items;
+  std::vector<std::pair<std::string, Json>> members;
+};
+
+std::string quote(const std::string& text);
+
+}  // namespace mock
+
+#endif
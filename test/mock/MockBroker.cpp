@@ -0,0 +1,213 @@
+#include "MockBroker.h"
+#include <algorithm>
+
+namespace mock {
+
+std::string mqttPacket(uint8_t header, const std::string& body) {
+  std::string packet(1, (char)header);
+  size_t remaining = body.size();
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    packet += (char)(remaining ? digit | 0x80 : digit);
+  } while (remaining);
+  return packet + body;
+}
+
+static std::string lengthPrefixed(const std::string& text) {
+  std::string out;
+  out += (char)((text.size() >> 8) & 0xFF);
+  out += (char)(text.size() & 0xFF);
+  return out + text;
+}
+
+Broker::Broker() : deliveryMs(0), stats(), _port(0) {}
+
+Broker::~Broker() {
+  stop();
+}
+
+void Broker::listen(const std::string& host, uint16_t port) {
+  _host = host;
+  _port = port;
+  sim::network().listen(host, port, this);
+}
+
+void Broker::stop() {
+  if (_port) sim::network().unlisten(_host, _port);
+  _port = 0;
+}
+
+bool Broker::matches(const std::string& filter, const std::string& topic) {
+  size_t f = 0;
+  size_t t = 0;
+  while (f < filter.size()) {
+    if (filter[f] == '#') return true;
+    if (filter[f] == '+') {
+      while (t < topic.size() && topic[t] != '/') t++;
+      f++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t]) {
+      // "a/#" also matches "a"
+      return t >= topic.size() && filter.compare(f, std::string::npos, "/#") == 0;
+    }
+    f++;
+    t++;
+  }
+  return t == topic.size();
+}
+
+void Broker::subscribe(const std::string& filter, Handler handler) {
+  _handlers.emplace_back(filter, handler);
+  for (const auto& message : _retained) {
+    if (matches(filter, message.first)) handler(message.first, message.second, true);
+  }
+}
+
+bool Broker::retained(const std::string& topic, std::string& payload) const {
+  auto found = _retained.find(topic);
+  if (found == _retained.end()) return false;
+  payload = found->second;
+  return true;
+}
+
+void Broker::publish(const std::string& topic, const std::string& payload, bool retain) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  stats.publishes++;
+  history.emplace_back(topic, payload);
+  if (retain) {
+    if (payload.empty()) {
+      _retained.erase(topic);
+    } else {
+      _retained[topic] = payload;
+    }
+  }
+  // Handlers may subscribe or publish in turn, so iterate over a copy
+  auto handlers = _handlers;
+  for (const auto& handler : handlers) {
+    if (matches(handler.first, topic)) handler.second(topic, payload, false);
+  }
+  auto sessions = _sessions;
+  for (const auto& session : sessions) {
+    for (const std::string& filter : session->filters) {
+      if (matches(filter, topic)) {
+        deliver(session, topic, payload, false);
+        break;
+      }
+    }
+  }
+}
+
+void Broker::deliver(const std::shared_ptr<Session>& session, const std::string& topic, const std::string& payload,
+                     bool retain) {
+  std::string packet = mqttPacket(0x30 | (retain ? 0x01 : 0x00), lengthPrefixed(topic) + payload);
+  std::weak_ptr<sim::Connection> weak = session->connection;
+  auto send = [this, weak, packet]() {
+    auto connection = weak.lock();
+    if (!connection || !connection->isOpen()) return;
+    stats.delivered++;
+    connection->send(packet);
+  };
+  if (deliveryMs) {
+    sim::after(deliveryMs, send);
+  } else {
+    send();
+  }
+}
+
+void Broker::accepted(const std::shared_ptr<sim::Connection>& connection) {
+  auto session = std::make_shared<Session>();
+  session->connection = connection;
+  session->connected = false;
+  connection->state = session;
+  _sessions.push_back(session);
+}
+
+void Broker::closed(const std::shared_ptr<sim::Connection>& connection) {
+  auto session = std::static_pointer_cast<Session>(connection->state);
+  _sessions.erase(std::remove(_sessions.begin(), _sessions.end(), session), _sessions.end());
+}
+
+void Broker::received(const std::shared_ptr<sim::Connection>& connection) {
+  auto session = std::static_pointer_cast<Session>(connection->state);
+  std::string& in = connection->inbound;
+  while (in.size() >= 2) {
+    size_t remaining = 0;
+    size_t multiplier = 1;
+    size_t offset = 1;
+    bool complete = false;
+    while (offset < in.size() && offset < 5) {
+      uint8_t digit = (uint8_t)in[offset++];
+      remaining += (digit & 0x7F) * multiplier;
+      multiplier *= 128;
+      if (!(digit & 0x80)) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete || in.size() < offset + remaining) return;
+    uint8_t header = (uint8_t)in[0];
+    std::string body = in.substr(offset, remaining);
+    in.erase(0, offset + remaining);
+    handlePacket(session, header, body);
+    if (!connection->isOpen()) return;
+  }
+}
+
+void Broker::handlePacket(const std::shared_ptr<Session>& session, uint8_t header, const std::string& body) {
+  auto connection = session->connection.lock();
+  if (!connection) return;
+  uint8_t type = header & 0xF0;
+
+  if (type == 0x10) {
+    // CONNECT; any client id and credentials are accepted
+    stats.connects++;
+    session->connected = true;
+    connection->send(std::string("\x20\x02\x00\x00", 4));
+    return;
+  }
+  if (!session->connected) {
+    connection->close();
+    return;
+  }
+
+  if (type == 0x30) {
+    if (body.size() < 2) return;
+    size_t topicLength = ((uint8_t)body[0] << 8) | (uint8_t)body[1];
+    size_t qos = (header >> 1) & 0x03;
+    size_t payloadStart = 2 + topicLength + (qos ? 2 : 0);
+    if (payloadStart > body.size()) return;
+    publish(body.substr(2, topicLength), body.substr(payloadStart), header & 0x01);
+  } else if (type == 0x80) {
+    // SUBSCRIBE: packet id, then (length, filter, qos) entries
+    std::string granted;
+    std::vector<std::string> added;
+    size_t offset = 2;
+    while (offset + 2 <= body.size()) {
+      size_t length = ((uint8_t)body[offset] << 8) | (uint8_t)body[offset + 1];
+      std::string filter = body.substr(offset + 2, length);
+      offset += 2 + length + 1;
+      session->filters.push_back(filter);
+      added.push_back(filter);
+      granted += '\0';
+    }
+    connection->send(mqttPacket(0x90, body.substr(0, 2) + granted));
+    for (const auto& message : _retained) {
+      for (const std::string& filter : added) {
+        if (matches(filter, message.first)) {
+          deliver(session, message.first, message.second, true);
+          break;
+        }
+      }
+    }
+  } else if (type == 0xC0) {
+    stats.pings++;
+    connection->send(std::string("\xD0\x00", 2));
+  } else if (type == 0xE0) {
+    connection->close();
+    closed(connection);
+  }
+}
+
+}  // namespace mock
@@ -0,0 +1,75 @@
+#ifndef MOCK_BROKER_H
+#define MOCK_BROKER_H
+
+// MQTT 3.1.1 broker subset: CONNECT, QoS 0 PUBLISH (retained or not),
+// SUBSCRIBE with + and # wildcards, PINGREQ and DISCONNECT. It is also the
+// message bus of the mock Home Assistant, which subscribes in-process; a
+// broker that isn't listen()ing is only that bus.
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Sim.h"
+
+namespace mock {
+
+struct BrokerStats {
+  uint32_t connects;
+  uint32_t publishes;  // PUBLISH packets and in-process publishes
+  uint32_t delivered;  // PUBLISH packets sent to network subscribers
+  uint32_t pings;
+};
+
+class Broker : public sim::Server {
+public:
+  typedef std::function<void(const std::string& topic, const std::string& payload, bool retain)> Handler;
+
+  Broker();
+  ~Broker();
+
+  void listen(const std::string& host = "broker.local", uint16_t port = 1883);
+  void stop();
+
+  void publish(const std::string& topic, const std::string& payload, bool retain);
+  void subscribe(const std::string& filter, Handler handler);
+  bool retained(const std::string& topic, std::string& payload) const;
+  const std::map<std::string, std::string>& retainedMessages() const { return _retained; }
+
+  static bool matches(const std::string& filter, const std::string& topic);
+
+  // Delay before a message reaches network subscribers
+  unsigned long deliveryMs;
+  BrokerStats stats;
+  // Every publish in order, for the tests to inspect
+  std::vector<std::pair<std::string, std::string>> history;
+
+  void accepted(const std::shared_ptr<sim::Connection>& connection) override;
+  void received(const std::shared_ptr<sim::Connection>& connection) override;
+  void closed(const std::shared_ptr<sim::Connection>& connection) override;
+
+private:
+  struct Session {
+    std::weak_ptr<sim::Connection> connection;
+    bool connected;
+    std::vector<std::string> filters;
+  };
+
+  std::string _host;
+  uint16_t _port;
+  std::map<std::string, std::string> _retained;
+  std::vector<std::pair<std::string, Handler>> _handlers;
+  std::vector<std::shared_ptr<Session>> _sessions;
+
+  std::shared_ptr<Session> sessionFor(const std::shared_ptr<sim::Connection>& connection);
+  void handlePacket(const std::shared_ptr<Session>& session, uint8_t header, const std::string& body);
+  void deliver(const std::shared_ptr<Session>& session, const std::string& topic, const std::string& payload,
+               bool retain);
+};
+
+std::string mqttPacket(uint8_t header, const std::string& body);
+
+}  // namespace mock
+
+#endif
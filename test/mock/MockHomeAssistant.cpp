@@ -0,0 +1,1051 @@
+#include "MockHomeAssistant.h"
+#include <time.h>
+#include <algorithm>
+#include <regex>
+
+namespace mock {
+
+struct HomeAssistant::Session {
+  std::weak_ptr<sim::Connection> connection;
+  bool websocket;
+  bool authed;
+  std::string message;  // text of a fragmented WebSocket message so far
+  std::map<std::string, int> subscriptions;  // entity id -> subscription id
+  double lastId;
+
+  Session() : websocket(false), authed(false), lastId(0) {}
+};
+
+static const char* reason(int code) {
+  switch (code) {
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Unknown";
+  }
+}
+
+static std::string message(const std::string& text) {
+  return "{\"message\":" + quote(text) + "}";
+}
+
+// Characters, as HA counts them for the 255 limit
+static size_t characters(const std::string& text) {
+  size_t count = 0;
+  for (unsigned char c : text) {
+    if ((c & 0xC0) != 0x80) count++;
+  }
+  return count;
+}
+
+// HA decodes request bodies as UTF-8 before parsing them
+static bool validUtf8(const std::string& text) {
+  for (size_t i = 0; i < text.size();) {
+    unsigned char lead = text[i];
+    size_t width = lead < 0x80 ? 1 : (lead & 0xE0) == 0xC0 ? 2 : (lead & 0xF0) == 0xE0 ? 3 : (lead & 0xF8) == 0xF0 ? 4 : 0;
+    if (width == 0 || i + width > text.size()) return false;
+    for (size_t j = 1; j < width; j++) {
+      if (((unsigned char)text[i + j] & 0xC0) != 0x80) return false;
+    }
+    i += width;
+  }
+  return true;
+}
+
+HomeAssistant::HomeAssistant(Broker* bus, const std::string& host, uint16_t port)
+  : token("test-token"), automationDelayMs(30), automationRunMs(120), discoveryDelayMs(20), automationQueueMax(5),
+    automationEnabled(true), stateBatchEnabled(true), stateBatchEvent("hamqtt_states"), refuseSubscriptions(0), _host(host), _port(port),
+    _bus(bus), _running(false), _random(0), _seededWith(0) {
+  if (!_bus) {
+    _ownBus.reset(new Broker());
+    _bus = _ownBus.get();
+  }
+  _bus->subscribe("homeassistant/+/+/config", [this](const std::string& topic, const std::string& payload, bool) {
+    std::string config = payload;
+    sim::after(discoveryDelayMs, [this, topic, config]() { discover(topic, config); });
+  });
+  _bus->subscribe("#", [this](const std::string& topic, const std::string& payload, bool) {
+    mqttMessage(topic, payload);
+  });
+  sim::network().listen(host, port, this);
+}
+
+HomeAssistant::~HomeAssistant() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  sim::network().unlisten(_host, _port);
+  for (const auto& session : _sessions) {
+    auto connection = session->connection.lock();
+    if (!connection) continue;
+    connection->open = false;
+    connection->server = nullptr;
+  }
+}
+
+std::string HomeAssistant::url() const {
+  return "http://" + _host + ":" + std::to_string(_port);
+}
+
+std::string HomeAssistant::helperId(int bank, int index) {
+  if (bank == 0) return "input_text.mqtt_buffer_" + std::to_string(index);
+  return "input_text.mqtt_bank" + std::to_string(bank + 1) + "_" + std::to_string(index);
+}
+
+void HomeAssistant::installHelpers(int banks, int buffers, int max) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  for (int bank = 0; bank < banks; bank++) {
+    for (int index = 1; index <= 6; index++) {
+      if (index > buffers && index != 6) continue;
+      std::string id = helperId(bank, index);
+      Json attributes = Json::object();
+      attributes.set("initial", Json());
+      attributes.set("editable", Json::of(true));
+      attributes.set("min", Json::of(0.0));
+      attributes.set("max", Json::of((double)(index == 6 ? 255 : max)));
+      attributes.set("pattern", Json());
+      attributes.set("mode", Json::of("text"));
+      attributes.set("friendly_name", Json::of(id.substr(11)));
+      _helperAttributes[id] = attributes;
+      changeState(id, "", attributes, true);
+    }
+  }
+}
+
+bool HomeAssistant::has(const std::string& entityId) const {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  return _entities.count(entityId) != 0;
+}
+
+std::string HomeAssistant::state(const std::string& entityId) const {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  auto found = _entities.find(entityId);
+  return found == _entities.end() ? "" : found->second.state;
+}
+
+const Entity* HomeAssistant::entity(const std::string& entityId) const {
+  auto found = _entities.find(entityId);
+  return found == _entities.end() ? nullptr : &found->second;
+}
+
+void HomeAssistant::setState(const std::string& entityId, const std::string& state, const Json& attributes) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  changeState(entityId, state, attributes, false);
+}
+
+void HomeAssistant::remove(const std::string& entityId) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  _entities.erase(entityId);
+}
+
+bool HomeAssistant::command(const std::string& entityId, const std::string& payload) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  const Entity* found = entity(entityId);
+  if (!found || !found->config["command_topic"].isString()) return false;
+  _bus->publish(found->config["command_topic"].text, payload, false);
+  return true;
+}
+
+void HomeAssistant::addNoiseEntities(int count) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  for (int i = 0; i < count; i++) {
+    Json attributes = Json::object();
+    attributes.set("state_class", Json::of("measurement"));
+    attributes.set("unit_of_measurement", Json::of("\xC2\xB0" "C"));
+    attributes.set("device_class", Json::of("temperature"));
+    attributes.set("friendly_name", Json::of("Room " + std::to_string(i) + " temperature"));
+    changeState("sensor.room_" + std::to_string(i) + "_temperature", std::to_string(18 + i % 7) + ".5",
+                attributes, true);
+  }
+}
+
+void HomeAssistant::dropWebSockets() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  for (const auto& session : _sessions) {
+    auto connection = session->connection.lock();
+    if (session->websocket && connection) connection->close();
+  }
+}
+
+bool HomeAssistant::logContains(const std::string& text) const {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  for (const std::string& line : log) {
+    if (line.find(text) != std::string::npos) return true;
+  }
+  return false;
+}
+
+uint32_t HomeAssistant::roll() {
+  if (_seededWith != faults.seed || !_random) {
+    _seededWith = faults.seed;
+    _random = (uint64_t)faults.seed * 0x9E3779B97F4A7C15ULL + 1;
+  }
+  _random ^= _random >> 12;
+  _random ^= _random << 25;
+  _random ^= _random >> 27;
+  return (uint32_t)((_random * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// ---- Connections and HTTP ----
+
+void HomeAssistant::accepted(const std::shared_ptr<sim::Connection>& connection) {
+  // Connections this side closed never report closed(); forget them here
+  _sessions.erase(std::remove_if(_sessions.begin(), _sessions.end(),
+                                 [](const std::shared_ptr<Session>& session) {
+                                   auto live = session->connection.lock();
+                                   return !live || !live->isOpen();
+                                 }),
+                  _sessions.end());
+  auto session = std::make_shared<Session>();
+  session->connection = connection;
+  connection->state = session;
+  _sessions.push_back(session);
+}
+
+void HomeAssistant::closed(const std::shared_ptr<sim::Connection>& connection) {
+  auto session = std::static_pointer_cast<Session>(connection->state);
+  _sessions.erase(std::remove(_sessions.begin(), _sessions.end(), session), _sessions.end());
+}
+
+void HomeAssistant::received(const std::shared_ptr<sim::Connection>& connection) {
+  auto session = std::static_pointer_cast<Session>(connection->state);
+  Request request;
+  while (!session->websocket && parseRequest(connection->inbound, request)) {
+    handle(connection, request);
+    if (!connection->isOpen()) return;
+  }
+  if (session->websocket) wsReceived(connection, session);
+}
+
+bool HomeAssistant::parseRequest(std::string& in, Request& request) {
+  size_t end = in.find("\r\n\r\n");
+  if (end == std::string::npos) return false;
+
+  request = Request();
+  size_t lineEnd = in.find("\r\n");
+  std::string line = in.substr(0, lineEnd);
+  size_t space = line.find(' ');
+  size_t second = line.find(' ', space + 1);
+  request.method = line.substr(0, space);
+  request.path = line.substr(space + 1, second - space - 1);
+
+  size_t position = lineEnd + 2;
+  while (position < end) {
+    size_t next = in.find("\r\n", position);
+    std::string header = in.substr(position, next - position);
+    size_t colon = header.find(':');
+    if (colon != std::string::npos) {
+      std::string name = header.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      size_t valueStart = header.find_first_not_of(' ', colon + 1);
+      request.headers[name] = valueStart == std::string::npos ? "" : header.substr(valueStart);
+    }
+    position = next + 2;
+  }
+
+  size_t length = 0;
+  auto contentLength = request.headers.find("content-length");
+  if (contentLength != request.headers.end()) length = strtoul(contentLength->second.c_str(), nullptr, 10);
+  if (in.size() < end + 4 + length) return false;
+  request.body = in.substr(end + 4, length);
+  stats.bytesIn += end + 4 + length;
+  in.erase(0, end + 4 + length);
+  return true;
+}
+
+void HomeAssistant::handle(const std::shared_ptr<sim::Connection>& connection, const Request& request) {
+  // A request on a kept-alive connection restarts its idle timer
+  connection->closeAt = 0;
+
+  auto upgradeHeader = request.headers.find("upgrade");
+  if (request.path == "/api/websocket" && upgradeHeader != request.headers.end()) {
+    upgrade(connection, request);
+    return;
+  }
+
+  stats.requests++;
+  uint32_t chance = roll() % 100;
+  if (chance < faults.lossPercent) {
+    stats.lost++;
+    if (faults.lossResets) connection->close();
+    return;
+  }
+
+  Response response;
+  if (chance < (uint32_t)faults.lossPercent + faults.errorPercent || request.path == faults.errorPath) {
+    stats.errors++;
+    response = Response{503, message("Service Unavailable"), "application/json"};
+  } else {
+    response = route(request);
+  }
+
+  auto connectionHeader = request.headers.find("connection");
+  bool close = connectionHeader != request.headers.end() && connectionHeader->second == "close";
+  sendResponse(connection, response, close);
+}
+
+void HomeAssistant::sendResponse(const std::shared_ptr<sim::Connection>& connection, const Response& response,
+                                 bool close) {
+  std::string text = "HTTP/1.1 " + std::to_string(response.code) + " " + reason(response.code) + "\r\n";
+  text += "Content-Type: " + response.contentType + "\r\n";
+  text += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+  if (close) text += "Connection: close\r\n";
+  text += "\r\n";
+  text += response.body;
+  stats.bytesOut += text.size();
+
+  std::weak_ptr<sim::Connection> weak = connection;
+  unsigned long idle = faults.idleTimeoutMs;
+  auto send = [weak, text, close, idle]() {
+    auto target = weak.lock();
+    if (!target || !target->isOpen()) return;
+    target->send(text);
+    if (close) {
+      target->close();
+    } else if (idle) {
+      target->closeAt = sim::now() + idle;
+    }
+  };
+  if (faults.latencyMs) {
+    sim::after(faults.latencyMs, send);
+  } else {
+    send();
+  }
+}
+
+HomeAssistant::Response HomeAssistant::route(const Request& request) {
+  auto authorization = request.headers.find("authorization");
+  if (authorization == request.headers.end() || authorization->second != "Bearer " + token) {
+    return Response{401, "401: Unauthorized", "text/plain"};
+  }
+
+  const std::string& path = request.path;
+  if (request.method == "GET") {
+    if (path == "/api/") return Response{200, message("API running."), "application/json"};
+    if (path == "/api/states") return getStates("");
+    if (path.compare(0, 12, "/api/states/") == 0) return getStates(path.substr(12));
+  } else if (request.method == "POST") {
+    if (path.compare(0, 12, "/api/states/") == 0) return postState(path.substr(12), request.body);
+    if (path == "/api/template") return renderTemplate(request.body);
+    if (path.compare(0, 14, "/api/services/") == 0) {
+      std::string rest = path.substr(14);
+      size_t slash = rest.find('/');
+      if (slash != std::string::npos) return callService(rest.substr(0, slash), rest.substr(slash + 1), request.body);
+    }
+    if (path.compare(0, 12, "/api/events/") == 0) return fireEvent(path.substr(12), request.body);
+  }
+  return Response{404, message("Not found"), "application/json"};
+}
+
+std::string HomeAssistant::isoTime(unsigned long ms) {
+  // The virtual clock starts at 2024-01-01T00:00:00Z
+  time_t seconds = 1704067200 + ms / 1000;
+  struct tm parts;
+  gmtime_r(&seconds, &parts);
+  char text[48];
+  snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%06lu+00:00", parts.tm_year + 1900, parts.tm_mon + 1,
+           parts.tm_mday, parts.tm_hour, parts.tm_min, parts.tm_sec, (ms % 1000) * 1000);
+  return text;
+}
+
+Json HomeAssistant::stateJson(const std::string& entityId, const Entity& entity) const {
+  Json json = Json::object();
+  json.set("entity_id", Json::of(entityId));
+  json.set("state", Json::of(entity.state));
+  json.set("attributes", entity.attributes);
+  json.set("last_changed", Json::of(isoTime(entity.lastChanged)));
+  json.set("last_reported", Json::of(isoTime(entity.lastUpdated)));
+  json.set("last_updated", Json::of(isoTime(entity.lastUpdated)));
+  Json context = Json::object();
+  context.set("id", Json::of("01HQ3Z5V8M2N4P6R8T0W2Y4A6C"));
+  context.set("parent_id", Json());
+  context.set("user_id", Json());
+  json.set("context", context);
+  return json;
+}
+
+HomeAssistant::Response HomeAssistant::getStates(const std::string& entityId) {
+  if (entityId.empty()) {
+    Json all = Json::array();
+    for (const auto& entry : _entities) all.push(stateJson(entry.first, entry.second));
+    return Response{200, all.dump(), "application/json"};
+  }
+  stats.stateReads++;
+  if (entityId.compare(0, 11, "input_text.") == 0) stats.helperReads++;
+  const Entity* found = entity(entityId);
+  if (!found) return Response{404, message("Entity not found."), "application/json"};
+  return Response{200, stateJson(entityId, *found).dump(), "application/json"};
+}
+
+HomeAssistant::Response HomeAssistant::postState(const std::string& entityId, const std::string& body) {
+  Json data;
+  if (!validUtf8(body) || !Json::parse(body, data) || !data.isObject()) {
+    return Response{400, message("Invalid JSON specified."), "application/json"};
+  }
+  if (!data.has("state")) return Response{400, message("No state specified."), "application/json"};
+  std::string state = data["state"].asString();
+  if (characters(state) > 255) {
+    return Response{400,
+                    message("Invalid state with length " + std::to_string(characters(state)) +
+                            ". State max length is 255 characters."),
+                    "application/json"};
+  }
+
+  bool existed = has(entityId);
+  if (entityId.compare(0, 16, "input_text.mqtt_") == 0) {
+    stats.helperWrites++;
+  } else {
+    stats.stateWrites++;
+  }
+  // Like HA, the attributes are replaced; a helper loses its max until the
+  // automation's input_text.set_value restores it
+  Json attributes = data["attributes"].isObject() ? data["attributes"] : Json::object();
+  changeState(entityId, state, attributes, false);
+  return Response{existed ? 200 : 201, stateJson(entityId, _entities[entityId]).dump(), "application/json"};
+}
+
+void HomeAssistant::changeState(const std::string& entityId, const std::string& state, const Json& attributes,
+                                bool force) {
+  auto found = _entities.find(entityId);
+  bool created = found == _entities.end();
+  Entity& entity = _entities[entityId];
+  bool stateChangedNow = created || entity.state != state;
+  bool attributesChanged = created || entity.attributes.dump() != attributes.dump();
+  if (!force && !stateChangedNow && !attributesChanged) return;
+
+  unsigned long now = sim::now();
+  if (stateChangedNow) entity.lastChanged = now;
+  entity.lastUpdated = now;
+  entity.state = state;
+  entity.attributes = attributes;
+
+  // subscribe_entities reports only what changed
+  for (const auto& session : _sessions) {
+    auto subscription = session->subscriptions.find(entityId);
+    auto connection = session->connection.lock();
+    if (!session->websocket || subscription == session->subscriptions.end() || !connection) continue;
+    Json diff = Json::object();
+    if (stateChangedNow) {
+      diff.set("s", Json::of(state));
+      diff.set("lc", Json::of(now / 1000.0));
+    }
+    if (attributesChanged) diff.set("a", attributes);
+    Json change = Json::object();
+    change.set("+", diff);
+    Json changes = Json::object();
+    changes.set(entityId, change);
+    Json event = Json::object();
+    event.set("c", changes);
+    Json envelope = Json::object();
+    envelope.set("id", Json::of((double)subscription->second));
+    envelope.set("type", Json::of("event"));
+    envelope.set("event", event);
+    wsSend(connection, envelope.dump());
+  }
+
+  if (stateChangedNow || attributesChanged) stateChanged(entityId, state);
+}
+
+void HomeAssistant::setHelperValue(const std::string& entityId, const std::string& value) {
+  // input_text.set_value writes the helper's own state, attributes included
+  auto attributes = _helperAttributes.find(entityId);
+  changeState(entityId, value, attributes == _helperAttributes.end() ? Json::object() : attributes->second, false);
+}
+
+// ---- Templates ----
+
+static std::vector<std::string> quotedStrings(const std::string& text) {
+  // Jinja string literals in single quotes, with \' and \\ escapes
+  std::vector<std::string> out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] != '\'') continue;
+    std::string value;
+    size_t j = i + 1;
+    for (; j < text.size() && text[j] != '\''; j++) {
+      if (text[j] == '\\' && j + 1 < text.size()) j++;
+      value += text[j];
+    }
+    out.push_back(value);
+    i = j;
+  }
+  return out;
+}
+
+static std::string htmlSafe(const std::string& json) {
+  std::string out;
+  for (char c : json) {
+    switch (c) {
+      case '<':
+        out += "\\u003c";
+        break;
+      case '>':
+        out += "\\u003e";
+        break;
+      case '&':
+        out += "\\u0026";
+        break;
+      case '\'':
+        out += "\\u0027";
+        break;
+      default:
+        out += c;
+    }
+  }
+  return out;
+}
+
+HomeAssistant::Response HomeAssistant::renderTemplate(const std::string& body) {
+  stats.templates++;
+  Json data;
+  if (!Json::parse(body, data) || !data["template"].isString()) {
+    return Response{400, message("Invalid JSON specified."), "application/json"};
+  }
+  const std::string& tmpl = data["template"].text;
+
+  // Helper geometry, as detectHelperGeometry() asks for it
+  if (tmpl.find("state_attr('input_text.mqtt_buffer_' ~ i, 'max')") != std::string::npos) {
+    int limit = 6;
+    size_t range = tmpl.find("range(1, ");
+    if (range != std::string::npos) limit = atoi(tmpl.c_str() + range + 9);
+    int size = 255;
+    size_t start = tmpl.find("size=");
+    if (start != std::string::npos) size = atoi(tmpl.c_str() + start + 5);
+    int count = 0;
+    for (int i = 1; i < limit; i++) {
+      const Entity* helper = entity(helperId(0, i));
+      if (!helper || helper->attributes["max"].type != Json::NUMBER || count != i - 1) continue;
+      count = i;
+      size = std::min(size, (int)helper->attributes["max"].number);
+    }
+    return Response{200, std::to_string(count) + "|" + std::to_string(size), "text/plain"};
+  }
+
+  // Entity states of a list of ids; expand() skips missing ones and sorts
+  size_t expand = tmpl.find("expand([");
+  if (expand != std::string::npos) {
+    size_t close = tmpl.find("])", expand);
+    std::vector<std::string> ids = quotedStrings(tmpl.substr(expand + 8, close - expand - 8));
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    bool json = tmpl.find("tojson") != std::string::npos;
+    std::string out = json ? "[" : "";
+    for (const std::string& id : ids) {
+      const Entity* found = entity(id);
+      if (!found) continue;
+      if (json) {
+        // Jinja's tojson sorts keys and escapes <, >, & and ' for HTML
+        Json item = Json::object();
+        item.set("c", Json::of(isoTime(found->lastChanged)));
+        item.set("e", Json::of(id));
+        item.set("s", Json::of(found->state));
+        if (out.size() > 1) out += ",";
+        out += htmlSafe(item.dump());
+      } else {
+        out += id + "|" + isoTime(found->lastChanged) + "|" + found->state + "\n";
+      }
+    }
+    if (json) out += "]";
+    return Response{200, out, "text/plain"};
+  }
+
+  return Response{400, message("Error rendering template: not understood by the mock"), "application/json"};
+}
+
+// ---- Services and events ----
+
+bool HomeAssistant::discoveryTopicOk(const std::string& topic) const {
+  static const std::regex discovery("^homeassistant/[^/]+/[^/]+/config$");
+  return std::regex_search(topic, discovery) && topic.find('#') == std::string::npos &&
+         topic.find('+') == std::string::npos && (topic.empty() || topic[0] != '$');
+}
+
+bool HomeAssistant::stateTopicOk(const std::string& topic) const {
+  static const std::regex state("^virt/[^/#+]+/state$");
+  return std::regex_search(topic, state);
+}
+
+HomeAssistant::Response HomeAssistant::callService(const std::string& domain, const std::string& service,
+                                                   const std::string& body) {
+  stats.serviceCalls++;
+  Json data;
+  if (!Json::parse(body, data) || !data.isObject()) {
+    return Response{400, message("Invalid JSON specified."), "application/json"};
+  }
+
+  if (domain == "mqtt" && service == "publish") {
+    if (!data["topic"].isString()) return Response{400, message("Invalid service data"), "application/json"};
+    std::string topic = data["topic"].text;
+    _bus->publish(topic, data["payload"].asString(), data["retain"].type == Json::BOOLEAN && data["retain"].boolean);
+    if (discoveryTopicOk(topic)) stats.published++;
+    return Response{200, "[]", "application/json"};
+  }
+
+  if (domain == "script") {
+    // Script.yaml: only discovery topics, always retained
+    std::string topic = data["topic"].asString();
+    std::string payload = data["payload"].asString();
+    if (!discoveryTopicOk(topic)) {
+      log.push_back("Topic rejected (not discovery config): " + topic);
+      stats.rejected++;
+    } else if (characters(payload) > 16384) {
+      log.push_back("Payload too large (" + std::to_string(characters(payload)) + " > 16384) - dropping");
+      stats.rejected++;
+    } else {
+      _bus->publish(topic, payload, true);
+      stats.published++;
+    }
+    return Response{200, "[]", "application/json"};
+  }
+
+  return Response{400, message("Service " + domain + "." + service + " not found."), "application/json"};
+}
+
+HomeAssistant::Response HomeAssistant::fireEvent(const std::string& eventType, const std::string& body) {
+  stats.events++;
+  Json data = Json::object();
+  if (!body.empty() && (!Json::parse(body, data) || !data.isObject())) {
+    return Response{400, message("Event data should be a JSON object"), "application/json"};
+  }
+  if (eventType == stateBatchEvent && stateBatchEnabled) {
+    sim::after(automationDelayMs, [this, data]() { runStateBatch(data); });
+  }
+  return Response{200, message("Event " + eventType + " fired."), "application/json"};
+}
+
+void HomeAssistant::runStateBatch(const Json& data) {
+  stats.stateBatches++;
+  // dictsort: by key, case-insensitively
+  std::vector<std::pair<std::string, Json>> items = data.members;
+  std::stable_sort(items.begin(), items.end(), [](const std::pair<std::string, Json>& a,
+                                                  const std::pair<std::string, Json>& b) {
+    std::string left = a.first;
+    std::string right = b.first;
+    std::transform(left.begin(), left.end(), left.begin(), ::tolower);
+    std::transform(right.begin(), right.end(), right.begin(), ::tolower);
+    return left < right;
+  });
+  for (const auto& item : items) {
+    if (stateTopicOk(item.first)) {
+      _bus->publish(item.first, item.second.asString(), false);
+    } else {
+      log.push_back("State topic rejected: " + item.first);
+      stats.rejected++;
+    }
+  }
+}
+
+// ---- Automation.yaml ----
+
+void HomeAssistant::stateChanged(const std::string& entityId, const std::string& state) {
+  static const std::regex triggerHelper("^input_text\\.(mqtt_buffer_6|mqtt_bank[2-4]_6)$");
+  if (!automationEnabled || state.compare(0, 3, "END") != 0 || !std::regex_match(entityId, triggerHelper)) return;
+
+  // mode: queued, max: 5 counts the running run
+  if ((int)_queue.size() + (_running ? 1 : 0) >= automationQueueMax) {
+    stats.dropped++;
+    log.push_back("Already running: maximum number of runs exceeded");
+    return;
+  }
+  _queue.push_back(Run{entityId, state});
+  if (!_running) startNextRun();
+}
+
+void HomeAssistant::startNextRun() {
+  if (_queue.empty()) {
+    _running = false;
+    return;
+  }
+  _running = true;
+  Run next = _queue.front();
+  _queue.erase(_queue.begin());
+  sim::after(automationDelayMs, [this, next]() { run(next); });
+}
+
+void HomeAssistant::run(const Run& current) {
+  stats.runs++;
+  std::string bank = current.trigger.substr(0, current.trigger.size() - 1);
+  std::vector<std::string> parts;
+  size_t start = 0;
+  while (true) {
+    size_t slash = current.value.find('/', start);
+    parts.push_back(current.value.substr(start, slash - start));
+    if (slash == std::string::npos) break;
+    start = slash + 1;
+  }
+  std::string seq = parts[0].size() > 4 ? parts[0].substr(4) : "";
+  int count = 5;
+  if (parts.size() > 1) {
+    char* end = nullptr;
+    long parsed = strtol(parts[1].c_str(), &end, 10);
+    count = end && end != parts[1].c_str() && *end == '\0' ? (int)parsed : 5;
+    count = std::min(std::max(count, 1), 5);
+  }
+
+  std::vector<std::string> bufferIds;
+  std::string text;
+  for (int i = 1; i <= count; i++) {
+    bufferIds.push_back(bank + std::to_string(i));
+    const Entity* buffer = entity(bufferIds.back());
+    // states() of a missing entity is 'unknown', which is truthy
+    text += buffer ? buffer->state : "unknown";
+  }
+  log.push_back("Assembled MQTT JSON len=" + std::to_string(characters(text)));
+
+  if (text.empty()) {
+    log.push_back("Buffers empty on END");
+  } else if (characters(text) > 8192) {
+    log.push_back("JSON too large (" + std::to_string(characters(text)) + " > 8192) - dropping");
+    stats.rejected++;
+  } else {
+    Json parsed;
+    if (!Json::parse(text, parsed)) parsed = Json();
+    std::vector<Json> messages;
+    if (parsed.isObject() && parsed["batch"].isArray()) {
+      messages = parsed["batch"].items;
+      if (messages.size() > 1) log.push_back("Batch frame with " + std::to_string(messages.size()) + " messages");
+    } else {
+      messages.push_back(parsed);
+    }
+    for (const Json& item : messages) {
+      if (item.isObject()) {
+        publishDiscovery(item);
+      } else {
+        log.push_back("Invalid JSON (not an object) - dropping");
+        stats.rejected++;
+      }
+    }
+  }
+
+  bool empty = text.empty();
+  std::string trigger = current.trigger;
+  sim::after(automationRunMs, [this, bufferIds, seq, empty, trigger]() {
+    for (const std::string& id : bufferIds) setHelperValue(id, "");
+    if (!seq.empty()) {
+      // Empty buffers on a sequenced trigger: the frame was already published
+      setHelperValue(trigger, (empty ? "DUP:" : "ACK:") + seq);
+      startNextRun();
+    } else {
+      setHelperValue(trigger, "");
+      sim::after(100, [this]() { startNextRun(); });
+    }
+  });
+}
+
+void HomeAssistant::publishDiscovery(const Json& item) {
+  std::string topic = item["topic"].asString();
+  Json payload = item.has("payload") ? item["payload"] : item;
+  if (!discoveryTopicOk(topic)) {
+    log.push_back("Topic rejected (not discovery config): " + topic);
+    stats.rejected++;
+    return;
+  }
+  bool empty = payload.isString() && payload.text.empty();
+  std::string json = empty ? "" : payload.dump();
+  if (characters(json) > 16384) {
+    log.push_back("Payload too large (" + std::to_string(characters(json)) + " > 16384) - dropping");
+    stats.rejected++;
+    return;
+  }
+  _bus->publish(topic, json, true);
+  stats.published++;
+  log.push_back("MQTT discovery publish ok topic=" + topic + " retained=true deleted=" + (empty ? "true" : "false"));
+}
+
+// ---- MQTT integration ----
+
+static const char* const ABBREVIATIONS[][2] = {
+  {"avty_t", "availability_topic"}, {"cmd_t", "command_topic"},     {"dev", "device"},
+  {"dev_cla", "device_class"},      {"ent_cat", "entity_category"}, {"ic", "icon"},
+  {"json_attr_t", "json_attributes_topic"}, {"mdl", "model"},      {"mf", "manufacturer"},
+  {"pl_avail", "payload_available"}, {"pl_not_avail", "payload_not_available"},
+  {"pl_off", "payload_off"},        {"pl_on", "payload_on"},        {"stat_cla", "state_class"},
+  {"stat_t", "state_topic"},        {"sw", "sw_version"},           {"uniq_id", "unique_id"},
+  {"unit_of_meas", "unit_of_measurement"}, {"ids", "identifiers"},
+};
+
+Json HomeAssistant::expandConfig(const Json& config) {
+  Json out = Json::object();
+  for (const auto& member : config.members) {
+    std::string key = member.first;
+    for (const auto& abbreviation : ABBREVIATIONS) {
+      if (key == abbreviation[0]) key = abbreviation[1];
+    }
+    out.set(key, member.second.isObject() ? expandConfig(member.second) : member.second);
+  }
+  if (!out["~"].isString()) return out;
+
+  std::string base = out["~"].text;
+  for (auto& member : out.members) {
+    if (!member.second.isString() || member.first == "~") continue;
+    std::string& value = member.second.text;
+    if (!value.empty() && value[0] == '~') {
+      value = base + value.substr(1);
+    } else if (!value.empty() && value.back() == '~') {
+      value = value.substr(0, value.size() - 1) + base;
+    }
+  }
+  return out;
+}
+
+void HomeAssistant::discover(const std::string& topic, const std::string& payload) {
+  size_t first = topic.find('/');
+  size_t second = topic.find('/', first + 1);
+  size_t third = topic.find('/', second + 1);
+  std::string entityId = topic.substr(first + 1, second - first - 1) + "." + topic.substr(second + 1, third - second - 1);
+
+  std::string current;
+  if (!_bus->retained(topic, current) || current != payload) return;  // replaced or removed meanwhile
+  if (payload.empty()) {
+    _entities.erase(entityId);
+    return;
+  }
+  Json raw;
+  if (!Json::parse(payload, raw) || !raw.isObject()) {
+    log.push_back("Invalid discovery payload on " + topic);
+    return;
+  }
+  Json config = expandConfig(raw);
+
+  Json attributes = Json::object();
+  if (config["name"].isString()) attributes.set("friendly_name", config["name"]);
+  if (config["unit_of_measurement"].isString()) attributes.set("unit_of_measurement", config["unit_of_measurement"]);
+  if (config["icon"].isString()) attributes.set("icon", config["icon"]);
+
+  auto existing = _entities.find(entityId);
+  std::string state = existing == _entities.end() ? "unknown" : existing->second.state;
+  std::string availability;
+  if (config["availability_topic"].isString() && existing == _entities.end()) {
+    std::string online = config.has("payload_available") ? config["payload_available"].asString() : "online";
+    bool available = _bus->retained(config["availability_topic"].text, availability) && availability == online;
+    if (!available) state = "unavailable";
+  }
+  changeState(entityId, state, attributes, false);
+  _entities[entityId].config = config;
+
+  // A retained state is applied as soon as HA subscribes
+  std::string retainedState;
+  if (config["state_topic"].isString() && _bus->retained(config["state_topic"].text, retainedState)) {
+    mqttMessage(config["state_topic"].text, retainedState);
+  }
+}
+
+void HomeAssistant::mqttMessage(const std::string& topic, const std::string& payload) {
+  for (auto& entry : _entities) {
+    Entity& entity = entry.second;
+    if (!entity.config.isObject()) continue;
+    const std::string& entityId = entry.first;
+    std::string component = entityId.substr(0, entityId.find('.'));
+
+    if (entity.config["availability_topic"].isString() && entity.config["availability_topic"].text == topic) {
+      std::string online = entity.config.has("payload_available") ? entity.config["payload_available"].asString() : "online";
+      std::string offline =
+        entity.config.has("payload_not_available") ? entity.config["payload_not_available"].asString() : "offline";
+      if (payload == online && entity.state == "unavailable") {
+        changeState(entityId, entity.reported.empty() ? "unknown" : entity.reported, entity.attributes, false);
+      } else if (payload == offline) {
+        changeState(entityId, "unavailable", entity.attributes, false);
+      }
+    }
+
+    if (entity.config["state_topic"].isString() && entity.config["state_topic"].text == topic) {
+      std::string state = payload;
+      if (component == "switch" || component == "binary_sensor") {
+        std::string on = entity.config.has("payload_on") ? entity.config["payload_on"].asString() : "ON";
+        std::string off = entity.config.has("payload_off") ? entity.config["payload_off"].asString() : "OFF";
+        if (payload == on) {
+          state = "on";
+        } else if (payload == off) {
+          state = "off";
+        } else {
+          continue;
+        }
+      }
+      entity.reported = state;
+      if (entity.state != "unavailable") changeState(entityId, state, entity.attributes, false);
+    }
+  }
+}
+
+// ---- WebSocket API ----
+
+void HomeAssistant::upgrade(const std::shared_ptr<sim::Connection>& connection, const Request& request) {
+  auto session = std::static_pointer_cast<Session>(connection->state);
+  (void)request;
+  session->websocket = true;
+  stats.wsConnections++;
+  connection->send(
+    "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n");
+  wsSend(connection, "{\"type\":\"auth_required\",\"ha_version\":\"2024.6.0\"}");
+}
+
+void HomeAssistant::wsSend(const std::shared_ptr<sim::Connection>& connection, const std::string& text,
+                           uint8_t opcode) {
+  std::string frame(1, (char)(0x80 | opcode));
+  size_t length = text.size();
+  if (length < 126) {
+    frame += (char)length;
+  } else if (length < 65536) {
+    frame += (char)126;
+    frame += (char)(length >> 8);
+    frame += (char)(length & 0xFF);
+  } else {
+    frame += (char)127;
+    for (int i = 7; i >= 0; i--) frame += (char)((uint64_t)length >> (8 * i));
+  }
+  connection->send(frame + text);
+}
+
+void HomeAssistant::wsReceived(const std::shared_ptr<sim::Connection>& connection,
+                               const std::shared_ptr<Session>& session) {
+  std::string& in = connection->inbound;
+  while (in.size() >= 2) {
+    uint8_t first = (uint8_t)in[0];
+    uint8_t second = (uint8_t)in[1];
+    size_t offset = 2;
+    uint64_t length = second & 0x7F;
+    if (length == 126) {
+      if (in.size() < 4) return;
+      length = ((uint8_t)in[2] << 8) | (uint8_t)in[3];
+      offset = 4;
+    } else if (length == 127) {
+      if (in.size() < 10) return;
+      length = 0;
+      for (int i = 0; i < 8; i++) length = (length << 8) | (uint8_t)in[2 + i];
+      offset = 10;
+    }
+    bool masked = second & 0x80;
+    if (!masked) {
+      // Clients must mask; HA closes the connection otherwise
+      connection->close();
+      return;
+    }
+    if (in.size() < offset + 4 + length) return;
+    const uint8_t* mask = (const uint8_t*)in.data() + offset;
+    std::string payload = in.substr(offset + 4, length);
+    for (size_t i = 0; i < payload.size(); i++) payload[i] ^= mask[i % 4];
+    in.erase(0, offset + 4 + length);
+
+    uint8_t opcode = first & 0x0F;
+    bool final = first & 0x80;
+    if (opcode == 0x8) {
+      wsSend(connection, payload.substr(0, 2), 0x8);
+      connection->close();
+      return;
+    }
+    if (opcode == 0x9) {
+      wsSend(connection, payload, 0xA);
+      continue;
+    }
+    if (opcode == 0x1 || opcode == 0x0) {
+      session->message += payload;
+      if (final) {
+        std::string text;
+        text.swap(session->message);
+        wsMessage(connection, session, text);
+        if (!connection->isOpen()) return;
+      }
+    }
+  }
+}
+
+void HomeAssistant::wsMessage(const std::shared_ptr<sim::Connection>& connection,
+                              const std::shared_ptr<Session>& session, const std::string& text) {
+  stats.wsMessages++;
+  Json request;
+  if (!Json::parse(text, request) || !request.isObject()) {
+    connection->close();
+    return;
+  }
+  std::string type = request["type"].asString();
+
+  if (!session->authed) {
+    if (type == "auth" && request["access_token"].asString() == token) {
+      session->authed = true;
+      wsSend(connection, "{\"type\":\"auth_ok\",\"ha_version\":\"2024.6.0\"}");
+    } else {
+      wsSend(connection, "{\"type\":\"auth_invalid\",\"message\":\"Invalid access token or password\"}");
+      connection->close();
+    }
+    return;
+  }
+
+  Json reply = Json::object();
+  reply.set("id", request["id"]);
+
+  // Like HA: ids must be integers and increase through the session
+  double requestId = request["id"].asNumber();
+  if (requestId != (double)(int64_t)requestId || requestId <= session->lastId) {
+    stats.wsRejected++;
+    reply.set("type", Json::of("result"));
+    reply.set("success", Json::of(false));
+    Json error = Json::object();
+    error.set("code", Json::of("id_reuse"));
+    error.set("message", Json::of("Identifier values have to increase."));
+    reply.set("error", error);
+    wsSend(connection, reply.dump());
+    return;
+  }
+  session->lastId = requestId;
+
+  if (type == "ping") {
+    reply.set("type", Json::of("pong"));
+    wsSend(connection, reply.dump());
+  } else if (type == "subscribe_entities" && refuseSubscriptions > 0) {
+    refuseSubscriptions--;
+    Json error = Json::object();
+    error.set("code", Json::of("unknown_error"));
+    error.set("message", Json::of("Unknown error"));
+    reply.set("type", Json::of("result"));
+    reply.set("success", Json::of(false));
+    reply.set("error", error);
+    wsSend(connection, reply.dump());
+  } else if (type == "subscribe_entities") {
+    int id = (int)request["id"].asNumber();
+    reply.set("type", Json::of("result"));
+    reply.set("success", Json::of(true));
+    reply.set("result", Json());
+    wsSend(connection, reply.dump());
+
+    Json added = Json::object();
+    for (const Json& item : request["entity_ids"].items) {
+      std::string entityId = item.asString();
+      session->subscriptions[entityId] = id;
+      const Entity* found = entity(entityId);
+      if (!found) continue;
+      Json compressed = Json::object();
+      compressed.set("s", Json::of(found->state));
+      compressed.set("a", found->attributes);
+      compressed.set("c", Json::of("01HQ3Z5V8M2N4P6R8T0W2Y4A6C"));
+      compressed.set("lc", Json::of(found->lastChanged / 1000.0));
+      added.set(entityId, compressed);
+    }
+    Json event = Json::object();
+    event.set("a", added);
+    Json envelope = Json::object();
+    envelope.set("id", Json::of((double)id));
+    envelope.set("type", Json::of("event"));
+    envelope.set("event", event);
+    wsSend(connection, envelope.dump());
+  } else {
+    reply.set("type", Json::of("result"));
+    reply.set("success", Json::of(false));
+    Json error = Json::object();
+    error.set("code", Json::of("unknown_command"));
+    error.set("message", Json::of("Unknown command."));
+    reply.set("error", error);
+    wsSend(connection, reply.dump());
+  }
+}
+
+}  // namespace mock
@@ -0,0 +1,192 @@
+#ifndef MOCK_HOME_ASSISTANT_H
+#define MOCK_HOME_ASSISTANT_H
+
+// Home Assistant as the library sees it: the REST API (states, template,
+// services, events), the WebSocket API's subscribe_entities, the MQTT
+// integration's discovery, and the repo's automations (Automation.yaml,
+// StateBatch.yaml, Script.yaml) simulated step by step on the virtual
+// clock. Latency, lost requests and error replies can be injected.
+
+#include <string.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "Json.h"
+#include "MockBroker.h"
+#include "Sim.h"
+
+namespace mock {
+
+struct Faults {
+  unsigned long latencyMs;      // added before each REST reply
+  uint8_t lossPercent;          // requests that get no reply
+  bool lossResets;              // a lost request resets the connection (else it just hangs)
+  uint8_t errorPercent;         // requests answered 503
+  unsigned long idleTimeoutMs;  // keep-alive connections closed after this idle time (0 = never)
+  std::string errorPath;        // requests to this exact path are answered 503
+  uint32_t seed;
+
+  Faults() : latencyMs(0), lossPercent(0), lossResets(true), errorPercent(0), idleTimeoutMs(0), seed(1) {}
+};
+
+struct HomeAssistantStats {
+  uint32_t requests;        // REST requests received
+  uint32_t lost;            // dropped by fault injection
+  uint32_t errors;          // answered 503 by fault injection
+  uint64_t bytesIn;         // request bytes, headers included
+  uint64_t bytesOut;        // response bytes, headers included
+  uint32_t helperWrites;    // POSTs to input_text helpers
+  uint32_t stateWrites;     // POSTs to other entities
+  uint32_t stateReads;      // GET /api/states/<id>
+  uint32_t helperReads;     // of those, reads of input_text helpers
+  uint32_t templates;       // POST /api/template
+  uint32_t serviceCalls;
+  uint32_t events;
+  uint32_t runs;            // Automation.yaml runs started
+  uint32_t dropped;         // triggers dropped by the full run queue
+  uint32_t published;       // discovery messages published by any path
+  uint32_t rejected;        // messages the automations or script refused
+  uint32_t stateBatches;    // StateBatch.yaml runs
+  uint32_t wsConnections;
+  uint32_t wsMessages;      // messages received over WebSocket
+  uint32_t wsRejected;      // of those, refused for a bad message id
+
+  HomeAssistantStats() { memset(this, 0, sizeof(*this)); }
+};
+
+struct Entity {
+  std::string state;
+  Json attributes;
+  unsigned long lastChanged;
+  unsigned long lastUpdated;
+  // MQTT entities: the discovery config with abbreviations expanded, and
+  // the last state received while the entity was unavailable
+  Json config;
+  std::string reported;
+};
+
+class HomeAssistant : public sim::Server {
+public:
+  // Without a bus, a private broker (not on the network) is used
+  explicit HomeAssistant(Broker* bus = nullptr, const std::string& host = "ha.local", uint16_t port = 8123);
+  ~HomeAssistant();
+
+  std::string url() const;
+  Broker& bus() { return *_bus; }
+
+  // The input_text helpers of Automation.yaml: mqtt_buffer_1..6, and
+  // mqtt_bank<n>_1..6 for the extra banks
+  void installHelpers(int banks = 1, int buffers = 5, int max = 255);
+  static std::string helperId(int bank, int index);
+
+  // Entities
+  bool has(const std::string& entityId) const;
+  std::string state(const std::string& entityId) const;
+  const Entity* entity(const std::string& entityId) const;
+  // Sets a state as an integration would, firing a state change
+  void setState(const std::string& entityId, const std::string& state, const Json& attributes = Json::object());
+  void remove(const std::string& entityId);
+  size_t entityCount() const { return _entities.size(); }
+  // Operates an MQTT entity from the UI: publishes to its command topic
+  bool command(const std::string& entityId, const std::string& payload);
+  // Adds n entities that aren't the device's, so /api/states is realistic
+  void addNoiseEntities(int count);
+  // A discovery config as the MQTT integration reads it: abbreviations
+  // expanded and "~" substituted into the topics
+  static Json expandConfig(const Json& config);
+
+  // Tells connected WebSocket clients nothing and closes them
+  void dropWebSockets();
+
+  std::string token;
+  Faults faults;
+  unsigned long automationDelayMs;  // trigger to run start
+  unsigned long automationRunMs;    // run start to clearing the buffers
+  unsigned long discoveryDelayMs;   // retained config to entity created
+  int automationQueueMax;
+  bool automationEnabled;
+  bool stateBatchEnabled;
+  std::string stateBatchEvent;
+  int refuseSubscriptions;  // subscribe_entities messages answered with success: false
+  HomeAssistantStats stats;
+  // system_log.write messages of the simulated automations
+  std::vector<std::string> log;
+  bool logContains(const std::string& text) const;
+
+  void accepted(const std::shared_ptr<sim::Connection>& connection) override;
+  void received(const std::shared_ptr<sim::Connection>& connection) override;
+  void closed(const std::shared_ptr<sim::Connection>& connection) override;
+
+private:
+  struct Request {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> headers;
+    std::string body;
+  };
+  struct Response {
+    int code;
+    std::string body;
+    std::string contentType;
+  };
+  struct Session;
+  struct Run {
+    std::string trigger;
+    std::string value;
+  };
+
+  std::string _host;
+  uint16_t _port;
+  std::unique_ptr<Broker> _ownBus;
+  Broker* _bus;
+  std::map<std::string, Entity> _entities;
+  std::vector<std::shared_ptr<Session>> _sessions;
+  std::vector<Run> _queue;
+  std::map<std::string, Json> _helperAttributes;
+  bool _running;
+  uint64_t _random;
+  uint32_t _seededWith;
+
+  uint32_t roll();
+  bool parseRequest(std::string& in, Request& request);
+  void handle(const std::shared_ptr<sim::Connection>& connection, const Request& request);
+  Response route(const Request& request);
+  Response getStates(const std::string& entityId);
+  Response postState(const std::string& entityId, const std::string& body);
+  Response renderTemplate(const std::string& body);
+  Response callService(const std::string& domain, const std::string& service, const std::string& body);
+  Response fireEvent(const std::string& eventType, const std::string& body);
+  void sendResponse(const std::shared_ptr<sim::Connection>& connection, const Response& response, bool close);
+
+  Json stateJson(const std::string& entityId, const Entity& entity) const;
+  static std::string isoTime(unsigned long ms);
+  void changeState(const std::string& entityId, const std::string& state, const Json& attributes, bool force);
+  void setHelperValue(const std::string& entityId, const std::string& value);
+
+  // Automation.yaml
+  void stateChanged(const std::string& entityId, const std::string& state);
+  void startNextRun();
+  void run(const Run& run);
+  void publishDiscovery(const Json& message);
+  // Script.yaml and StateBatch.yaml
+  bool discoveryTopicOk(const std::string& topic) const;
+  bool stateTopicOk(const std::string& topic) const;
+  void runStateBatch(const Json& data);
+
+  // MQTT integration
+  void mqttMessage(const std::string& topic, const std::string& payload);
+  void discover(const std::string& topic, const std::string& payload);
+
+  // WebSocket API
+  void upgrade(const std::shared_ptr<sim::Connection>& connection, const Request& request);
+  void wsReceived(const std::shared_ptr<sim::Connection>& connection, const std::shared_ptr<Session>& session);
+  void wsMessage(const std::shared_ptr<sim::Connection>& connection, const std::shared_ptr<Session>& session,
+                 const std::string& text);
+  void wsSend(const std::shared_ptr<sim::Connection>& connection, const std::string& text, uint8_t opcode = 0x1);
+};
+
+}  // namespace mock
+
+#endif
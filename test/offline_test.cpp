@@ -0,0 +1,194 @@
+// Offline buffer: held writes, their file on flash, and replay once HA is
+// back, one by one or as state batches.
+
+#include <Arduino.h>
+#include <FS.h>
+#include <HAMQTTDiscovery.h>
+#include <algorithm>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 4;
+const char* PATH = "/ha_offline.txt";
+
+void createProbes(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** probes) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  // Fail fast while HA is away, and try again as soon as it is back
+  discovery.setRetryPolicy(0);
+  discovery.setCircuitBreaker(0);
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    probes[i] = discovery.createSensor(id, "Probe", id + "_uid");
+  }
+}
+
+void takeHaAway() {
+  sim::network().dropConnections();
+  sim::network().setReachable("ha.local", false);
+}
+
+void bringHaBack() {
+  sim::network().setReachable("ha.local", true);
+}
+
+void runLoop(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    discovery.loop();
+    delay(50);
+  }
+}
+
+// Last payload published on a topic, "" if none
+std::string lastPublished(HomeAssistant& ha, const std::string& topic) {
+  std::string payload;
+  for (const auto& message : ha.bus().history) {
+    if (message.first == topic) payload = message.second;
+  }
+  return payload;
+}
+
+size_t lines(fs::FS& flash) {
+  if (!flash.exists(PATH)) return 0;
+  const std::string& text = flash.contents(PATH);
+  return std::count(text.begin(), text.end(), '\n');
+}
+
+}  // namespace
+
+TEST(held_writes_replay_in_order_once_ha_is_back) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+
+  takeHaAway();
+  for (int i = 1; i <= 3; i++) CHECK(discovery.writeControl(probes[0], String(i)));
+  CHECK_EQ(discovery.getOfflineStats().occupancy, 3);
+
+  bringHaBack();
+  uint32_t before = ha.stats.stateWrites;
+  runLoop(discovery, 5000);
+  HAOfflineStats stats = discovery.getOfflineStats();
+  CHECK_EQ(stats.occupancy, 0);
+  CHECK_EQ(stats.buffered, 3u);
+  CHECK_EQ(stats.replayed, 3u);
+  CHECK_EQ(ha.stats.stateWrites - before, 3u);
+  CHECK_EQ(ha.state("sensor.probe_0"), "3");
+}
+
+TEST(each_held_write_appends_one_line_to_the_file) {
+  HomeAssistant ha;
+  fs::FS flash;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+  CHECK(discovery.setOfflineStorage(flash, PATH));
+
+  takeHaAway();
+  CHECK(discovery.writeControl(probes[0], "a\tb"));
+  uint64_t firstLine = flash.bytesWritten;
+  for (int i = 0; i < 9; i++) CHECK(discovery.writeControl(probes[1], String(i)));
+  CHECK_EQ(lines(flash), (size_t)10);
+  // Appending, not rewriting: the bytes on flash grow by a line per write
+  CHECK(flash.bytesWritten < firstLine * 10);
+  CHECK(flash.contents(PATH).find("a\\tb") != std::string::npos);
+}
+
+TEST(replayed_writes_leave_the_file_without_a_rewrite_each) {
+  HomeAssistant ha;
+  fs::FS flash;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+  discovery.setOfflineReplay(1, 100);
+  CHECK(discovery.setOfflineStorage(flash, PATH));
+
+  takeHaAway();
+  for (int i = 0; i < 8; i++) CHECK(discovery.writeControl(probes[0], String(i)));
+  uint32_t opens = flash.opensForWrite;
+
+  // Eight writes replay within a second; the file is rewritten at most
+  // once meanwhile and removed when the buffer is empty
+  bringHaBack();
+  runLoop(discovery, 1000);
+  CHECK_EQ(discovery.getOfflineStats().occupancy, 0);
+  CHECK(flash.opensForWrite - opens <= 1);
+  CHECK(!flash.exists(PATH));
+}
+
+TEST(a_slow_replay_trims_the_file_now_and_then) {
+  HomeAssistant ha;
+  fs::FS flash;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+  discovery.setOfflineReplay(1, 2000);
+  CHECK(discovery.setOfflineStorage(flash, PATH));
+
+  takeHaAway();
+  for (int i = 0; i < 10; i++) CHECK(discovery.writeControl(probes[0], String(i)));
+  bringHaBack();
+  runLoop(discovery, 13000);
+  // Replayed lines stay until the next trim, at most 10 s later
+  int held = discovery.getOfflineStats().occupancy;
+  CHECK(held > 0 && held < 10);
+  CHECK(lines(flash) >= (size_t)held);
+  CHECK(lines(flash) < (size_t)10);
+}
+
+TEST(loading_the_file_does_not_count_as_buffering) {
+  HomeAssistant ha;
+  fs::FS flash;
+  flash.contents(PATH) = "sensor.probe_0\t1\nsensor.probe_1\t2\n";
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+  CHECK(discovery.setOfflineStorage(flash, PATH));
+
+  HAOfflineStats stats = discovery.getOfflineStats();
+  CHECK_EQ(stats.occupancy, 2);
+  CHECK_EQ(stats.buffered, 0u);
+  // Nothing new, so nothing written
+  CHECK_EQ(flash.opensForWrite, 0u);
+
+  runLoop(discovery, 3000);
+  CHECK_EQ(discovery.getOfflineStats().replayed, 2u);
+  CHECK_EQ(ha.state("sensor.probe_1"), "2");
+}
+
+TEST(replay_uses_state_batches_when_enabled) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.enableOfflineBuffer(16, OFFLINE_HISTORY));
+  discovery.enableStateBatch();
+
+  takeHaAway();
+  for (int i = 0; i < CONTROLS; i++) CHECK(discovery.writeControl(probes[i], String(10 + i)));
+  CHECK(!discovery.flushStates());
+  // A second value for probe_0 can't share the first one's event
+  CHECK(discovery.writeControl(probes[0], "20"));
+  CHECK_EQ(discovery.getOfflineStats().occupancy, CONTROLS + 1);
+
+  bringHaBack();
+  uint32_t writes = ha.stats.stateWrites;
+  runLoop(discovery, 5000);
+  sim::drain();
+  CHECK_EQ(discovery.getOfflineStats().replayed, (uint32_t)(CONTROLS + 1));
+  CHECK_EQ(ha.stats.stateBatches, 2u);
+  CHECK_EQ(ha.stats.stateWrites, writes);
+  CHECK_EQ(lastPublished(ha, probes[0]->getStateTopic().c_str()), "20");
+  CHECK_EQ(lastPublished(ha, probes[3]->getStateTopic().c_str()), "13");
+}
@@ -0,0 +1,156 @@
+// Publish policies: which writeControl() calls reach HA, what loop() sends
+// later, and how each outcome is counted in the write stats.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+HAControl* start(HAMQTTDiscovery& discovery, HomeAssistant& ha, const HAPublishPolicy& policy,
+                 const char* objectId = "probe") {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  HAControl* control = discovery.createSensor(objectId, "Probe", String(objectId) + "_uid");
+  CHECK(control != nullptr);
+  discovery.setPublishPolicy(control, policy);
+  return control;
+}
+
+// Runs loop() for a while on the virtual clock
+void runFor(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    discovery.loop();
+    delay(100);
+  }
+}
+
+}  // namespace
+
+TEST(unchanged_values_and_the_deadband_are_suppressed) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAPublishPolicy policy;
+  policy.skipUnchanged = true;
+  policy.deadband = 0.5f;
+  HAControl* probe = start(discovery, ha, policy);
+  uint32_t writes = ha.stats.stateWrites;
+
+  CHECK(discovery.writeControl(probe, "20.0"));
+  CHECK(discovery.writeControl(probe, "20.0"));
+  CHECK(discovery.writeControl(probe, "20.3"));
+  CHECK(discovery.writeControl(probe, "19.6"));
+  CHECK(discovery.writeControl(probe, "20.6"));
+  // The deadband only applies to numbers
+  CHECK(discovery.writeControl(probe, "unavailable"));
+
+  CHECK_EQ(ha.stats.stateWrites - writes, 3u);
+  CHECK_EQ(ha.state("sensor.probe"), std::string("unavailable"));
+  CHECK_EQ(probe->writeStats.sent, 3u);
+  CHECK_EQ(probe->writeStats.suppressed, 3u);
+  CHECK_EQ(probe->writeStats.coalesced, 0u);
+}
+
+TEST(min_interval_holds_back_and_coalesces_to_the_latest) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAPublishPolicy policy;
+  policy.minIntervalMs = 5000;
+  HAControl* probe = start(discovery, ha, policy);
+  uint32_t writes = ha.stats.stateWrites;
+
+  CHECK(discovery.writeControl(probe, "1"));
+  delay(1000);
+  CHECK(discovery.writeControl(probe, "2"));
+  CHECK(discovery.writeControl(probe, "3"));
+  CHECK(discovery.writeControl(probe, "4"));
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(probe->writeStats.coalesced, 2u);
+
+  runFor(discovery, 3000);
+  CHECK_EQ(ha.state("sensor.probe"), std::string("1"));
+  runFor(discovery, 1500);
+  CHECK_EQ(ha.state("sensor.probe"), std::string("4"));
+  CHECK_EQ(ha.stats.stateWrites - writes, 2u);
+  CHECK_EQ(probe->writeStats.sent, 2u);
+}
+
+TEST(max_interval_resends_the_current_state) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAPublishPolicy policy;
+  policy.skipUnchanged = true;
+  policy.maxIntervalMs = 30000;
+  HAControl* probe = start(discovery, ha, policy);
+  uint32_t writes = ha.stats.stateWrites;
+
+  CHECK(discovery.writeControl(probe, "7"));
+  runFor(discovery, 29000);
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  runFor(discovery, 1500);
+  CHECK_EQ(ha.stats.stateWrites - writes, 2u);
+  CHECK_EQ(ha.state("sensor.probe"), std::string("7"));
+
+  // A write of the same value is only skipped until the next heartbeat
+  CHECK(discovery.writeControl(probe, "7"));
+  CHECK_EQ(probe->writeStats.suppressed, 1u);
+  delay(30000);
+  CHECK(discovery.writeControl(probe, "7"));
+  CHECK_EQ(ha.stats.stateWrites - writes, 3u);
+  CHECK_EQ(probe->writeStats.sent, 3u);
+}
+
+TEST(coalesced_value_is_flushed_at_the_max_interval) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAPublishPolicy policy;
+  // The heartbeat comes before the hold is over
+  policy.minIntervalMs = 60000;
+  policy.maxIntervalMs = 30000;
+  HAControl* probe = start(discovery, ha, policy);
+  uint32_t writes = ha.stats.stateWrites;
+
+  CHECK(discovery.writeControl(probe, "1"));
+  delay(1000);
+  CHECK(discovery.writeControl(probe, "2"));
+  CHECK(discovery.writeControl(probe, "3"));
+  CHECK_EQ(probe->writeStats.coalesced, 1u);
+
+  runFor(discovery, 29500);
+  CHECK_EQ(ha.stats.stateWrites - writes, 2u);
+  // The heartbeat carries the held value, not the stale one
+  CHECK_EQ(ha.state("sensor.probe"), std::string("3"));
+  CHECK(!probe->hasPending);
+  CHECK_EQ(probe->writeStats.sent, 2u);
+}
+
+TEST(write_stats_sum_over_controls_and_reset) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAPublishPolicy policy;
+  policy.skipUnchanged = true;
+  HAControl* a = start(discovery, ha, policy, "probe_a");
+  HAControl* b = discovery.createSensor("probe_b", "Probe B", "probe_b_uid");
+  discovery.setPublishPolicy(b, policy);
+
+  discovery.writeControl(a, "1");
+  discovery.writeControl(a, "1");
+  discovery.writeControl(b, "2");
+  ha.faults.errorPercent = 100;
+  CHECK(!discovery.writeControl(b, "3"));
+  ha.faults.errorPercent = 0;
+
+  HAWriteStats total = discovery.getWriteStats();
+  CHECK_EQ(total.sent, 2u);
+  CHECK_EQ(total.suppressed, 1u);
+  CHECK_EQ(total.failed, 1u);
+  CHECK_EQ(b->writeStats.failed, 1u);
+
+  discovery.resetWriteStats();
+  total = discovery.getWriteStats();
+  CHECK_EQ(total.sent + total.suppressed + total.coalesced + total.failed, 0u);
+}
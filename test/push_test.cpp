@@ -0,0 +1,122 @@
+// Push updates over the WebSocket API: subscription, delivery of changes
+// made in HA, and reconnecting after the connection drops.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+int calls = 0;
+String lastState;
+
+void onState(HAControl*, const String& state) {
+  calls++;
+  lastState = state;
+}
+
+void runLoop(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while (millis() < end) {
+    discovery.loop();
+    delay(20);
+  }
+}
+
+HAControl* startPushing(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  discovery.onStateChange(lamp, onState);
+  calls = 0;
+  lastState = "";
+  CHECK(discovery.startPush());
+  runLoop(discovery, 500);
+  return lamp;
+}
+
+}  // namespace
+
+TEST(changes_made_in_ha_reach_the_callback) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* lamp = startPushing(discovery, ha);
+  CHECK(discovery.pushConnected());
+  CHECK_EQ(ha.stats.wsConnections, 1u);
+
+  // As if toggled in the HA UI
+  ha.setState("switch.lamp", "on");
+  runLoop(discovery, 200);
+  CHECK_EQ(lamp->currentState, String("on"));
+  CHECK_EQ(lastState, String("on"));
+  int before = calls;
+
+  // The echo of the sketch's own write is not reported again
+  CHECK(discovery.writeControl(lamp, "on"));
+  runLoop(discovery, 200);
+  CHECK_EQ(calls, before);
+}
+
+TEST(message_ids_count_up_across_the_session) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  startPushing(discovery, ha);
+  // auth, subscribe_entities, then pings every 30 s; HA refuses an id
+  // that isn't an integer above the last one
+  runLoop(discovery, 65000);
+  CHECK(discovery.pushConnected());
+  CHECK_EQ(ha.stats.wsConnections, 1u);
+  CHECK(ha.stats.wsMessages >= 4u);
+  CHECK_EQ(ha.stats.wsRejected, 0u);
+}
+
+TEST(dropped_connection_is_reopened_and_resubscribed) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* lamp = startPushing(discovery, ha);
+
+  ha.dropWebSockets();
+  runLoop(discovery, 3000);
+  CHECK(discovery.pushConnected());
+  CHECK_EQ(ha.stats.wsConnections, 2u);
+
+  ha.setState("switch.lamp", "off");
+  ha.setState("switch.lamp", "on");
+  runLoop(discovery, 200);
+  CHECK_EQ(lamp->currentState, String("on"));
+}
+
+TEST(stop_push_closes_the_connection) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  startPushing(discovery, ha);
+  discovery.stopPush();
+  CHECK(!discovery.pushConnected());
+  int before = calls;
+  ha.setState("switch.lamp", "on");
+  runLoop(discovery, 500);
+  CHECK_EQ(calls, before);
+}
+
+TEST(refused_subscription_is_asked_for_again) {
+  HomeAssistant ha;
+  ha.refuseSubscriptions = 1;
+  HAMQTTDiscovery discovery;
+  HAControl* lamp = startPushing(discovery, ha);
+  CHECK(discovery.pushConnected());
+
+  // Retried after a pause, not on every pass of loop()
+  uint32_t messages = ha.stats.wsMessages;
+  runLoop(discovery, 500);
+  CHECK(ha.stats.wsMessages - messages <= 1u);
+  runLoop(discovery, 1000);
+
+  ha.setState("switch.lamp", "on");
+  runLoop(discovery, 200);
+  CHECK_EQ(lamp->currentState, String("on"));
+  CHECK_EQ(lastState, String("on"));
+  CHECK_EQ(ha.stats.wsConnections, 1u);
+}
@@ -0,0 +1,102 @@
+// Bulk state refresh: one template render reads every control's state.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 4;
+
+void createProbes(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** probes) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    probes[i] = discovery.createSensor(id, "Probe", id + "_uid");
+  }
+}
+
+}  // namespace
+
+TEST(refresh_reads_every_state_in_one_request) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  for (int i = 0; i < CONTROLS; i++) ha.setState(("sensor.probe_" + std::to_string(i)).c_str(), "1");
+
+  uint32_t before = ha.stats.templates;
+  CHECK_EQ(discovery.refreshAll(), CONTROLS);
+  CHECK_EQ(ha.stats.templates - before, 1u);
+  CHECK_EQ(probes[2]->currentState, String("1"));
+  CHECK(probes[2]->lastChanged.startsWith("2024-01-01T"));
+
+  // Nothing changed, then one state did
+  CHECK_EQ(discovery.refreshAll(), 0);
+  delay(1000);
+  ha.setState("sensor.probe_1", "2");
+  CHECK_EQ(discovery.refreshAll(), 1);
+  CHECK(probes[1]->changed);
+  CHECK(!probes[0]->changed);
+  CHECK_EQ(probes[1]->currentState, String("2"));
+}
+
+TEST(refresh_keeps_states_with_json_special_characters) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+
+  // The old line format broke on "|" and newlines; tojson also escapes
+  // <, >, & and ' as \u sequences
+  const char* awkward = "a|b\nc <\"it's\"> & \xC3\xA9";
+  ha.setState("sensor.probe_0", awkward);
+  CHECK(discovery.refreshAll() >= 1);
+  CHECK_EQ(probes[0]->currentState, String(awkward));
+}
+
+TEST(refresh_marks_missing_entities_offline) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  CHECK(discovery.refreshAll() >= 0);
+
+  ha.remove("sensor.probe_3");
+  CHECK_EQ(discovery.refreshAll(), 1);
+  CHECK(!probes[3]->isOnline);
+  CHECK(probes[0]->isOnline);
+}
+
+TEST(refresh_escapes_quotes_in_entity_ids) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+
+  // An id with a quote must not end the Jinja string early and shift
+  // every id after it
+  HAControl* odd = discovery.createSensor("it's", "Odd", "odd_uid");
+  CHECK(odd != nullptr);
+  ha.setState("sensor.it's", "7");
+  ha.setState("sensor.probe_0", "5");
+  CHECK(discovery.refreshAll() >= 2);
+  CHECK_EQ(probes[0]->currentState, String("5"));
+  CHECK(odd && odd->currentState == "7");
+}
+
+TEST(refresh_fails_cleanly_when_ha_is_unreachable) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+
+  sim::network().dropConnections();
+  sim::network().setReachable("ha.local", false);
+  CHECK_EQ(discovery.refreshAll(), -1);
+  CHECK(probes[0]->isOnline);
+}
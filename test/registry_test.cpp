@@ -0,0 +1,161 @@
+// Control registry: pooled slots, lookups, and no fixed control limit.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+// Past several pool blocks and the old fixed limit
+const int CONTROLS = 40;
+
+void start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  // Creation is checked elsewhere; here only the registry matters
+  discovery.setAsyncCreation(true);
+}
+
+// HAControl as it was before the per-type settings moved to HAControlOptions,
+// kept here as the baseline the slot size is measured against
+struct BaselineControl {
+  ControlType type;
+  String objectId, name, uniqueId, icon, stateTopic, commandTopic, availabilityTopic;
+  HADevice* device;
+  float minValue, maxValue, step;
+  String unit, mode, payloadOn, payloadOff;
+  String currentState, lastChanged;
+  bool isOnline, changed;
+  HAPublishPolicy policy;
+  HAWriteStats writeStats;
+  String pendingValue;
+  bool hasPending, hasWritten;
+  unsigned long lastWriteAt;
+  String batchValue;
+  bool batched;
+  ControlStatus status;
+  CreationStage stage;
+  unsigned long stageStartedAt;
+  uint32_t fingerprint;
+  unsigned long createdAt;
+  bool diagnostic;
+  HAStateCallback stateCallback;
+  uint32_t subscription;
+  const HAEntityDescriptor* descriptor;
+  HAAggregator* aggregator;
+  HANode* node;
+  unsigned long queuedAt, batchQueuedAt;
+};
+
+double heapPerSensor(HAMQTTDiscovery& discovery, const char* prefix, const String& unit) {
+  sim::HeapStats before = sim::heap();
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = String(prefix) + "_" + String(i);
+    discovery.createSensor(id, "Probe", id + "_uid", unit);
+  }
+  sim::HeapStats after = sim::heap();
+  return (double)(after.liveBytes - before.liveBytes) / CONTROLS;
+}
+
+}  // namespace
+
+TEST(controls_keep_their_address_as_the_registry_grows) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+
+  HAControl* controls[CONTROLS];
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    controls[i] = discovery.createSensor(id, "Probe", id + "_uid");
+    CHECK(controls[i] != nullptr);
+  }
+  CHECK_EQ(discovery.controlCount(), CONTROLS);
+  for (int i = 0; i < CONTROLS; i++) {
+    CHECK(discovery.findControl("probe_" + String(i)) == controls[i]);
+    CHECK_EQ(String(controls[i]->getObjectId()), "probe_" + String(i));
+  }
+}
+
+TEST(find_control_takes_an_object_or_entity_id) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  HAControl* level = discovery.createNumber("level", "Level", "level_uid", 0, 100, 1);
+
+  CHECK(discovery.findControl("lamp") == lamp);
+  CHECK(discovery.findControl("switch.lamp") == lamp);
+  CHECK(discovery.findControl("number.level") == level);
+  CHECK(discovery.findControl("sensor.lamp") == nullptr);
+  CHECK(discovery.findControl("missing") == nullptr);
+}
+
+TEST(a_rejected_create_leaves_no_control_behind) {
+  HomeAssistant ha;
+  ha.installHelpers();
+  ha.setState("sensor.taken", "1");
+  HAMQTTDiscovery discovery;
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+
+  CHECK(discovery.createSensor("taken", "Taken", "taken_uid") == nullptr);
+  CHECK_EQ(discovery.controlCount(), 0);
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  CHECK(probe != nullptr);
+  CHECK_EQ(discovery.controlCount(), 1);
+  CHECK(discovery.findControl("taken") == nullptr);
+}
+
+TEST(many_controls_cost_less_than_the_baseline_slot) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  for (int i = 0; i < 8; i++) discovery.createSensor("warm_" + String(i), "Warm", "warm_uid_" + String(i));
+
+  // Per control: its strings and, once per block of slots, the block. The
+  // baseline is the same heap with every slot at the old size.
+  double perControl = heapPerSensor(discovery, "probe", "");
+  double baseline = perControl + (double)sizeof(BaselineControl) - (double)sizeof(HAControl);
+  check::report("registry", "baseline_heap_per_control", baseline, "B");
+  check::report("registry", "heap_per_control", perControl, "B");
+  check::report("registry", "slot_bytes", sizeof(HAControl), "B");
+  CHECK(perControl < baseline);
+  CHECK(perControl < 2 * sizeof(HAControl));
+}
+
+TEST(only_controls_with_custom_settings_carry_options) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  for (int i = 0; i < 8; i++) discovery.createSensor("warm_" + String(i), "Warm", "warm_uid_" + String(i));
+
+  double plain = heapPerSensor(discovery, "plain", "");
+  double withUnit = heapPerSensor(discovery, "unit", "°C");
+  check::report("registry", "heap_per_control_with_options", withUnit, "B");
+  CHECK(withUnit >= plain + sizeof(HAControlOptions));
+
+  HAControl* plainSensor = discovery.findControl("plain_0");
+  HAControl* unitSensor = discovery.findControl("unit_0");
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  HAControl* level = discovery.createNumber("level", "Level", "level_uid", 0, 100, 1);
+  HAControl* dimmer = discovery.createNumber("dimmer", "Dimmer", "dimmer_uid", 0, 255, 5, "", "box");
+  CHECK(plainSensor->options == nullptr);
+  CHECK(lamp->options == nullptr);
+  CHECK(level->options == nullptr);
+  CHECK(unitSensor->options != nullptr);
+  CHECK(dimmer->options != nullptr);
+
+  // Defaults still reach the payload when a control has no options
+  String payload = lamp->getDiscoveryPayload();
+  CHECK(payload.indexOf("\"payload_on\":\"ON\"") >= 0);
+  CHECK(payload.indexOf("\"icon\":\"mdi:toggle-switch\"") >= 0);
+  payload = level->getDiscoveryPayload();
+  CHECK(payload.indexOf("\"mode\":\"slider\"") >= 0);
+  payload = dimmer->getDiscoveryPayload();
+  CHECK(payload.indexOf("\"max\":255") >= 0);
+  CHECK(payload.indexOf("\"mode\":\"box\"") >= 0);
+  CHECK(unitSensor->getDiscoveryPayload().indexOf("\"unit_of_measurement\":\"°C\"") >= 0);
+}
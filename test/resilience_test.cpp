@@ -0,0 +1,125 @@
+// Retries, backoff and the circuit breaker, with their off-by-default
+// settings, and the fault injection test builds use to exercise them.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+HAControl* startWithSensor(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  return discovery.createSensor("probe", "Probe", "probe_uid");
+}
+
+HABreakerState lastChange = BREAKER_CLOSED;
+int changes = 0;
+
+void onBreaker(HABreakerState state) {
+  lastChange = state;
+  changes++;
+}
+
+}  // namespace
+
+TEST(by_default_a_failed_request_is_sent_once) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+
+  ha.faults.errorPercent = 100;
+  discovery.resetRequestStats();
+  for (int i = 0; i < 10; i++) CHECK(!discovery.writeControl(probe, String(i)));
+  HARequestStats stats = discovery.getRequestStats();
+  CHECK_EQ(stats.requests, 10u);
+  CHECK_EQ(stats.retries, 0u);
+  CHECK_EQ(stats.failures, 10u);
+  // No breaker either: every write still reaches HA
+  CHECK_EQ(discovery.breakerState(), BREAKER_CLOSED);
+}
+
+TEST(retries_back_off_on_server_errors) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+  discovery.setRetryPolicy(2, 250, 4000);
+
+  ha.faults.errorPercent = 100;
+  discovery.resetRequestStats();
+  unsigned long start = millis();
+  CHECK(!discovery.writeControl(probe, "1"));
+  HARequestStats stats = discovery.getRequestStats();
+  CHECK_EQ(stats.requests, 3u);
+  CHECK_EQ(stats.retries, 2u);
+  CHECK_EQ(stats.failures, 1u);
+  // Two waits, each at least half its jittered base
+  CHECK(millis() - start >= 125 + 250);
+}
+
+TEST(rejected_requests_are_not_retried) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+  discovery.setRetryPolicy(2);
+
+  // HA answers 400 to a state over 255 characters; sending it again
+  // can't help
+  String tooLong;
+  for (int i = 0; i < 300; i++) tooLong += 'x';
+  discovery.resetRequestStats();
+  CHECK(!discovery.writeControl(probe, tooLong));
+  CHECK_EQ(discovery.getRequestStats().requests, 1u);
+  CHECK_EQ(discovery.getRequestStats().retries, 0u);
+}
+
+TEST(breaker_opens_fails_fast_and_closes_after_a_probe) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+  discovery.setCircuitBreaker(3, 1000);
+  discovery.onBreakerChange(onBreaker);
+  changes = 0;
+
+  sim::network().dropConnections();
+  sim::network().setReachable("ha.local", false);
+  for (int i = 0; i < 3; i++) CHECK(!discovery.writeControl(probe, String(i)));
+  CHECK_EQ(discovery.breakerState(), BREAKER_OPEN);
+  CHECK_EQ(lastChange, BREAKER_OPEN);
+
+  // Open: no connection attempt at all
+  uint32_t connects = sim::network().stats.connects + sim::network().stats.refused;
+  unsigned long start = millis();
+  CHECK(!discovery.writeControl(probe, "x"));
+  CHECK_EQ(sim::network().stats.connects + sim::network().stats.refused, connects);
+  CHECK_EQ(millis() - start, 0ul);
+
+  sim::network().setReachable("ha.local", true);
+  delay(1000);
+  discovery.loop();
+  CHECK_EQ(discovery.breakerState(), BREAKER_CLOSED);
+  CHECK_EQ(lastChange, BREAKER_CLOSED);
+  CHECK(discovery.writeControl(probe, "back"));
+}
+
+TEST(fault_injection_fails_requests_before_they_reach_ha) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha);
+
+  uint32_t requests = ha.stats.requests;
+  discovery.setFaultInjection(100, 0, 0);
+  CHECK(!discovery.writeControl(probe, "1"));
+  discovery.setFaultInjection(0, 100, 50);
+  unsigned long start = millis();
+  CHECK(!discovery.writeControl(probe, "2"));
+  CHECK(millis() - start >= 50);
+  CHECK_EQ(ha.stats.requests, requests);
+
+  discovery.setFaultInjection(0, 0, 0);
+  CHECK(discovery.writeControl(probe, "3"));
+  CHECK_EQ(ha.state("sensor.probe"), "3");
+}
@@ -0,0 +1,485 @@
+#include <Arduino.h>
+#include <atomic>
+#include <new>
+#include <thread>
+#include "Sim.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+// ---- String ----
+
+static std::string formatInteger(unsigned long long value, bool negative, unsigned char base) {
+  if (base < 2 || base > 16) base = 10;
+  char digits[72];
+  int count = 0;
+  do {
+    digits[count++] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  std::string out = negative ? "-" : "";
+  while (count) out += digits[--count];
+  return out;
+}
+
+String::String(unsigned char value, unsigned char base) : _s(formatInteger(value, false, base)) {}
+String::String(int value, unsigned char base)
+  : _s(base == 10 && value < 0 ? formatInteger(-(long long)value, true, base)
+                               : formatInteger(base == 10 ? (unsigned long long)value : (unsigned int)value, false, base)) {}
+String::String(unsigned int value, unsigned char base) : _s(formatInteger(value, false, base)) {}
+String::String(long value, unsigned char base)
+  : _s(base == 10 && value < 0 ? formatInteger(-(long long)value, true, base)
+                               : formatInteger(base == 10 ? (unsigned long long)value : (unsigned long)value, false, base)) {}
+String::String(unsigned long value, unsigned char base) : _s(formatInteger(value, false, base)) {}
+
+String::String(float value, unsigned int decimals) : String((double)value, decimals) {}
+
+String::String(double value, unsigned int decimals) {
+  char buffer[352];
+  snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, value);
+  _s = buffer;
+}
+
+char& String::operator[](unsigned int index) {
+  static char dummy;
+  if (index >= _s.size()) {
+    dummy = 0;
+    return dummy;
+  }
+  return _s[index];
+}
+
+StringSumHelper operator+(const StringSumHelper& lhs, const String& rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, const char* rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, char rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, unsigned char rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, int rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, unsigned int rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, long rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, unsigned long rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, float rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+StringSumHelper operator+(const StringSumHelper& lhs, double rhs) {
+  StringSumHelper out(lhs);
+  out.concat(rhs);
+  return out;
+}
+
+bool String::equalsIgnoreCase(const String& other) const {
+  if (_s.size() != other._s.size()) return false;
+  for (size_t i = 0; i < _s.size(); i++) {
+    if (tolower((unsigned char)_s[i]) != tolower((unsigned char)other._s[i])) return false;
+  }
+  return true;
+}
+
+bool String::startsWith(const String& prefix, unsigned int offset) const {
+  return offset <= _s.size() && _s.compare(offset, prefix._s.size(), prefix._s) == 0;
+}
+
+bool String::endsWith(const String& suffix) const {
+  return _s.size() >= suffix._s.size() &&
+         _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+  size_t found = _s.find(c, from);
+  return found == std::string::npos ? -1 : (int)found;
+}
+
+int String::indexOf(const String& text, unsigned int from) const {
+  if (from > _s.size()) return -1;
+  size_t found = _s.find(text._s, from);
+  return found == std::string::npos ? -1 : (int)found;
+}
+
+int String::lastIndexOf(char c) const {
+  size_t found = _s.rfind(c);
+  return found == std::string::npos ? -1 : (int)found;
+}
+
+int String::lastIndexOf(const String& text) const {
+  size_t found = _s.rfind(text._s);
+  return found == std::string::npos ? -1 : (int)found;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (from > to) std::swap(from, to);
+  if (from >= _s.size()) return String();
+  if (to > _s.size()) to = _s.size();
+  String out;
+  out._s = _s.substr(from, to - from);
+  return out;
+}
+
+void String::replace(char find, char replacement) {
+  for (char& c : _s) {
+    if (c == find) c = replacement;
+  }
+}
+
+void String::replace(const String& find, const String& replacement) {
+  if (find._s.empty()) return;
+  size_t position = 0;
+  while ((position = _s.find(find._s, position)) != std::string::npos) {
+    _s.replace(position, find._s.size(), replacement._s);
+    position += replacement._s.size();
+  }
+}
+
+void String::remove(unsigned int index) {
+  if (index < _s.size()) _s.erase(index);
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+  if (index < _s.size()) _s.erase(index, count);
+}
+
+void String::toLowerCase() {
+  for (char& c : _s) c = tolower((unsigned char)c);
+}
+
+void String::toUpperCase() {
+  for (char& c : _s) c = toupper((unsigned char)c);
+}
+
+void String::trim() {
+  size_t end = _s.size();
+  while (end > 0 && isspace((unsigned char)_s[end - 1])) end--;
+  size_t start = 0;
+  while (start < end && isspace((unsigned char)_s[start])) start++;
+  _s = _s.substr(start, end - start);
+}
+
+long String::toInt() const {
+  return atol(_s.c_str());
+}
+
+float String::toFloat() const {
+  return (float)atof(_s.c_str());
+}
+
+double String::toDouble() const {
+  return atof(_s.c_str());
+}
+
+void String::getBytes(unsigned char* buffer, unsigned int size, unsigned int index) const {
+  if (!size || !buffer) return;
+  size_t count = 0;
+  if (index < _s.size()) {
+    count = std::min((size_t)size - 1, _s.size() - index);
+    memcpy(buffer, _s.data() + index, count);
+  }
+  buffer[count] = '\0';
+}
+
+// ---- Print and Stream ----
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    if (!write(*buffer++)) break;
+    n++;
+  }
+  return n;
+}
+
+size_t Print::print(long value, int base) {
+  String text(value, (unsigned char)base);
+  return print(text);
+}
+
+size_t Print::print(unsigned long value, int base) {
+  String text(value, (unsigned char)base);
+  return print(text);
+}
+
+size_t Print::print(double value, int decimals) {
+  String text(value, (unsigned int)decimals);
+  return print(text);
+}
+
+size_t Print::printf(const char* format, ...) {
+  char small[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+  if (length < 0) return 0;
+  if ((size_t)length < sizeof(small)) return write((const uint8_t*)small, length);
+
+  std::string large(length + 1, '\0');
+  va_start(args, format);
+  vsnprintf(&large[0], large.size(), format, args);
+  va_end(args);
+  return write((const uint8_t*)large.data(), length);
+}
+
+int Stream::timedRead() {
+  unsigned long start = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+    delay(1);
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = timedRead();
+    if (c < 0) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+String Stream::readString() {
+  String out;
+  int c;
+  while ((c = timedRead()) >= 0) out += (char)c;
+  return out;
+}
+
+String Stream::readStringUntil(char terminator) {
+  String out;
+  int c;
+  while ((c = timedRead()) >= 0 && c != terminator) out += (char)c;
+  return out;
+}
+
+String IPAddress::toString() const {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(text);
+}
+
+// ---- Serial capture ----
+
+namespace {
+
+std::string& serialBuffer() {
+  static std::string* buffer = new std::string();
+  return *buffer;
+}
+
+bool verbose() {
+  static bool value = getenv("HAMQTT_TEST_VERBOSE") != nullptr;
+  return value;
+}
+
+void capture(const uint8_t* data, size_t size) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (verbose()) fwrite(data, 1, size, stdout);
+  std::string& buffer = serialBuffer();
+  buffer.append((const char*)data, size);
+  if (buffer.size() > 256 * 1024) buffer.erase(0, buffer.size() - 192 * 1024);
+}
+
+}  // namespace
+
+size_t HardwareSerial::write(uint8_t c) {
+  capture(&c, 1);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) {
+  capture(buffer, size);
+  return size;
+}
+
+// ---- Random ----
+
+static uint64_t randomState = 0x2545F4914F6CDD1DULL;
+
+static uint32_t nextRandom() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return (uint32_t)((randomState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+long random(long max) {
+  return max > 0 ? (long)(nextRandom() % (uint32_t)max) : 0;
+}
+
+long random(long min, long max) {
+  return min >= max ? min : min + random(max - min);
+}
+
+void randomSeed(unsigned long seed) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  randomState = seed ? seed : 0x2545F4914F6CDD1DULL;
+}
+
+uint32_t esp_random() {
+  return nextRandom();
+}
+
+// ---- Time ----
+
+unsigned long millis() {
+  return sim::now();
+}
+
+unsigned long micros() {
+  return sim::now() * 1000;
+}
+
+void delay(unsigned long ms) {
+  sim::advance(ms);
+  // Lets a worker thread run while the caller "waits"
+  std::this_thread::yield();
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+// ---- Heap accounting ----
+
+namespace {
+
+std::atomic<size_t> liveBytes(0);
+std::atomic<size_t> peakBytes(0);
+std::atomic<uint64_t> allocations(0);
+std::atomic<uint64_t> frees(0);
+
+// The size is kept in front of each block so delete can account for it
+const size_t HEADER = 16;
+
+void* allocate(size_t size) {
+  void* block = malloc(size + HEADER);
+  if (!block) throw std::bad_alloc();
+  *(size_t*)block = size;
+  size_t live = liveBytes += size;
+  size_t peak = peakBytes.load();
+  while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) {
+  }
+  allocations++;
+  return (char*)block + HEADER;
+}
+
+void release(void* pointer) {
+  if (!pointer) return;
+  void* block = (char*)pointer - HEADER;
+  liveBytes -= *(size_t*)block;
+  frees++;
+  free(block);
+}
+
+}  // namespace
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+void operator delete(void* pointer) noexcept { release(pointer); }
+void operator delete[](void* pointer) noexcept { release(pointer); }
+void operator delete(void* pointer, size_t) noexcept { release(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { release(pointer); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { release(pointer); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { release(pointer); }
+
+uint32_t EspClass::getHeapSize() {
+  return sim::HEAP_SIZE;
+}
+
+uint32_t EspClass::getFreeHeap() {
+  size_t live = liveBytes.load();
+  return live >= sim::HEAP_SIZE ? 0 : (uint32_t)(sim::HEAP_SIZE - live);
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+  size_t peak = peakBytes.load();
+  return peak >= sim::HEAP_SIZE ? 0 : (uint32_t)(sim::HEAP_SIZE - peak);
+}
+
+uint32_t EspClass::getMaxAllocHeap() {
+  return getFreeHeap();
+}
+
+namespace sim {
+
+std::recursive_mutex& lock() {
+  static std::recursive_mutex* mutex = new std::recursive_mutex();
+  return *mutex;
+}
+
+HeapStats heap() {
+  HeapStats stats;
+  stats.liveBytes = liveBytes.load();
+  stats.peakBytes = peakBytes.load();
+  stats.allocations = allocations.load();
+  stats.frees = frees.load();
+  return stats;
+}
+
+void resetHeapPeak() {
+  peakBytes = liveBytes.load();
+}
+
+const std::string& serialOutput() {
+  return serialBuffer();
+}
+
+bool serialContains(const char* text) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  return serialBuffer().find(text) != std::string::npos;
+}
+
+void clearSerial() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  serialBuffer().clear();
+}
+
+}  // namespace sim
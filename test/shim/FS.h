@@ -0,0 +1,71 @@
+#ifndef FS_H
+#define FS_H
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+class FS;
+
+class File : public Stream {
+public:
+  File() {}
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t size() const;
+  void close();
+  operator bool() const { return (bool)_handle; }
+
+private:
+  friend class FS;
+  struct Handle {
+    FS* fs;
+    std::string path;
+    size_t position;
+    bool writable;
+  };
+  std::shared_ptr<Handle> _handle;
+};
+
+// Flash file system in process memory, with write accounting so tests can
+// see what a policy costs in flash wear
+class FS {
+public:
+  File open(const char* path, const char* mode = FILE_READ, bool create = false);
+  File open(const String& path, const char* mode = FILE_READ, bool create = false) {
+    return open(path.c_str(), mode, create);
+  }
+  bool exists(const char* path) const { return _files.count(path) != 0; }
+  bool exists(const String& path) const { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool remove(const String& path) { return remove(path.c_str()); }
+
+  // Host only
+  std::string& contents(const char* path) { return _files[path]; }
+  uint32_t opensForWrite = 0;
+  uint64_t bytesWritten = 0;
+  uint32_t removes = 0;
+
+private:
+  friend class File;
+  std::map<std::string, std::string> _files;
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
+
+#endif
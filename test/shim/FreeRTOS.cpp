@@ -0,0 +1,181 @@
+#include <Arduino.h>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include "Sim.h"
+
+// Tasks wait for each other in real time, but only the thread that calls
+// delay() moves the virtual clock. A timed-out wait costs no virtual time.
+
+struct SimTask {
+  std::mutex mutex;
+  std::condition_variable signal;
+  uint32_t notifications = 0;
+};
+
+struct SimSemaphore {
+  enum Kind { MUTEX, RECURSIVE, BINARY } kind;
+  std::mutex mutex;
+  std::condition_variable signal;
+  uint32_t count = 0;
+  std::thread::id owner;
+  uint32_t depth = 0;
+};
+
+namespace {
+
+// Thrown by vTaskDelete(nullptr) to unwind the task's thread
+struct TaskExit {};
+
+thread_local SimTask* currentTask = nullptr;
+
+SimTask& mainTask() {
+  static SimTask* task = new SimTask();
+  return *task;
+}
+
+template <typename Predicate>
+bool waitFor(std::unique_lock<std::mutex>& guard, std::condition_variable& signal, TickType_t ticks,
+             Predicate ready) {
+  if (ticks == portMAX_DELAY) {
+    signal.wait(guard, ready);
+    return true;
+  }
+  return signal.wait_for(guard, std::chrono::milliseconds(ticks), ready);
+}
+
+}  // namespace
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char*, uint32_t, void* arg, UBaseType_t,
+                                   TaskHandle_t* handle, BaseType_t) {
+  SimTask* task = new SimTask();
+  if (handle) *handle = task;
+  std::thread([function, arg, task]() {
+    currentTask = task;
+    try {
+      function(arg);
+    } catch (const TaskExit&) {
+      // The handle is dead once the task has deleted itself
+      currentTask = nullptr;
+      delete task;
+      return;
+    }
+    // A FreeRTOS task must not return; reaching here without vTaskDelete
+    // is a bug in the task, not something to hide
+    abort();
+  }).detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackSize, void* arg,
+                       UBaseType_t priority, TaskHandle_t* handle) {
+  return xTaskCreatePinnedToCore(function, name, stackSize, arg, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task == nullptr || task == currentTask) throw TaskExit();
+  // Deleting another task isn't simulated; the library never does it
+  abort();
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  return currentTask ? currentTask : &mainTask();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  {
+    std::lock_guard<std::mutex> guard(task->mutex);
+    task->notifications++;
+  }
+  task->signal.notify_all();
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+  SimTask* task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> guard(task->mutex);
+  if (!waitFor(guard, task->signal, ticks, [task]() { return task->notifications > 0; })) return 0;
+  uint32_t value = task->notifications;
+  task->notifications = clearOnExit ? 0 : value - 1;
+  return value;
+}
+
+static SemaphoreHandle_t createSemaphore(SimSemaphore::Kind kind, uint32_t count) {
+  SimSemaphore* semaphore = new SimSemaphore();
+  semaphore->kind = kind;
+  semaphore->count = count;
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return createSemaphore(SimSemaphore::MUTEX, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+  return createSemaphore(SimSemaphore::RECURSIVE, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return createSemaphore(SimSemaphore::BINARY, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+  delete semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> guard(semaphore->mutex);
+  if (!waitFor(guard, semaphore->signal, ticks, [semaphore]() { return semaphore->count > 0; })) return pdFALSE;
+  semaphore->count--;
+  semaphore->owner = std::this_thread::get_id();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+  {
+    std::lock_guard<std::mutex> guard(semaphore->mutex);
+    if (semaphore->count > 0) return pdFALSE;
+    semaphore->count++;
+    semaphore->owner = std::thread::id();
+  }
+  semaphore->signal.notify_all();
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticks) {
+  std::unique_lock<std::mutex> guard(semaphore->mutex);
+  std::thread::id self = std::this_thread::get_id();
+  if (semaphore->depth && semaphore->owner == self) {
+    semaphore->depth++;
+    return pdTRUE;
+  }
+  if (!waitFor(guard, semaphore->signal, ticks, [semaphore]() { return semaphore->depth == 0; })) return pdFALSE;
+  semaphore->owner = self;
+  semaphore->depth = 1;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore) {
+  {
+    std::lock_guard<std::mutex> guard(semaphore->mutex);
+    if (!semaphore->depth || semaphore->owner != std::this_thread::get_id()) return pdFALSE;
+    if (--semaphore->depth) return pdTRUE;
+    semaphore->owner = std::thread::id();
+  }
+  semaphore->signal.notify_all();
+  return pdTRUE;
+}
+
+void vPortEnterCritical(portMUX_TYPE* mux) {
+  sim::lock().lock();
+  mux->count++;
+}
+
+void vPortExitCritical(portMUX_TYPE* mux) {
+  mux->count--;
+  sim::lock().unlock();
+}
@@ -0,0 +1,237 @@
+#include <HTTPClient.h>
+
+HTTPClient::HTTPClient()
+  : _client(nullptr), _port(80), _reuse(true), _canReuse(false), _timeout(5000), _connectTimeout(5000), _size(-1),
+    _returnCode(0) {}
+
+HTTPClient::~HTTPClient() {
+  if (_client) _client->stop();
+}
+
+void HTTPClient::clear() {
+  _headers = "";
+  _size = -1;
+  _returnCode = 0;
+  _canReuse = false;
+}
+
+bool HTTPClient::begin(WiFiClient& client, const String& url) {
+  String rest = url;
+  bool https = rest.startsWith("https://");
+  int scheme = rest.indexOf("://");
+  if (scheme >= 0) rest = rest.substring(scheme + 3);
+  int slash = rest.indexOf('/');
+  String host = slash >= 0 ? rest.substring(0, slash) : rest;
+  String uri = slash >= 0 ? rest.substring(slash) : String("/");
+  uint16_t port = https ? 443 : 80;
+  int colon = host.indexOf(':');
+  if (colon >= 0) {
+    port = (uint16_t)host.substring(colon + 1).toInt();
+    host = host.substring(0, colon);
+  }
+  return begin(client, host, port, uri, https);
+}
+
+bool HTTPClient::begin(WiFiClient& client, const String& host, uint16_t port, const String& uri, bool) {
+  if (_client && _client != &client) _client->stop();
+  clear();
+  _client = &client;
+  _host = host;
+  _port = port;
+  _uri = uri;
+  return true;
+}
+
+void HTTPClient::end() {
+  if (!_client) return;
+  if (_reuse && _canReuse && _client->connected()) {
+    // Whatever wasn't read would be taken as the next response
+    uint8_t scratch[256];
+    while (_client->available() > 0) _client->read(scratch, sizeof(scratch));
+  } else {
+    _client->stop();
+  }
+  clear();
+}
+
+void HTTPClient::addHeader(const String& name, const String& value, bool first, bool) {
+  String line = name + ": " + value + "\r\n";
+  if (first) {
+    _headers = line + _headers;
+  } else {
+    _headers += line;
+  }
+}
+
+bool HTTPClient::connected() {
+  return _client && (_client->connected() || _client->available() > 0);
+}
+
+int HTTPClient::GET() {
+  return sendRequest("GET");
+}
+
+int HTTPClient::POST(const String& payload) {
+  return sendRequest("POST", (uint8_t*)payload.c_str(), payload.length());
+}
+
+int HTTPClient::POST(uint8_t* payload, size_t size) {
+  return sendRequest("POST", payload, size);
+}
+
+int HTTPClient::sendRequest(const char* type, const String& payload) {
+  return sendRequest(type, (uint8_t*)payload.c_str(), payload.length());
+}
+
+int HTTPClient::sendRequest(const char* type, uint8_t* payload, size_t size) {
+  if (!_client) return HTTPC_ERROR_NOT_CONNECTED;
+  if (!_client->connected()) {
+    if (!_client->connect(_host.c_str(), _port, _connectTimeout)) return HTTPC_ERROR_CONNECTION_REFUSED;
+  } else {
+    uint8_t scratch[256];
+    while (_client->available() > 0) _client->read(scratch, sizeof(scratch));
+  }
+
+  String request = String(type) + " " + _uri + " HTTP/1.1\r\n";
+  request += "Host: " + _host + "\r\n";
+  request += _reuse ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  request += "User-Agent: ESP32HTTPClient\r\n";
+  request += _headers;
+  if (payload && size) request += "Content-Length: " + String((unsigned long)size) + "\r\n";
+  request += "\r\n";
+
+  if (_client->write((const uint8_t*)request.c_str(), request.length()) != request.length()) {
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+  }
+  if (payload && size && _client->write(payload, size) != size) {
+    return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+  }
+  _returnCode = readHeaders();
+  return _returnCode;
+}
+
+bool HTTPClient::readLine(String& line) {
+  line = "";
+  unsigned long start = millis();
+  while (true) {
+    int c = _client->read();
+    if (c >= 0) {
+      if (c == '\n') return true;
+      if (c != '\r') line += (char)c;
+      start = millis();
+      continue;
+    }
+    if (!_client->connected()) return false;
+    if (millis() - start >= _timeout) return false;
+    delay(1);
+  }
+}
+
+int HTTPClient::readHeaders() {
+  String line;
+  unsigned long start = millis();
+  // Nothing back yet: wait for the first byte or the server to go away
+  while (_client->available() <= 0) {
+    if (!_client->connected()) return HTTPC_ERROR_CONNECTION_LOST;
+    if (millis() - start >= _timeout) return HTTPC_ERROR_READ_TIMEOUT;
+    delay(1);
+  }
+
+  if (!readLine(line)) return _client->connected() ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+  if (!line.startsWith("HTTP/1.")) return HTTPC_ERROR_NO_HTTP_SERVER;
+  int code = line.substring(9, 12).toInt();
+  _canReuse = _reuse;
+  _size = -1;
+
+  while (true) {
+    if (!readLine(line)) return _client->connected() ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+    if (!line.length()) break;
+    int colon = line.indexOf(':');
+    if (colon < 0) continue;
+    String name = line.substring(0, colon);
+    String value = line.substring(colon + 1);
+    value.trim();
+    if (name.equalsIgnoreCase("Content-Length")) {
+      _size = value.toInt();
+    } else if (name.equalsIgnoreCase("Connection") && value.equalsIgnoreCase("close")) {
+      _canReuse = false;
+    }
+  }
+  return code;
+}
+
+String HTTPClient::getString() {
+  String body;
+  if (!_client || _size <= 0) return body;
+  body.reserve(_size);
+  char buffer[512];
+  int remaining = _size;
+  unsigned long start = millis();
+  while (remaining > 0 && millis() - start < _timeout) {
+    int available = _client->available();
+    if (available <= 0) {
+      if (!_client->connected()) break;
+      delay(1);
+      continue;
+    }
+    int count = _client->read((uint8_t*)buffer, std::min(remaining, (int)sizeof(buffer)));
+    if (count <= 0) break;
+    body.concat(buffer, count);
+    remaining -= count;
+  }
+  return body;
+}
+
+int HTTPClient::writeToStream(Stream* stream) {
+  if (!stream) return HTTPC_ERROR_NO_STREAM;
+  if (!_client || !connected()) return HTTPC_ERROR_NOT_CONNECTED;
+  if (_size < 0) return HTTPC_ERROR_ENCODING;
+  uint8_t buffer[512];
+  int remaining = _size;
+  int written = 0;
+  unsigned long start = millis();
+  while (remaining > 0) {
+    int available = _client->available();
+    if (available <= 0) {
+      if (!_client->connected() || millis() - start >= _timeout) return HTTPC_ERROR_READ_TIMEOUT;
+      delay(1);
+      continue;
+    }
+    int count = _client->read(buffer, std::min(remaining, (int)sizeof(buffer)));
+    if (count <= 0) return HTTPC_ERROR_CONNECTION_LOST;
+    if (stream->write(buffer, count) != (size_t)count) return HTTPC_ERROR_STREAM_WRITE;
+    remaining -= count;
+    written += count;
+    start = millis();
+  }
+  return written;
+}
+
+String HTTPClient::errorToString(int error) {
+  switch (error) {
+    case HTTPC_ERROR_CONNECTION_REFUSED:
+      return "connection refused";
+    case HTTPC_ERROR_SEND_HEADER_FAILED:
+      return "send header failed";
+    case HTTPC_ERROR_SEND_PAYLOAD_FAILED:
+      return "send payload failed";
+    case HTTPC_ERROR_NOT_CONNECTED:
+      return "not connected";
+    case HTTPC_ERROR_CONNECTION_LOST:
+      return "connection lost";
+    case HTTPC_ERROR_NO_STREAM:
+      return "no stream";
+    case HTTPC_ERROR_NO_HTTP_SERVER:
+      return "no HTTP server";
+    case HTTPC_ERROR_TOO_LESS_RAM:
+      return "too less ram";
+    case HTTPC_ERROR_ENCODING:
+      return "Transfer-Encoding not supported";
+    case HTTPC_ERROR_STREAM_WRITE:
+      return "Stream write error";
+    case HTTPC_ERROR_READ_TIMEOUT:
+      return "read Timeout";
+    default:
+      return String();
+  }
+}
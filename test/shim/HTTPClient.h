@@ -0,0 +1,79 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED (-3)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_NO_STREAM (-6)
+#define HTTPC_ERROR_NO_HTTP_SERVER (-7)
+#define HTTPC_ERROR_TOO_LESS_RAM (-8)
+#define HTTPC_ERROR_ENCODING (-9)
+#define HTTPC_ERROR_STREAM_WRITE (-10)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+typedef enum {
+  HTTP_CODE_OK = 200,
+  HTTP_CODE_CREATED = 201,
+  HTTP_CODE_BAD_REQUEST = 400,
+  HTTP_CODE_UNAUTHORIZED = 401,
+  HTTP_CODE_NOT_FOUND = 404,
+  HTTP_CODE_PAYLOAD_TOO_LARGE = 413,
+  HTTP_CODE_SERVICE_UNAVAILABLE = 503
+} t_http_codes;
+
+// HTTP/1.1 client with the ESP32 HTTPClient's interface and keep-alive
+// behaviour: the socket stays open after end() when reuse is on and the
+// server didn't ask to close it. Bodies need a Content-Length.
+class HTTPClient {
+public:
+  HTTPClient();
+  ~HTTPClient();
+
+  bool begin(WiFiClient& client, const String& url);
+  bool begin(WiFiClient& client, const String& host, uint16_t port, const String& uri = "/", bool https = false);
+  void end();
+
+  void setReuse(bool reuse) { _reuse = reuse; }
+  void setTimeout(uint16_t timeout) { _timeout = timeout; }
+  void setConnectTimeout(int32_t timeout) { _connectTimeout = timeout; }
+  void addHeader(const String& name, const String& value, bool first = false, bool replace = true);
+
+  int GET();
+  int POST(const String& payload);
+  int POST(uint8_t* payload, size_t size);
+  int sendRequest(const char* type, const String& payload);
+  int sendRequest(const char* type, uint8_t* payload = nullptr, size_t size = 0);
+
+  int getSize() { return _size; }
+  WiFiClient* getStreamPtr() { return connected() ? _client : nullptr; }
+  WiFiClient& getStream() { return *_client; }
+  String getString();
+  int writeToStream(Stream* stream);
+  bool connected();
+
+  static String errorToString(int error);
+
+private:
+  WiFiClient* _client;
+  String _host;
+  uint16_t _port;
+  String _uri;
+  String _headers;
+  bool _reuse;
+  bool _canReuse;
+  uint16_t _timeout;
+  int32_t _connectTimeout;
+  int _size;
+  int _returnCode;
+
+  void clear();
+  int readHeaders();
+  bool readLine(String& line);
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef PREFERENCES_H
+#define PREFERENCES_H
+
+#include <Arduino.h>
+
+// NVS kept in process memory; it survives a new Preferences (a reboot) but
+// not sim::reset()
+class Preferences {
+public:
+  Preferences() : _open(false), _readOnly(false) {}
+  ~Preferences() { end(); }
+
+  bool begin(const char* name, bool readOnly = false, const char* partition = nullptr);
+  void end();
+  bool clear();
+  bool remove(const char* key);
+  bool isKey(const char* key);
+  size_t putUInt(const char* key, uint32_t value);
+  uint32_t getUInt(const char* key, uint32_t defaultValue = 0);
+
+  // Host only: writes to NVS since sim::reset()
+  static uint32_t writes();
+
+private:
+  bool _open;
+  bool _readOnly;
+  String _name;
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "Sim.h"
+#include <Arduino.h>
+
+void resetPreferences();
+
+namespace sim {
+
+namespace {
+
+unsigned long clockMs = 0;
+uint64_t timerSequence = 0;
+std::multimap<std::pair<unsigned long, uint64_t>, std::function<void()>>& timers() {
+  static auto* queue = new std::multimap<std::pair<unsigned long, uint64_t>, std::function<void()>>();
+  return *queue;
+}
+
+}  // namespace
+
+unsigned long now() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  return clockMs;
+}
+
+void advance(unsigned long ms) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  unsigned long target = clockMs + ms;
+  auto& queue = timers();
+  while (!queue.empty() && queue.begin()->first.first <= target) {
+    auto next = queue.begin();
+    if (next->first.first > clockMs) clockMs = next->first.first;
+    std::function<void()> action = std::move(next->second);
+    queue.erase(next);
+    action();
+  }
+  if (target > clockMs) clockMs = target;
+}
+
+void at(unsigned long when, std::function<void()> action) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  timers().emplace(std::make_pair(when, timerSequence++), std::move(action));
+}
+
+void after(unsigned long ms, std::function<void()> action) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  at(clockMs + ms, std::move(action));
+}
+
+void drain(unsigned long limit) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  unsigned long end = clockMs + limit;
+  auto& queue = timers();
+  while (!queue.empty() && queue.begin()->first.first <= end) {
+    advance(queue.begin()->first.first - clockMs);
+  }
+}
+
+// ---- Network ----
+
+void Connection::send(const char* data, size_t length) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  if (!open) return;
+  outbound.append(data, length);
+  network().stats.bytesDown += length;
+}
+
+void Connection::close() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  open = false;
+}
+
+bool Connection::isOpen() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  if (open && closeAt && clockMs >= closeAt) open = false;
+  return open;
+}
+
+Network::Network() : dnsMs(0), connectMs(0), handshakeMs(0), stats() {}
+
+static std::string endpoint(const std::string& host, uint16_t port) {
+  return host + ":" + std::to_string(port);
+}
+
+void Network::listen(const std::string& host, uint16_t port, Server* server) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  _servers[endpoint(host, port)] = server;
+}
+
+void Network::unlisten(const std::string& host, uint16_t port) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  _servers.erase(endpoint(host, port));
+}
+
+void Network::setReachable(const std::string& host, bool reachable) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  _unreachable[host] = !reachable;
+}
+
+void Network::dropConnections(bool silently) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  for (auto& weak : _connections) {
+    std::shared_ptr<Connection> connection = weak.lock();
+    if (!connection || !connection->open) continue;
+    if (silently) {
+      connection->stale = true;
+    } else {
+      connection->open = false;
+    }
+  }
+  _connections.clear();
+}
+
+void Network::reset() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  dropConnections();
+  _servers.clear();
+  _unreachable.clear();
+  _addresses.clear();
+  dnsMs = connectMs = handshakeMs = 0;
+  stats = NetworkStats();
+}
+
+uint32_t Network::resolve(const std::string& host) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  stats.dnsLookups++;
+  if (dnsMs) advance(dnsMs);
+  auto found = _addresses.find(host);
+  if (found != _addresses.end()) return found->second;
+  uint32_t address = IPAddress(10, 0, 0, (uint8_t)(_addresses.size() + 2));
+  _addresses[host] = address;
+  return address;
+}
+
+std::string Network::hostFor(uint32_t address) const {
+  for (const auto& entry : _addresses) {
+    if (entry.second == address) return entry.first;
+  }
+  return IPAddress(address).toString().str();
+}
+
+std::shared_ptr<Connection> Network::connect(const std::string& host, uint16_t port, bool tls) {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  auto server = _servers.find(endpoint(host, port));
+  if (server == _servers.end() || _unreachable[host]) {
+    stats.refused++;
+    return nullptr;
+  }
+  if (connectMs) advance(connectMs);
+  stats.connects++;
+  if (tls) {
+    stats.handshakes++;
+    if (handshakeMs) advance(handshakeMs);
+  }
+
+  auto connection = std::make_shared<Connection>();
+  connection->host = host;
+  connection->port = port;
+  connection->tls = tls;
+  connection->server = server->second;
+  // Forget connections that are gone so the list doesn't grow with churn
+  _connections.erase(std::remove_if(_connections.begin(), _connections.end(),
+                                    [](const std::weak_ptr<Connection>& weak) {
+                                      auto live = weak.lock();
+                                      return !live || !live->open;
+                                    }),
+                     _connections.end());
+  _connections.push_back(connection);
+  server->second->accepted(connection);
+  return connection;
+}
+
+Network& network() {
+  static Network* instance = new Network();
+  return *instance;
+}
+
+void reset() {
+  std::lock_guard<std::recursive_mutex> guard(lock());
+  network().reset();
+  timers().clear();
+  clockMs = 0;
+  clearSerial();
+  resetPreferences();
+}
+
+}  // namespace sim
@@ -0,0 +1,131 @@
+#ifndef SIM_H
+#define SIM_H
+
+// Host simulation behind the shims: a virtual clock with timers, heap
+// accounting, captured Serial output and an in-process network that the
+// WiFiClient shims connect through. Everything is guarded by one recursive
+// lock, so a worker thread and the test thread can share it.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+std::recursive_mutex& lock();
+
+// Virtual clock. delay() advances it; timers due by then run in order.
+unsigned long now();
+void advance(unsigned long ms);
+void at(unsigned long when, std::function<void()> action);
+void after(unsigned long ms, std::function<void()> action);
+// Runs timers until none is left or `limit` ms have passed
+void drain(unsigned long limit = 60000);
+
+// Every allocation through operator new is counted
+struct HeapStats {
+  size_t liveBytes;
+  size_t peakBytes;
+  uint64_t allocations;
+  uint64_t frees;
+};
+HeapStats heap();
+void resetHeapPeak();
+// Heap the ESP reports as free is this minus the live bytes
+static const size_t HEAP_SIZE = 320 * 1024;
+
+// Serial output is kept (the last 256 KB) instead of printed, unless
+// HAMQTT_TEST_VERBOSE is set
+const std::string& serialOutput();
+bool serialContains(const char* text);
+void clearSerial();
+
+class Connection;
+
+// A listener registered on host:port. Calls come in under the sim lock.
+class Server {
+public:
+  virtual ~Server() {}
+  virtual void accepted(const std::shared_ptr<Connection>& connection) { (void)connection; }
+  // New bytes are in connection->inbound
+  virtual void received(const std::shared_ptr<Connection>& connection) = 0;
+  virtual void closed(const std::shared_ptr<Connection>& connection) { (void)connection; }
+};
+
+class Connection {
+public:
+  std::string host;
+  uint16_t port;
+  bool tls;
+  Server* server;
+  std::string inbound;   // sent by the client, not consumed by the server yet
+  std::string outbound;  // sent by the server; the client has read up to `consumed`
+  size_t consumed;
+  bool open;
+  // Closed by the peer without the client noticing yet: writes vanish and
+  // the connection then reads as reset
+  bool stale;
+  // The server closes an idle connection at this time (0 = never)
+  unsigned long closeAt;
+  std::shared_ptr<void> state;
+
+  Connection() : port(0), tls(false), server(nullptr), consumed(0), open(true), stale(false), closeAt(0) {}
+  void send(const char* data, size_t length);
+  void send(const std::string& data) { send(data.data(), data.size()); }
+  // Server side close; the client still reads what was sent before
+  void close();
+  bool isOpen();
+  size_t unread() const { return outbound.size() - consumed; }
+};
+
+struct NetworkStats {
+  uint32_t dnsLookups;
+  uint32_t connects;
+  uint32_t handshakes;
+  uint32_t refused;
+  uint64_t bytesUp;
+  uint64_t bytesDown;
+};
+
+class Network {
+public:
+  Network();
+
+  void listen(const std::string& host, uint16_t port, Server* server);
+  void unlisten(const std::string& host, uint16_t port);
+  // An unreachable host refuses connections; its server stays registered
+  void setReachable(const std::string& host, bool reachable);
+  // Closes every open connection; silently leaves the client unaware
+  void dropConnections(bool silently = false);
+  void reset();
+
+  uint32_t resolve(const std::string& host);
+  std::string hostFor(uint32_t address) const;
+  std::shared_ptr<Connection> connect(const std::string& host, uint16_t port, bool tls);
+
+  unsigned long dnsMs;
+  unsigned long connectMs;
+  unsigned long handshakeMs;
+  NetworkStats stats;
+
+private:
+  std::map<std::string, Server*> _servers;
+  std::map<std::string, bool> _unreachable;
+  std::map<std::string, uint32_t> _addresses;
+  std::vector<std::weak_ptr<Connection>> _connections;
+};
+
+Network& network();
+
+// Puts clock, network, Serial capture and NVS back to a fresh boot state.
+// RTC memory (static RTC_DATA_ATTR data) is deliberately left alone.
+void reset();
+
+}  // namespace sim
+
+#endif
@@ -0,0 +1,144 @@
+#include <FS.h>
+#include <Preferences.h>
+#include "Sim.h"
+
+// ---- Preferences ----
+
+namespace {
+
+std::map<std::string, std::map<std::string, uint32_t>>& nvs() {
+  static auto* store = new std::map<std::string, std::map<std::string, uint32_t>>();
+  return *store;
+}
+
+uint32_t nvsWrites = 0;
+
+}  // namespace
+
+void resetPreferences() {
+  nvs().clear();
+  nvsWrites = 0;
+}
+
+bool Preferences::begin(const char* name, bool readOnly, const char*) {
+  if (_open || !name) return false;
+  _open = true;
+  _readOnly = readOnly;
+  _name = name;
+  return true;
+}
+
+void Preferences::end() {
+  _open = false;
+}
+
+bool Preferences::clear() {
+  if (!_open || _readOnly) return false;
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  nvs().erase(_name.str());
+  nvsWrites++;
+  return true;
+}
+
+bool Preferences::remove(const char* key) {
+  if (!_open || _readOnly) return false;
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  nvsWrites++;
+  return nvs()[_name.str()].erase(key) != 0;
+}
+
+bool Preferences::isKey(const char* key) {
+  if (!_open) return false;
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  return nvs()[_name.str()].count(key) != 0;
+}
+
+size_t Preferences::putUInt(const char* key, uint32_t value) {
+  if (!_open || _readOnly) return 0;
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  nvs()[_name.str()][key] = value;
+  nvsWrites++;
+  return sizeof(value);
+}
+
+uint32_t Preferences::getUInt(const char* key, uint32_t defaultValue) {
+  if (!_open) return defaultValue;
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  auto& space = nvs()[_name.str()];
+  auto found = space.find(key);
+  return found == space.end() ? defaultValue : found->second;
+}
+
+uint32_t Preferences::writes() {
+  return nvsWrites;
+}
+
+// ---- FS ----
+
+namespace fs {
+
+File FS::open(const char* path, const char* mode, bool create) {
+  File file;
+  bool writing = mode[0] == 'w' || mode[0] == 'a';
+  if (!writing && !create && !exists(path)) return file;
+
+  auto handle = std::make_shared<File::Handle>();
+  handle->fs = this;
+  handle->path = path;
+  handle->position = 0;
+  handle->writable = writing;
+  std::string& data = _files[path];
+  if (mode[0] == 'w') data.clear();
+  if (mode[0] == 'a') handle->position = data.size();
+  if (writing) opensForWrite++;
+  file._handle = handle;
+  return file;
+}
+
+bool FS::remove(const char* path) {
+  removes++;
+  return _files.erase(path) != 0;
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  if (!_handle || !_handle->writable) return 0;
+  std::string& data = _handle->fs->_files[_handle->path];
+  data.replace(_handle->position, std::min(size, data.size() - _handle->position), (const char*)buffer, size);
+  _handle->position += size;
+  _handle->fs->bytesWritten += size;
+  return size;
+}
+
+int File::available() {
+  if (!_handle) return 0;
+  auto found = _handle->fs->_files.find(_handle->path);
+  if (found == _handle->fs->_files.end()) return 0;
+  return (int)(found->second.size() - std::min(_handle->position, found->second.size()));
+}
+
+int File::read() {
+  int c = peek();
+  if (c >= 0) _handle->position++;
+  return c;
+}
+
+int File::peek() {
+  if (!available()) return -1;
+  return (uint8_t)_handle->fs->_files[_handle->path][_handle->position];
+}
+
+size_t File::size() const {
+  if (!_handle) return 0;
+  auto found = _handle->fs->_files.find(_handle->path);
+  return found == _handle->fs->_files.end() ? 0 : found->second.size();
+}
+
+void File::close() {
+  _handle.reset();
+}
+
+}  // namespace fs
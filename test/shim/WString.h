@@ -0,0 +1,154 @@
+#ifndef WSTRING_H
+#define WSTRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class StringSumHelper;
+
+// Arduino String on top of std::string; only the members the library, the
+// sketch and the tests use
+class String {
+public:
+  String() {}
+  String(const char* text) : _s(text ? text : "") {}
+  String(const String& other) = default;
+  String(String&& other) = default;
+  explicit String(char c) : _s(1, c) {}
+  explicit String(unsigned char value, unsigned char base = 10);
+  explicit String(int value, unsigned char base = 10);
+  explicit String(unsigned int value, unsigned char base = 10);
+  explicit String(long value, unsigned char base = 10);
+  explicit String(unsigned long value, unsigned char base = 10);
+  explicit String(float value, unsigned int decimals = 2);
+  explicit String(double value, unsigned int decimals = 2);
+  ~String() {}
+
+  String& operator=(const String& other) = default;
+  String& operator=(String&& other) = default;
+  String& operator=(const char* text) {
+    _s = text ? text : "";
+    return *this;
+  }
+
+  unsigned int length() const { return (unsigned int)_s.size(); }
+  bool isEmpty() const { return _s.empty(); }
+  const char* c_str() const { return _s.c_str(); }
+  bool reserve(unsigned int size) {
+    _s.reserve(size);
+    return true;
+  }
+
+  char operator[](unsigned int index) const { return index < _s.size() ? _s[index] : 0; }
+  char& operator[](unsigned int index);
+  char charAt(unsigned int index) const { return (*this)[index]; }
+  void setCharAt(unsigned int index, char c) {
+    if (index < _s.size()) _s[index] = c;
+  }
+
+  bool concat(const String& other) {
+    _s += other._s;
+    return true;
+  }
+  bool concat(const char* text) {
+    if (text) _s += text;
+    return true;
+  }
+  bool concat(const char* text, unsigned int length) {
+    if (text) _s.append(text, length);
+    return true;
+  }
+  bool concat(char c) {
+    _s += c;
+    return true;
+  }
+  bool concat(unsigned char value) { return concat(String(value)); }
+  bool concat(int value) { return concat(String(value)); }
+  bool concat(unsigned int value) { return concat(String(value)); }
+  bool concat(long value) { return concat(String(value)); }
+  bool concat(unsigned long value) { return concat(String(value)); }
+  bool concat(float value) { return concat(String(value)); }
+  bool concat(double value) { return concat(String(value)); }
+
+  template <typename T>
+  String& operator+=(const T& value) {
+    concat(value);
+    return *this;
+  }
+
+  friend StringSumHelper operator+(const StringSumHelper& lhs, const String& rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, const char* rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, char rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, unsigned char rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, int rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, unsigned int rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, long rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, unsigned long rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, float rhs);
+  friend StringSumHelper operator+(const StringSumHelper& lhs, double rhs);
+
+  int compareTo(const String& other) const { return _s.compare(other._s); }
+  bool equals(const String& other) const { return _s == other._s; }
+  bool equals(const char* text) const { return _s == (text ? text : ""); }
+  bool equalsIgnoreCase(const String& other) const;
+  bool operator==(const String& other) const { return equals(other); }
+  bool operator==(const char* text) const { return equals(text); }
+  bool operator!=(const String& other) const { return !equals(other); }
+  bool operator!=(const char* text) const { return !equals(text); }
+  bool operator<(const String& other) const { return compareTo(other) < 0; }
+  bool operator>(const String& other) const { return compareTo(other) > 0; }
+
+  bool startsWith(const String& prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+  bool startsWith(const String& prefix, unsigned int offset) const;
+  bool endsWith(const String& suffix) const;
+
+  int indexOf(char c) const { return indexOf(c, 0); }
+  int indexOf(char c, unsigned int from) const;
+  int indexOf(const String& text) const { return indexOf(text, 0); }
+  int indexOf(const String& text, unsigned int from) const;
+  int lastIndexOf(char c) const;
+  int lastIndexOf(const String& text) const;
+
+  String substring(unsigned int from) const { return substring(from, length()); }
+  String substring(unsigned int from, unsigned int to) const;
+
+  void replace(char find, char replacement);
+  void replace(const String& find, const String& replacement);
+  void remove(unsigned int index);
+  void remove(unsigned int index, unsigned int count);
+  void toLowerCase();
+  void toUpperCase();
+  void trim();
+
+  long toInt() const;
+  float toFloat() const;
+  double toDouble() const;
+
+  void getBytes(unsigned char* buffer, unsigned int size, unsigned int index = 0) const;
+  void toCharArray(char* buffer, unsigned int size, unsigned int index = 0) const {
+    getBytes((unsigned char*)buffer, size, index);
+  }
+
+  // Host-only access for the tests
+  const std::string& str() const { return _s; }
+
+private:
+  std::string _s;
+};
+
+class StringSumHelper : public String {
+public:
+  StringSumHelper(const String& s) : String(s) {}
+  StringSumHelper(const char* p) : String(p) {}
+  StringSumHelper(char c) : String(c) {}
+  StringSumHelper(unsigned char value) : String(value) {}
+  StringSumHelper(int value) : String(value) {}
+  StringSumHelper(unsigned int value) : String(value) {}
+  StringSumHelper(long value) : String(value) {}
+  StringSumHelper(unsigned long value) : String(value) {}
+  StringSumHelper(float value) : String(value) {}
+  StringSumHelper(double value) : String(value) {}
+};
+
+#endif
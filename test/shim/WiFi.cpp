@@ -0,0 +1,129 @@
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include "Sim.h"
+
+WiFiClass WiFi;
+
+int WiFiClass::hostByName(const char* host, IPAddress& result) {
+  if (_status != WL_CONNECTED) return 0;
+  result = IPAddress(sim::network().resolve(host));
+  return 1;
+}
+
+int WiFiClient::open(const String& host, uint16_t port, bool tls) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  stop();
+  if (WiFi.status() != WL_CONNECTED) return 0;
+  _connection = sim::network().connect(host.str(), port, tls);
+  return _connection ? 1 : 0;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  return open(sim::network().hostFor(ip).c_str(), port, false);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port, int32_t) {
+  return connect(ip, port);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+  sim::network().resolve(host);
+  return open(host, port, false);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port, int32_t) {
+  return connect(host, port);
+}
+
+size_t WiFiClient::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection || !_connection->isOpen() || !_connection->server) return 0;
+  if (_connection->stale) {
+    // The peer is gone: the bytes leave, and a reset comes back
+    _connection->stale = false;
+    _connection->open = false;
+    return size;
+  }
+  _connection->inbound.append((const char*)buffer, size);
+  sim::network().stats.bytesUp += size;
+  std::shared_ptr<sim::Connection> connection = _connection;
+  connection->server->received(connection);
+  return size;
+}
+
+int WiFiClient::available() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection || _connection->stale) return 0;
+  return (int)_connection->unread();
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t* buffer, size_t size) {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection || _connection->stale) return -1;
+  size_t count = std::min(size, _connection->unread());
+  if (!count) return _connection->isOpen() ? 0 : -1;
+  memcpy(buffer, _connection->outbound.data() + _connection->consumed, count);
+  _connection->consumed += count;
+  if (_connection->consumed > 4096 && _connection->consumed * 2 > _connection->outbound.size()) {
+    _connection->outbound.erase(0, _connection->consumed);
+    _connection->consumed = 0;
+  }
+  return (int)count;
+}
+
+int WiFiClient::peek() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection || _connection->stale || !_connection->unread()) return -1;
+  return (uint8_t)_connection->outbound[_connection->consumed];
+}
+
+void WiFiClient::flush() {}
+
+void WiFiClient::stop() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection) return;
+  std::shared_ptr<sim::Connection> connection = _connection;
+  _connection.reset();
+  if (connection->open) {
+    connection->open = false;
+    if (connection->server) connection->server->closed(connection);
+  }
+}
+
+uint8_t WiFiClient::connected() {
+  std::lock_guard<std::recursive_mutex> guard(sim::lock());
+  if (!_connection) return 0;
+  if (_connection->isOpen()) return 1;
+  // Like lwIP: data that arrived before the FIN can still be read
+  return _connection->unread() > 0 ? 1 : 0;
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port) {
+  return open(sim::network().hostFor(ip).c_str(), port, true);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port, int32_t) {
+  return connect(ip, port);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port) {
+  sim::network().resolve(host);
+  return open(host, port, true);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port, int32_t) {
+  return connect(host, port);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port, const char*, const char*, const char*, const char*) {
+  return connect(ip, port);
+}
@@ -0,0 +1,68 @@
+#ifndef WIFI_H
+#define WIFI_H
+
+#include <Arduino.h>
+#include <memory>
+
+namespace sim {
+class Connection;
+}
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+#define WIFI_STA 1
+
+// TCP client over the simulated network (see Sim.h)
+class WiFiClient : public Stream {
+public:
+  WiFiClient() {}
+  virtual ~WiFiClient() {}
+
+  virtual int connect(IPAddress ip, uint16_t port);
+  virtual int connect(IPAddress ip, uint16_t port, int32_t timeout);
+  virtual int connect(const char* host, uint16_t port);
+  virtual int connect(const char* host, uint16_t port, int32_t timeout);
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  virtual int read(uint8_t* buffer, size_t size);
+  int peek() override;
+  void flush() override;
+  virtual void stop();
+  virtual uint8_t connected();
+  operator bool() { return connected(); }
+  int setNoDelay(bool) { return 0; }
+
+protected:
+  std::shared_ptr<sim::Connection> _connection;
+  int open(const String& host, uint16_t port, bool tls);
+};
+
+class WiFiClass {
+public:
+  void mode(int) {}
+  void begin(const char*, const char*) {}
+  wl_status_t status() { return _status; }
+  int hostByName(const char* host, IPAddress& result);
+  IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+
+  // Host only
+  void setStatus(wl_status_t status) { _status = status; }
+
+private:
+  wl_status_t _status = WL_CONNECTED;
+};
+
+extern WiFiClass WiFi;
+
+#endif
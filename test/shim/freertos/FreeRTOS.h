@@ -0,0 +1,33 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+// FreeRTOS on std::thread: tasks are threads, a tick is a millisecond and
+// critical sections share one process-wide lock
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portTICK_PERIOD_MS 1
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+struct portMUX_TYPE {
+  uint32_t owner;
+  uint32_t count;
+};
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+
+void vPortEnterCritical(portMUX_TYPE* mux);
+void vPortExitCritical(portMUX_TYPE* mux);
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+
+#endif
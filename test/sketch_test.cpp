@@ -0,0 +1,72 @@
+// Host build of ESP32_MQTT_via_Helpers.ino, the standalone sketch, run
+// through setup() and loop() against the mock Home Assistant at the
+// address and token the sketch is configured with.
+
+#include <Arduino.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+#include SKETCH_PATH
+
+using mock::HomeAssistant;
+
+namespace {
+
+void setupHomeAssistant(HomeAssistant& ha) {
+  ha.token = bearerToken;
+  ha.installHelpers();
+  // The sketch opens a TLS connection per request; on an ESP32 that's
+  // hundreds of ms, which is also what keeps its unacknowledged frames
+  // from overwriting each other before the automation has read them
+  sim::network().handshakeMs = 300;
+}
+
+}  // namespace
+
+TEST(sketch_publishes_discovery_for_both_entities) {
+  HomeAssistant ha(nullptr, "homeassistant.local", 8123);
+  setupHomeAssistant(ha);
+
+  setup();
+  sim::drain();
+
+  std::string config;
+  CHECK(ha.bus().retained("homeassistant/switch/esp_test_switch/config", config));
+  CHECK(ha.bus().retained("homeassistant/number/esp_test_level/config", config));
+  CHECK(ha.has("switch.esp_test_switch"));
+  CHECK(ha.has("number.esp_test_level"));
+  CHECK(sim::serialContains("Discovery for switch sent."));
+  CHECK(sim::serialContains("Discovery for number sent."));
+  CHECK_EQ(ha.stats.rejected, 0u);
+  // Each helper write is its own TLS connection
+  CHECK_EQ(sim::network().stats.handshakes, 12u);
+}
+
+TEST(sketch_loop_posts_states_every_five_seconds) {
+  HomeAssistant ha(nullptr, "homeassistant.local", 8123);
+  setupHomeAssistant(ha);
+  setup();
+  sim::drain();
+
+  uint32_t before = ha.stats.stateWrites;
+  unsigned long end = millis() + 11000;
+  while (millis() < end) {
+    loop();
+    delay(10);
+  }
+  // Setup took over 5 s, so the first pass posts at once, then at 5 and 10 s
+  CHECK_EQ(ha.stats.stateWrites - before, 6u);
+  CHECK(ha.state("switch.esp_test_switch") == "on" || ha.state("switch.esp_test_switch") == "off");
+  int level = atoi(ha.state("number.esp_test_level").c_str());
+  CHECK(level >= 0 && level <= 100);
+}
+
+TEST(sketch_reports_failures_without_wifi) {
+  HomeAssistant ha(nullptr, "homeassistant.local", 8123);
+  setupHomeAssistant(ha);
+  WiFi.setStatus(WL_DISCONNECTED);
+  setup();
+  WiFi.setStatus(WL_CONNECTED);
+  CHECK(sim::serialContains("Failed to publish discovery for switch."));
+  CHECK_EQ(ha.stats.requests, 0u);
+}
@@ -0,0 +1,133 @@
+// Sleep mode: each cycle is a fresh instance, as after a deep sleep, with
+// only the RTC-retained state carried over. A warm wake skips DNS and the
+// existence checks and sends its held states over one connection.
+//
+// Each test uses its own host, so state retained by an earlier test reads
+// as another server's and the first cycle is cold.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+struct Cycle {
+  bool resumed;
+  bool ready;
+  HASleepStats sleep;
+  uint32_t requests;
+  uint32_t stateReads;
+  uint32_t connects;
+};
+
+// Wake, write both probes and prepare to sleep, then sleep for a minute
+Cycle wake(HomeAssistant& ha, const String& a, const String& b, fs::FS* flash = nullptr) {
+  Cycle cycle;
+  uint32_t requests = ha.stats.requests;
+  uint32_t reads = ha.stats.stateReads;
+  uint32_t connects = sim::network().stats.connects;
+  unsigned long wokeAt = millis();
+  {
+    HAMQTTDiscovery node;
+    node.begin(ha.url().c_str(), ha.token.c_str(), TRANSPORT_SERVICE);
+    cycle.resumed = node.enableSleepMode(wokeAt);
+    if (flash) {
+      node.enableOfflineBuffer(8);
+      node.setOfflineStorage(*flash, "/held.txt");
+    }
+    HAControl* probeA = node.createSensor("probe_a", "Probe A", "probe_a_uid", "W");
+    HAControl* probeB = node.createSensor("probe_b", "Probe B", "probe_b_uid", "W");
+    node.writeControl(probeA, a);
+    node.writeControl(probeB, b);
+    cycle.ready = node.prepareSleep();
+    cycle.sleep = node.getSleepStats();
+  }
+  cycle.requests = ha.stats.requests - requests;
+  cycle.stateReads = ha.stats.stateReads - reads;
+  cycle.connects = sim::network().stats.connects - connects;
+  delay(60000);
+  return cycle;
+}
+
+}  // namespace
+
+TEST(warm_wake_skips_dns_and_existence_checks) {
+  HomeAssistant ha(nullptr, "sleep1.local", 8123);
+  sim::network().dnsMs = 200;
+  sim::network().connectMs = 20;
+  ha.faults.latencyMs = 15;
+
+  Cycle cold = wake(ha, "1", "2");
+  CHECK(!cold.resumed);
+  CHECK(cold.ready);
+  CHECK_EQ(ha.state("sensor.probe_a"), "1");
+
+  Cycle warm = wake(ha, "3", "4");
+  CHECK(warm.resumed);
+  CHECK(warm.ready);
+  CHECK(warm.sleep.addressCached);
+  CHECK_EQ(warm.sleep.resumedControls, 2);
+  CHECK_EQ(warm.sleep.wakes, 1u);
+  CHECK_EQ(warm.sleep.lastAwakeMs, cold.sleep.awakeMs);
+  CHECK_EQ(warm.stateReads, 0u);
+  CHECK_EQ(warm.connects, 1u);
+  CHECK_EQ(warm.requests, 2u);
+  CHECK(warm.sleep.awakeMs < cold.sleep.awakeMs);
+  CHECK_EQ(ha.state("sensor.probe_a"), "3");
+  CHECK_EQ(ha.state("sensor.probe_b"), "4");
+  check::report("sleep_cycle", "cold_awake", cold.sleep.awakeMs, "ms");
+  check::report("sleep_cycle", "warm_awake", warm.sleep.awakeMs, "ms");
+}
+
+TEST(writes_are_held_until_prepare_sleep) {
+  HomeAssistant ha(nullptr, "sleep2.local", 8123);
+  wake(ha, "1", "2");
+
+  HAMQTTDiscovery node;
+  node.begin(ha.url().c_str(), ha.token.c_str(), TRANSPORT_SERVICE);
+  CHECK(node.enableSleepMode(millis()));
+  HAControl* probe = node.createSensor("probe_a", "Probe A", "probe_a_uid", "W");
+  uint32_t writes = ha.stats.stateWrites;
+  CHECK(node.writeControl(probe, "5"));
+  CHECK(node.writeControl(probe, "6"));
+  CHECK_EQ(ha.stats.stateWrites, writes);
+
+  // Only the latest held value is sent
+  CHECK(node.prepareSleep());
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(ha.state("sensor.probe_a"), "6");
+}
+
+TEST(unreachable_ha_reports_writes_that_would_be_lost) {
+  HomeAssistant ha(nullptr, "sleep3.local", 8123);
+  wake(ha, "1", "2");
+
+  sim::network().setReachable("sleep3.local", false);
+  Cycle lost = wake(ha, "3", "4");
+  CHECK(!lost.ready);
+
+  // With a flash-backed offline buffer they are kept for the next wake
+  fs::FS flash;
+  Cycle held = wake(ha, "5", "6", &flash);
+  CHECK(held.ready);
+  sim::network().setReachable("sleep3.local", true);
+  Cycle back = wake(ha, "7", "8", &flash);
+  CHECK(back.ready);
+  CHECK_EQ(ha.state("sensor.probe_a"), "7");
+  CHECK(!flash.exists("/held.txt"));
+}
+
+TEST(another_server_is_a_cold_wake) {
+  HomeAssistant first(nullptr, "sleep4.local", 8123);
+  HomeAssistant second(nullptr, "sleep5.local", 8123);
+  wake(first, "1", "2");
+  CHECK(wake(first, "1", "2").resumed);
+
+  Cycle moved = wake(second, "3", "4");
+  CHECK(!moved.resumed);
+  CHECK_EQ(moved.sleep.resumedControls, 0);
+  CHECK_EQ(second.state("sensor.probe_a"), "3");
+}
@@ -0,0 +1,105 @@
+// State batching: one event for many controls, what StateBatch.yaml
+// accepts, and controls whose topics it wouldn't.
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+const int CONTROLS = 4;
+
+void createProbes(HAMQTTDiscovery& discovery, HomeAssistant& ha, HAControl** probes) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  for (int i = 0; i < CONTROLS; i++) {
+    String id = "probe_" + String(i);
+    probes[i] = discovery.createSensor(id, "Probe", id + "_uid");
+  }
+}
+
+std::string lastPublished(HomeAssistant& ha, const std::string& topic) {
+  std::string payload;
+  for (const auto& message : ha.bus().history) {
+    if (message.first == topic) payload = message.second;
+  }
+  return payload;
+}
+
+// An event from something other than the library
+int postEvent(HomeAssistant& ha, const String& body) {
+  WiFiClient client;
+  HTTPClient http;
+  http.begin(client, String(ha.url().c_str()) + "/api/events/hamqtt_states");
+  http.addHeader("Authorization", "Bearer " + String(ha.token.c_str()));
+  http.addHeader("Content-Type", "application/json");
+  int code = http.POST(body);
+  http.end();
+  return code;
+}
+
+}  // namespace
+
+TEST(one_event_carries_every_controls_latest_value) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  discovery.enableStateBatch();
+
+  uint32_t writes = ha.stats.stateWrites;
+  for (int i = 0; i < CONTROLS; i++) CHECK(discovery.writeControl(probes[i], String(i)));
+  CHECK(discovery.writeControl(probes[0], "latest"));
+  CHECK(discovery.flushStates());
+  sim::drain();
+
+  CHECK_EQ(ha.stats.events, 1u);
+  CHECK_EQ(ha.stats.stateBatches, 1u);
+  CHECK_EQ(ha.stats.stateWrites, writes);
+  CHECK_EQ(ha.stats.rejected, 0u);
+  CHECK_EQ(lastPublished(ha, "virt/probe_0/state"), "latest");
+  CHECK_EQ(lastPublished(ha, "virt/probe_3/state"), "3");
+}
+
+TEST(a_custom_state_topic_is_written_directly) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probes[CONTROLS];
+  createProbes(discovery, ha, probes);
+  HAControl* custom = discovery.createSensor("outside", "Outside", "outside_uid", "", "", "garden/outside/temperature");
+  CHECK(custom != nullptr);
+  discovery.enableStateBatch();
+
+  uint32_t writes = ha.stats.stateWrites;
+  CHECK(discovery.writeControl(probes[1], "1"));
+  CHECK(discovery.writeControl(custom, "12.5"));
+  CHECK(discovery.flushStates());
+  sim::drain();
+
+  CHECK_EQ(ha.stats.stateWrites - writes, 1u);
+  CHECK_EQ(ha.state("sensor.outside"), "12.5");
+  CHECK_EQ(ha.stats.rejected, 0u);
+  CHECK_EQ(lastPublished(ha, "virt/probe_1/state"), "1");
+}
+
+TEST(the_automation_only_publishes_default_state_topics) {
+  HomeAssistant ha;
+  CHECK_EQ(postEvent(ha, "{\"virt/lamp/state\":\"ON\","
+                         "\"homeassistant/switch/lamp/config\":\"\","
+                         "\"virt/lamp/set\":\"OFF\","
+                         "\"virt/#\":\"x\","
+                         "\"virt/a/b/state\":\"x\","
+                         "\"other/lamp/state\":\"x\"}"),
+           200);
+  sim::drain();
+  CHECK_EQ(lastPublished(ha, "virt/lamp/state"), "ON");
+  CHECK_EQ(ha.stats.rejected, 5u);
+  CHECK(ha.logContains("State topic rejected: homeassistant/switch/lamp/config"));
+  std::string config;
+  CHECK(!ha.bus().retained("homeassistant/switch/lamp/config", config));
+}
@@ -0,0 +1,125 @@
+// Telemetry: the latency histograms kept per operation, and the diagnostic
+// sensors that publish a summary of them.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+// Added to every REST reply by the mock
+const unsigned long REPLY_MS = 40;
+
+void start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  discovery.setDevice("pump_controller", "Pump Controller", "Virtual Devices", "ESP32");
+}
+
+// Runs loop() for a while on the virtual clock
+void runFor(HAMQTTDiscovery& discovery, unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    discovery.loop();
+    delay(100);
+  }
+}
+
+}  // namespace
+
+TEST(histogram_buckets_double_from_eight_ms) {
+  HALatencyStats stats;
+  CHECK_EQ(stats.percentileMs(90), 0u);
+  CHECK_EQ(stats.averageMs(), 0u);
+
+  // 0-7 ms, 8-15 ms and 16-31 ms
+  stats.record(3, true);
+  stats.record(8, true);
+  stats.record(12, true);
+  stats.record(20, false);
+  CHECK_EQ(stats.buckets[0], 1u);
+  CHECK_EQ(stats.buckets[1], 2u);
+  CHECK_EQ(stats.buckets[2], 1u);
+  CHECK_EQ(stats.count, 4u);
+  CHECK_EQ(stats.failures, 1u);
+  CHECK_EQ(stats.averageMs(), 10u);
+  CHECK_EQ(stats.percentileMs(50), 16u);
+  // The upper bound is capped at the slowest operation seen
+  CHECK_EQ(stats.percentileMs(90), 20u);
+
+  // Anything past the last limit lands in the last bucket
+  stats.record(100000, true);
+  CHECK_EQ(stats.buckets[HALatencyStats::BUCKETS - 1], 1u);
+  CHECK_EQ(stats.percentileMs(100), 100000u);
+}
+
+TEST(each_operation_is_timed_separately) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  HAControl* flow = discovery.createSensor("flow", "Flow", "flow_uid");
+  CHECK(flow != nullptr);
+  discovery.resetRequestStats();
+  ha.faults.latencyMs = REPLY_MS;
+
+  for (int i = 0; i < 5; i++) {
+    CHECK(discovery.writeControl(flow, String(i)));
+  }
+  discovery.readControl(flow);
+  ha.faults.errorPercent = 100;
+  CHECK(!discovery.writeControl(flow, "5"));
+  ha.faults.errorPercent = 0;
+
+  HARequestStats stats = discovery.getRequestStats();
+  const HALatencyStats& writes = stats.ops[OP_STATE_POST];
+  CHECK_EQ(writes.count, 6u);
+  CHECK_EQ(writes.failures, 1u);
+  CHECK(writes.averageMs() >= REPLY_MS);
+  CHECK(writes.percentileMs(90) >= REPLY_MS);
+  CHECK(writes.percentileMs(90) <= writes.maxMs);
+  CHECK_EQ(stats.ops[OP_STATE_GET].count, 1u);
+  // The connection is kept alive, so nothing was connected again
+  CHECK_EQ(stats.ops[OP_CONNECT].count, 0u);
+  CHECK_EQ(stats.failures, 1u);
+  CHECK(stats.minFreeHeap > 0u);
+}
+
+TEST(diagnostic_sensors_publish_the_summary) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  CHECK(discovery.enableDiagnostics(10000));
+
+  const mock::Entity* entity = ha.entity("sensor.pump_controller_state_post_ms");
+  CHECK(entity != nullptr);
+  if (entity) {
+    CHECK_EQ(entity->config["entity_category"].text, std::string("diagnostic"));
+    CHECK_EQ(entity->config["unit_of_measurement"].text, std::string("ms"));
+  }
+  CHECK(ha.has("sensor.pump_controller_connect_ms"));
+  CHECK(ha.has("sensor.pump_controller_min_heap"));
+
+  HAControl* flow = discovery.createSensor("flow", "Flow", "flow_uid");
+  // The existence checks that found nothing count as failed calls too
+  uint32_t failures = discovery.getRequestStats().failures;
+  ha.faults.latencyMs = REPLY_MS;
+  CHECK(discovery.writeControl(flow, "1"));
+  ha.faults.errorPercent = 100;
+  CHECK(!discovery.writeControl(flow, "2"));
+  ha.faults.errorPercent = 0;
+  ha.faults.latencyMs = 0;
+  HARequestStats stats = discovery.getRequestStats();
+  CHECK_EQ(stats.failures, failures + 1);
+  std::string published(String(stats.failures).c_str());
+
+  // Nothing until the interval is up
+  runFor(discovery, 5000);
+  CHECK(ha.state("sensor.pump_controller_failures") != published);
+  runFor(discovery, 5500);
+  CHECK_EQ(ha.state("sensor.pump_controller_failures"), published);
+  CHECK_EQ(ha.state("sensor.pump_controller_state_post_ms"),
+           std::string(String(stats.ops[OP_STATE_POST].percentileMs(90)).c_str()));
+}
@@ -0,0 +1,80 @@
+// Service transport: each discovery message is one call to the service
+// chosen with setDiscoveryService(), with no helpers or automation.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+void start(HAMQTTDiscovery& discovery, HomeAssistant& ha) {
+  discovery.begin(ha.url().c_str(), ha.token.c_str(), TRANSPORT_SERVICE);
+}
+
+}  // namespace
+
+TEST(default_service_is_mqtt_publish) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+
+  HAControl* lamp = discovery.createSwitch("lamp", "Lamp", "lamp_uid");
+  CHECK(lamp != nullptr);
+  CHECK(discovery.isControlOnline(lamp));
+  CHECK_EQ(ha.stats.serviceCalls, 1u);
+  CHECK_EQ(ha.stats.helperWrites, 0u);
+  CHECK_EQ(ha.stats.templates, 0u);
+  CHECK_EQ(ha.stats.runs, 0u);
+  // Retained as sent, with the payload as a JSON string
+  std::string retained;
+  CHECK(ha.bus().retained("homeassistant/switch/lamp/config", retained));
+  CHECK_EQ(retained, std::string(lamp->getDiscoveryPayload().c_str()));
+}
+
+TEST(set_discovery_service_routes_to_the_script) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  discovery.setDiscoveryService("script.mqtt_discovery_publish");
+
+  HAControl* level = discovery.createNumber("level", "Level", "level_uid", 0, 50, 5);
+  CHECK(level != nullptr);
+  CHECK_EQ(ha.stats.serviceCalls, 1u);
+  CHECK_EQ(ha.stats.published, 1u);
+  CHECK(ha.has("number.level"));
+  // Script.yaml logs what it refuses; nothing was
+  CHECK(!ha.logContains("Topic rejected"));
+}
+
+TEST(an_unknown_service_fails_the_create) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  discovery.setDiscoveryService("notify.mobile_app");
+
+  CHECK(discovery.createSensor("probe", "Probe", "probe_uid") == nullptr);
+  CHECK_EQ(ha.stats.serviceCalls, 1u);
+  CHECK_EQ(ha.stats.published, 0u);
+  CHECK_EQ(discovery.controlCount(), 0);
+}
+
+TEST(async_creation_skips_the_settle_delay) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  start(discovery, ha);
+  discovery.setAsyncCreation(true);
+
+  unsigned long startedAt = millis();
+  HAControl* probe = discovery.createSensor("probe", "Probe", "probe_uid");
+  while (discovery.pendingControls() > 0 && millis() - startedAt < 10000) {
+    discovery.loop();
+    delay(10);
+  }
+  CHECK_EQ(probe->status, STATUS_ONLINE);
+  // The helper transport waits out the automation; a service call is
+  // published by the time it returns
+  CHECK(millis() - startedAt < 3000);
+}
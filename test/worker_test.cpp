@@ -0,0 +1,105 @@
+// Background worker: queued jobs, a clean stop, and the caller's own
+// requests interleaving with the worker's on the shared connection.
+
+#include <Arduino.h>
+#include <HAMQTTDiscovery.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "Check.h"
+#include "MockHomeAssistant.h"
+
+using mock::HomeAssistant;
+
+namespace {
+
+struct Results {
+  std::atomic<int> succeeded{0};
+  std::atomic<int> failed{0};
+
+  int total() const { return succeeded + failed; }
+};
+
+void onJob(HAControl*, bool success, const String&, void* context) {
+  Results* results = static_cast<Results*>(context);
+  (success ? results->succeeded : results->failed)++;
+}
+
+// The worker runs on its own thread in real time
+bool waitFor(const Results& results, int count) {
+  for (int i = 0; i < 2000 && results.total() < count; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return results.total() >= count;
+}
+
+HAControl* startWithSensor(HAMQTTDiscovery& discovery, HomeAssistant& ha, const char* id) {
+  ha.installHelpers();
+  discovery.begin(ha.url().c_str(), ha.token.c_str());
+  return discovery.createSensor(id, "Probe", String(id) + "_uid");
+}
+
+}  // namespace
+
+TEST(queued_writes_run_on_the_worker) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha, "probe");
+  CHECK(discovery.startWorker());
+
+  Results results;
+  for (int i = 1; i <= 5; i++) CHECK(discovery.writeControlAsync(probe, String(i), onJob, &results));
+  CHECK(waitFor(results, 5));
+  CHECK_EQ(results.succeeded.load(), 5);
+  CHECK_EQ(ha.state("sensor.probe"), "5");
+  discovery.stopWorker();
+}
+
+TEST(stop_returns_once_the_worker_has_exited_and_it_can_restart) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* probe = startWithSensor(discovery, ha, "probe");
+
+  for (int round = 0; round < 3; round++) {
+    CHECK(discovery.startWorker());
+    discovery.stopWorker();
+  }
+  // Without a worker nothing is queued
+  CHECK(!discovery.writeControlAsync(probe, "1"));
+  CHECK_EQ(discovery.queuedJobs(), 0);
+
+  Results results;
+  CHECK(discovery.startWorker());
+  CHECK(discovery.writeControlAsync(probe, "2", onJob, &results));
+  CHECK(waitFor(results, 1));
+  discovery.stopWorker();
+  CHECK_EQ(ha.state("sensor.probe"), "2");
+}
+
+TEST(caller_and_worker_share_the_connection) {
+  HomeAssistant ha;
+  HAMQTTDiscovery discovery;
+  HAControl* first = startWithSensor(discovery, ha, "first");
+  HAControl* second = discovery.createSensor("second", "Second", "second_uid");
+  CHECK(discovery.startWorker());
+
+  // The worker writes one control while setup() goes on writing and
+  // creating others; each request has the connection to itself. Fewer
+  // jobs than the queue holds, since the caller is the faster of the two.
+  Results results;
+  const int WRITES = 12;
+  uint32_t before = ha.stats.stateWrites;
+  for (int i = 0; i < WRITES; i++) {
+    CHECK(discovery.writeControlAsync(first, String(i), onJob, &results));
+    CHECK(discovery.writeControl(second, String(i)));
+  }
+  HAControl* third = discovery.createSensor("third", "Third", "third_uid");
+  CHECK(waitFor(results, WRITES));
+  discovery.stopWorker();
+
+  CHECK_EQ(results.succeeded.load(), WRITES);
+  CHECK_EQ(ha.state("sensor.first"), std::to_string(WRITES - 1));
+  CHECK_EQ(ha.state("sensor.second"), std::to_string(WRITES - 1));
+  CHECK(third && discovery.isControlOnline(third));
+  CHECK_EQ(ha.stats.stateWrites - before, (uint32_t)(2 * WRITES));
+}